@@ -0,0 +1,357 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Free cluster bitmap and extent allocator for FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+
+/**
+ * Mark a run of clusters in the bitmap
+ */
+static void markRun(ClusterBitmap* bitmap, u_int32_t start, u_int32_t length, int used) {
+  u_int32_t i;
+
+  for(i = start; i < start + length; i++) {
+    if (used) {
+      bitmap->bits[i / 64] |= 1ULL << (i % 64);
+    } else {
+      bitmap->bits[i / 64] &= ~(1ULL << (i % 64));
+    }
+  }
+}
+
+
+/**
+ * Rebuild the free run list from the bitmap
+ */
+static int buildFreeRuns(ClusterBitmap* bitmap) {
+  u_int32_t i;
+  u_int32_t start = 0;
+  int inRun = 0;
+  int allocated = 256;
+
+  bitmap->runCount = 0;
+  bitmap->freeClusters = 0;
+  bitmap->runs = (ClusterRun*) malloc(allocated * sizeof(ClusterRun));
+  if (bitmap->runs == NULL) {
+    return -1;
+  }
+
+  for(i = bitmap->firstCluster; i <= bitmap->lastCluster + 1; i++) {
+    // skip whole words of used clusters quickly
+    if (!inRun && ((i % 64) == 0) && (i + 64 <= bitmap->lastCluster) && (bitmap->bits[i / 64] == ~0ULL)) {
+      i += 63;
+      continue;
+    }
+
+    if ((i <= bitmap->lastCluster) && !isClusterUsed(bitmap, i)) {
+      if (!inRun) {
+        start = i;
+        inRun = 1;
+      }
+    } else if (inRun) {
+      if (bitmap->runCount == allocated) {
+        allocated *= 2;
+        bitmap->runs = (ClusterRun*) realloc(bitmap->runs, allocated * sizeof(ClusterRun));
+        if (bitmap->runs == NULL) {
+          return -1;
+        }
+      }
+      bitmap->runs[bitmap->runCount].start = start;
+      bitmap->runs[bitmap->runCount].length = i - start;
+      bitmap->freeClusters += i - start;
+      bitmap->runCount++;
+      inRun = 0;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Find the last cluster ID which can hold data
+ *
+ * @param partition FATX partition
+ * @return The cluster ID
+ */
+u_int32_t lastDataCluster(FATXPartition* partition) {
+  u_int64_t dataClusters;
+
+  // the chain map may describe more clusters than fit after it
+  dataClusters = (partition->partitionSize - FATX_PARTITION_HEADERSIZE - partition->chainTableSize) / 
+    partition->clusterSize;
+  if (partition->clusterCount - 1 < dataClusters) {
+    return partition->clusterCount - 1;
+  }
+  return dataClusters;
+}
+
+
+/**
+ * Build the free cluster bitmap and free run list of a partition
+ *
+ * @param partition FATX partition (chain map must be loaded)
+ * @return New bitmap, or NULL if out of memory
+ */
+ClusterBitmap* loadClusterBitmap(FATXPartition* partition) {
+  ClusterBitmap* bitmap;
+  u_int32_t i;
+
+  bitmap = (ClusterBitmap*) calloc(1, sizeof(ClusterBitmap));
+  if (bitmap == NULL) {
+    return NULL;
+  }
+
+  bitmap->firstCluster = FATX_ROOT_FAT_CLUSTER;
+  bitmap->lastCluster = lastDataCluster(partition);
+
+  bitmap->bits = (u_int64_t*) calloc((bitmap->lastCluster / 64) + 2, sizeof(u_int64_t));
+  if (bitmap->bits == NULL) {
+    free(bitmap);
+    return NULL;
+  }
+
+  // cluster 0 is never allocatable
+  bitmap->bits[0] = 1;
+  for(i = bitmap->firstCluster; i <= bitmap->lastCluster; i++) {
+    if (getChainEntry(partition, i) != 0) {
+      bitmap->bits[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+
+  if (buildFreeRuns(bitmap) == -1) {
+    freeClusterBitmap(bitmap);
+    return NULL;
+  }
+  return bitmap;
+}
+
+
+/**
+ * Free a cluster bitmap
+ */
+void freeClusterBitmap(ClusterBitmap* bitmap) {
+  free(bitmap->bits);
+  free(bitmap->runs);
+  free(bitmap->released);
+  free(bitmap);
+}
+
+
+/**
+ * Check if a cluster is in use
+ *
+ * @param bitmap Cluster bitmap
+ * @param clusterId Cluster to check
+ * @return 1 if in use (or out of range), 0 if free
+ */
+int isClusterUsed(ClusterBitmap* bitmap, u_int32_t clusterId) {
+  if ((clusterId < bitmap->firstCluster) || (clusterId > bitmap->lastCluster)) {
+    return 1;
+  }
+  return (bitmap->bits[clusterId / 64] >> (clusterId % 64)) & 1;
+}
+
+
+/**
+ * Take clusters from the start of a free run
+ */
+static void takeFromRun(ClusterBitmap* bitmap, ClusterRun* freeRun, u_int32_t count, ClusterRun* out) {
+  out->start = freeRun->start;
+  out->length = count;
+  markRun(bitmap, out->start, count, 1);
+  freeRun->start += count;
+  freeRun->length -= count;
+  bitmap->freeClusters -= count;
+}
+
+
+/**
+ * Allocate a single run of clusters from the smallest free run which can
+ * hold it
+ *
+ * @param bitmap Cluster bitmap
+ * @param count Number of clusters wanted
+ * @param run Set to the run allocated
+ * @return 0 on success, -1 if no free run is big enough
+ */
+int allocateRun(ClusterBitmap* bitmap, u_int32_t count, ClusterRun* run) {
+  int best = -1;
+  int i;
+
+  if ((count == 0) || (count > bitmap->freeClusters)) {
+    return -1;
+  }
+  for(i = 0; i < bitmap->runCount; i++) {
+    if ((bitmap->runs[i].length >= count) && 
+        ((best == -1) || (bitmap->runs[i].length < bitmap->runs[best].length))) {
+      best = i;
+      if (bitmap->runs[i].length == count) {
+        break;
+      }
+    }
+  }
+  if (best == -1) {
+    return -1;
+  }
+  takeFromRun(bitmap, &bitmap->runs[best], count, run);
+  return 0;
+}
+
+
+/**
+ * Allocate clusters, preferring a single run. The smallest free run that
+ * can hold all the clusters is used; only if none can are the largest
+ * runs combined.
+ *
+ * @param bitmap Cluster bitmap
+ * @param count Number of clusters wanted
+ * @param runCount Set to the number of runs returned
+ * @return malloc()ed array of runs in allocation order, or NULL if there
+ *         is not enough free space
+ */
+ClusterRun* allocateClusters(ClusterBitmap* bitmap, u_int32_t count, int* runCount) {
+  ClusterRun* result;
+  int allocated = 1;
+  int best;
+  int i;
+
+  *runCount = 0;
+  if ((count == 0) || (count > bitmap->freeClusters)) {
+    return NULL;
+  }
+
+  result = (ClusterRun*) malloc(sizeof(ClusterRun));
+  if (result == NULL) {
+    return NULL;
+  }
+  if (allocateRun(bitmap, count, result) == 0) {
+    *runCount = 1;
+    return result;
+  }
+
+  // no single run is big enough, so use as few runs as possible
+  while(count > 0) {
+    best = 0;
+    for(i = 1; i < bitmap->runCount; i++) {
+      if (bitmap->runs[i].length > bitmap->runs[best].length) {
+        best = i;
+      }
+    }
+    if (*runCount == allocated) {
+      allocated *= 2;
+      result = (ClusterRun*) realloc(result, allocated * sizeof(ClusterRun));
+      if (result == NULL) {
+        return NULL;
+      }
+    }
+    takeFromRun(bitmap, &bitmap->runs[best], 
+                (bitmap->runs[best].length < count) ? bitmap->runs[best].length : count, 
+                &result[*runCount]);
+    count -= result[*runCount].length;
+    (*runCount)++;
+  }
+
+  // sort the pieces into disk order so the file reads forwards
+  for(i = 1; i < *runCount; i++) {
+    ClusterRun tmp = result[i];
+    int j = i - 1;
+    while((j >= 0) && (result[j].start > tmp.start)) {
+      result[j + 1] = result[j];
+      j--;
+    }
+    result[j + 1] = tmp;
+  }
+  return result;
+}
+
+
+/**
+ * Free a cluster chain in the chain map. The clusters cannot be allocated
+ * again until reuseReleasedClusters() is called after the change is
+ * committed.
+ *
+ * @param bitmap Cluster bitmap
+ * @param partition FATX partition
+ * @param firstCluster First cluster of the chain
+ * @return 0 on success, -1 if out of memory
+ */
+int releaseChain(ClusterBitmap* bitmap, FATXPartition* partition, u_int32_t firstCluster) {
+  u_int32_t clusterId = firstCluster;
+  u_int32_t next;
+  u_int32_t steps;
+  ClusterRun *last;
+
+  // the step limit stops a looped chain going round forever
+  for(steps = 0; steps <= bitmap->lastCluster; steps++) {
+    if ((clusterId < bitmap->firstCluster) || (clusterId > bitmap->lastCluster)) {
+      break;
+    }
+    next = getChainEntry(partition, clusterId);
+    if (next == 0) {
+      break;
+    }
+    setChainEntry(partition, clusterId, 0);
+
+    last = (bitmap->releasedCount > 0) ? &bitmap->released[bitmap->releasedCount - 1] : NULL;
+    if ((last != NULL) && (last->start + last->length == clusterId)) {
+      last->length++;
+    } else {
+      if (bitmap->releasedCount == bitmap->releasedAllocated) {
+        bitmap->releasedAllocated = bitmap->releasedAllocated ? bitmap->releasedAllocated * 2 : 64;
+        bitmap->released = (ClusterRun*) realloc(bitmap->released, 
+                                                 bitmap->releasedAllocated * sizeof(ClusterRun));
+        if (bitmap->released == NULL) {
+          return -1;
+        }
+      }
+      bitmap->released[bitmap->releasedCount].start = clusterId;
+      bitmap->released[bitmap->releasedCount].length = 1;
+      bitmap->releasedCount++;
+    }
+    clusterId = next;
+  }
+  return 0;
+}
+
+
+/**
+ * Make clusters released since the last call available for allocation
+ *
+ * @param bitmap Cluster bitmap
+ * @return 0 on success, -1 if out of memory
+ */
+int reuseReleasedClusters(ClusterBitmap* bitmap) {
+  int i;
+
+  if (bitmap->releasedCount == 0) {
+    return 0;
+  }
+  for(i = 0; i < bitmap->releasedCount; i++) {
+    markRun(bitmap, bitmap->released[i].start, bitmap->released[i].length, 0);
+  }
+  bitmap->releasedCount = 0;
+
+  free(bitmap->runs);
+  return buildFreeRuns(bitmap);
+}
@@ -0,0 +1,136 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Free cluster bitmap and extent allocator for FATX partitions
+
+#ifndef ALLOC_H
+#define ALLOC_H 1
+
+#include <sys/types.h>
+#include "fatx.h"
+
+/**
+ * A run of consecutive clusters
+ */
+typedef struct {
+  u_int32_t start;
+  u_int32_t length;
+} ClusterRun;
+
+/**
+ * Cluster usage of a partition, derived from its chain map
+ */
+typedef struct {
+  // First and last cluster IDs which hold data
+  u_int32_t firstCluster;
+  u_int32_t lastCluster;
+
+  // One bit per cluster ID, set if the cluster is in use
+  u_int64_t *bits;
+
+  // Number of free clusters
+  u_int32_t freeClusters;
+
+  // Free runs in cluster order (zero-length runs are spent)
+  ClusterRun *runs;
+  int runCount;
+
+  // Runs released since the last commit; they stay marked in use until the
+  // directory entries which dropped them are on disk
+  ClusterRun *released;
+  int releasedCount;
+  int releasedAllocated;
+} ClusterBitmap;
+
+/**
+ * Find the last cluster ID which can hold data
+ *
+ * @param partition FATX partition
+ * @return The cluster ID
+ */
+u_int32_t lastDataCluster(FATXPartition* partition);
+
+/**
+ * Build the free cluster bitmap and free run list of a partition
+ *
+ * @param partition FATX partition (chain map must be loaded)
+ * @return New bitmap, or NULL if out of memory
+ */
+ClusterBitmap* loadClusterBitmap(FATXPartition* partition);
+
+/**
+ * Free a cluster bitmap
+ */
+void freeClusterBitmap(ClusterBitmap* bitmap);
+
+/**
+ * Check if a cluster is in use
+ *
+ * @param bitmap Cluster bitmap
+ * @param clusterId Cluster to check
+ * @return 1 if in use (or out of range), 0 if free
+ */
+int isClusterUsed(ClusterBitmap* bitmap, u_int32_t clusterId);
+
+/**
+ * Allocate a single run of clusters from the smallest free run which can
+ * hold it
+ *
+ * @param bitmap Cluster bitmap
+ * @param count Number of clusters wanted
+ * @param run Set to the run allocated
+ * @return 0 on success, -1 if no free run is big enough
+ */
+int allocateRun(ClusterBitmap* bitmap, u_int32_t count, ClusterRun* run);
+
+/**
+ * Allocate clusters, preferring a single run. The smallest free run that
+ * can hold all the clusters is used; only if none can are the largest
+ * runs combined.
+ *
+ * @param bitmap Cluster bitmap
+ * @param count Number of clusters wanted
+ * @param runCount Set to the number of runs returned
+ * @return malloc()ed array of runs in allocation order, or NULL if there
+ *         is not enough free space
+ */
+ClusterRun* allocateClusters(ClusterBitmap* bitmap, u_int32_t count, int* runCount);
+
+/**
+ * Free a cluster chain in the chain map. The clusters cannot be allocated
+ * again until reuseReleasedClusters() is called after the change is
+ * committed.
+ *
+ * @param bitmap Cluster bitmap
+ * @param partition FATX partition
+ * @param firstCluster First cluster of the chain
+ * @return 0 on success, -1 if out of memory
+ */
+int releaseChain(ClusterBitmap* bitmap, FATXPartition* partition, u_int32_t firstCluster);
+
+/**
+ * Make clusters released since the last call available for allocation
+ *
+ * @param bitmap Cluster bitmap
+ * @return 0 on success, -1 if out of memory
+ */
+int reuseReleasedClusters(ClusterBitmap* bitmap);
+
+#endif
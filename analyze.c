@@ -0,0 +1,444 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Fragmentation and layout analysis of FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "analyze.h"
+#include "alloc.h"
+#include "extent.h"
+#include "pool.h"
+#include "tree.h"
+#include "util.h"
+
+// Histogram buckets: bucket n holds values from 2^n to 2^(n+1)-1
+#define HISTOGRAM_BUCKETS 33
+
+// A file or directory found in the tree, in the same order as the tree
+typedef struct {
+  int parent;
+  int isDirectory;
+  u_int32_t firstCluster;
+  u_int32_t fileSize;
+
+  // Filled in by the parallel pass
+  u_int32_t extents;
+  u_int32_t lowCluster;
+  u_int32_t highCluster;
+  int broken;
+
+  // For directories: lowest and highest cluster of the directory and
+  // everything directly in it
+  u_int32_t spreadLow;
+  u_int32_t spreadHigh;
+} AnalyzeItem;
+
+// Free space found in one slice of the chain map
+typedef struct {
+  u_int32_t first;
+  u_int32_t last;
+
+  // Free clusters at each end of the slice, and whether it is all free
+  u_int32_t leading;
+  u_int32_t trailing;
+  int allFree;
+
+  // Free runs wholly inside the slice
+  u_int32_t largest;
+  u_int64_t runs[HISTOGRAM_BUCKETS];
+  u_int64_t clusters[HISTOGRAM_BUCKETS];
+} FreeSlice;
+
+// State for one analysis
+typedef struct {
+  FATXPartition *partition;
+  FATXTree *tree;
+
+  AnalyzeItem *items;
+  int count;
+  int itemJobs;
+
+  FreeSlice *slices;
+  int sliceCount;
+} AnalyzeContext;
+
+
+/**
+ * Histogram bucket for a value of at least 1
+ */
+static int bucket(u_int64_t value) {
+  int n = 0;
+
+  while(value > 1) {
+    value >>= 1;
+    n++;
+  }
+  return n;
+}
+
+
+/**
+ * Fill in the items from the tree
+ */
+static void collectItems(AnalyzeContext* ctx) {
+  FATXTreeNode *node;
+  AnalyzeItem *item;
+  int i;
+
+  ctx->count = ctx->tree->count;
+  ctx->items = (AnalyzeItem*) calloc(ctx->count, sizeof(AnalyzeItem));
+  if (ctx->items == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < ctx->count; i++) {
+    node = &ctx->tree->nodes[i];
+    item = &ctx->items[i];
+    item->parent = node->parent;
+    item->isDirectory = isTreeDirectory(node);
+    item->firstCluster = node->entry.firstCluster;
+    item->fileSize = node->entry.fileSize;
+  }
+}
+
+
+/**
+ * Count the extents of a batch of files and directories
+ */
+static void extentJob(AnalyzeContext* ctx, int job) {
+  FATXPartition *partition = ctx->partition;
+  AnalyzeItem *item;
+  FATXExtent *extents;
+  u_int32_t expected;
+  u_int32_t clusters;
+  int count;
+  int i;
+  int e;
+
+  for(i = job * ANALYZE_ITEMS_PER_JOB; (i < ctx->count) && (i < (job + 1) * ANALYZE_ITEMS_PER_JOB); i++) {
+    item = &ctx->items[i];
+    expected = 0;
+    if (!item->isDirectory) {
+      expected = ((u_int64_t) item->fileSize + partition->clusterSize - 1) / partition->clusterSize;
+      if (expected == 0) {
+        continue;
+      }
+    }
+
+    extents = buildExtents(partition, item->firstCluster, expected, &count, &clusters);
+    item->extents = count;
+    item->broken = (count == 0) || (!item->isDirectory && (clusters != expected));
+    if (count > 0) {
+      item->lowCluster = extents[0].start;
+      item->highCluster = extents[0].start + extents[0].length - 1;
+      for(e = 1; e < count; e++) {
+        if (extents[e].start < item->lowCluster) {
+          item->lowCluster = extents[e].start;
+        }
+        if (extents[e].start + extents[e].length - 1 > item->highCluster) {
+          item->highCluster = extents[e].start + extents[e].length - 1;
+        }
+      }
+    }
+    free(extents);
+  }
+}
+
+
+/**
+ * Find the free runs in a slice of the chain map
+ */
+static void freeSpaceJob(AnalyzeContext* ctx, int job) {
+  FreeSlice *slice = &ctx->slices[job];
+  u_int32_t run = 0;
+  u_int32_t i;
+  int seenUsed = 0;
+
+  for(i = slice->first; i <= slice->last; i++) {
+    if (getChainEntry(ctx->partition, i) == 0) {
+      run++;
+      continue;
+    }
+    if (!seenUsed) {
+      slice->leading = run;
+      seenUsed = 1;
+    } else if (run > 0) {
+      slice->runs[bucket(run)]++;
+      slice->clusters[bucket(run)] += run;
+      if (run > slice->largest) {
+        slice->largest = run;
+      }
+    }
+    run = 0;
+  }
+  slice->allFree = !seenUsed;
+  slice->trailing = run;
+}
+
+
+/**
+ * Run one job of the parallel pass: extent counting jobs first, then the
+ * chain map slices
+ */
+static void analyzeJob(void* context, int index) {
+  AnalyzeContext *ctx = (AnalyzeContext*) context;
+
+  if (index < ctx->itemJobs) {
+    extentJob(ctx, index);
+  } else {
+    freeSpaceJob(ctx, index - ctx->itemJobs);
+  }
+}
+
+
+/**
+ * Widen a directory's spread to cover a cluster range
+ */
+static void widenSpread(AnalyzeItem* dir, u_int32_t low, u_int32_t high) {
+  if ((dir->spreadLow == 0) || (low < dir->spreadLow)) {
+    dir->spreadLow = low;
+  }
+  if (high > dir->spreadHigh) {
+    dir->spreadHigh = high;
+  }
+}
+
+
+/**
+ * Print a histogram, skipping empty buckets
+ */
+static void printHistogram(char* title, u_int64_t* counts, u_int64_t* clusters) {
+  int i;
+
+  printf("analyze : %s\n", title);
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    if (clusters != NULL) {
+      printf("analyze :   %10llu-%-10llu %10llu runs %12llu clusters\n", 1ULL << i, (2ULL << i) - 1,
+             (unsigned long long) counts[i], (unsigned long long) clusters[i]);
+    } else {
+      printf("analyze :   %10llu-%-10llu %10llu files\n", 1ULL << i, (2ULL << i) - 1,
+             (unsigned long long) counts[i]);
+    }
+  }
+}
+
+
+/**
+ * Order item indexes by extent count, most first
+ */
+static int compareExtents(const void* a, const void* b, void* context) {
+  AnalyzeItem *x = &((AnalyzeContext*) context)->items[*(const int*) a];
+  AnalyzeItem *y = &((AnalyzeContext*) context)->items[*(const int*) b];
+  return (x->extents < y->extents) - (x->extents > y->extents);
+}
+
+
+/**
+ * Order directory indexes by spread, widest first
+ */
+static int compareSpread(const void* a, const void* b, void* context) {
+  AnalyzeItem *x = &((AnalyzeContext*) context)->items[*(const int*) a];
+  AnalyzeItem *y = &((AnalyzeContext*) context)->items[*(const int*) b];
+  u_int32_t xs = x->spreadHigh - x->spreadLow;
+  u_int32_t ys = y->spreadHigh - y->spreadLow;
+  return (xs < ys) - (xs > ys);
+}
+
+
+/**
+ * Report how fragmented the files and free space of a partition are
+ *
+ * @param partition FATX partition
+ * @param flags ANALYZE_* flags
+ * @return 0 on success, -1 on failure
+ */
+int analyzePartition(FATXPartition* partition, int flags) {
+  AnalyzeContext ctx;
+  AnalyzeItem *item;
+  FreeSlice *slice;
+  u_int64_t extentHistogram[HISTOGRAM_BUCKETS];
+  u_int64_t freeRuns[HISTOGRAM_BUCKETS];
+  u_int64_t freeClusters[HISTOGRAM_BUCKETS];
+  u_int64_t totalExtents = 0;
+  u_int64_t totalFree = 0;
+  u_int64_t runCount = 0;
+  u_int64_t usedClusters;
+  u_int32_t lastCluster = lastDataCluster(partition);
+  u_int32_t largest = 0;
+  u_int32_t maxExtents = 0;
+  u_int32_t files = 0;
+  u_int32_t fragmented = 0;
+  u_int32_t broken = 0;
+  u_int32_t carry = 0;
+  char path[4096];
+  int *order;
+  int orderCount;
+  int i;
+  int j;
+
+  memset(&ctx, 0, sizeof(AnalyzeContext));
+  memset(extentHistogram, 0, sizeof(extentHistogram));
+  memset(freeRuns, 0, sizeof(freeRuns));
+  memset(freeClusters, 0, sizeof(freeClusters));
+  ctx.partition = partition;
+  ctx.tree = loadTree(partition);
+  if (ctx.tree == NULL) {
+    error("Out of memory");
+  }
+
+  // the tree has to be read in order; everything else is one parallel pass
+  collectItems(&ctx);
+
+  ctx.itemJobs = (ctx.count + ANALYZE_ITEMS_PER_JOB - 1) / ANALYZE_ITEMS_PER_JOB;
+  ctx.sliceCount = (lastCluster + ANALYZE_CLUSTERS_PER_JOB - 1) / ANALYZE_CLUSTERS_PER_JOB;
+  ctx.slices = (FreeSlice*) calloc(ctx.sliceCount, sizeof(FreeSlice));
+  order = (int*) malloc(ctx.count * sizeof(int));
+  if ((ctx.slices == NULL) || (order == NULL)) {
+    error("Out of memory");
+  }
+  for(i = 0; i < ctx.sliceCount; i++) {
+    ctx.slices[i].first = FATX_ROOT_FAT_CLUSTER + (u_int64_t) i * ANALYZE_CLUSTERS_PER_JOB;
+    ctx.slices[i].last = ctx.slices[i].first + ANALYZE_CLUSTERS_PER_JOB - 1;
+    if (ctx.slices[i].last > lastCluster) {
+      ctx.slices[i].last = lastCluster;
+    }
+  }
+  runParallel(analyzeJob, &ctx, ctx.itemJobs + ctx.sliceCount, 0);
+
+  // stitch together free runs crossing slice boundaries
+  for(i = 0; i < ctx.sliceCount; i++) {
+    slice = &ctx.slices[i];
+    if (slice->allFree) {
+      carry += slice->trailing;
+      continue;
+    }
+    carry += slice->leading;
+    if (carry > 0) {
+      freeRuns[bucket(carry)]++;
+      freeClusters[bucket(carry)] += carry;
+      if (carry > largest) {
+        largest = carry;
+      }
+    }
+    for(j = 0; j < HISTOGRAM_BUCKETS; j++) {
+      freeRuns[j] += slice->runs[j];
+      freeClusters[j] += slice->clusters[j];
+    }
+    if (slice->largest > largest) {
+      largest = slice->largest;
+    }
+    carry = slice->trailing;
+  }
+  if (carry > 0) {
+    freeRuns[bucket(carry)]++;
+    freeClusters[bucket(carry)] += carry;
+    if (carry > largest) {
+      largest = carry;
+    }
+  }
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    runCount += freeRuns[i];
+    totalFree += freeClusters[i];
+  }
+
+  // per file totals, and each directory's spread over its own clusters
+  // and those of everything directly in it
+  for(i = 0; i < ctx.count; i++) {
+    item = &ctx.items[i];
+    if (item->extents == 0) {
+      continue;
+    }
+    if (item->isDirectory) {
+      widenSpread(item, item->lowCluster, item->highCluster);
+    } else {
+      files++;
+      totalExtents += item->extents;
+      extentHistogram[bucket(item->extents)]++;
+      if (item->extents > 1) {
+        fragmented++;
+      }
+      if (item->extents > maxExtents) {
+        maxExtents = item->extents;
+      }
+    }
+    if (item->broken) {
+      broken++;
+    }
+    if (item->parent >= 0) {
+      widenSpread(&ctx.items[item->parent], item->lowCluster, item->highCluster);
+    }
+  }
+
+  usedClusters = lastCluster - totalFree;
+  printf("analyze : %d entries, %u files with data, %u broken chains\n", ctx.count - 1, files, broken);
+  printf("analyze : %llu of %u clusters used (%.1f%%), cluster size %u\n", (unsigned long long) usedClusters,
+         lastCluster, lastCluster ? (100.0 * usedClusters) / lastCluster : 0.0, partition->clusterSize);
+  printf("analyze : %u files fragmented (%.1f%%), %.2f extents per file, at most %u\n", fragmented,
+         files ? (100.0 * fragmented) / files : 0.0, files ? (double) totalExtents / files : 0.0, maxExtents);
+  printf("analyze : %llu free clusters in %llu runs, largest run %u clusters (%llu bytes)\n",
+         (unsigned long long) totalFree, (unsigned long long) runCount, largest,
+         (unsigned long long) largest * partition->clusterSize);
+  printHistogram("extents per file:", extentHistogram, NULL);
+  printHistogram("free run lengths (clusters):", freeRuns, freeClusters);
+
+  // worst offenders
+  for(i = 0, orderCount = 0; i < ctx.count; i++) {
+    if (!ctx.items[i].isDirectory && (ctx.items[i].extents > 1)) {
+      order[orderCount++] = i;
+    }
+  }
+  qsort_r(order, orderCount, sizeof(int), compareExtents, &ctx);
+  printf("analyze : most fragmented files:\n");
+  for(i = 0; (i < orderCount) && (i < ANALYZE_WORST); i++) {
+    treePath(ctx.tree, order[i], path, sizeof(path));
+    printf("analyze :   %8u extents  %s\n", ctx.items[order[i]].extents, path);
+  }
+
+  for(i = 0, orderCount = 0; i < ctx.count; i++) {
+    if (ctx.items[i].isDirectory && (ctx.items[i].spreadHigh != 0)) {
+      order[orderCount++] = i;
+    }
+  }
+  qsort_r(order, orderCount, sizeof(int), compareSpread, &ctx);
+  printf("analyze : most spread out directories:\n");
+  for(i = 0; (i < orderCount) && (i < ANALYZE_WORST); i++) {
+    item = &ctx.items[order[i]];
+    treePath(ctx.tree, order[i], path, sizeof(path));
+    printf("analyze :   %14llu bytes  %s\n", 
+           (unsigned long long) (item->spreadHigh - item->spreadLow + 1) * partition->clusterSize, path);
+  }
+
+  if (flags & ANALYZE_FILES) {
+    for(i = 1; i < ctx.count; i++) {
+      treePath(ctx.tree, i, path, sizeof(path));
+      printf("%8u %s%s\n", ctx.items[i].extents, path, ctx.items[i].isDirectory ? "/" : "");
+    }
+  }
+
+  free(order);
+  free(ctx.slices);
+  free(ctx.items);
+  freeTree(ctx.tree);
+  return 0;
+}
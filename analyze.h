@@ -0,0 +1,49 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Fragmentation and layout analysis of FATX partitions
+
+#ifndef ANALYZE_H
+#define ANALYZE_H 1
+
+#include "fatx.h"
+
+// List the extent count of every file as well as the summary
+#define ANALYZE_FILES 1
+
+// Number of files and directories in the worst offender lists
+#define ANALYZE_WORST 10
+
+// Files whose extents are counted by one job
+#define ANALYZE_ITEMS_PER_JOB 256
+
+// Chain map entries scanned for free space by one job
+#define ANALYZE_CLUSTERS_PER_JOB (1024 * 1024)
+
+/**
+ * Report how fragmented the files and free space of a partition are
+ *
+ * @param partition FATX partition
+ * @param flags ANALYZE_* flags
+ * @return 0 on success, -1 on failure
+ */
+int analyzePartition(FATXPartition* partition, int flags);
+
+#endif
@@ -0,0 +1,621 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Block backends: where the bytes of a disk image come from
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "backend.h"
+
+// A decompressed frame
+typedef struct {
+  u_int64_t frame;
+  unsigned char *data;
+  u_int64_t lastUsed;
+} CachedFrame;
+
+// State of a compressed backend
+typedef struct {
+  u_int32_t frameSize;
+  u_int64_t frameCount;
+  u_int64_t *offsets;
+  u_int32_t *lengths;
+
+  CachedFrame cache[BACKEND_FRAME_CACHE];
+  u_int64_t clock;
+  pthread_mutex_t lock;
+} CompressedState;
+
+
+// State of a split backend
+typedef struct {
+  // Segment names, the offset in the image each starts at (with one more
+  // entry for the end of the image), and descriptors once opened (-1 until
+  // then)
+  char **names;
+  u_int64_t *starts;
+  int *fds;
+  int count;
+  pthread_mutex_t lock;
+} SplitState;
+
+
+/**
+ * pread all of a range of a file
+ *
+ * @return 0 on success, -1 on failure or end of file (errno set)
+ */
+static int preadFully(int fd, void* data, u_int64_t length, u_int64_t offset) {
+  u_int64_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = pread(fd, (unsigned char*) data + done, length - done, offset + done);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Read from a plain image
+ */
+static int readFile(FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset) {
+  return preadFully(fileno(backend->file), data, length, offset);
+}
+
+
+/**
+ * Find data in a plain image, using the filesystem's knowledge of holes
+ */
+static u_int64_t nextFileData(FATXBackend* backend, u_int64_t offset) {
+  off_t data;
+
+  data = lseek(fileno(backend->file), offset, SEEK_DATA);
+  if (data != -1) {
+    return data;
+  }
+  // ENXIO means there is no more data; anything else (devices, or
+  // filesystems without SEEK_DATA) means we can't tell
+  return (errno == ENXIO) ? backend->size : offset;
+}
+
+
+/**
+ * Copy part of a frame out, decompressing it if it is not cached
+ *
+ * @param backend Backend
+ * @param frame Frame number
+ * @param data Where to store the data
+ * @param length Number of bytes
+ * @param offset Offset into the frame
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int readFrame(FATXBackend* backend, u_int64_t frame, unsigned char* data,
+                     u_int64_t length, u_int64_t offset) {
+  CompressedState *state = (CompressedState*) backend->state;
+  CachedFrame *victim;
+  unsigned char *compressed;
+  unsigned char *frameData;
+  uLongf frameLength;
+  uLongf expected;
+  int result;
+  int i;
+
+  pthread_mutex_lock(&state->lock);
+  for(i = 0; i < BACKEND_FRAME_CACHE; i++) {
+    if ((state->cache[i].data != NULL) && (state->cache[i].frame == frame)) {
+      memcpy(data, state->cache[i].data + offset, length);
+      state->cache[i].lastUsed = ++state->clock;
+      pthread_mutex_unlock(&state->lock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  // decompress without holding the lock, so other frames can be read
+  expected = state->frameSize;
+  if ((frame + 1) * state->frameSize > backend->size) {
+    expected = backend->size - frame * state->frameSize;
+  }
+  compressed = (unsigned char*) malloc(state->lengths[frame]);
+  frameData = (unsigned char*) malloc(state->frameSize);
+  if ((compressed == NULL) || (frameData == NULL)) {
+    free(compressed);
+    free(frameData);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (preadFully(fileno(backend->file), compressed, state->lengths[frame], state->offsets[frame]) == -1) {
+    free(compressed);
+    free(frameData);
+    return -1;
+  }
+  frameLength = state->frameSize;
+  result = uncompress(frameData, &frameLength, compressed, state->lengths[frame]);
+  free(compressed);
+  if ((result != Z_OK) || (frameLength != expected)) {
+    free(frameData);
+    errno = EIO;
+    return -1;
+  }
+  memcpy(data, frameData + offset, length);
+
+  // replace the least recently used frame (another thread may have cached
+  // this one meanwhile, which does no harm)
+  pthread_mutex_lock(&state->lock);
+  victim = &state->cache[0];
+  for(i = 1; i < BACKEND_FRAME_CACHE; i++) {
+    if (state->cache[i].lastUsed < victim->lastUsed) {
+      victim = &state->cache[i];
+    }
+  }
+  free(victim->data);
+  victim->frame = frame;
+  victim->data = frameData;
+  victim->lastUsed = ++state->clock;
+  pthread_mutex_unlock(&state->lock);
+  return 0;
+}
+
+
+/**
+ * Read from a compressed image, a frame at a time
+ */
+static int readCompressed(FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset) {
+  CompressedState *state = (CompressedState*) backend->state;
+  u_int64_t frame;
+  u_int64_t start;
+  u_int64_t n;
+
+  while(length > 0) {
+    frame = offset / state->frameSize;
+    start = offset % state->frameSize;
+    n = state->frameSize - start;
+    if (n > length) {
+      n = length;
+    }
+    if (state->lengths[frame] == 0) {
+      memset(data, 0, n);
+    } else if (readFrame(backend, frame, (unsigned char*) data, n, start) == -1) {
+      return -1;
+    }
+    data = (unsigned char*) data + n;
+    offset += n;
+    length -= n;
+  }
+  return 0;
+}
+
+
+/**
+ * Find data in a compressed image: frames of zeros are holes
+ */
+static u_int64_t nextCompressedData(FATXBackend* backend, u_int64_t offset) {
+  CompressedState *state = (CompressedState*) backend->state;
+  u_int64_t frame = offset / state->frameSize;
+
+  while((frame < state->frameCount) && (state->lengths[frame] == 0)) {
+    frame++;
+  }
+  if (frame >= state->frameCount) {
+    return backend->size;
+  }
+  return (frame * state->frameSize > offset) ? frame * state->frameSize : offset;
+}
+
+
+/**
+ * Free the state of a compressed backend
+ */
+static void closeCompressed(FATXBackend* backend) {
+  CompressedState *state = (CompressedState*) backend->state;
+  int i;
+
+  for(i = 0; i < BACKEND_FRAME_CACHE; i++) {
+    free(state->cache[i].data);
+  }
+  pthread_mutex_destroy(&state->lock);
+  free(state->offsets);
+  free(state->lengths);
+  free(state);
+}
+
+
+/**
+ * Find the segment holding an offset of a split image
+ */
+static int findSegment(SplitState* state, u_int64_t offset) {
+  int low = 0;
+  int high = state->count - 1;
+  int mid;
+
+  // last segment starting at or before offset
+  while(low < high) {
+    mid = (low + high + 1) / 2;
+    if (state->starts[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+
+/**
+ * Get the descriptor of a segment, opening it the first time
+ *
+ * @return Descriptor, or -1 on failure (errno set)
+ */
+static int segmentFd(SplitState* state, int segment) {
+  int fd;
+
+  pthread_mutex_lock(&state->lock);
+  if (state->fds[segment] == -1) {
+    state->fds[segment] = open(state->names[segment], O_RDONLY);
+  }
+  fd = state->fds[segment];
+  pthread_mutex_unlock(&state->lock);
+  return fd;
+}
+
+
+/**
+ * Read from a split image, a segment at a time
+ */
+static int readSplit(FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset) {
+  SplitState *state = (SplitState*) backend->state;
+  u_int64_t n;
+  int segment;
+  int fd;
+
+  segment = findSegment(state, offset);
+  while(length > 0) {
+    // skip empty segments
+    while(offset >= state->starts[segment + 1]) {
+      segment++;
+    }
+    n = state->starts[segment + 1] - offset;
+    if (n > length) {
+      n = length;
+    }
+    fd = segmentFd(state, segment);
+    if ((fd == -1) || (preadFully(fd, data, n, offset - state->starts[segment]) == -1)) {
+      return -1;
+    }
+    data = (unsigned char*) data + n;
+    offset += n;
+    length -= n;
+  }
+  return 0;
+}
+
+
+/**
+ * Find data in a split image, using the filesystem's knowledge of holes
+ * in each segment
+ */
+static u_int64_t nextSplitData(FATXBackend* backend, u_int64_t offset) {
+  SplitState *state = (SplitState*) backend->state;
+  off_t data;
+  int segment;
+  int fd;
+
+  for(segment = findSegment(state, offset); segment < state->count; segment++) {
+    if (offset < state->starts[segment]) {
+      offset = state->starts[segment];
+    }
+    if (offset >= state->starts[segment + 1]) {
+      continue;
+    }
+    fd = segmentFd(state, segment);
+    if (fd == -1) {
+      return offset;
+    }
+    data = lseek(fd, offset - state->starts[segment], SEEK_DATA);
+    if (data != -1) {
+      return state->starts[segment] + data;
+    }
+    if (errno != ENXIO) {
+      return offset;
+    }
+  }
+  return backend->size;
+}
+
+
+/**
+ * Free the state of a split backend (the first segment is the caller's)
+ */
+static void closeSplit(FATXBackend* backend) {
+  SplitState *state = (SplitState*) backend->state;
+  int i;
+
+  for(i = 0; i < state->count; i++) {
+    if ((i > 0) && (state->fds[i] != -1)) {
+      close(state->fds[i]);
+    }
+    free(state->names[i]);
+  }
+  pthread_mutex_destroy(&state->lock);
+  free(state->names);
+  free(state->starts);
+  free(state->fds);
+  free(state);
+}
+
+
+/**
+ * Find the segments of a split image: its name must end in a segment
+ * number, and the following numbers (of the same width) must exist
+ *
+ * @return 1 if it is a split image, 0 if not, -1 on failure (errno set)
+ */
+static int loadSplit(FATXBackend* backend, char* filename) {
+  SplitState *state;
+  struct stat info;
+  char *number;
+  char *name;
+  long first;
+  int width;
+  int i;
+
+  number = strrchr(filename, '.');
+  if ((number == NULL) || (number[1] == 0) || (strspn(number + 1, "0123456789") != strlen(number + 1))) {
+    return 0;
+  }
+  number++;
+  width = strlen(number);
+  first = atol(number);
+
+  state = (SplitState*) calloc(1, sizeof(SplitState));
+  if (state == NULL) {
+    return -1;
+  }
+  pthread_mutex_init(&state->lock, NULL);
+  backend->state = state;
+  state->names = (char**) calloc(SPLIT_MAX_SEGMENTS, sizeof(char*));
+  state->starts = (u_int64_t*) calloc(SPLIT_MAX_SEGMENTS + 1, sizeof(u_int64_t));
+  state->fds = (int*) malloc(SPLIT_MAX_SEGMENTS * sizeof(int));
+  if ((state->names == NULL) || (state->starts == NULL) || (state->fds == NULL)) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // the caller has opened the first segment
+  for(i = 0; i < SPLIT_MAX_SEGMENTS; i++) {
+    name = (char*) malloc(strlen(filename) + 16);
+    if (name == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    sprintf(name, "%.*s%0*ld", (int) (number - filename), filename, width, first + i);
+    if (((i == 0) ? fstat(fileno(backend->file), &info) : stat(name, &info)) == -1) {
+      free(name);
+      break;
+    }
+    state->names[i] = name;
+    state->fds[i] = (i == 0) ? fileno(backend->file) : -1;
+    state->starts[i + 1] = state->starts[i] + info.st_size;
+    state->count++;
+  }
+  backend->size = state->starts[state->count];
+  return (state->count > 1) ? 1 : 0;
+}
+
+
+/**
+ * Read the header and frame index of a compressed image
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int loadCompressed(FATXBackend* backend, unsigned char* header, u_int64_t fileSize) {
+  CompressedState *state;
+  unsigned char trailer[COMPRESSED_TRAILERSIZE];
+  unsigned char *index;
+  u_int64_t indexOffset;
+  u_int64_t i;
+
+  if ((le32toh(*(u_int32_t*) &header[8]) != COMPRESSED_VERSION) ||
+      (fileSize < COMPRESSED_HEADERSIZE + COMPRESSED_TRAILERSIZE) ||
+      (preadFully(fileno(backend->file), trailer, sizeof(trailer), fileSize - COMPRESSED_TRAILERSIZE) == -1) ||
+      memcmp(trailer + 24, COMPRESSED_INDEX_MAGIC, 8)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  state = (CompressedState*) calloc(1, sizeof(CompressedState));
+  if (state == NULL) {
+    return -1;
+  }
+  backend->state = state;
+  backend->size = le64toh(*(u_int64_t*) &header[16]);
+  state->frameSize = le32toh(*(u_int32_t*) &header[12]);
+  state->frameCount = le64toh(*(u_int64_t*) &trailer[8]);
+  indexOffset = le64toh(*(u_int64_t*) &trailer[0]);
+  pthread_mutex_init(&state->lock, NULL);
+
+  // the index must describe exactly the frames of the image
+  if ((state->frameSize == 0) || (state->frameSize > COMPRESSED_MAX_FRAMESIZE) ||
+      (state->frameCount != (backend->size + state->frameSize - 1) / state->frameSize) ||
+      (indexOffset + state->frameCount * COMPRESSED_INDEXENTRYSIZE + COMPRESSED_TRAILERSIZE != fileSize)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  state->offsets = (u_int64_t*) malloc((state->frameCount + 1) * sizeof(u_int64_t));
+  state->lengths = (u_int32_t*) malloc((state->frameCount + 1) * sizeof(u_int32_t));
+  index = (unsigned char*) malloc(state->frameCount * COMPRESSED_INDEXENTRYSIZE + 1);
+  if ((state->offsets == NULL) || (state->lengths == NULL) || (index == NULL)) {
+    free(index);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (preadFully(fileno(backend->file), index, state->frameCount * COMPRESSED_INDEXENTRYSIZE, indexOffset) == -1) {
+    free(index);
+    return -1;
+  }
+  for(i = 0; i < state->frameCount; i++) {
+    state->offsets[i] = le64toh(*(u_int64_t*) &index[i * COMPRESSED_INDEXENTRYSIZE]);
+    state->lengths[i] = le32toh(*(u_int32_t*) &index[i * COMPRESSED_INDEXENTRYSIZE + 8]);
+    if (state->offsets[i] + state->lengths[i] > indexOffset) {
+      free(index);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  free(index);
+  return 0;
+}
+
+
+/**
+ * Open a backend for an image file, recognising compressed images, and
+ * split images whose name ends in a segment number (image.000 followed by
+ * image.001 and so on)
+ *
+ * @param file Image file, or its first segment (left open by
+ *        closeBackend())
+ * @param filename Name of file
+ * @return New backend, or NULL if out of memory or the image is damaged
+ *         (errno set)
+ */
+FATXBackend* openBackend(FILE* file, char* filename) {
+  FATXBackend *backend;
+  unsigned char header[COMPRESSED_HEADERSIZE];
+  off_t fileSize;
+  int split;
+
+  backend = (FATXBackend*) calloc(1, sizeof(FATXBackend));
+  if (backend == NULL) {
+    return NULL;
+  }
+  backend->file = file;
+  fileSize = lseek(fileno(file), 0, SEEK_END);
+  if (fileSize == -1) {
+    free(backend);
+    return NULL;
+  }
+
+  if ((fileSize >= COMPRESSED_HEADERSIZE) &&
+      (preadFully(fileno(file), header, sizeof(header), 0) == 0) &&
+      !memcmp(header, COMPRESSED_MAGIC, 8)) {
+    backend->type = BACKEND_COMPRESSED;
+    backend->read = readCompressed;
+    backend->nextData = nextCompressedData;
+    backend->close = closeCompressed;
+    if (loadCompressed(backend, header, fileSize) == -1) {
+      if (backend->state != NULL) {
+        closeCompressed(backend);
+      }
+      free(backend);
+      return NULL;
+    }
+    return backend;
+  }
+
+  split = loadSplit(backend, filename);
+  if (split != 0) {
+    backend->type = BACKEND_SPLIT;
+    backend->read = readSplit;
+    backend->nextData = nextSplitData;
+    backend->close = closeSplit;
+    if (split == -1) {
+      if (backend->state != NULL) {
+        closeSplit(backend);
+      }
+      free(backend);
+      return NULL;
+    }
+    return backend;
+  }
+  if (backend->state != NULL) {
+    closeSplit(backend);
+    backend->state = NULL;
+  }
+
+  backend->type = BACKEND_FILE;
+  backend->size = fileSize;
+  backend->writable = 1;
+  backend->read = readFile;
+  backend->nextData = nextFileData;
+  return backend;
+}
+
+
+/**
+ * Close a backend
+ */
+void closeBackend(FATXBackend* backend) {
+  if (backend->close != NULL) {
+    backend->close(backend);
+  }
+  free(backend);
+}
+
+
+/**
+ * Read from an image
+ *
+ * @param backend Backend
+ * @param data Where to store the data
+ * @param length Number of bytes
+ * @param offset Offset into the image
+ * @return 0 on success, -1 on failure or if the range runs off the end of
+ *         the image (errno set)
+ */
+int backendRead(FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset) {
+  if ((offset > backend->size) || (length > backend->size - offset)) {
+    errno = EIO;
+    return -1;
+  }
+  return backend->read(backend, data, length, offset);
+}
+
+
+/**
+ * Find the next part of an image that may hold data, skipping holes
+ *
+ * @param backend Backend
+ * @param offset Where to start looking
+ * @return Offset of the data, at least offset, or the image size if there
+ *         is none
+ */
+u_int64_t backendNextData(FATXBackend* backend, u_int64_t offset) {
+  if (offset >= backend->size) {
+    return backend->size;
+  }
+  return backend->nextData(backend, offset);
+}
@@ -0,0 +1,148 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Block backends: where the bytes of a disk image come from
+
+#ifndef BACKEND_H
+#define BACKEND_H 1
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Kinds of backend
+#define BACKEND_FILE 0
+#define BACKEND_COMPRESSED 1
+#define BACKEND_SPLIT 2
+
+// Most segments a split image may have
+#define SPLIT_MAX_SEGMENTS 10000
+
+// Seekable compressed images: a header, then the image cut into frames of
+// a fixed size, each compressed on its own with zlib, then an index
+// giving each frame's place in the file and a trailer pointing at the
+// index. Frames of nothing but zeros are not stored. All values are
+// little endian.
+#define COMPRESSED_MAGIC "XBDZIMG1"
+#define COMPRESSED_INDEX_MAGIC "XBDZIDX1"
+#define COMPRESSED_VERSION 1
+
+// Header: magic, version (4 bytes), frame size (4), image size (8),
+// reserved (8)
+#define COMPRESSED_HEADERSIZE 32
+
+// Index entry: file offset (8), compressed length (4, 0 = all zeros),
+// reserved (4)
+#define COMPRESSED_INDEXENTRYSIZE 16
+
+// Trailer: index offset (8), frame count (8), reserved (8), index magic
+#define COMPRESSED_TRAILERSIZE 32
+
+// Largest frame size accepted
+#define COMPRESSED_MAX_FRAMESIZE (64 * 1024 * 1024)
+
+// Decompressed frames kept by a compressed backend
+#define BACKEND_FRAME_CACHE 16
+
+/**
+ * A source of image data
+ */
+typedef struct FATXBackend {
+  int type;
+
+  // The file the data comes from
+  FILE *file;
+
+  // Size of the image the backend presents
+  u_int64_t size;
+
+  // Whether the image can be written in place through file
+  int writable;
+
+  /**
+   * Read from the image
+   *
+   * @param backend Backend
+   * @param data Where to store the data
+   * @param length Number of bytes
+   * @param offset Offset into the image
+   * @return 0 on success, -1 on failure (errno set)
+   */
+  int (*read)(struct FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset);
+
+  /**
+   * Find the next part of the image that may hold data
+   *
+   * @param backend Backend
+   * @param offset Where to start looking
+   * @return Offset of the data, at least offset, or the image size if
+   *         there is none
+   */
+  u_int64_t (*nextData)(struct FATXBackend* backend, u_int64_t offset);
+
+  /**
+   * Free the backend's own state
+   */
+  void (*close)(struct FATXBackend* backend);
+
+  // Backend specific state
+  void *state;
+} FATXBackend;
+
+/**
+ * Open a backend for an image file, recognising compressed images, and
+ * split images whose name ends in a segment number (image.000 followed by
+ * image.001 and so on)
+ *
+ * @param file Image file, or its first segment (left open by
+ *        closeBackend())
+ * @param filename Name of file
+ * @return New backend, or NULL if out of memory or the image is damaged
+ *         (errno set)
+ */
+FATXBackend* openBackend(FILE* file, char* filename);
+
+/**
+ * Close a backend
+ */
+void closeBackend(FATXBackend* backend);
+
+/**
+ * Read from an image
+ *
+ * @param backend Backend
+ * @param data Where to store the data
+ * @param length Number of bytes
+ * @param offset Offset into the image
+ * @return 0 on success, -1 on failure or if the range runs off the end of
+ *         the image (errno set)
+ */
+int backendRead(FATXBackend* backend, void* data, u_int64_t length, u_int64_t offset);
+
+/**
+ * Find the next part of an image that may hold data, skipping holes
+ *
+ * @param backend Backend
+ * @param offset Where to start looking
+ * @return Offset of the data, at least offset, or the image size if there
+ *         is none
+ */
+u_int64_t backendNextData(FATXBackend* backend, u_int64_t offset);
+
+#endif
@@ -0,0 +1,832 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Benchmark driver: times standard scenarios against generated images and
+// writes the results as JSON, so they can be compared across commits
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include "fatx.h"
+#include "backend.h"
+#include "tree.h"
+#include "import.h"
+#include "analyze.h"
+#include "generate.h"
+#include "util.h"
+
+// Runs of each whole-partition scenario
+#define BENCH_FORMAT_RUNS 10
+#define BENCH_LIST_COLD_RUNS 5
+#define BENCH_LIST_WARM_RUNS 20
+#define BENCH_DUMP_LARGE_RUNS 5
+#define BENCH_ANALYZE_RUNS 5
+#define BENCH_IMPORT_RUNS 5
+
+// Passes over every chain in the chain walk scenarios
+#define BENCH_CHAIN_PASSES 10
+
+// Size of the partition formatted by the format scenario, in MB
+#define BENCH_FORMAT_MB 8192
+
+// Host files copied in by the import scenario
+#define BENCH_IMPORT_FILES 256
+#define BENCH_IMPORT_FILESIZE (64 * 1024)
+#define BENCH_IMPORT_MB 128
+
+// Read and write system call counts of this process, from /proc/self/io
+typedef struct {
+  long long readCalls;
+  long long writeCalls;
+  long long readBytes;
+  long long writeBytes;
+} IOCounters;
+
+// Measurements of one scenario
+typedef struct {
+  const char *name;
+  const char *unit;
+
+  // One latency per sample, in seconds
+  double *latencies;
+  int samples;
+  int allocated;
+  double seconds;
+
+  u_int64_t items;
+  u_int64_t bytes;
+
+  // I/O made inside samples, the counters when the sample started and
+  // how much reading them took
+  IOCounters io;
+  IOCounters mark;
+  ssize_t markBytes;
+  struct timespec started;
+} BenchResult;
+
+// State of a benchmark run
+typedef struct {
+  char *workDir;
+  FILE *json;
+  int scenarios;
+
+  // Whether /proc/self/io can be read
+  int haveCounters;
+
+  // Where the scenarios write the data they extract
+  int nullFd;
+  FILE *nullFile;
+} BenchContext;
+
+
+/**
+ * Output syntax
+ */
+void syntax() {
+  fprintf(stderr, "Syntax: fatxbench [-d <work directory>] [-o <JSON output file>] [-r <revision>] [-k]\n");
+  fprintf(stderr, "Syntax: where the work directory needs about 1.5GB; use a disk backed one (not tmpfs)\n");
+  fprintf(stderr, "Syntax:   for the cold cache scenarios to mean anything. -k keeps the images.\n");
+  exit(1);
+}
+
+
+/**
+ * Read the I/O counters of this process
+ *
+ * @param counters Set to the counters (zeroed if they cannot be read)
+ * @return Number of bytes read from /proc/self/io, or -1 if it cannot be
+ *         read
+ */
+static ssize_t readIOCounters(IOCounters* counters) {
+  char buffer[512];
+  char *line;
+  ssize_t n;
+  int fd;
+
+  memset(counters, 0, sizeof(IOCounters));
+  fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0) {
+    return -1;
+  }
+  buffer[n] = 0;
+
+  for(line = buffer; line != NULL; line = strchr(line, '\n')) {
+    line += (*line == '\n') ? 1 : 0;
+    sscanf(line, "rchar: %lld", &counters->readBytes);
+    sscanf(line, "wchar: %lld", &counters->writeBytes);
+    sscanf(line, "syscr: %lld", &counters->readCalls);
+    sscanf(line, "syscw: %lld", &counters->writeCalls);
+  }
+  return n;
+}
+
+
+/**
+ * Start measuring a scenario
+ *
+ * @param result Result to set up
+ * @param name Name of the scenario
+ * @param unit What the items counted are
+ */
+static void startResult(BenchResult* result, const char* name, const char* unit) {
+  memset(result, 0, sizeof(BenchResult));
+  result->name = name;
+  result->unit = unit;
+  fprintf(stderr, "bench : %s\n", name);
+}
+
+
+/**
+ * Start a timed sample
+ *
+ * @param ctx Benchmark context
+ * @param result Scenario being measured
+ */
+static void startSample(BenchContext* ctx, BenchResult* result) {
+  if (ctx->haveCounters) {
+    result->markBytes = readIOCounters(&result->mark);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &result->started);
+}
+
+
+/**
+ * End a timed sample, adding its latency and I/O to the scenario
+ *
+ * @param ctx Benchmark context
+ * @param result Scenario being measured
+ */
+static void endSample(BenchContext* ctx, BenchResult* result) {
+  struct timespec now;
+  IOCounters io;
+  double latency;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  latency = (now.tv_sec - result->started.tv_sec) + (now.tv_nsec - result->started.tv_nsec) / 1e9;
+
+  // the counters read at the start leave out that read, but these include
+  // it; this read is left out in turn
+  if (ctx->haveCounters) {
+    readIOCounters(&io);
+    result->io.readCalls += io.readCalls - result->mark.readCalls - 1;
+    result->io.writeCalls += io.writeCalls - result->mark.writeCalls;
+    result->io.readBytes += io.readBytes - result->mark.readBytes - result->markBytes;
+    result->io.writeBytes += io.writeBytes - result->mark.writeBytes;
+  }
+
+  if (result->samples == result->allocated) {
+    result->allocated = result->allocated ? result->allocated * 2 : 64;
+    result->latencies = (double*) realloc(result->latencies, result->allocated * sizeof(double));
+    if (result->latencies == NULL) {
+      error("Out of memory");
+    }
+  }
+  result->latencies[result->samples++] = latency;
+  result->seconds += latency;
+}
+
+
+/**
+ * Compare latencies for qsort()
+ */
+static int compareLatencies(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+
+/**
+ * Get a percentile of the sorted latencies (nearest rank)
+ *
+ * @param result Scenario, with its latencies sorted
+ * @param percent Percentile wanted
+ * @return Latency in seconds
+ */
+static double percentile(BenchResult* result, int percent) {
+  int rank = (result->samples * percent + 99) / 100;
+
+  return result->latencies[(rank > 0) ? rank - 1 : 0];
+}
+
+
+/**
+ * Write a scenario's results to the JSON output and free them
+ *
+ * @param ctx Benchmark context
+ * @param result Scenario measured
+ */
+static void finishResult(BenchContext* ctx, BenchResult* result) {
+  FILE *json = ctx->json;
+  double seconds = (result->seconds > 0) ? result->seconds : 1e-9;
+
+  qsort(result->latencies, result->samples, sizeof(double), compareLatencies);
+
+  fprintf(json, "%s\n    {\n", ctx->scenarios++ ? "," : "");
+  fprintf(json, "      \"name\": \"%s\",\n", result->name);
+  fprintf(json, "      \"unit\": \"%s\",\n", result->unit);
+  fprintf(json, "      \"samples\": %d,\n", result->samples);
+  fprintf(json, "      \"items\": %llu,\n", (unsigned long long) result->items);
+  fprintf(json, "      \"bytes\": %llu,\n", (unsigned long long) result->bytes);
+  fprintf(json, "      \"seconds\": %.6f,\n", result->seconds);
+  fprintf(json, "      \"items_per_second\": %.1f,\n", result->items / seconds);
+  fprintf(json, "      \"mb_per_second\": %.2f,\n", result->bytes / seconds / (1024 * 1024));
+  fprintf(json, "      \"p50_ms\": %.6f,\n", result->samples ? percentile(result, 50) * 1000 : 0);
+  fprintf(json, "      \"p99_ms\": %.6f,\n", result->samples ? percentile(result, 99) * 1000 : 0);
+  if (ctx->haveCounters) {
+    fprintf(json, "      \"read_syscalls\": %lld,\n", result->io.readCalls);
+    fprintf(json, "      \"write_syscalls\": %lld,\n", result->io.writeCalls);
+    fprintf(json, "      \"syscall_read_bytes\": %lld,\n", result->io.readBytes);
+    fprintf(json, "      \"syscall_write_bytes\": %lld\n", result->io.writeBytes);
+  } else {
+    fprintf(json, "      \"read_syscalls\": null,\n      \"write_syscalls\": null,\n");
+    fprintf(json, "      \"syscall_read_bytes\": null,\n      \"syscall_write_bytes\": null\n");
+  }
+  fprintf(json, "    }");
+  fflush(json);
+
+  free(result->latencies);
+}
+
+
+/**
+ * Build the path of a file in the work directory
+ *
+ * @param ctx Benchmark context
+ * @param name File name
+ * @return malloc()ed path
+ */
+static char* workPath(BenchContext* ctx, const char* name) {
+  char *path = (char*) malloc(strlen(ctx->workDir) + strlen(name) + 2);
+
+  if (path == NULL) {
+    error("Out of memory");
+  }
+  sprintf(path, "%s/%s", ctx->workDir, name);
+  return path;
+}
+
+
+/**
+ * Open the partition filling an image
+ *
+ * @param filename Image
+ * @param backend Set to the image's backend, for closeImage()
+ * @return The partition
+ */
+static FATXPartition* openImage(char* filename, FATXBackend** backend) {
+  FILE *file;
+
+  if ((file = fopen(filename, "r+")) == NULL) {
+    error("Unable to open %s: %s", filename, strerror(errno));
+  }
+  *backend = openBackend(file, filename);
+  if (*backend == NULL) {
+    error("Unable to read %s: %s", filename, strerror(errno));
+  }
+  return openPartition(*backend, 0, (*backend)->size);
+}
+
+
+/**
+ * Close a partition opened by openImage()
+ */
+static void closeImage(FATXPartition* partition, FATXBackend* backend) {
+  FILE *file = backend->file;
+
+  closePartition(partition);
+  closeBackend(backend);
+  fclose(file);
+}
+
+
+/**
+ * Drop an image from the page cache, so the next read of it goes to disk
+ *
+ * @param filename Image
+ */
+static void evictImage(char* filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+  if (fd != -1) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+
+/**
+ * Generate an image for the scenarios, timing it as a scenario of its own
+ *
+ * @param ctx Benchmark context
+ * @param name Scenario name
+ * @param filename Image to create
+ * @param options What to put in it
+ */
+static void benchGenerate(BenchContext* ctx, const char* name, char* filename, GenerateOptions* options) {
+  BenchResult result;
+
+  startResult(&result, name, "files");
+  startSample(ctx, &result);
+  if (generateImage(filename, options) == -1) {
+    error("Unable to generate %s", filename);
+  }
+  endSample(ctx, &result);
+  result.items = options->files;
+  finishResult(ctx, &result);
+}
+
+
+/**
+ * Time formatting a large sparse partition
+ *
+ * @param ctx Benchmark context
+ */
+static void benchFormat(BenchContext* ctx) {
+  char *filename = workPath(ctx, "format.img");
+  u_int64_t size = (u_int64_t) BENCH_FORMAT_MB * 1024 * 1024;
+  BenchResult result;
+  int fd;
+  int i;
+
+  startResult(&result, "format", "partitions");
+  for(i = 0; i < BENCH_FORMAT_RUNS; i++) {
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ((fd == -1) || (ftruncate(fd, size) == -1)) {
+      error("Unable to create %s: %s", filename, strerror(errno));
+    }
+    startSample(ctx, &result);
+    if (formatPartitionGeometry(fd, 0, size, 0x4000, 1) == -1) {
+      error("Unable to format %s: %s", filename, strerror(errno));
+    }
+    endSample(ctx, &result);
+    close(fd);
+    result.items++;
+  }
+  finishResult(ctx, &result);
+  unlink(filename);
+  free(filename);
+}
+
+
+/**
+ * Time listing the whole tree of an image, from opening it to the last
+ * entry written
+ *
+ * @param ctx Benchmark context
+ * @param filename Image
+ * @param cold Whether to drop the image from the page cache before each run
+ */
+static void benchList(BenchContext* ctx, char* filename, int cold) {
+  FATXPartition *partition;
+  FATXBackend *backend;
+  FATXTree *tree;
+  BenchResult result;
+  int entries;
+  int i;
+
+  partition = openImage(filename, &backend);
+  tree = loadTree(partition);
+  if (tree == NULL) {
+    error("Out of memory");
+  }
+  entries = tree->count - 1;
+  freeTree(tree);
+  closeImage(partition, backend);
+
+  startResult(&result, cold ? "list_cold" : "list_warm", "entries");
+  for(i = 0; i < (cold ? BENCH_LIST_COLD_RUNS : BENCH_LIST_WARM_RUNS); i++) {
+    if (cold) {
+      evictImage(filename);
+    }
+    startSample(ctx, &result);
+    partition = openImage(filename, &backend);
+    dumpTree(partition, ctx->nullFd);
+    fflush(stdout);
+    closeImage(partition, backend);
+    endSample(ctx, &result);
+    result.items += entries;
+  }
+  finishResult(ctx, &result);
+}
+
+
+/**
+ * Time extracting files with the dump code. Either the largest file is
+ * extracted several times, or every file is extracted once with a sample
+ * per file.
+ *
+ * @param ctx Benchmark context
+ * @param filename Image
+ * @param large Whether to extract the largest file rather than every file
+ */
+static void benchDump(BenchContext* ctx, char* filename, int large) {
+  char path[FATX_FILENAME_MAX * 64];
+  FATXPartition *partition;
+  FATXBackend *backend;
+  FATXTree *tree;
+  BenchResult result;
+  int largest = -1;
+  int i;
+
+  partition = openImage(filename, &backend);
+  tree = loadTree(partition);
+  if (tree == NULL) {
+    error("Out of memory");
+  }
+
+  if (large) {
+    for(i = 1; i < tree->count; i++) {
+      if (!isTreeDirectory(&tree->nodes[i]) &&
+          ((largest == -1) || (tree->nodes[i].entry.fileSize > tree->nodes[largest].entry.fileSize))) {
+        largest = i;
+      }
+    }
+    if (largest == -1) {
+      error("No files in %s", filename);
+    }
+
+    startResult(&result, "dump_large", "files");
+    for(i = 0; i < BENCH_DUMP_LARGE_RUNS; i++) {
+      treePath(tree, largest, path, sizeof(path));
+      startSample(ctx, &result);
+      dumpFile(partition, path, ctx->nullFile, NULL);
+      fflush(ctx->nullFile);
+      fflush(stdout);
+      endSample(ctx, &result);
+      result.items++;
+      result.bytes += tree->nodes[largest].entry.fileSize;
+    }
+  } else {
+    startResult(&result, "dump_small", "files");
+    for(i = 1; i < tree->count; i++) {
+      if (isTreeDirectory(&tree->nodes[i])) {
+        continue;
+      }
+      treePath(tree, i, path, sizeof(path));
+      startSample(ctx, &result);
+      dumpFile(partition, path, ctx->nullFile, NULL);
+      fflush(ctx->nullFile);
+      fflush(stdout);
+      endSample(ctx, &result);
+      result.items++;
+      result.bytes += tree->nodes[i].entry.fileSize;
+    }
+  }
+  finishResult(ctx, &result);
+
+  freeTree(tree);
+  closeImage(partition, backend);
+}
+
+
+/**
+ * Time following every file's cluster chain in the in-memory chain map,
+ * with a sample per chain
+ *
+ * @param ctx Benchmark context
+ * @param name Scenario name
+ * @param filename Image
+ */
+static void benchChainWalk(BenchContext* ctx, const char* name, char* filename) {
+  FATXPartition *partition;
+  FATXBackend *backend;
+  FATXTree *tree;
+  BenchResult result;
+  u_int32_t clusterId;
+  u_int64_t clusters;
+  int pass;
+  int i;
+
+  partition = openImage(filename, &backend);
+  tree = loadTree(partition);
+  if (tree == NULL) {
+    error("Out of memory");
+  }
+
+  startResult(&result, name, "clusters");
+  for(pass = 0; pass < BENCH_CHAIN_PASSES; pass++) {
+    for(i = 1; i < tree->count; i++) {
+      if (tree->nodes[i].entry.firstCluster == 0) {
+        continue;
+      }
+      clusters = 0;
+      startSample(ctx, &result);
+      for(clusterId = tree->nodes[i].entry.firstCluster; clusterId != -1;
+          clusterId = getNextClusterInChain(partition, clusterId)) {
+        clusters++;
+      }
+      endSample(ctx, &result);
+      result.items += clusters;
+    }
+  }
+  finishResult(ctx, &result);
+
+  freeTree(tree);
+  closeImage(partition, backend);
+}
+
+
+/**
+ * Time the analyze pass, which walks every chain and counts the broken
+ * ones; it is the nearest thing this tree has to fsck
+ *
+ * @param ctx Benchmark context
+ * @param filename Image
+ */
+static void benchAnalyze(BenchContext* ctx, char* filename) {
+  FATXPartition *partition;
+  FATXBackend *backend;
+  FATXTree *tree;
+  BenchResult result;
+  int i;
+
+  startResult(&result, "analyze", "entries");
+  for(i = 0; i < BENCH_ANALYZE_RUNS; i++) {
+    partition = openImage(filename, &backend);
+    tree = loadTree(partition);
+    if (tree == NULL) {
+      error("Out of memory");
+    }
+    result.items += tree->count - 1;
+    freeTree(tree);
+
+    startSample(ctx, &result);
+    analyzePartition(partition, 0);
+    fflush(stdout);
+    endSample(ctx, &result);
+    closeImage(partition, backend);
+  }
+  finishResult(ctx, &result);
+}
+
+
+/**
+ * Time importing a directory of host files into a freshly formatted image
+ *
+ * @param ctx Benchmark context
+ */
+static void benchImport(BenchContext* ctx) {
+  char *hostDir = workPath(ctx, "import");
+  char *filename = workPath(ctx, "import.img");
+  u_int64_t size = (u_int64_t) BENCH_IMPORT_MB * 1024 * 1024;
+  unsigned char *data;
+  FATXPartition *partition;
+  FATXBackend *backend;
+  BenchResult result;
+  char *hostFile;
+  u_int32_t i;
+  int run;
+  int fd;
+
+  // the host files, with made up contents
+  if ((mkdir(hostDir, 0755) == -1) && (errno != EEXIST)) {
+    error("Unable to create %s: %s", hostDir, strerror(errno));
+  }
+  data = (unsigned char*) malloc(BENCH_IMPORT_FILESIZE);
+  hostFile = (char*) malloc(strlen(hostDir) + 32);
+  if ((data == NULL) || (hostFile == NULL)) {
+    error("Out of memory");
+  }
+  for(i = 0; i < BENCH_IMPORT_FILES; i++) {
+    memset(data, i, BENCH_IMPORT_FILESIZE);
+    sprintf(hostFile, "%s/file%04u.bin", hostDir, i);
+    fd = open(hostFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ((fd == -1) || (write(fd, data, BENCH_IMPORT_FILESIZE) != BENCH_IMPORT_FILESIZE)) {
+      error("Unable to write %s: %s", hostFile, strerror(errno));
+    }
+    close(fd);
+  }
+
+  startResult(&result, "import", "files");
+  for(run = 0; run < BENCH_IMPORT_RUNS; run++) {
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ((fd == -1) || (ftruncate(fd, size) == -1) ||
+        (formatPartitionGeometry(fd, 0, size, 0x4000, 1) == -1)) {
+      error("Unable to create %s: %s", filename, strerror(errno));
+    }
+    close(fd);
+
+    partition = openImage(filename, &backend);
+    startSample(ctx, &result);
+    if (importPath(partition, hostDir, "/") == -1) {
+      error("Import into %s failed", filename);
+    }
+    fflush(stdout);
+    endSample(ctx, &result);
+    closeImage(partition, backend);
+    result.items += BENCH_IMPORT_FILES;
+    result.bytes += (u_int64_t) BENCH_IMPORT_FILES * BENCH_IMPORT_FILESIZE;
+  }
+  finishResult(ctx, &result);
+
+  for(i = 0; i < BENCH_IMPORT_FILES; i++) {
+    sprintf(hostFile, "%s/file%04u.bin", hostDir, i);
+    unlink(hostFile);
+  }
+  rmdir(hostDir);
+  unlink(filename);
+  free(data);
+  free(hostFile);
+  free(hostDir);
+  free(filename);
+}
+
+
+/**
+ * Write a string as a JSON string
+ */
+static void writeJSONString(FILE* json, const char* text) {
+  fputc('"', json);
+  for(; *text != 0; text++) {
+    if ((*text == '"') || (*text == '\\')) {
+      fputc('\\', json);
+    }
+    if ((unsigned char) *text >= 0x20) {
+      fputc(*text, json);
+    }
+  }
+  fputc('"', json);
+}
+
+
+/**
+ * Main entry point
+ */
+int main(int argc, char* argv[]) {
+  BenchContext ctx;
+  GenerateOptions small;
+  GenerateOptions large;
+  GenerateOptions chains;
+  IOCounters counters;
+  struct utsname host;
+  char *outputFilename = NULL;
+  char *revision = "";
+  char *baseDir = "/var/tmp";
+  char *images[4];
+  char date[32];
+  time_t now;
+  int keep = 0;
+  int jsonFd;
+  int i;
+
+  while((i = getopt(argc, argv, "d:o:r:k")) != -1) {
+    if (i == 'd') {
+      baseDir = optarg;
+    } else if (i == 'o') {
+      outputFilename = optarg;
+    } else if (i == 'r') {
+      revision = optarg;
+    } else if (i == 'k') {
+      keep = 1;
+    } else {
+      syntax();
+    }
+  }
+  if (optind != argc) {
+    syntax();
+  }
+
+  memset(&ctx, 0, sizeof(BenchContext));
+  ctx.workDir = (char*) malloc(strlen(baseDir) + 32);
+  if (ctx.workDir == NULL) {
+    error("Out of memory");
+  }
+  sprintf(ctx.workDir, "%s/fatxbench.XXXXXX", baseDir);
+  if (mkdtemp(ctx.workDir) == NULL) {
+    error("Unable to create a directory in %s: %s", baseDir, strerror(errno));
+  }
+
+  // the code being measured prints as it goes; send that to /dev/null and
+  // keep the real stdout for the results
+  jsonFd = dup(STDOUT_FILENO);
+  ctx.nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if ((jsonFd == -1) || (ctx.nullFd == -1) || (dup2(ctx.nullFd, STDOUT_FILENO) == -1)) {
+    error("Unable to redirect output");
+  }
+  if (outputFilename != NULL) {
+    close(jsonFd);
+    jsonFd = open(outputFilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (jsonFd == -1) {
+      error("Unable to create %s: %s", outputFilename, strerror(errno));
+    }
+  }
+  ctx.json = fdopen(jsonFd, "w");
+  ctx.nullFile = fdopen(dup(ctx.nullFd), "w");
+  if ((ctx.json == NULL) || (ctx.nullFile == NULL)) {
+    error("Out of memory");
+  }
+
+  ctx.haveCounters = (readIOCounters(&counters) != -1);
+
+  // the images: many small files in a deep tree, one large file, and
+  // fragmented files on 16 and 32 bit chain maps
+  images[0] = workPath(&ctx, "small.img");
+  images[1] = workPath(&ctx, "large.img");
+  images[2] = workPath(&ctx, "chain16.img");
+  images[3] = workPath(&ctx, "chain32.img");
+
+  defaultGenerateOptions(&small);
+  small.size = 256ULL * 1024 * 1024;
+  small.files = 4000;
+  small.dirs = 100;
+  small.minSize = 512;
+  small.maxSize = 32 * 1024;
+  small.fragmentPercent = 10;
+  small.deletedPercent = 5;
+
+  defaultGenerateOptions(&large);
+  large.size = 512ULL * 1024 * 1024;
+  large.files = 1;
+  large.dirs = 0;
+  large.depth = 0;
+  large.minSize = large.maxSize = 256 * 1024 * 1024;
+
+  defaultGenerateOptions(&chains);
+  chains.size = 256ULL * 1024 * 1024;
+  chains.files = 64;
+  chains.dirs = 0;
+  chains.depth = 0;
+  chains.minSize = 1024 * 1024;
+  chains.maxSize = 2 * 1024 * 1024;
+  chains.fragmentPercent = 50;
+
+  time(&now);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  uname(&host);
+  fprintf(ctx.json, "{\n  \"revision\": ");
+  writeJSONString(ctx.json, revision);
+  fprintf(ctx.json, ",\n  \"date\": \"%s\",\n  \"kernel\": ", date);
+  writeJSONString(ctx.json, host.release);
+  fprintf(ctx.json, ",\n  \"machine\": ");
+  writeJSONString(ctx.json, host.machine);
+  fprintf(ctx.json, ",\n  \"cpus\": %ld,\n  \"scenarios\": [", sysconf(_SC_NPROCESSORS_ONLN));
+
+  benchFormat(&ctx);
+  benchGenerate(&ctx, "generate_small", images[0], &small);
+  benchGenerate(&ctx, "generate_large", images[1], &large);
+  chains.chainBits = 16;
+  benchGenerate(&ctx, "generate_chain16", images[2], &chains);
+  chains.chainBits = 32;
+  benchGenerate(&ctx, "generate_chain32", images[3], &chains);
+
+  benchList(&ctx, images[0], 1);
+  benchList(&ctx, images[0], 0);
+  benchDump(&ctx, images[1], 1);
+  benchDump(&ctx, images[0], 0);
+  benchChainWalk(&ctx, "chain_walk_16", images[2]);
+  benchChainWalk(&ctx, "chain_walk_32", images[3]);
+  benchAnalyze(&ctx, images[0]);
+  benchImport(&ctx);
+
+  fprintf(ctx.json, "\n  ]\n}\n");
+  if (fclose(ctx.json) != 0) {
+    error("Unable to write the results: %s", strerror(errno));
+  }
+
+  for(i = 0; i < 4; i++) {
+    if (!keep) {
+      unlink(images[i]);
+    }
+    free(images[i]);
+  }
+  if (keep) {
+    fprintf(stderr, "bench : images kept in %s\n", ctx.workDir);
+  } else {
+    rmdir(ctx.workDir);
+  }
+  free(ctx.workDir);
+  fclose(ctx.nullFile);
+  close(ctx.nullFd);
+  return 0;
+}
@@ -0,0 +1,265 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Cloning the stored data of an Xbox disk into a sparse image
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "clone.h"
+#include "disk.h"
+#include "live.h"
+#include "util.h"
+
+// A chunk read by the reading thread, waiting to be written
+typedef struct {
+  unsigned char *data;
+  u_int64_t offset;
+  u_int64_t length;
+  int full;
+} CloneBuffer;
+
+// State for one clone
+typedef struct {
+  FATXBackend *backend;
+  int outputFd;
+  FATXRangeList *list;
+
+  // Ring of buffers from the reading thread to the writing one; a full
+  // buffer of length 0 marks the end
+  CloneBuffer buffers[CLONE_BUFFERS];
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int failed;
+} CloneContext;
+
+
+/**
+ * Wait for a buffer to be full or empty
+ *
+ * @return 0 once it is, -1 if the clone has failed
+ */
+static int waitForBuffer(CloneContext* ctx, CloneBuffer* buffer, int full) {
+  pthread_mutex_lock(&ctx->lock);
+  while((buffer->full != full) && !ctx->failed) {
+    pthread_cond_wait(&ctx->changed, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return ctx->failed ? -1 : 0;
+}
+
+
+/**
+ * Mark a buffer full or empty, or the clone failed
+ */
+static void setBuffer(CloneContext* ctx, CloneBuffer* buffer, int full, int failed) {
+  pthread_mutex_lock(&ctx->lock);
+  if (buffer != NULL) {
+    buffer->full = full;
+  }
+  if (failed) {
+    ctx->failed = 1;
+  }
+  pthread_cond_broadcast(&ctx->changed);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+
+/**
+ * Read a chunk from the source
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int readChunk(CloneContext* ctx, CloneBuffer* buffer) {
+  if (backendRead(ctx->backend, buffer->data, buffer->length, buffer->offset) == -1) {
+    fprintf(stderr, "clone : unable to read %llu bytes at %llu: %s\n", (unsigned long long) buffer->length,
+            (unsigned long long) buffer->offset, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Reading thread: read every range, a chunk at a time, in disk order
+ */
+static void* readRanges(void* context) {
+  CloneContext *ctx = (CloneContext*) context;
+  CloneBuffer *buffer;
+  u_int64_t done;
+  int slot = 0;
+  int i;
+
+  for(i = 0; i < ctx->list->count; i++) {
+    for(done = 0; done < ctx->list->ranges[i].length; done += buffer->length) {
+      buffer = &ctx->buffers[slot];
+      slot = (slot + 1) % CLONE_BUFFERS;
+      if (waitForBuffer(ctx, buffer, 0) == -1) {
+        return NULL;
+      }
+      buffer->offset = ctx->list->ranges[i].offset + done;
+      buffer->length = ctx->list->ranges[i].length - done;
+      if (buffer->length > CLONE_CHUNKSIZE) {
+        buffer->length = CLONE_CHUNKSIZE;
+      }
+      if (readChunk(ctx, buffer) == -1) {
+        setBuffer(ctx, NULL, 0, 1);
+        return NULL;
+      }
+      setBuffer(ctx, buffer, 1, 0);
+    }
+  }
+
+  // mark the end
+  buffer = &ctx->buffers[slot];
+  if (waitForBuffer(ctx, buffer, 0) == 0) {
+    buffer->length = 0;
+    setBuffer(ctx, buffer, 1, 0);
+  }
+  return NULL;
+}
+
+
+/**
+ * Write the chunks read by the reading thread
+ *
+ * @return Number of bytes written, or -1 on failure
+ */
+static int64_t writeRanges(CloneContext* ctx) {
+  CloneBuffer *buffer;
+  int64_t written = 0;
+  int slot = 0;
+
+  while(1) {
+    buffer = &ctx->buffers[slot];
+    slot = (slot + 1) % CLONE_BUFFERS;
+    if (waitForBuffer(ctx, buffer, 1) == -1) {
+      return -1;
+    }
+    if (buffer->length == 0) {
+      return written;
+    }
+    if (pwrite(ctx->outputFd, buffer->data, buffer->length, buffer->offset) != (ssize_t) buffer->length) {
+      fprintf(stderr, "clone : unable to write %llu bytes at %llu: %s\n", (unsigned long long) buffer->length,
+              (unsigned long long) buffer->offset, strerror(errno));
+      setBuffer(ctx, NULL, 0, 1);
+      return -1;
+    }
+    written += buffer->length;
+    setBuffer(ctx, buffer, 0, 0);
+  }
+}
+
+
+/**
+ * Copy a disk to a sparse image of the same size, reading only what
+ * holds data: everything before the first partition, and for each FATX
+ * partition its header, chain table and allocated clusters. Partitions
+ * that are not FATX are left out. The rest of the image is left as holes.
+ *
+ * @param sourceFilename Disk or image to copy
+ * @param outputFilename Image to create
+ * @return 0 on success, -1 on failure
+ */
+int cloneDisk(char* sourceFilename, char* outputFilename) {
+  CloneContext ctx;
+  FATXBackend *backend;
+  FATXDisk *disk;
+  FILE *sourceFd;
+  pthread_t reader;
+  u_int64_t diskSize;
+  int64_t written;
+  int i;
+
+  memset(&ctx, 0, sizeof(CloneContext));
+  if ((sourceFd = fopen(sourceFilename, "r")) == NULL) {
+    error("Unable to open source file %s", sourceFilename);
+  }
+  backend = openBackend(sourceFd, sourceFilename);
+  if (backend == NULL) {
+    error("Unable to read source file %s: %s", sourceFilename, strerror(errno));
+  }
+  diskSize = backend->size;
+  disk = openDisk(backend, diskSize);
+  if (disk == NULL) {
+    error("Out of memory");
+  }
+
+  // work out what to copy
+  ctx.list = liveRanges(disk, CLONE_MERGE_GAP);
+  for(i = 0; i < disk->count; i++) {
+    if ((disk->entries[i].size != 0) && (getDiskPartition(disk, i) == NULL)) {
+      printf("clone : skipping partition %d at %llu, which is not FATX\n", i,
+             (unsigned long long) disk->entries[i].offset);
+    }
+  }
+
+  // the output is the size of the disk, holes and all
+  ctx.backend = backend;
+  ctx.outputFd = open(outputFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ctx.outputFd == -1) {
+    error("Unable to open output file %s", outputFilename);
+  }
+  if (ftruncate(ctx.outputFd, diskSize) == -1) {
+    error("Unable to size output file %s", outputFilename);
+  }
+
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.changed, NULL);
+  for(i = 0; i < CLONE_BUFFERS; i++) {
+    ctx.buffers[i].data = (unsigned char*) malloc(CLONE_CHUNKSIZE);
+    if (ctx.buffers[i].data == NULL) {
+      error("Out of memory");
+    }
+  }
+
+  // one thread reads while this one writes
+  if (pthread_create(&reader, NULL, readRanges, &ctx) != 0) {
+    error("Unable to start reading thread");
+  }
+  written = writeRanges(&ctx);
+  pthread_join(reader, NULL);
+  if ((written != -1) && (fsync(ctx.outputFd) == -1)) {
+    written = -1;
+  }
+  if (close(ctx.outputFd) == -1) {
+    written = -1;
+  }
+
+  if (written != -1) {
+    printf("clone : copied %llu of %llu bytes in %d ranges\n", (unsigned long long) written,
+           (unsigned long long) diskSize, ctx.list->count);
+  }
+
+  for(i = 0; i < CLONE_BUFFERS; i++) {
+    free(ctx.buffers[i].data);
+  }
+  pthread_cond_destroy(&ctx.changed);
+  pthread_mutex_destroy(&ctx.lock);
+  freeRangeList(ctx.list);
+  closeDisk(disk);
+  closeBackend(backend);
+  fclose(sourceFd);
+  return (written == -1) ? -1 : 0;
+}
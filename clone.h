@@ -0,0 +1,47 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Cloning the stored data of an Xbox disk into a sparse image
+
+#ifndef CLONE_H
+#define CLONE_H 1
+
+// Most data read or written at once
+#define CLONE_CHUNKSIZE (8 * 1024 * 1024)
+
+// Buffers in flight between the reading and writing threads
+#define CLONE_BUFFERS 4
+
+// Ranges closer together than this are read as one, the gap included
+#define CLONE_MERGE_GAP (256 * 1024)
+
+/**
+ * Copy a disk to a sparse image of the same size, reading only what
+ * holds data: everything before the first partition, and for each FATX
+ * partition its header, chain table and allocated clusters. Partitions
+ * that are not FATX are left out. The rest of the image is left as holes.
+ *
+ * @param sourceFilename Disk or image to copy
+ * @param outputFilename Image to create
+ * @return 0 on success, -1 on failure
+ */
+int cloneDisk(char* sourceFilename, char* outputFilename);
+
+#endif
@@ -0,0 +1,439 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Duplicate file reports across FATX partitions and images
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dedupe.h"
+#include "disk.h"
+#include "extent.h"
+#include "hash.h"
+#include "tree.h"
+#include "pool.h"
+#include "util.h"
+
+// A partition being searched
+typedef struct {
+  char *image;
+  FATXDisk *disk;
+  int entry;
+  FATXPartition *partition;
+  FATXTree *tree;
+} DedupeSource;
+
+// A file being compared
+typedef struct {
+  int source;
+  int node;
+  u_int32_t size;
+  int broken;
+
+  // Hash of the start of the file, then of all of it (files no bigger
+  // than DEDUPE_PARTIAL_SIZE get their full hash in the first stage)
+  char partial[HASH_HEXSIZE];
+  char full[HASH_HEXSIZE];
+} DedupeFile;
+
+// State for one report
+typedef struct {
+  DedupeSource *sources;
+  int sourceCount;
+
+  DedupeFile *files;
+  int fileCount;
+  int allocated;
+
+  // Files taking part in the current stage
+  int *candidates;
+  int candidateCount;
+
+  // Bytes read by each stage
+  u_int64_t partialBytes;
+  u_int64_t fullBytes;
+  pthread_mutex_t lock;
+} DedupeContext;
+
+
+/**
+ * Add a piece of a file to its hash
+ */
+static int hashPiece(void* context, unsigned char* data, u_int64_t length) {
+  hashUpdate((HashState*) context, data, length);
+  return 0;
+}
+
+
+/**
+ * Hash the first length bytes of a file
+ *
+ * @return Number of bytes read, or -1 if the file could not be read
+ */
+static int64_t hashFile(DedupeContext* ctx, DedupeFile* file, int algorithm, u_int32_t length, char* hex) {
+  DedupeSource *source = &ctx->sources[file->source];
+  FATXPartition *partition = source->partition;
+  FATXExtent *extents;
+  unsigned char *buffer;
+  u_int64_t bufferSize;
+  u_int32_t clusters;
+  HashState hash;
+  int count;
+  int result;
+
+  clusters = ((u_int64_t) length + partition->clusterSize - 1) / partition->clusterSize;
+  bufferSize = (u_int64_t) clusters * partition->clusterSize;
+  if (bufferSize > DEDUPE_CHUNKSIZE) {
+    bufferSize = DEDUPE_CHUNKSIZE - (DEDUPE_CHUNKSIZE % partition->clusterSize);
+  }
+
+  hashInit(&hash, algorithm);
+  extents = buildExtents(partition, source->tree->nodes[file->node].entry.firstCluster, clusters, &count, NULL);
+  buffer = (unsigned char*) malloc(bufferSize);
+  result = (extents != NULL) && (buffer != NULL) &&
+           (readExtents(partition, extents, count, length, buffer, bufferSize, hashPiece, &hash) == 0);
+  free(buffer);
+  free(extents);
+  hashFinal(&hash, hex);
+  return result ? (int64_t) clusters * partition->clusterSize : -1;
+}
+
+
+/**
+ * First stage: hash the start of a file, or all of a small one
+ */
+static void partialJob(void* context, int index) {
+  DedupeContext *ctx = (DedupeContext*) context;
+  DedupeFile *file = &ctx->files[ctx->candidates[index]];
+  int64_t bytes;
+
+  if (file->size <= DEDUPE_PARTIAL_SIZE) {
+    bytes = hashFile(ctx, file, HASH_SHA1, file->size, file->full);
+    strcpy(file->partial, file->full);
+  } else {
+    bytes = hashFile(ctx, file, HASH_XXH64, DEDUPE_PARTIAL_SIZE, file->partial);
+  }
+  if (bytes == -1) {
+    file->broken = 1;
+    return;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  ctx->partialBytes += bytes;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+
+/**
+ * Second stage: hash all of a file
+ */
+static void fullJob(void* context, int index) {
+  DedupeContext *ctx = (DedupeContext*) context;
+  DedupeFile *file = &ctx->files[ctx->candidates[index]];
+  int64_t bytes;
+
+  bytes = hashFile(ctx, file, HASH_SHA1, file->size, file->full);
+  if (bytes == -1) {
+    file->broken = 1;
+    return;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  ctx->fullBytes += bytes;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+
+/**
+ * Order file indexes by size, then partial hash, then full hash, then
+ * where they were found
+ */
+static int compareFiles(const void* a, const void* b, void* context) {
+  DedupeFile *x = &((DedupeContext*) context)->files[*(const int*) a];
+  DedupeFile *y = &((DedupeContext*) context)->files[*(const int*) b];
+  int result;
+
+  if (x->size != y->size) {
+    return (x->size < y->size) ? -1 : 1;
+  }
+  if ((result = strcmp(x->partial, y->partial)) != 0) {
+    return result;
+  }
+  if ((result = strcmp(x->full, y->full)) != 0) {
+    return result;
+  }
+  return (*(const int*) a) - (*(const int*) b);
+}
+
+
+/**
+ * Check if two files are still alike after a stage
+ *
+ * @param level 0 = same size, 1 = same partial hash, 2 = same full hash
+ */
+static int sameFiles(DedupeFile* x, DedupeFile* y, int level) {
+  if (x->broken || y->broken || (x->size != y->size)) {
+    return 0;
+  }
+  if ((level >= 1) && strcmp(x->partial, y->partial)) {
+    return 0;
+  }
+  if ((level >= 2) && strcmp(x->full, y->full)) {
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Sort the candidates, and keep only those with at least one match
+ *
+ * @param level How alike the files must be (see sameFiles())
+ */
+static void keepMatches(DedupeContext* ctx, int level) {
+  int kept = 0;
+  int start;
+  int end;
+  int i;
+
+  qsort_r(ctx->candidates, ctx->candidateCount, sizeof(int), compareFiles, ctx);
+  for(start = 0; start < ctx->candidateCount; start = end) {
+    for(end = start + 1; (end < ctx->candidateCount) &&
+        sameFiles(&ctx->files[ctx->candidates[start]], &ctx->files[ctx->candidates[end]], level); end++);
+    if (end - start > 1) {
+      for(i = start; i < end; i++) {
+        ctx->candidates[kept++] = ctx->candidates[i];
+      }
+    }
+  }
+  ctx->candidateCount = kept;
+}
+
+
+/**
+ * Open an image and add its partitions to the list to search
+ */
+static void addImage(DedupeContext* ctx, char* image, char* partitionSpec) {
+  DedupeSource *source;
+  FATXBackend *backend;
+  FATXDisk *disk;
+  FILE *sourceFd;
+  int first = 0;
+  int last;
+  int i;
+
+  if ((sourceFd = fopen(image, "r")) == NULL) {
+    error("Unable to open source file %s", image);
+  }
+  backend = openBackend(sourceFd, image);
+  if (backend == NULL) {
+    error("Unable to read source file %s", image);
+  }
+  disk = openDisk(backend, backend->size);
+  if (disk == NULL) {
+    error("Out of memory");
+  }
+  last = disk->count - 1;
+  if (partitionSpec != NULL) {
+    first = last = findDiskEntry(disk, partitionSpec);
+    if (first == -1) {
+      error("No FATX partition %s found in %s", partitionSpec, image);
+    }
+  }
+
+  for(i = first; i <= last; i++) {
+    if (getDiskPartition(disk, i) == NULL) {
+      continue;
+    }
+    ctx->sources = (DedupeSource*) realloc(ctx->sources, (ctx->sourceCount + 1) * sizeof(DedupeSource));
+    if (ctx->sources == NULL) {
+      error("Out of memory");
+    }
+    source = &ctx->sources[ctx->sourceCount++];
+    source->image = image;
+    source->disk = disk;
+    source->entry = i;
+    source->partition = disk->entries[i].partition;
+    source->tree = loadTree(source->partition);
+    if (source->tree == NULL) {
+      error("Out of memory");
+    }
+  }
+
+  // nothing to search on this image
+  if ((ctx->sourceCount == 0) || (ctx->sources[ctx->sourceCount - 1].disk != disk)) {
+    fprintf(stderr, "dedupe : no FATX partitions found in %s\n", image);
+    closeDisk(disk);
+    closeBackend(backend);
+    fclose(sourceFd);
+  }
+}
+
+
+/**
+ * Add the files of a partition to the list to compare
+ */
+static void addFiles(DedupeContext* ctx, int sourceIndex) {
+  FATXTree *tree = ctx->sources[sourceIndex].tree;
+  DedupeFile *file;
+  int i;
+
+  for(i = 0; i < tree->count; i++) {
+    if (isTreeDirectory(&tree->nodes[i]) || (tree->nodes[i].entry.fileSize == 0)) {
+      continue;
+    }
+    if (ctx->fileCount == ctx->allocated) {
+      ctx->allocated = ctx->allocated ? ctx->allocated * 2 : 1024;
+      ctx->files = (DedupeFile*) realloc(ctx->files, ctx->allocated * sizeof(DedupeFile));
+      if (ctx->files == NULL) {
+        error("Out of memory");
+      }
+    }
+    file = &ctx->files[ctx->fileCount++];
+    memset(file, 0, sizeof(DedupeFile));
+    file->source = sourceIndex;
+    file->node = i;
+    file->size = tree->nodes[i].entry.fileSize;
+  }
+}
+
+
+/**
+ * Print where a file is: image, partition and path
+ */
+static void printFile(DedupeContext* ctx, DedupeFile* file) {
+  DedupeSource *source = &ctx->sources[file->source];
+  FATXDiskEntry *entry = &source->disk->entries[source->entry];
+  char path[4096];
+
+  treePath(source->tree, file->node, path, sizeof(path));
+  if (entry->letter) {
+    printf("dedupe :   %s:%c:%s\n", source->image, entry->letter, path);
+  } else {
+    printf("dedupe :   %s:%d:%s\n", source->image, source->entry, path);
+  }
+}
+
+
+/**
+ * Find files with identical contents in the FATX partitions of one or
+ * more images, and report each set of duplicates and the bytes that
+ * keeping one copy of each would free
+ *
+ * Files are compared in stages: only files sharing a size have their
+ * first DEDUPE_PARTIAL_SIZE bytes hashed, and only files that still match
+ * are hashed in full. Each stage runs in parallel.
+ *
+ * @param images Image filenames
+ * @param count Number of images
+ * @param partitionSpec If not NULL, only look at this partition of each
+ *        image (see findDiskEntry()); otherwise look at all of them
+ * @return 0 on success, -1 if any file could not be read
+ */
+int dedupeReport(char** images, int count, char* partitionSpec) {
+  DedupeContext ctx;
+  DedupeFile *file;
+  FATXBackend *backend;
+  u_int64_t totalBytes = 0;
+  u_int64_t reclaimable = 0;
+  int sizeMatches;
+  int partialMatches;
+  int sets = 0;
+  int broken = 0;
+  int start;
+  int end;
+  int i;
+
+  memset(&ctx, 0, sizeof(DedupeContext));
+  pthread_mutex_init(&ctx.lock, NULL);
+  for(i = 0; i < count; i++) {
+    addImage(&ctx, images[i], partitionSpec);
+  }
+  for(i = 0; i < ctx.sourceCount; i++) {
+    addFiles(&ctx, i);
+  }
+  ctx.candidates = (int*) malloc((ctx.fileCount + 1) * sizeof(int));
+  if (ctx.candidates == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < ctx.fileCount; i++) {
+    ctx.candidates[i] = i;
+    totalBytes += ctx.files[i].size;
+  }
+  ctx.candidateCount = ctx.fileCount;
+
+  // only files sharing a size can be duplicates
+  keepMatches(&ctx, 0);
+  sizeMatches = ctx.candidateCount;
+
+  // then only those whose first part matches
+  runParallel(partialJob, &ctx, ctx.candidateCount, 0);
+  keepMatches(&ctx, 1);
+  partialMatches = ctx.candidateCount;
+
+  // then only those matching in full; small files are already hashed
+  for(i = 0, end = 0; i < ctx.candidateCount; i++) {
+    if (ctx.files[ctx.candidates[i]].full[0] == 0) {
+      start = ctx.candidates[end];
+      ctx.candidates[end++] = ctx.candidates[i];
+      ctx.candidates[i] = start;
+    }
+  }
+  runParallel(fullJob, &ctx, end, 0);
+  keepMatches(&ctx, 2);
+
+  for(start = 0; start < ctx.candidateCount; start = end) {
+    file = &ctx.files[ctx.candidates[start]];
+    for(end = start + 1; (end < ctx.candidateCount) &&
+        sameFiles(file, &ctx.files[ctx.candidates[end]], 2); end++);
+    printf("dedupe : %d copies of %u bytes, %llu bytes reclaimable, sha1 %s\n", end - start, file->size,
+           (unsigned long long) file->size * (end - start - 1), file->full);
+    for(i = start; i < end; i++) {
+      printFile(&ctx, &ctx.files[ctx.candidates[i]]);
+    }
+    reclaimable += (u_int64_t) file->size * (end - start - 1);
+    sets++;
+  }
+
+  for(i = 0; i < ctx.fileCount; i++) {
+    broken += ctx.files[i].broken;
+  }
+  printf("dedupe : %d files (%llu bytes) in %d partitions of %d images\n", ctx.fileCount,
+         (unsigned long long) totalBytes, ctx.sourceCount, count);
+  printf("dedupe : %d share a size, %d share a partial hash (%llu bytes read), %llu bytes read for full hashes\n",
+         sizeMatches, partialMatches, (unsigned long long) ctx.partialBytes, (unsigned long long) ctx.fullBytes);
+  printf("dedupe : %d duplicate sets, %llu bytes reclaimable, %d unreadable files\n", sets,
+         (unsigned long long) reclaimable, broken);
+
+  // the sources of an image are together, and share its disk
+  for(i = 0; i < ctx.sourceCount; i++) {
+    freeTree(ctx.sources[i].tree);
+    if ((i == ctx.sourceCount - 1) || (ctx.sources[i].disk != ctx.sources[i + 1].disk)) {
+      backend = ctx.sources[i].disk->backend;
+      closeDisk(ctx.sources[i].disk);
+      fclose(backend->file);
+      closeBackend(backend);
+    }
+  }
+  pthread_mutex_destroy(&ctx.lock);
+  free(ctx.candidates);
+  free(ctx.files);
+  free(ctx.sources);
+  return broken ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Duplicate file reports across FATX partitions and images
+
+#ifndef DEDUPE_H
+#define DEDUPE_H 1
+
+// Bytes from the start of a file hashed to weed out files that only
+// share a size
+#define DEDUPE_PARTIAL_SIZE (64 * 1024)
+
+// Most data read at once when fully hashing one file
+#define DEDUPE_CHUNKSIZE (8 * 1024 * 1024)
+
+/**
+ * Find files with identical contents in the FATX partitions of one or
+ * more images, and report each set of duplicates and the bytes that
+ * keeping one copy of each would free
+ *
+ * Files are compared in stages: only files sharing a size have their
+ * first DEDUPE_PARTIAL_SIZE bytes hashed, and only files that still match
+ * are hashed in full. Each stage runs in parallel.
+ *
+ * @param images Image filenames
+ * @param count Number of images
+ * @param partitionSpec If not NULL, only look at this partition of each
+ *        image (see findDiskEntry()); otherwise look at all of them
+ * @return 0 on success, -1 if any file could not be read
+ */
+int dedupeReport(char** images, int count, char* partitionSpec);
+
+#endif
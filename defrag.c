@@ -0,0 +1,280 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Offline defragmentation of FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "defrag.h"
+#include "fatxdir.h"
+#include "fatxcore.h"
+#include "alloc.h"
+#include "extent.h"
+#include "util.h"
+
+// State shared by everything defragmented in one go
+typedef struct {
+  FATXPartition *partition;
+  ClusterBitmap *bitmap;
+  FATXDirCache *dirCache;
+  int flags;
+
+  // Data staging buffer (a multiple of the cluster size)
+  unsigned char *buffer;
+  u_int64_t bufferSize;
+
+  // Bytes moved since the last commit
+  u_int64_t uncommitted;
+
+  u_int32_t chains;
+  u_int32_t fragmented;
+  u_int32_t moved;
+  u_int32_t stuck;
+  u_int64_t extents;
+  u_int64_t seeksSaved;
+  u_int64_t bytesMoved;
+  int failures;
+} DefragContext;
+
+
+/**
+ * Commit the moves so far, making the clusters they freed reusable
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int commitMoves(DefragContext* ctx) {
+  ctx->uncommitted = 0;
+  if (ctx->flags & DEFRAG_DRYRUN) {
+    return reuseReleasedClusters(ctx->bitmap);
+  }
+  return commitPartition(ctx->dirCache, ctx->bitmap);
+}
+
+
+/**
+ * Copy a chain's data into a run, reading and writing through the staging
+ * buffer in large sequential pieces
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int copyExtents(DefragContext* ctx, FATXExtent* extents, int count, u_int32_t destination) {
+  u_int32_t clusterSize = ctx->partition->clusterSize;
+  u_int64_t filled = 0;
+  u_int64_t done;
+  u_int64_t length;
+  u_int64_t n;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    length = (u_int64_t) extents[i].length * clusterSize;
+    for(done = 0; done < length; done += n) {
+      n = length - done;
+      if (n > ctx->bufferSize - filled) {
+        n = ctx->bufferSize - filled;
+      }
+      if (readClusters(ctx->partition, extents[i].start + done / clusterSize, ctx->buffer + filled, n) == -1) {
+        return -1;
+      }
+      filled += n;
+      if (filled == ctx->bufferSize) {
+        if (writeClusters(ctx->partition, destination, ctx->buffer, filled) == -1) {
+          return -1;
+        }
+        destination += filled / clusterSize;
+        filled = 0;
+      }
+    }
+  }
+  if ((filled > 0) && (writeClusters(ctx->partition, destination, ctx->buffer, filled) == -1)) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Length of a directory entry's name, safe for printing
+ */
+static int nameLength(FATXDirEntry* entry) {
+  return (entry->filenameSize <= FATX_FILENAME_MAX) ? entry->filenameSize : FATX_FILENAME_MAX;
+}
+
+
+/**
+ * Move a file or directory into a single run of clusters if it is
+ * fragmented
+ *
+ * @param ctx Defrag context
+ * @param slot Location of the directory entry
+ * @param entry The directory entry
+ */
+static void defragChain(DefragContext* ctx, FATXDirSlot* slot, FATXDirEntry* entry) {
+  FATXPartition *partition = ctx->partition;
+  int isDirectory = entry->attributes & FATX_FILEATTR_DIRECTORY;
+  u_int32_t expected = 0;
+  u_int32_t clusters;
+  u_int32_t i;
+  u_int32_t j;
+  FATXExtent *extents;
+  ClusterRun run;
+  int count;
+  int e;
+
+  if (!isDirectory) {
+    expected = ((u_int64_t) entry->fileSize + partition->clusterSize - 1) / partition->clusterSize;
+    if (expected == 0) {
+      return;
+    }
+  }
+
+  ctx->chains++;
+  extents = buildExtents(partition, entry->firstCluster, expected, &count, &clusters);
+  ctx->extents += count;
+  if (count <= 1) {
+    free(extents);
+    return;
+  }
+  ctx->fragmented++;
+
+  // leave broken chains for a filesystem checker
+  if (!isDirectory && (clusters != expected)) {
+    fprintf(stderr, "defrag: %.*s: chain is broken, skipped\n", nameLength(entry), entry->filename);
+    ctx->stuck++;
+    free(extents);
+    return;
+  }
+
+  // clusters freed by earlier moves may make room
+  if ((allocateRun(ctx->bitmap, clusters, &run) == -1) && 
+      ((ctx->bitmap->releasedCount == 0) || (commitMoves(ctx) == -1) || 
+       (allocateRun(ctx->bitmap, clusters, &run) == -1))) {
+    ctx->stuck++;
+    free(extents);
+    return;
+  }
+
+  if (isDirectory) {
+    // directory clusters move through the cache, keeping unflushed changes
+    for(i = 0, e = 0; e < count; e++) {
+      for(j = 0; j < extents[e].length; j++, i++) {
+        memcpy(newDirCluster(ctx->dirCache, run.start + i), 
+               getDirCluster(ctx->dirCache, extents[e].start + j), partition->clusterSize);
+      }
+    }
+  } else if (!(ctx->flags & DEFRAG_DRYRUN) && (copyExtents(ctx, extents, count, run.start) == -1)) {
+    fprintf(stderr, "defrag: moving %.*s: %s\n", nameLength(entry), entry->filename, strerror(errno));
+    ctx->failures++;
+    free(extents);
+    return;
+  }
+  free(extents);
+
+  // point everything at the new copy, then free the old one
+  for(i = 0; i < clusters; i++) {
+    setChainEntry(partition, run.start + i, (i + 1 < clusters) ? run.start + i + 1 : chainEndMarker(partition));
+  }
+  if (releaseChain(ctx->bitmap, partition, entry->firstCluster) == -1) {
+    error("Out of memory");
+  }
+  modifyDirEntry(ctx->dirCache, slot)->firstCluster = run.start;
+
+  ctx->moved++;
+  ctx->seeksSaved += count - 1;
+  ctx->bytesMoved += (u_int64_t) clusters * partition->clusterSize;
+  ctx->uncommitted += (u_int64_t) clusters * partition->clusterSize;
+  if ((ctx->uncommitted >= DEFRAG_COMMIT_BYTES) && (commitMoves(ctx) == -1)) {
+    fprintf(stderr, "defrag: error updating partition: %s\n", strerror(errno));
+    ctx->failures++;
+  }
+}
+
+
+/**
+ * Defragment the contents of a directory, deepest first, so each directory
+ * only moves once nothing below it needs its entries changed
+ *
+ * @param ctx Defrag context
+ * @param dirCluster First cluster of the directory
+ */
+static void defragDirectory(DefragContext* ctx, u_int32_t dirCluster) {
+  FATXDirEntry entry;
+  FATXDirSlot slot;
+  int status;
+
+  slot.clusterId = dirCluster;
+  slot.index = -1;
+  while((status = nextDirEntry(ctx->dirCache, &slot, &entry)) == 1) {
+    if (entry.attributes & FATX_FILEATTR_DIRECTORY) {
+      defragDirectory(ctx, entry.firstCluster);
+      if (ctx->flags & DEFRAG_DIRECTORIES) {
+        defragChain(ctx, &slot, &entry);
+      }
+    } else {
+      defragChain(ctx, &slot, &entry);
+    }
+  }
+  if (status < 0) {
+    error("Unable to read the directory at cluster %u: %s", dirCluster, fatxStatusString(status));
+  }
+}
+
+
+/**
+ * Rewrite each fragmented file (and optionally directory) of a partition
+ * into a single run of clusters
+ *
+ * @param partition FATX partition (source file opened for writing unless
+ *        DEFRAG_DRYRUN is set)
+ * @param flags DEFRAG_* flags
+ * @return 0 on success, -1 if anything could not be moved
+ */
+int defragPartition(FATXPartition* partition, int flags) {
+  DefragContext ctx;
+
+  memset(&ctx, 0, sizeof(DefragContext));
+  ctx.partition = partition;
+  ctx.flags = flags;
+  ctx.bufferSize = DEFRAG_CHUNKSIZE - (DEFRAG_CHUNKSIZE % partition->clusterSize);
+  ctx.buffer = (unsigned char*) malloc(ctx.bufferSize);
+  ctx.bitmap = loadClusterBitmap(partition);
+  ctx.dirCache = createDirCache(partition);
+  if ((ctx.buffer == NULL) || (ctx.bitmap == NULL) || (ctx.dirCache == NULL)) {
+    error("Out of memory");
+  }
+
+  defragDirectory(&ctx, FATX_ROOT_FAT_CLUSTER);
+  if (commitMoves(&ctx) == -1) {
+    fprintf(stderr, "defrag: error updating partition: %s\n", strerror(errno));
+    ctx.failures++;
+  }
+
+  printf("defrag : %u of %u chains fragmented, %llu extents in all\n", 
+         ctx.fragmented, ctx.chains, (unsigned long long) ctx.extents);
+  printf("defrag : %s %u chains (%llu bytes), saving %llu seeks; %u cannot be moved\n", 
+         (flags & DEFRAG_DRYRUN) ? "would move" : "moved", ctx.moved, (unsigned long long) ctx.bytesMoved,
+         (unsigned long long) ctx.seeksSaved, ctx.stuck);
+
+  free(ctx.buffer);
+  freeClusterBitmap(ctx.bitmap);
+  freeDirCache(ctx.dirCache);
+  return (ctx.failures || ctx.stuck) ? -1 : 0;
+}
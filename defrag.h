@@ -0,0 +1,51 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Offline defragmentation of FATX partitions
+
+#ifndef DEFRAG_H
+#define DEFRAG_H 1
+
+#include "fatx.h"
+
+// Only report what would be moved
+#define DEFRAG_DRYRUN 1
+
+// Make directories contiguous as well as files
+#define DEFRAG_DIRECTORIES 2
+
+// Size of the staging buffer data is copied through
+#define DEFRAG_CHUNKSIZE (8 * 1024 * 1024)
+
+// Bytes moved between commits, so freed clusters become reusable
+#define DEFRAG_COMMIT_BYTES (256 * 1024 * 1024)
+
+/**
+ * Rewrite each fragmented file (and optionally directory) of a partition
+ * into a single run of clusters
+ *
+ * @param partition FATX partition (source file opened for writing unless
+ *        DEFRAG_DRYRUN is set)
+ * @param flags DEFRAG_* flags
+ * @return 0 on success, -1 if anything could not be moved
+ */
+int defragPartition(FATXPartition* partition, int flags);
+
+#endif
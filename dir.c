@@ -18,85 +18,290 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+// Scanning host directory trees
+
 #include <stddef.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include "dir.h"
+#include "pool.h"
+#include "util.h"
 
-DIR_ENTRY *add_entry(DIR_ENTRY *root,DIR_ENTRY *add) {
+// Size of the getdents64() buffer
+#define SCAN_BUFFERSIZE (64 * 1024)
 
-	DIR_ENTRY *next;
-	
+// State shared by the threads scanning one tree
+typedef struct {
+	HostTree *tree;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
 
-	if(add == NULL) return NULL;
+	// Directories waiting to be read (entry indexes, -1 = root)
+	int *queue;
+	int queueHead;
+	int queueTail;
+	int queueAllocated;
 
-	if(root == NULL) {
-		root = (DIR_ENTRY *)malloc(sizeof(DIR_ENTRY));
-		memset(root,0,sizeof(DIR_ENTRY));
-		memcpy(root,add,sizeof(DIR_ENTRY));
-	} else {
-		next = root;
-		while(next->next != NULL) {
-			next = next->next;
-		}
-		next->next = (DIR_ENTRY *)malloc(sizeof(DIR_ENTRY));
-		memset(next->next,0,sizeof(DIR_ENTRY));
-		memcpy(next->next,add,sizeof(DIR_ENTRY));
-	}
+	// Directories queued or being read
+	int pending;
+} ScanState;
 
-	return root;
+// Entries read from one directory, before they join the tree
+typedef struct {
+	HostEntry *entries;
+	int count;
+	int allocated;
+} ScanBatch;
 
-	
-}
 
-DIR_ENTRY *free_list(DIR_ENTRY *root) {
-	
-	DIR_ENTRY *next,*delete;
-	
-	if(root == NULL) return NULL;
-	
-	next = delete = root;
-	while(next->next != NULL) {
-		delete = next;
-		next = next->next;
-		free(delete);
+/**
+ * Store a path in an arena: prefix, a '/' if prefix is not empty, then name
+ */
+static char *arenaPath(HostArena **arena, char *prefix, char *name) {
+	size_t prefixLength = strlen(prefix);
+	size_t nameLength = strlen(name);
+	size_t needed = prefixLength + nameLength + 2;
+	HostArena *block;
+	char *path;
+
+	if ((*arena == NULL) || ((*arena)->size - (*arena)->used < needed)) {
+		size_t size = (needed > HOST_ARENA_BLOCKSIZE) ? needed : HOST_ARENA_BLOCKSIZE;
+		block = (HostArena *)malloc(sizeof(HostArena) + size);
+		if (block == NULL) {
+			error("Out of memory");
+		}
+		block->next = *arena;
+		block->used = 0;
+		block->size = size;
+		*arena = block;
 	}
-	free(next);
 
-	return NULL;
+	path = (*arena)->data + (*arena)->used;
+	memcpy(path, prefix, prefixLength);
+	if (prefixLength) {
+		path[prefixLength++] = '/';
+	}
+	memcpy(path + prefixLength, name, nameLength + 1);
+	(*arena)->used += prefixLength + nameLength + 1;
+	return path;
 }
 
-int find(char *szStartDir,char *szNextDir,DIR_ENTRY **list) {
-	DIR *dp;
-	struct dirent *ep;
-	char szDir[20000];
-	DIR_ENTRY add;
 
-	if(szNextDir != NULL) {
-		sprintf(szDir,"%s/%s",szStartDir,szNextDir);
-	} else {
-		sprintf(szDir,"%s",szStartDir);
+/**
+ * Read one directory into a batch
+ *
+ * @return Number of unreadable entries, or -1 if the directory itself
+ *         could not be read
+ */
+static int readDirectory(ScanState *state, HostArena **arena, ScanBatch *batch,
+			 int dirIndex, char *dirPath) {
+	char buffer[SCAN_BUFFERSIZE];
+	struct dirent64 *ep;
+	struct stat st;
+	HostEntry *add;
+	long n, pos;
+	int errors = 0;
+	int isLink;
+	int fd;
+
+	fd = openat(state->tree->rootFd, (*dirPath) ? dirPath : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "scan: %s: %s\n", dirPath, strerror(errno));
+		return -1;
 	}
-	dp = opendir(szDir);
-	if (dp != NULL) {
-		while ((ep = readdir(dp))) {
-			memset(&add,0,sizeof(DIR_ENTRY));
-			if(strcmp(ep->d_name,".") == 0 || strcmp(ep->d_name,"..") == 0) {
+
+	while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+		for (pos = 0; pos < n; pos += ep->d_reclen) {
+			ep = (struct dirent64 *)(buffer + pos);
+			if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, "..")) {
+				continue;
+			}
+			// look at the entry itself first: d_type may be DT_UNKNOWN, so
+			// it cannot be trusted to spot links
+			isLink = 0;
+			if ((fstatat(fd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) ||
+			    ((isLink = S_ISLNK(st.st_mode)) && (fstatat(fd, ep->d_name, &st, 0) == -1))) {
+				fprintf(stderr, "scan: %s/%s: %s\n", dirPath, ep->d_name, strerror(errno));
+				errors++;
+				continue;
+			}
+			// never follow links into directories, they may loop
+			if (isLink && S_ISDIR(st.st_mode)) {
 				continue;
 			}
-			sprintf(add.szFileName,"%s/%s",szDir,ep->d_name);
-			stat(add.szFileName,&add.sp);
-			*list = add_entry(*list,&add);
-			if(ep->d_type == 4) {
-				find(szDir,ep->d_name,list);
+
+			if (batch->count == batch->allocated) {
+				batch->allocated = batch->allocated ? batch->allocated * 2 : 256;
+				batch->entries = (HostEntry *)realloc(batch->entries, batch->allocated * sizeof(HostEntry));
+				if (batch->entries == NULL) {
+					error("Out of memory");
+				}
+			}
+			add = &batch->entries[batch->count++];
+			add->path = arenaPath(arena, dirPath, ep->d_name);
+			add->name = add->path + strlen(add->path) - strlen(ep->d_name);
+			add->parent = dirIndex;
+			add->mode = st.st_mode;
+			add->size = st.st_size;
+			add->mtime = st.st_mtime;
+		}
+	}
+	if (n == -1) {
+		fprintf(stderr, "scan: %s: %s\n", dirPath, strerror(errno));
+		errors++;
+	}
+	close(fd);
+	return errors;
+}
+
+
+/**
+ * Add a batch to the tree and queue its directories. Called with the lock held.
+ */
+static void addBatch(ScanState *state, ScanBatch *batch) {
+	HostTree *tree = state->tree;
+	int i;
+
+	if (tree->count + batch->count > tree->allocated) {
+		while (tree->count + batch->count > tree->allocated) {
+			tree->allocated = tree->allocated ? tree->allocated * 2 : 1024;
+		}
+		tree->entries = (HostEntry *)realloc(tree->entries, tree->allocated * sizeof(HostEntry));
+		if (tree->entries == NULL) {
+			error("Out of memory");
+		}
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		tree->entries[tree->count] = batch->entries[i];
+		if (S_ISDIR(batch->entries[i].mode)) {
+			if (state->queueTail == state->queueAllocated) {
+				state->queueAllocated *= 2;
+				state->queue = (int *)realloc(state->queue, state->queueAllocated * sizeof(int));
+				if (state->queue == NULL) {
+					error("Out of memory");
+				}
 			}
+			state->queue[state->queueTail++] = tree->count;
+			state->pending++;
 		}
-		(void) closedir (dp);
+		tree->count++;
 	}
-	return 0;
+	batch->count = 0;
 }
 
+
+/**
+ * Scanning thread: read queued directories until there are none left
+ */
+static void scanWorker(void *context, int index) {
+	ScanState *state = (ScanState *)context;
+	HostArena *arena = NULL;
+	HostArena *last;
+	ScanBatch batch;
+	char *dirPath;
+	int dirIndex;
+	int errors;
+
+	memset(&batch, 0, sizeof(ScanBatch));
+	pthread_mutex_lock(&state->lock);
+	for (;;) {
+		while ((state->queueHead == state->queueTail) && (state->pending > 0)) {
+			pthread_cond_wait(&state->wakeup, &state->lock);
+		}
+		if (state->queueHead == state->queueTail) {
+			break;
+		}
+		dirIndex = state->queue[state->queueHead++];
+		dirPath = (dirIndex == -1) ? "" : state->tree->entries[dirIndex].path;
+		pthread_mutex_unlock(&state->lock);
+
+		errors = readDirectory(state, &arena, &batch, dirIndex, dirPath);
+
+		pthread_mutex_lock(&state->lock);
+		state->tree->errors += (errors == -1) ? 1 : errors;
+		addBatch(state, &batch);
+		state->pending--;
+		pthread_cond_broadcast(&state->wakeup);
+	}
+
+	// hand this thread's path storage to the tree
+	if (arena != NULL) {
+		for (last = arena; last->next != NULL; last = last->next)
+			;
+		last->next = state->tree->arenas;
+		state->tree->arenas = arena;
+	}
+	pthread_mutex_unlock(&state->lock);
+	free(batch.entries);
+}
+
+
+/**
+ * Scan a host directory tree
+ *
+ * @param root Directory to scan
+ * @param threads Number of directories to read at once (0 = one per CPU)
+ * @return The tree, or NULL if root cannot be opened
+ */
+HostTree *scanHostTree(char *root, int threads) {
+	ScanState state;
+	HostTree *tree;
+
+	tree = (HostTree *)calloc(1, sizeof(HostTree));
+	if (tree == NULL) {
+		error("Out of memory");
+	}
+	tree->rootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (tree->rootFd == -1) {
+		fprintf(stderr, "scan: %s: %s\n", root, strerror(errno));
+		free(tree);
+		return NULL;
+	}
+
+	memset(&state, 0, sizeof(ScanState));
+	state.tree = tree;
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.wakeup, NULL);
+	state.queueAllocated = 1024;
+	state.queue = (int *)malloc(state.queueAllocated * sizeof(int));
+	if (state.queue == NULL) {
+		error("Out of memory");
+	}
+	state.queue[state.queueTail++] = -1;
+	state.pending = 1;
+
+	if (threads <= 0) {
+		threads = defaultThreads();
+	}
+	runParallel(scanWorker, &state, threads, threads);
+
+	free(state.queue);
+	pthread_mutex_destroy(&state.lock);
+	pthread_cond_destroy(&state.wakeup);
+	return tree;
+}
+
+
+/**
+ * Free a scanned tree and close its root
+ */
+void freeHostTree(HostTree *tree) {
+	HostArena *next;
+
+	while (tree->arenas != NULL) {
+		next = tree->arenas->next;
+		free(tree->arenas);
+		tree->arenas = next;
+	}
+	close(tree->rootFd);
+	free(tree->entries);
+	free(tree);
+}
@@ -18,17 +18,77 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+// Scanning host directory trees
+
 #ifndef _DIR_H_
 #define _DIR_H_
 
-typedef struct DIR_ENTRY {
-        char szFileName[2000];
-        struct DIR_ENTRY *next;
-        struct stat sp;
-} DIR_ENTRY;
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+// Size of each block of path storage
+#define HOST_ARENA_BLOCKSIZE (1024 * 1024)
+
+/**
+ * A block of path storage. Paths are packed one after another and are
+ * only freed all together.
+ */
+typedef struct HostArena {
+        struct HostArena *next;
+        size_t used;
+        size_t size;
+        char data[];
+} HostArena;
+
+/**
+ * A file or directory found under the scan root
+ */
+typedef struct {
+        // Path relative to the scan root
+        char *path;
+
+        // Last component of path
+        char *name;
+
+        // Index of the containing directory's entry, -1 if it is the root
+        int parent;
+
+        mode_t mode;
+        off_t size;
+        time_t mtime;
+} HostEntry;
+
+/**
+ * Everything under a host directory. A directory's entry always comes
+ * before the entries of its contents.
+ */
+typedef struct {
+        // Descriptor of the scan root, for openat() on entry paths
+        int rootFd;
+
+        HostEntry *entries;
+        int count;
+        int allocated;
+
+        // Number of directories or entries which could not be read
+        int errors;
+
+        HostArena *arenas;
+} HostTree;
+
+/**
+ * Scan a host directory tree
+ *
+ * @param root Directory to scan
+ * @param threads Number of directories to read at once (0 = one per CPU)
+ * @return The tree, or NULL if root cannot be opened
+ */
+HostTree* scanHostTree(char *root, int threads);
 
-DIR_ENTRY *add_entry(DIR_ENTRY *root,DIR_ENTRY *add);
-DIR_ENTRY *free_list(DIR_ENTRY *root);
-int find(char *szStartDir,char *szNextDir,DIR_ENTRY **list);
+/**
+ * Free a scanned tree and close its root
+ */
+void freeHostTree(HostTree *tree);
 
 #endif //       _DIR_H_
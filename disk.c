@@ -0,0 +1,371 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// A whole Xbox disk (or image) and the partitions on it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include "disk.h"
+#include "partition.h"
+#include "scan.h"
+#include "util.h"
+
+// Drive letter of each partition table slot
+static const char driveLetters[] = "ECXYZFG";
+
+
+/**
+ * Read the cluster size from a partition header
+ *
+ * @return Cluster size, or 0 if there is no valid FATX header
+ */
+static u_int32_t readClusterSize(FATXDisk* disk, u_int64_t offset) {
+  u_int32_t header[4];
+  u_int32_t clusterSize;
+
+  if (backendRead(disk->backend, header, sizeof(header), offset) == -1) {
+    return 0;
+  }
+  if (header[0] != FATX_PARTITION_MAGIC) {
+    return 0;
+  }
+  clusterSize = header[2] * 512;
+  if ((clusterSize == 0) || (clusterSize > 0x10000) || (clusterSize & (clusterSize - 1))) {
+    return 0;
+  }
+  return clusterSize;
+}
+
+
+/**
+ * Add a partition to a disk's list
+ */
+static FATXDiskEntry* addEntry(FATXDisk* disk, u_int64_t offset, u_int64_t size, char letter) {
+  FATXDiskEntry *entry;
+
+  disk->entries = (FATXDiskEntry*) realloc(disk->entries, (disk->count + 1) * sizeof(FATXDiskEntry));
+  if (disk->entries == NULL) {
+    error("Out of memory");
+  }
+  entry = &disk->entries[disk->count++];
+  memset(entry, 0, sizeof(FATXDiskEntry));
+  entry->offset = offset;
+  entry->size = size;
+  entry->letter = letter;
+  if (size > 0) {
+    entry->clusterSize = readClusterSize(disk, offset);
+  }
+  return entry;
+}
+
+
+/**
+ * Load the partition list from the partition table
+ *
+ * @return 1 if there is a table, 0 if not
+ */
+static int readTable(FATXDisk* disk) {
+  XboxPartitionTable table;
+  XboxPartitionTableEntry *slot;
+  int i;
+
+  if (backendRead(disk->backend, &table, sizeof(table), 0) == -1) {
+    return 0;
+  }
+  if (memmem(table.Magic, sizeof(table.Magic), "PARTINFO", 8) == NULL) {
+    return 0;
+  }
+  for(i = 0; i < DISK_TABLE_ENTRIES; i++) {
+    slot = &table.TableEntries[i];
+    if (slot->Flags & PE_PARTFLAGS_IN_USE) {
+      addEntry(disk, slot->LBAStart * 512ULL, slot->LBASize * 512ULL, (i < 7) ? driveLetters[i] : 0);
+    } else {
+      addEntry(disk, 0, 0, 0);
+    }
+  }
+  return 1;
+}
+
+
+/**
+ * Load the partition list from the standard Xbox layout, in partition
+ * table order
+ *
+ * @return 1 if any standard partition is FATX, 0 if not
+ */
+static int readStandardLayout(FATXDisk* disk) {
+  u_int64_t sectors = disk->diskSize / 512;
+  int found = 0;
+  int i;
+
+  addEntry(disk, XBOX_MUSICPART_LBA_START * 512ULL, XBOX_MUSICPART_LBA_SIZE * 512ULL, 'E');
+  addEntry(disk, XBOX_SYSPART_LBA_START * 512ULL, XBOX_SYSPART_LBA_SIZE * 512ULL, 'C');
+  addEntry(disk, XBOX_SWAPPART1_LBA_START * 512ULL, XBOX_SWAPPART_LBA_SIZE * 512ULL, 'X');
+  addEntry(disk, XBOX_SWAPPART2_LBA_START * 512ULL, XBOX_SWAPPART_LBA_SIZE * 512ULL, 'Y');
+  addEntry(disk, XBOX_SWAPPART3_LBA_START * 512ULL, XBOX_SWAPPART_LBA_SIZE * 512ULL, 'Z');
+  if (sectors > XBOX_PART6_LBA_START) {
+    addEntry(disk, XBOX_PART6_LBA_START * 512ULL, (sectors - XBOX_PART6_LBA_START) * 512ULL, 'F');
+  }
+
+  for(i = 0; i < disk->count; i++) {
+    if (disk->entries[i].offset + disk->entries[i].size > disk->diskSize) {
+      disk->entries[i].size = 0;
+      disk->entries[i].clusterSize = 0;
+    }
+    if (disk->entries[i].clusterSize != 0) {
+      found = 1;
+    }
+  }
+  return found;
+}
+
+
+/**
+ * Add partitions found by scanning the disk, skipping ones already listed
+ */
+static void addScannedPartitions(FATXDisk* disk) {
+  FATXPartitionMap *map;
+  FATXDiskEntry *entry;
+  int i;
+  int j;
+
+  map = scanPartitions(disk->backend, disk->diskSize);
+  if (map == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < map->count; i++) {
+    for(j = 0; j < disk->count; j++) {
+      if ((disk->entries[j].size != 0) && (disk->entries[j].offset == map->partitions[i].offset)) {
+        break;
+      }
+    }
+    if (j == disk->count) {
+      entry = addEntry(disk, map->partitions[i].offset, map->partitions[i].size, 0);
+      entry->clusterSize = map->partitions[i].clusterSize;
+    }
+  }
+  freePartitionMap(map);
+}
+
+
+/**
+ * Open a disk, reading its partition table. Without a table the standard
+ * Xbox layout is tried, and failing that the disk is scanned.
+ *
+ * @param backend Disk or image
+ * @param diskSize Size of the disk in bytes
+ * @return New disk, or NULL if out of memory
+ */
+FATXDisk* openDisk(FATXBackend *backend, u_int64_t diskSize) {
+  FATXDisk *disk;
+
+  disk = (FATXDisk*) calloc(1, sizeof(FATXDisk));
+  if (disk == NULL) {
+    return NULL;
+  }
+  disk->backend = backend;
+  disk->diskSize = diskSize;
+
+  disk->source = DISK_SOURCE_TABLE;
+  if (readTable(disk)) {
+    return disk;
+  }
+  disk->source = DISK_SOURCE_STANDARD;
+  if (readStandardLayout(disk)) {
+    return disk;
+  }
+  disk->source = DISK_SOURCE_SCAN;
+  disk->count = 0;
+  addScannedPartitions(disk);
+  return disk;
+}
+
+
+/**
+ * Close a disk and any partitions opened through it (but not its backend)
+ */
+void closeDisk(FATXDisk* disk) {
+  int i;
+
+  for(i = 0; i < disk->count; i++) {
+    if (disk->entries[i].partition != NULL) {
+      closePartition(disk->entries[i].partition);
+    }
+  }
+  free(disk->entries);
+  free(disk);
+}
+
+
+/**
+ * Find a partition of a disk
+ *
+ * @param disk Disk
+ * @param spec Partition index (0-13), drive letter (E, C, X, Y, Z, F or
+ *        G), "auto" for the first FATX partition, or "@offset" for the
+ *        partition at a byte offset
+ * @return Index into the disk's entries, or -1 if there is no such FATX
+ *         partition
+ */
+int findDiskEntry(FATXDisk* disk, char* spec) {
+  u_int64_t offset;
+  char *end;
+  int index = -1;
+  int scanned = (disk->source == DISK_SOURCE_SCAN);
+  int i;
+
+  if (*spec == '@') {
+    offset = strtoull(spec + 1, &end, 0);
+    if ((*end != 0) || (end == spec + 1)) {
+      return -1;
+    }
+    for(;;) {
+      for(i = 0; i < disk->count; i++) {
+        if ((disk->entries[i].size != 0) && (disk->entries[i].offset == offset)) {
+          index = i;
+        }
+      }
+      // partitions outside the table can still be found by scanning
+      if ((index != -1) || scanned) {
+        break;
+      }
+      addScannedPartitions(disk);
+      scanned = 1;
+    }
+  } else if (!strcmp(spec, "auto")) {
+    for(i = 0; (i < disk->count) && (index == -1); i++) {
+      if (disk->entries[i].clusterSize != 0) {
+        index = i;
+      }
+    }
+  } else if (isdigit(*spec)) {
+    index = strtol(spec, &end, 10);
+    if ((*end != 0) || (index >= disk->count)) {
+      index = -1;
+    }
+  } else if (spec[1] == 0) {
+    for(i = 0; i < disk->count; i++) {
+      if ((disk->entries[i].letter != 0) && (disk->entries[i].letter == toupper(*spec))) {
+        index = i;
+      }
+    }
+  }
+
+  if ((index == -1) || (disk->entries[index].clusterSize == 0)) {
+    return -1;
+  }
+  return index;
+}
+
+
+/**
+ * Get a partition of a disk, opening it if need be
+ *
+ * @param disk Disk
+ * @param index Index into the disk's entries
+ * @return The partition, or NULL if it is not FATX
+ */
+FATXPartition* getDiskPartition(FATXDisk* disk, int index) {
+  FATXDiskEntry *entry = &disk->entries[index];
+
+  if (entry->clusterSize == 0) {
+    return NULL;
+  }
+  if (entry->partition == NULL) {
+    entry->partition = loadPartition(disk->backend, entry->offset, entry->size, entry->clusterSize);
+  }
+  return entry->partition;
+}
+
+
+/**
+ * Print the partitions of a disk
+ *
+ * @param szDrive Disk or image file
+ * @return 1 on success, 0 on failure
+ */
+int listPartitions(char *szDrive) {
+	static const char *sources[] = { "", " (no table, standard layout)", " (no table, found by scanning)" };
+	FILE *fp;
+	FATXBackend *backend;
+	FATXDisk *disk;
+	FATXDiskEntry *entry;
+	u_int64_t totalsectors;
+	u_int64_t disksize;
+	int cl_size;
+	int i;
+
+	totalsectors = getDiskSize(szDrive);
+	printf("Total Sectors  -> %llu\n",(unsigned long long)totalsectors);
+
+	fp = fopen(szDrive, "r");
+	if (!fp) {
+		printf("Error opening %s\n",szDrive);
+		return 0;
+	}
+	backend = openBackend(fp, szDrive);
+	if (backend == NULL) {
+		printf("Error reading %s: %s\n",szDrive,strerror(errno));
+		fclose(fp);
+		return 0;
+	}
+	disksize = backend->size;
+	if (disksize == 0) {
+		disksize = totalsectors * 512;
+	}
+
+	disk = openDisk(backend, disksize);
+	if (disk == NULL) {
+		printf("Out of memory\n");
+		closeBackend(backend);
+		fclose(fp);
+		return 0;
+	}
+
+	printf("Partition table%s:\n", sources[disk->source]);
+	for (i = 0; i < disk->count; i++) {
+		entry = &disk->entries[i];
+		if (entry->size == 0)
+			continue;
+		printf("partition %d\tstart %llu\tsize\t%010lluMB\t", i,
+		       (unsigned long long) entry->offset / 512, (unsigned long long) entry->size / 1048576);
+		if (entry->letter)
+			printf("%c:\t", entry->letter);
+		if (entry->clusterSize) {
+			cl_size = entry->clusterSize / 1024;
+			if ((entry->size / 512 >= LBASIZE_512GB && cl_size < 64) ||
+			    (entry->size / 512 >= LBASIZE_256GB && cl_size < 32))
+				printf("Cluster size %02dK-ERR\n",cl_size);
+			else
+				printf("Cluster size %02dK\n",cl_size);
+		} else {
+			printf("Unknown cluster size\n");
+		}
+	}
+
+	closeDisk(disk);
+	closeBackend(backend);
+	fclose(fp);
+	return 1;
+}
@@ -0,0 +1,115 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// A whole Xbox disk (or image) and the partitions on it
+
+#ifndef DISK_H
+#define DISK_H 1
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "fatx.h"
+
+// Where the partition list of a disk came from
+#define DISK_SOURCE_TABLE 0
+#define DISK_SOURCE_STANDARD 1
+#define DISK_SOURCE_SCAN 2
+
+// Number of entries in a partition table
+#define DISK_TABLE_ENTRIES 14
+
+/**
+ * A partition of a disk
+ */
+typedef struct {
+  // Byte offset and size of the partition
+  u_int64_t offset;
+  u_int64_t size;
+
+  // Cluster size from the partition header (0 if it is not FATX)
+  u_int32_t clusterSize;
+
+  // Drive letter (0 if none)
+  char letter;
+
+  // Opened on first use
+  FATXPartition *partition;
+} FATXDiskEntry;
+
+/**
+ * An open disk: its partition list is worked out once, and its partitions
+ * are opened on demand, all sharing the disk's backend
+ */
+typedef struct {
+  FATXBackend *backend;
+  u_int64_t diskSize;
+  int source;
+
+  // Partition list; table entries are indexed by table slot, unused slots
+  // having a size of 0
+  FATXDiskEntry *entries;
+  int count;
+} FATXDisk;
+
+/**
+ * Open a disk, reading its partition table. Without a table the standard
+ * Xbox layout is tried, and failing that the disk is scanned.
+ *
+ * @param backend Disk or image
+ * @param diskSize Size of the disk in bytes
+ * @return New disk, or NULL if out of memory
+ */
+FATXDisk* openDisk(FATXBackend *backend, u_int64_t diskSize);
+
+/**
+ * Close a disk and any partitions opened through it (but not its backend)
+ */
+void closeDisk(FATXDisk* disk);
+
+/**
+ * Find a partition of a disk
+ *
+ * @param disk Disk
+ * @param spec Partition index (0-13), drive letter (E, C, X, Y, Z, F or
+ *        G), "auto" for the first FATX partition, or "@offset" for the
+ *        partition at a byte offset
+ * @return Index into the disk's entries, or -1 if there is no such FATX
+ *         partition
+ */
+int findDiskEntry(FATXDisk* disk, char* spec);
+
+/**
+ * Get a partition of a disk, opening it if need be
+ *
+ * @param disk Disk
+ * @param index Index into the disk's entries
+ * @return The partition, or NULL if it is not FATX
+ */
+FATXPartition* getDiskPartition(FATXDisk* disk, int index);
+
+/**
+ * Print the partitions of a disk
+ *
+ * @param szDrive Disk or image file
+ * @return 1 on success, 0 on failure
+ */
+int listPartitions(char *szDrive);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Exporting the stored data of an Xbox disk as a compressed image
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "export.h"
+#include "backend.h"
+#include "disk.h"
+#include "live.h"
+#include "pool.h"
+#include "util.h"
+
+// A frame being compressed
+typedef struct {
+  unsigned char *data;
+  unsigned char *compressed;
+
+  // Compressed length (0 = nothing but zeros), and the bytes of data read
+  uLongf length;
+  u_int64_t live;
+  int failed;
+} ExportFrame;
+
+// State for one export
+typedef struct {
+  FATXBackend *backend;
+  FATXRangeList *list;
+
+  // Frames of the current batch
+  u_int64_t firstFrame;
+  ExportFrame frames[EXPORT_BATCH_FRAMES];
+} ExportContext;
+
+
+/**
+ * Check if a buffer is all zeros
+ */
+static int isZero(unsigned char* data, u_int64_t length) {
+  u_int64_t i;
+
+  for(i = 0; i < length; i++) {
+    if (data[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/**
+ * Read the live parts of one frame, and compress it
+ */
+static void compressJob(void* context, int index) {
+  ExportContext *ctx = (ExportContext*) context;
+  ExportFrame *frame = &ctx->frames[index];
+  FATXRange *range;
+  u_int64_t start = (ctx->firstFrame + index) * EXPORT_FRAMESIZE;
+  u_int64_t end = start + EXPORT_FRAMESIZE;
+  u_int64_t from;
+  u_int64_t to;
+  int low = 0;
+  int high = ctx->list->count;
+  int mid;
+
+  if (end > ctx->backend->size) {
+    end = ctx->backend->size;
+  }
+  frame->length = 0;
+  frame->live = 0;
+  frame->failed = 0;
+
+  // first range ending after the start of the frame
+  while(low < high) {
+    mid = (low + high) / 2;
+    range = &ctx->list->ranges[mid];
+    if (range->offset + range->length <= start) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  memset(frame->data, 0, end - start);
+  for(; (low < ctx->list->count) && (ctx->list->ranges[low].offset < end); low++) {
+    range = &ctx->list->ranges[low];
+    from = (range->offset > start) ? range->offset : start;
+    to = (range->offset + range->length < end) ? range->offset + range->length : end;
+    if (backendRead(ctx->backend, frame->data + (from - start), to - from, from) == -1) {
+      frame->failed = 1;
+      return;
+    }
+    frame->live += to - from;
+  }
+  if ((frame->live == 0) || isZero(frame->data, end - start)) {
+    return;
+  }
+
+  frame->length = compressBound(EXPORT_FRAMESIZE);
+  if (compress2(frame->compressed, &frame->length, frame->data, end - start, EXPORT_LEVEL) != Z_OK) {
+    frame->failed = 1;
+  }
+}
+
+
+/**
+ * Write all of a buffer
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int writeFully(int fd, void* data, u_int64_t length) {
+  u_int64_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = write(fd, (unsigned char*) data + done, length - done);
+    if (n < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Write a disk as a seekable compressed image (see backend.h). Only what
+ * holds data is read and stored: everything before the first partition,
+ * and for each FATX partition its header, chain table and allocated
+ * clusters. Everything else reads back as zeros, and frames holding
+ * nothing else are left out altogether.
+ *
+ * @param sourceFilename Disk or image to export
+ * @param outputFilename Compressed image to create
+ * @return 0 on success, -1 on failure
+ */
+int exportDisk(char* sourceFilename, char* outputFilename) {
+  ExportContext ctx;
+  ExportFrame *frame;
+  FATXDisk *disk;
+  FILE *sourceFd;
+  unsigned char header[COMPRESSED_HEADERSIZE];
+  unsigned char trailer[COMPRESSED_TRAILERSIZE];
+  unsigned char *index;
+  unsigned char *entry;
+  u_int64_t frameCount;
+  u_int64_t offset = COMPRESSED_HEADERSIZE;
+  u_int64_t live = 0;
+  u_int64_t stored = 0;
+  u_int64_t written;
+  int outputFd;
+  int failed = 0;
+  int count;
+  int i;
+
+  memset(&ctx, 0, sizeof(ExportContext));
+  if ((sourceFd = fopen(sourceFilename, "r")) == NULL) {
+    error("Unable to open source file %s", sourceFilename);
+  }
+  ctx.backend = openBackend(sourceFd, sourceFilename);
+  if (ctx.backend == NULL) {
+    error("Unable to read source file %s: %s", sourceFilename, strerror(errno));
+  }
+  disk = openDisk(ctx.backend, ctx.backend->size);
+  if (disk == NULL) {
+    error("Out of memory");
+  }
+  ctx.list = liveRanges(disk, 0);
+
+  frameCount = (ctx.backend->size + EXPORT_FRAMESIZE - 1) / EXPORT_FRAMESIZE;
+  index = (unsigned char*) calloc(frameCount + 1, COMPRESSED_INDEXENTRYSIZE);
+  if (index == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < EXPORT_BATCH_FRAMES; i++) {
+    ctx.frames[i].data = (unsigned char*) malloc(EXPORT_FRAMESIZE);
+    ctx.frames[i].compressed = (unsigned char*) malloc(compressBound(EXPORT_FRAMESIZE));
+    if ((ctx.frames[i].data == NULL) || (ctx.frames[i].compressed == NULL)) {
+      error("Out of memory");
+    }
+  }
+
+  outputFd = open(outputFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (outputFd == -1) {
+    error("Unable to open output file %s", outputFilename);
+  }
+  memset(header, 0, sizeof(header));
+  memcpy(header, COMPRESSED_MAGIC, 8);
+  *(u_int32_t*) &header[8] = htole32(COMPRESSED_VERSION);
+  *(u_int32_t*) &header[12] = htole32(EXPORT_FRAMESIZE);
+  *(u_int64_t*) &header[16] = htole64(ctx.backend->size);
+  failed = (writeFully(outputFd, header, sizeof(header)) == -1);
+
+  // compress a batch of frames in parallel, then write them in order
+  for(ctx.firstFrame = 0; (ctx.firstFrame < frameCount) && !failed; ctx.firstFrame += count) {
+    count = (frameCount - ctx.firstFrame < EXPORT_BATCH_FRAMES) ? frameCount - ctx.firstFrame : EXPORT_BATCH_FRAMES;
+    runParallel(compressJob, &ctx, count, 0);
+
+    for(i = 0; (i < count) && !failed; i++) {
+      frame = &ctx.frames[i];
+      if (frame->failed) {
+        fprintf(stderr, "export : unable to read or compress frame %llu\n",
+                (unsigned long long) (ctx.firstFrame + i));
+        failed = 1;
+        break;
+      }
+      live += frame->live;
+      if (frame->length == 0) {
+        continue;
+      }
+      if (writeFully(outputFd, frame->compressed, frame->length) == -1) {
+        failed = 1;
+        break;
+      }
+      entry = &index[(ctx.firstFrame + i) * COMPRESSED_INDEXENTRYSIZE];
+      *(u_int64_t*) &entry[0] = htole64(offset);
+      *(u_int32_t*) &entry[8] = htole32(frame->length);
+      offset += frame->length;
+      stored++;
+    }
+  }
+
+  // then the index and trailer
+  memset(trailer, 0, sizeof(trailer));
+  *(u_int64_t*) &trailer[0] = htole64(offset);
+  *(u_int64_t*) &trailer[8] = htole64(frameCount);
+  memcpy(trailer + 24, COMPRESSED_INDEX_MAGIC, 8);
+  if (!failed && ((writeFully(outputFd, index, frameCount * COMPRESSED_INDEXENTRYSIZE) == -1) ||
+                  (writeFully(outputFd, trailer, sizeof(trailer)) == -1) || (fsync(outputFd) == -1))) {
+    failed = 1;
+  }
+  if (close(outputFd) == -1) {
+    failed = 1;
+  }
+  if (failed) {
+    fprintf(stderr, "export : unable to write %s: %s\n", outputFilename, strerror(errno));
+  } else {
+    written = offset + frameCount * COMPRESSED_INDEXENTRYSIZE + COMPRESSED_TRAILERSIZE;
+    printf("export : %llu of %llu bytes hold data, %llu of %llu frames stored, %llu bytes written\n",
+           (unsigned long long) live, (unsigned long long) ctx.backend->size, (unsigned long long) stored,
+           (unsigned long long) frameCount, (unsigned long long) written);
+  }
+
+  for(i = 0; i < EXPORT_BATCH_FRAMES; i++) {
+    free(ctx.frames[i].data);
+    free(ctx.frames[i].compressed);
+  }
+  free(index);
+  freeRangeList(ctx.list);
+  closeDisk(disk);
+  closeBackend(ctx.backend);
+  fclose(sourceFd);
+  return failed ? -1 : 0;
+}
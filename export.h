@@ -0,0 +1,48 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Exporting the stored data of an Xbox disk as a compressed image
+
+#ifndef EXPORT_H
+#define EXPORT_H 1
+
+// Bytes of the disk in each compressed frame
+#define EXPORT_FRAMESIZE (1024 * 1024)
+
+// Frames compressed in parallel before being written out
+#define EXPORT_BATCH_FRAMES 64
+
+// zlib compression level
+#define EXPORT_LEVEL 6
+
+/**
+ * Write a disk as a seekable compressed image (see backend.h). Only what
+ * holds data is read and stored: everything before the first partition,
+ * and for each FATX partition its header, chain table and allocated
+ * clusters. Everything else reads back as zeros, and frames holding
+ * nothing else are left out altogether.
+ *
+ * @param sourceFilename Disk or image to export
+ * @param outputFilename Compressed image to create
+ * @return 0 on success, -1 on failure
+ */
+int exportDisk(char* sourceFilename, char* outputFilename);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Mapping FATX cluster chains to extents
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "extent.h"
+
+/**
+ * Follow a cluster chain, merging consecutive clusters into extents. A
+ * broken chain (a free or out of range entry) ends the list early.
+ *
+ * @param partition FATX partition
+ * @param firstCluster First cluster of the chain
+ * @param maxClusters Most clusters to follow (0 = to the end of the chain)
+ * @param count Set to the number of extents returned
+ * @param clusters If not NULL, set to the number of clusters followed
+ * @return malloc()ed array of extents, or NULL if there are none or out
+ *         of memory
+ */
+FATXExtent* buildExtents(FATXPartition* partition, u_int32_t firstCluster, u_int32_t maxClusters,
+                         int* count, u_int32_t* clusters) {
+  FATXExtent *extents = NULL;
+  FATXExtent *last = NULL;
+  u_int32_t endMarker = chainEndMarker(partition);
+  u_int32_t clusterId = firstCluster;
+  u_int32_t followed = 0;
+  u_int32_t next;
+  int allocated = 0;
+
+  *count = 0;
+  if ((maxClusters == 0) || (maxClusters > partition->clusterCount)) {
+    // a chain can't be longer than the partition, even if it loops
+    maxClusters = partition->clusterCount;
+  }
+
+  while((followed < maxClusters) && (clusterId >= FATX_ROOT_FAT_CLUSTER) && 
+        (clusterId < partition->clusterCount)) {
+    next = getChainEntry(partition, clusterId);
+    if (next == 0) {
+      break;
+    }
+
+    if ((last != NULL) && (last->start + last->length == clusterId)) {
+      last->length++;
+    } else {
+      if (*count == allocated) {
+        allocated = allocated ? allocated * 2 : 8;
+        extents = (FATXExtent*) realloc(extents, allocated * sizeof(FATXExtent));
+        if (extents == NULL) {
+          *count = 0;
+          return NULL;
+        }
+      }
+      last = &extents[*count];
+      last->start = clusterId;
+      last->length = 1;
+      last->offset = (u_int64_t) followed * partition->clusterSize;
+      (*count)++;
+    }
+    followed++;
+
+    // any end of chain or reserved marker stops the walk
+    if (next >= (endMarker & 0xfffffff0)) {
+      break;
+    }
+    clusterId = next;
+  }
+
+  if (clusters != NULL) {
+    *clusters = followed;
+  }
+  return extents;
+}
+
+
+/**
+ * Read the data of a chain a buffer at a time, in order
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param length Number of bytes to read from the start of the chain
+ * @param buffer Buffer to read into
+ * @param bufferSize Size of buffer (a multiple of the cluster size)
+ * @param reader Called with each piece read
+ * @param context Passed to reader
+ * @return 0 on success, -1 on a read failure, if the extents are too
+ *         short or if reader stopped
+ */
+int readExtents(FATXPartition* partition, FATXExtent* extents, int count, u_int64_t length,
+                unsigned char* buffer, u_int64_t bufferSize, ExtentReader reader, void* context) {
+  u_int64_t extentBytes;
+  u_int64_t done;
+  u_int64_t n;
+  int i;
+
+  for(i = 0; (i < count) && (length > 0); i++) {
+    extentBytes = (u_int64_t) extents[i].length * partition->clusterSize;
+    for(done = 0; (done < extentBytes) && (length > 0); done += n) {
+      n = extentBytes - done;
+      if (n > bufferSize) {
+        n = bufferSize;
+      }
+      if (n > length) {
+        n = length;
+      }
+
+      // whole clusters are read; only what was asked for is passed on
+      if (readClusters(partition, extents[i].start + done / partition->clusterSize, buffer,
+                       (n + partition->clusterSize - 1) / partition->clusterSize * partition->clusterSize) == -1) {
+        return -1;
+      }
+      if (reader(context, buffer, n) == -1) {
+        return -1;
+      }
+      length -= n;
+    }
+  }
+  return (length == 0) ? 0 : -1;
+}
+
+
+/**
+ * Find the extent holding a byte of a chain, by binary search on the
+ * extent offsets
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param offset Byte offset in the chain
+ * @return Index of the extent, or -1 if the extents end before offset
+ */
+int findExtent(FATXPartition* partition, FATXExtent* extents, int count, u_int64_t offset) {
+  int low = 0;
+  int high = count - 1;
+  int middle;
+
+  if ((count == 0) ||
+      (offset >= extents[high].offset + (u_int64_t) extents[high].length * partition->clusterSize)) {
+    return -1;
+  }
+  while(low < high) {
+    middle = low + (high - low + 1) / 2;
+    if (extents[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+
+/**
+ * Read a byte range of a chain, reading only the clusters that hold it
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param offset Byte offset in the chain to start at
+ * @param length Number of bytes to read
+ * @param buffer Where to put the data
+ * @return Number of bytes read (less than length if the extents end
+ *         first), or -1 on a read failure
+ */
+int64_t readExtentRange(FATXPartition* partition, FATXExtent* extents, int count,
+                        u_int64_t offset, u_int64_t length, unsigned char* buffer) {
+  u_int64_t extentEnd;
+  u_int64_t within;
+  u_int64_t done = 0;
+  u_int64_t n;
+  int i;
+
+  i = findExtent(partition, extents, count, offset);
+  if (i == -1) {
+    return 0;
+  }
+
+  // each extent is contiguous on disk, so it takes one read
+  for(; (i < count) && (done < length); i++) {
+    extentEnd = extents[i].offset + (u_int64_t) extents[i].length * partition->clusterSize;
+    within = offset + done - extents[i].offset;
+    n = extentEnd - (offset + done);
+    if (n > length - done) {
+      n = length - done;
+    }
+    if (backendRead(partition->backend, buffer + done, n,
+                    partition->cluster1Address + (u_int64_t) (extents[i].start - 1) * partition->clusterSize +
+                    within) == -1) {
+      return -1;
+    }
+    done += n;
+  }
+  return done;
+}
@@ -0,0 +1,112 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Mapping FATX cluster chains to extents
+
+#ifndef EXTENT_H
+#define EXTENT_H 1
+
+#include <sys/types.h>
+#include "fatx.h"
+
+/**
+ * A run of consecutive clusters within a chain
+ */
+typedef struct {
+  // First cluster of the run
+  u_int32_t start;
+
+  // Number of clusters in the run
+  u_int32_t length;
+
+  // Offset in bytes of the run from the start of the chain
+  u_int64_t offset;
+} FATXExtent;
+
+/**
+ * Follow a cluster chain, merging consecutive clusters into extents. A
+ * broken chain (a free or out of range entry) ends the list early.
+ *
+ * @param partition FATX partition
+ * @param firstCluster First cluster of the chain
+ * @param maxClusters Most clusters to follow (0 = to the end of the chain)
+ * @param count Set to the number of extents returned
+ * @param clusters If not NULL, set to the number of clusters followed
+ * @return malloc()ed array of extents, or NULL if there are none or out
+ *         of memory
+ */
+FATXExtent* buildExtents(FATXPartition* partition, u_int32_t firstCluster, u_int32_t maxClusters,
+                         int* count, u_int32_t* clusters);
+
+/**
+ * Called with each piece of data read by readExtents()
+ *
+ * @param context Caller's context
+ * @param data Data read
+ * @param length Number of bytes
+ * @return 0 to carry on, -1 to stop
+ */
+typedef int (*ExtentReader)(void* context, unsigned char* data, u_int64_t length);
+
+/**
+ * Read the data of a chain a buffer at a time, in order
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param length Number of bytes to read from the start of the chain
+ * @param buffer Buffer to read into
+ * @param bufferSize Size of buffer (a multiple of the cluster size)
+ * @param reader Called with each piece read
+ * @param context Passed to reader
+ * @return 0 on success, -1 on a read failure, if the extents are too
+ *         short or if reader stopped
+ */
+int readExtents(FATXPartition* partition, FATXExtent* extents, int count, u_int64_t length,
+                unsigned char* buffer, u_int64_t bufferSize, ExtentReader reader, void* context);
+
+/**
+ * Find the extent holding a byte of a chain, by binary search on the
+ * extent offsets
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param offset Byte offset in the chain
+ * @return Index of the extent, or -1 if the extents end before offset
+ */
+int findExtent(FATXPartition* partition, FATXExtent* extents, int count, u_int64_t offset);
+
+/**
+ * Read a byte range of a chain, reading only the clusters that hold it
+ *
+ * @param partition FATX partition
+ * @param extents Extents of the chain
+ * @param count Number of extents
+ * @param offset Byte offset in the chain to start at
+ * @param length Number of bytes to read
+ * @param buffer Where to put the data
+ * @return Number of bytes read (less than length if the extents end
+ *         first), or -1 on a read failure
+ */
+int64_t readExtentRange(FATXPartition* partition, FATXExtent* extents, int count,
+                        u_int64_t offset, u_int64_t length, unsigned char* buffer);
+
+#endif
@@ -29,15 +29,25 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <linux/hdreg.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include "fatx.h"
+#include "fatxcore.h"
 #include "util.h"
 #include "partition.h"
+#include "pool.h"
 
 #define DEBUG
 
+// Printing a directory tree
+typedef struct {
+  FATXPartition *partition;
+  int outputStream;
+  int nesting;
+} DumpTreeContext;
+
 /**
  * Checks if the current entry is the last entry in a directory
  *
@@ -55,15 +65,6 @@ int checkForLastDirectoryEntry(unsigned char* entry);
  */
 u_int32_t getNextClusterInChain(FATXPartition* partition, int clusterId);
 
-/**
- * Load data for a cluster
- *
- * @param partition FATX partition
- * @param clusterId ID of the cluster to load
- * @param clusterData Where to store the data (must be at least the cluster size)
- */
-void loadCluster(FATXPartition* partition, unsigned long clusterId, unsigned char* clusterData);
-
 /**
  * fwrite data to a cluster
  *
@@ -87,21 +88,6 @@ void _dumpTree(FATXPartition* partition,
 
 
 
-/**
- * Recursively down a directory tree to find and extract a specific file
- *
- * @param partition FATX Partition
- * @param filename Filename to extract
- * @param outputStream Stream to output to
- * @param clusterId ID of cluster to start at
- */
-void _recurseToFile(FATXPartition* partition, 
-                    char* filename,
-                    FILE *outputStream,
-                    int clusterId);
-
-
-
 /** 
  * Dump a file to supplied outputStream
  *
@@ -109,27 +95,41 @@ void _recurseToFile(FATXPartition* partition,
  * @param outputStream Stream to output to
  * @param clusterId Starting cluster ID of file
  * @param fileSize Size of file
+ * @param hash If not NULL, hash to update with the data written
  */
 void _dumpFile(FATXPartition* partition, FILE *outputStream, 
-               int clusterId, u_int32_t fileSize);
+               int clusterId, u_int32_t fileSize, HashState *hash);
 
 
-void fwriteChainMap(FATXPartition *partition) {
-	if((fseeko(partition->sourceFd, partition->partitionStart + FATX_PARTITION_HEADERSIZE, SEEK_SET)) == -1) {
-		printf("fwriteChainMap : Error in setting position %lld\n",partition->partitionStart + FATX_PARTITION_HEADERSIZE);
-	}
-	fwrite(partition->clusterChainMap.words, 1, 2*sizeof(u_int64_t), partition->sourceFd);
-	// append zero until the size of chainTableSize
-	char buffer[] = {0x00};
-	int i;
-	for (i=0;i<partition->chainTableSize-sizeof(partition->clusterChainMap);i++)
-		fwrite(buffer, 1, 1,partition->sourceFd); 	
+/**
+ * fwrite a freshly initialised chain map: the first chain table block
+ * comes from memory, the rest of the table is zeroed in one operation
+ *
+ * @param partition FATX partition
+ * @param fd Descriptor to write to
+ * @param keepAllocated Nonzero if the image was filled and must stay so
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int fwriteChainMap(FATXPartition *partition, int fd, int keepAllocated) {
+	u_int64_t chainTableStart = partition->partitionStart + FATX_PARTITION_HEADERSIZE;
 
+	if (pwrite(fd, partition->clusterChainMap.words, FATX_CHAINTABLE_BLOCKSIZE, chainTableStart) != FATX_CHAINTABLE_BLOCKSIZE) {
+		printf("fwriteChainMap : Error writing chain table at %llu\n", (unsigned long long)chainTableStart);
+		return -1;
+	}
+	if (zeroRegion(fd, chainTableStart + FATX_CHAINTABLE_BLOCKSIZE,
+			partition->chainTableSize - FATX_CHAINTABLE_BLOCKSIZE, keepAllocated) == -1) {
+		printf("fwriteChainMap : Error clearing chain table at %llu: %s\n",
+				(unsigned long long)chainTableStart + FATX_CHAINTABLE_BLOCKSIZE, strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 	       
 void DumpSector(char *szFileName, long lSector) {
 	FILE *fp;
-	unsigned char buffer[16*1024];
+	FATXBackend *backend;
+	unsigned char *buffer;
 	u_int64_t lFileSize;
 	u_int64_t cluster;
 	FATXPartition *partition;	
@@ -142,17 +142,23 @@ void DumpSector(char *szFileName, long lSector) {
 		exit(0);
 	}
 
+	backend = openBackend(fp, szFileName);
+	if(backend == NULL) {
+		printf("DumpSector : error in reading file %s: %s\n",szFileName,strerror(errno));
+		exit(1);
+	}
+	lFileSize = backend->size;
 	
-	fseeko(fp, 0L, SEEK_END);
-	lFileSize = ftello(fp);
-	fseeko(fp, 0L, SEEK_SET);
-	
-        printf("DumpCluster : Filename %s Filesize %lld\n", szFileName, lFileSize);
+        printf("DumpCluster : Filename %s Filesize %lld\n", szFileName, (unsigned long long)lFileSize);
 
-	partition = openPartition(fp,0,lFileSize);
+	partition = openPartition(backend,0,lFileSize);
 
 	cluster = lSector;
 
+	buffer = (unsigned char *)malloc(partition->clusterSize);
+	if(buffer == NULL) {
+		error("Out of memory");
+	}
 	loadCluster(partition, cluster, buffer);
 
 	for(i = 0 ; i < 512/16; i++) {
@@ -172,6 +178,9 @@ void DumpSector(char *szFileName, long lSector) {
 		
 	}
 	
+	free(buffer);
+	closePartition(partition);
+	closeBackend(backend);
 	fclose(fp);
 	
 }
@@ -188,8 +197,14 @@ unsigned long getDiskSize(char *szDrive) {
 	
 	rc = ioctl(dev,HDIO_DRIVE_CMD,args);
 	if(rc != 0) {
-		printf("HDIO_DRIVE_CMD(identify) failed - is drive frozen?\n");
-		return 0;
+		u_int64_t bytes = 0;
+
+		// not an ATA drive we can identify (image file, USB bridge...)
+		printf("HDIO_DRIVE_CMD(identify) failed - using device size\n");
+		if (ioctl(dev,BLKGETSIZE64,&bytes) != 0)
+			bytes = lseek(dev,0,SEEK_END);
+		close(dev);
+		return bytes / 512;
 	}
      	close(dev);
      
@@ -199,12 +214,111 @@ unsigned long getDiskSize(char *szDrive) {
 	return sectorsTotal;
 }
 	       
+/**
+ * Clear the config area at the start of the drive
+ *
+ * @param fp Drive to clear
+ * @return 0 on success, -1 on failure
+ */
+static int clearConfigArea(FILE *fp) {
+	fflush(fp);
+	if (zeroRegion(fileno(fp), XBOX_SECTOR_CONFIG * 512ULL, XBOX_SECTORS_CONFIG * 512ULL, 0) == -1) {
+		printf("Error clearing config area: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Discard the old contents of the partitions about to be formatted, so
+ * SSDs know the space is free. Devices without discard support are
+ * left alone; formatting writes everything that matters.
+ *
+ * @param fp Drive holding the partitions
+ * @param PartTbl Partition table
+ * @param first First table entry to discard
+ */
+static void discardPartitions(FILE *fp, XboxPartitionTable *PartTbl, int first) {
+	int i;
+
+	fflush(fp);
+	for (i = first; i < 14; i++)
+	{
+		if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
+		{
+			discardRegion(fileno(fp), PartTbl->TableEntries[i].LBAStart*512ULL, PartTbl->TableEntries[i].LBASize*512ULL);
+		}
+	}
+}
+
+// Partitions being formatted concurrently on one drive
+typedef struct {
+	int fd;
+	XboxPartitionTable *PartTbl;
+	int count;
+	int index[14];
+	int failed; // set by any job, so only accessed atomically
+} FormatJobs;
+
+/**
+ * Format one partition of a FormatJobs set
+ */
+static void formatJob(void *context, int job) {
+	FormatJobs *jobs = (FormatJobs*) context;
+	XboxPartitionTableEntry *entry = &jobs->PartTbl->TableEntries[jobs->index[job]];
+
+	if (formatPartition(jobs->fd, entry->LBAStart*512ULL, entry->LBASize*512ULL) == -1) {
+		printf("Error creating -> partition %d: %s\n", jobs->index[job], strerror(errno));
+		__atomic_store_n(&jobs->failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Format the partitions of a partition table. The partitions are disjoint,
+ * so they are all formatted at once through one descriptor and flushed
+ * together at the end.
+ *
+ * @param szDrive Drive holding the partitions
+ * @param PartTbl Partition table
+ * @param first First table entry to format
+ * @return 1 on success, 0 on failure
+ */
+static int formatTablePartitions(char *szDrive, XboxPartitionTable *PartTbl, int first) {
+	FormatJobs jobs;
+	int i;
+
+	memset(&jobs,0,sizeof(FormatJobs));
+	jobs.PartTbl = PartTbl;
+	jobs.fd = open(szDrive, O_RDWR);
+	if (jobs.fd == -1) {
+		printf("Error opening %s\n",szDrive);
+		return 0;
+	}
+
+	for (i=first;i<14;i++)
+	{
+		if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
+		{
+			printf("Creating -> partition %d start %llu size %llu\n", i,PartTbl->TableEntries[i].LBAStart*512ULL,PartTbl->TableEntries[i].LBASize*512ULL);
+			jobs.index[jobs.count++] = i;
+		}
+	}
+	runParallel(formatJob, &jobs, jobs.count, jobs.count);
+
+	if (fdatasync(jobs.fd) == -1) {
+		printf("Error flushing %s: %s\n",szDrive,strerror(errno));
+		__atomic_store_n(&jobs.failed, 1, __ATOMIC_RELAXED);
+	}
+	close(jobs.fd);
+
+	return !__atomic_load_n(&jobs.failed, __ATOMIC_RELAXED);
+}
+
 int writeBRFR(char *szDrive,int partition_mode) {
 
 	FILE *fp;
 	int fd,i;
  	int error = 0;
-	FATXPartition* partition = NULL;
 	u_int64_t start,size,totalsize,totalsectors,tb_totalsectors=0;
 	char szBuffer[512];
 	XboxPartitionTable *BackupPartTbl;
@@ -252,9 +366,10 @@ int writeBRFR(char *szDrive,int partition_mode) {
 
 	memset(szBuffer,0,512);
 			
-	fseeko(fp,0L,SEEK_SET);
-	for(i = XBOX_SECTOR_CONFIG;i < XBOX_SECTORS_CONFIG;i++)
-		fwrite(szBuffer,512,1,fp);
+	if (clearConfigArea(fp) == -1) {
+		fclose(fp);
+		return 0;
+	}
 
 	fseeko(fp,0x600,SEEK_SET);
 	sprintf(szBuffer,"BRFR");
@@ -276,77 +391,12 @@ int writeBRFR(char *szDrive,int partition_mode) {
 	fseeko(fp,0L,SEEK_SET);
 	fwrite(PartTbl, sizeof(XboxPartitionTable), 1, fp);
 	
+	discardPartitions(fp, PartTbl, 0);
 	fclose(fp);
 
-	sprintf(szBuffer,"part50");
-	start = XBOX_SECTOR_STORE * 512ULL;
-	size = XBOX_SECTORS_STORE * 512ULL;
-	printf("Creating -> %s start %lld size %lld\n",szBuffer, start ,size);
-	
-	partition = createPartition(szDrive, start,size, 0);
-	if(partition == NULL) {
-		printf("Error creating -> %s\n",szBuffer);
-		return 0;
-	}
-	closePartition(partition);
-
-	sprintf(szBuffer,"part51");
-	start = XBOX_SECTOR_SYSTEM * 512ULL;
-	size = XBOX_SECTORS_SYSTEM * 512ULL;
-	printf("Creating -> %s start %lld size %lld\n",szBuffer, start ,size);
-	
-	partition = createPartition(szDrive, start,size, 0);
-	if(partition == NULL) {
-		printf("Error creating -> %s\n",szBuffer);
-		return 0;
-	}
-	closePartition(partition);
-
-	sprintf(szBuffer,"part52");
-	start = XBOX_SECTOR_CACHE1 * 512ULL;
-	size = XBOX_SECTORS_CACHE1 * 512ULL;
-	printf("Creating -> %s start %lld size %lld\n",szBuffer, start ,size);
-	
-	partition = createPartition(szDrive, start,size, 0);
-	if(partition == NULL) {
-		printf("Error creating -> %s\n",szBuffer);
-		return 0;
-	}
-	closePartition(partition);
-
-	sprintf(szBuffer,"part53");
-	start = XBOX_SECTOR_CACHE2 * 512ULL;
-	size = XBOX_SECTORS_CACHE2 * 512ULL;
-	printf("Creating -> %s start %lld size %lld\n",szBuffer, start ,size);
-	
-	partition = createPartition(szDrive, start,size, 0);
-	if(partition == NULL) {
-		printf("Error creating -> %s\n",szBuffer);
+	if (!formatTablePartitions(szDrive, PartTbl, 0)) {
 		return 0;
 	}
-	closePartition(partition);
-
-	sprintf(szBuffer,"part54");
-	start = XBOX_SECTOR_CACHE3 * 512ULL;
-	size = XBOX_SECTORS_CACHE3 * 512ULL; 
-	printf("Creating -> %s start %lld size %lld\n",szBuffer, start ,size);
-	
-	partition = createPartition(szDrive, start,size, 0);
-	if(partition == NULL) {
-		printf("Error creating -> %s\n",szBuffer);
-		return 0;
-	}
-	closePartition(partition);
-	
-	for (i=5;i<14;i++)
-	{
-		if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
-		{
-			printf("Creating -> start %llu size %llu\n", (PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL);
-			partition = createPartition(szDrive, (PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL,0);
-			closePartition (partition);
-		}
-	}
         printf("Calling ioctl() to re-fread partition table.\n");
 	for (i=0;i<14;i++)
 	{
@@ -355,15 +405,10 @@ int writeBRFR(char *szDrive,int partition_mode) {
 			printf("partition %d start %llu size %llu\n", i,(PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL);
 		}
 	}
-        sync();
-	sleep(2);
-	
 	fd = open(szDrive,O_RDONLY);
         if ((i = ioctl(fd, BLKRRPART)) != 0) {
 		error = errno;
 	} else {
-                sync();
-                sleep(2);
 		if ((i = ioctl(fd, BLKRRPART)) != 0)
 			error = errno;
 	}
@@ -377,7 +422,6 @@ int prepareFG(char *szDrive,int partition_mode) {
 	FILE *fp;
 	int fd,i;
  	int error = 0;
-	FATXPartition* partition = NULL;
 	u_int64_t start,size,totalsize,totalsectors,tb_totalsectors=0;
 	char szBuffer[512];
 	XboxPartitionTable *BackupPartTbl;
@@ -417,9 +461,10 @@ int prepareFG(char *szDrive,int partition_mode) {
 	memset(szBuffer,0,256);
 	memset(szBuffer,0,512);
 			
-	fseeko(fp,0L,SEEK_SET);
-	for(i = XBOX_SECTOR_CONFIG;i < XBOX_SECTORS_CONFIG;i++)
-		fwrite(szBuffer,512,1,fp);
+	if (clearConfigArea(fp) == -1) {
+		fclose(fp);
+		return 0;
+	}
 	
 	fseeko(fp,0x600,SEEK_SET);
 	sprintf(szBuffer,"BRFR");
@@ -435,16 +480,11 @@ int prepareFG(char *szDrive,int partition_mode) {
 	fseeko(fp,0L,SEEK_SET);
 	fwrite(PartTbl, sizeof(XboxPartitionTable), 1, fp);
 	
+	discardPartitions(fp, PartTbl, 5);
 	fclose(fp);
 
-	for (i=5;i<14;i++)
-	{
-		if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
-		{
-			printf("Creating -> start %llu size %llu\n", (PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL);
-			partition = createPartition(szDrive, (PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL,0);
-			closePartition (partition);
-		}
+	if (!formatTablePartitions(szDrive, PartTbl, 5)) {
+		return 0;
 	}
         printf("Calling ioctl() to re-fread partition table.\n");
 	for (i=0;i<14;i++)
@@ -454,9 +494,6 @@ int prepareFG(char *szDrive,int partition_mode) {
 			printf("partition %d start %llu size %llu\n", i,(PartTbl->TableEntries[i].LBAStart)*512ULL,(PartTbl->TableEntries[i].LBASize)*512ULL);
 		}
 	}
-        sync();
-	sleep(2);
-	
 	/*fd = open(szDrive,O_RDONLY);
         if ((i = ioctl(fd, BLKRRPART)) != 0) {
 		error = errno;
@@ -476,7 +513,6 @@ int customFG(char *szDrive,int f_percent) {
 	FILE *fp;
 	int fd,i;
  	int error = 0;
-	FATXPartition* partition = NULL;
 	u_int64_t start,size,totalsize,totalsectors,tb_totalsectors=0;
 	char szBuffer[512];
 	XboxPartitionTable *BackupPartTbl;
@@ -515,9 +551,10 @@ int customFG(char *szDrive,int f_percent) {
 	
 	memset(szBuffer,0,512);
 			
-	fseeko(fp,0L,SEEK_SET);
-	for(i = XBOX_SECTOR_CONFIG;i < XBOX_SECTORS_CONFIG;i++)
-		fwrite(szBuffer,512,1,fp);
+	if (clearConfigArea(fp) == -1) {
+		fclose(fp);
+		return 0;
+	}
 	
 	fseeko(fp,0x600,SEEK_SET);
 	sprintf(szBuffer,"BRFR");
@@ -533,16 +570,11 @@ int customFG(char *szDrive,int f_percent) {
 	fseeko(fp,0L,SEEK_SET);
 	fwrite(PartTbl, sizeof(XboxPartitionTable), 1, fp);
 	
+	discardPartitions(fp, PartTbl, 5);
 	fclose(fp);
 
-	for (i=5;i<14;i++)
-	{
-		if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
-		{
-			printf("Creating -> start %llu size %llu\n", PartTbl->TableEntries[i].LBAStart*512ULL,PartTbl->TableEntries[i].LBASize*512ULL);
-			partition = createPartition(szDrive, PartTbl->TableEntries[i].LBAStart*512ULL,PartTbl->TableEntries[i].LBASize*512ULL,0);
-			closePartition (partition);
-		}
+	if (!formatTablePartitions(szDrive, PartTbl, 5)) {
+		return 0;
 	}
         printf("Calling ioctl() to re-fread partition table.\n");
 	for (i=0;i<14;i++)
@@ -552,9 +584,6 @@ int customFG(char *szDrive,int f_percent) {
 			printf("partition %d start %llu size %llu\n", i,PartTbl->TableEntries[i].LBAStart*512ULL,PartTbl->TableEntries[i].LBASize*512ULL);
 		}
 	}
-        sync();
-	sleep(2);
-	
 	/*fd = open(szDrive,O_RDONLY);
         if ((i = ioctl(fd, BLKRRPART)) != 0) {
 		error = errno;
@@ -571,120 +600,116 @@ int customFG(char *szDrive,int f_percent) {
 }
 
 
-int listPartitions(char *szDrive) {
-
-	FILE *fp;
-	int fd,i,result;
- 	int error = 0;
-	FATXPartition* partition = NULL;
-	u_int64_t start,size,totalsize,totalsectors;
-	char szBuffer[512];
-	XboxPartitionTable *PartTbl;
-	FATX_SUPERBLOCK fatx_sb;
-	int cl_size=0;
-	
-	
-	totalsectors = getDiskSize(szDrive);
-	
-	printf("Total Sectors  -> %lld\n",totalsectors);
-	fp = fopen (szDrive, "r");
-	
-        if(!fp) {
-		printf("Error opening %s\n",szDrive);
+/**
+ * Physically allocate and zero a region of a newly created image
+ *
+ * @param fp Image file
+ * @param offset Start of the region
+ * @param length Length of the region in bytes
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int fillImage(FILE *fp, u_int64_t offset, u_int64_t length) {
+	static unsigned char zeroes[FATX_FILL_CHUNKSIZE];
+	u_int64_t done;
+	ssize_t n;
+	int fd = fileno(fp);
+
+	// let the filesystem reserve zeroed blocks if it can
+	if (posix_fallocate(fd, offset, length) == 0)
 		return 0;
+
+	for (done = 0; done < length; done += n) {
+		n = pwrite(fd, zeroes, (length - done < sizeof(zeroes)) ? length - done : sizeof(zeroes), offset + done);
+		if (n <= 0)
+			return -1;
 	}
-	PartTbl = (XboxPartitionTable*) malloc(sizeof(XboxPartitionTable));
+	return 0;
+}
 
-	fseeko(fp,0L,SEEK_SET);
-	result = fread(PartTbl, sizeof(XboxPartitionTable), 1, fp);
-	
-	if (result != 1){
-		printf("Error freading %s\n",szDrive);
-		return 0;
+/**
+ * Pick the cluster size used when formatting a partition of a given size
+ *
+ * @param partitionSize Size of partition in bytes
+ * @return Cluster size in bytes
+ */
+static u_int32_t formatClusterSize(u_int64_t partitionSize) {
+	if (partitionSize >= 512000000000ULL) // more than 512GB
+		return 0x10000; // 64k clustersize
+	if (partitionSize >= 256000000000ULL) // between 256GB and 512GB
+		return 0x8000; // 32k clustersize
+	return 0x4000; // 16k clustersize
+}
+
+/**
+ * Write the header, empty chain table and empty root directory of a
+ * partition. partitionStart, partitionSize and clusterSize must be set;
+ * the rest of the geometry is filled in. Only positional writes are
+ * used, so several partitions on one descriptor can be formatted at once.
+ *
+ * @param fd Descriptor to write to
+ * @param partition FATX partition
+ * @param volumeId Volume id to give the partition
+ * @param keepAllocated Nonzero if the image was filled and must stay so
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int writeFormat(int fd, FATXPartition* partition, u_int32_t volumeId, int keepAllocated) {
+	unsigned char partitionInfo[FATX_PARTITION_HEADERSIZE];
+	unsigned char *clusterData;
+	int result;
+
+	memset(partitionInfo,0,FATX_PARTITION_HEADERSIZE);
+	*(u_int32_t *)partitionInfo = FATX_PARTITION_MAGIC;
+	*(u_int32_t *)&partitionInfo[0x0004] = volumeId; // Volume id
+	*(u_int32_t *)&partitionInfo[0x0008] = partition->clusterSize / 512; // Clustersize in 512 bytes
+	*(u_int16_t *)&partitionInfo[0x000C] = 0x0001; //Number of active FATs (always 1) (?)
+	*(u_int32_t *)&partitionInfo[0x000E] = 0x00000000; //Unknown (always set to 0)
+	memset(&partitionInfo[0x0012],0xff,0xfee); //Unknown (usually set to 0xff, or 0). Probably padding.
+
+	partition->clusterCount = partition->partitionSize / partition->clusterSize;
+	partition->chainMapEntrySize = (partition->clusterCount >= 0xfff4) ? 4 : 2;
+	partition->chainTableSize = partition->clusterCount * partition->chainMapEntrySize;
+	if (partition->chainTableSize % FATX_CHAINTABLE_BLOCKSIZE) {
+	// round up to nearest FATX_CHAINTABLE_BLOCKSIZE bytes
+		partition->chainTableSize = ((partition->chainTableSize / FATX_CHAINTABLE_BLOCKSIZE) + 1) 
+						* FATX_CHAINTABLE_BLOCKSIZE;
 	}
+	partition->cluster1Address = partition->partitionStart + FATX_PARTITION_HEADERSIZE + partition->chainTableSize;
+	partition->chainDirtyBlocks = NULL;
+	partition->chainDirtyCount = 0;
+	partition->chainDiskBlocks = NULL;
 
-	if (strcmp(PartTbl->Magic,"****PARTINFO****")){
-		printf("Error freading partition table with strict magic compare in %s\n",szDrive);
-			if (strstr(PartTbl->Magic,"PARTINFO")==NULL){
-				printf("Error freading partition table with relaxed magic compare in %s\n",szDrive);
-				return 0;
-			}
-			else
-			{
-				printf("Partition table:\n");
-				for (i=0;i<14;i++)
-				{
-					if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
-					{
-						printf("partition %d\tstart %lu\tsize\t%010luMB\t", i,PartTbl->TableEntries[i].LBAStart,PartTbl->TableEntries[i].LBASize*512ULL/1048576);
-						fseeko(fp,PartTbl->TableEntries[i].LBAStart*512ULL,SEEK_SET);
-						result = fread(&fatx_sb, sizeof(FATX_SUPERBLOCK), 1, fp);
-						if ((fatx_sb.ClusterSize>0) && (fatx_sb.ClusterSize % 16 == 0))
-						{
-							cl_size=fatx_sb.ClusterSize/2;
-							if ((PartTbl->TableEntries[i].LBASize>=LBASIZE_512GB && cl_size<64)||
-									(PartTbl->TableEntries[i].LBASize>=LBASIZE_256GB && cl_size<32))
-								printf("Cluster size %02dK-ERR\n",cl_size);
-							else
-								printf("Cluster size %02dK\n",cl_size);
-						}
-						else
- 						{
-							printf("Unknown cluster size\n");
-						}
- 					}
-				}
-			}
+	// Create empty chain map table; only its first block holds any entries
+	partition->clusterChainMap.words = (u_int16_t*) calloc(1, FATX_CHAINTABLE_BLOCKSIZE);
+	clusterData = (unsigned char *)malloc(partition->clusterSize);
+	if ((partition->clusterChainMap.words == NULL) || (clusterData == NULL)) {
+		error("Out of memory here");
 	}
-	else
-	{
-		printf("Partition table:\n");
-		for (i=0;i<14;i++)
-		{
-			if (PartTbl->TableEntries[i].Flags & PE_PARTFLAGS_IN_USE)
-			{
-				printf("partition %d\tstart %lu\tsize\t%010luMB\t", i,PartTbl->TableEntries[i].LBAStart,PartTbl->TableEntries[i].LBASize*512ULL/1048576);
-				fseeko(fp,PartTbl->TableEntries[i].LBAStart*512ULL,SEEK_SET);
-				result = fread(&fatx_sb, sizeof(FATX_SUPERBLOCK), 1, fp);
-				if ((fatx_sb.ClusterSize>0) && (fatx_sb.ClusterSize % 16 == 0))
-				{
-					cl_size=fatx_sb.ClusterSize/2;
-					if ((PartTbl->TableEntries[i].LBASize>=LBASIZE_512GB && cl_size<64)||
-								(PartTbl->TableEntries[i].LBASize>=LBASIZE_256GB && cl_size<32))
-						printf("Cluster size %02dK-ERR\n",cl_size);
-					else
-						printf("Cluster size %02dK\n",cl_size);
-				}
-				else
- 				{
-					printf("Unknown cluster size\n");
-				}
- 
-				
-			}
-		}
 
+	if (partition->chainMapEntrySize == 2) {
+		partition->clusterChainMap.words[0] = 0xfff8; // root fat marker
+		partition->clusterChainMap.words[1] = 0xffff; // end of chain
+	} else {
+		partition->clusterChainMap.dwords[0] = 0xfffffff8;
+		partition->clusterChainMap.dwords[1] = 0xffffffff;
 	}
-	fclose(fp);
 
-	
-	return 1;
+	// the header, the chain table, then the cleared root directory cluster
+	memset(clusterData,0xFF,partition->clusterSize);
+	result = -1;
+	if ((pwrite(fd, partitionInfo, FATX_PARTITION_HEADERSIZE, partition->partitionStart) == FATX_PARTITION_HEADERSIZE) &&
+			(fwriteChainMap(partition, fd, keepAllocated) == 0) &&
+			(pwrite(fd, clusterData, partition->clusterSize, partition->cluster1Address) == partition->clusterSize)) {
+		result = 0;
+	}
+	free(clusterData);
+	return result;
 }
 
 FATXPartition* createPartition(char *szFileName, u_int64_t partitionOffset, 
 		u_int64_t partitionSize, int nCreate) {
 
 	FATXPartition* partition;
-	unsigned char partitionInfo[FATX_PARTITION_HEADERSIZE];
-	unsigned char *clusterData;
-	char szBuffer[1024];
-	long lRet;
-	u_int64_t i;
-	u_int32_t eocMarker;
-	u_int32_t rootFatMarker;
 
-	memset(szBuffer,0,1024);
-	
 	partition = (FATXPartition*) malloc(sizeof(FATXPartition));
 	
 	if (partition == NULL) {
@@ -692,18 +717,6 @@ FATXPartition* createPartition(char *szFileName, u_int64_t partitionOffset,
 		return NULL;
 	}
 
-	memset(partitionInfo,0,FATX_PARTITION_HEADERSIZE);
-	*(u_int64_t *)partitionInfo = FATX_PARTITION_MAGIC;
-	*(u_int64_t *)&partitionInfo[0x0004] = (u_int64_t) time(NULL); // Volume id
-	if(!nCreate) {
-		*(u_int64_t *)&partitionInfo[0x0008] = 0x00000020; // Clustersize in 512 bytes
-	} else {
-		*(u_int64_t *)&partitionInfo[0x0008] = 0x00000004; // Clustersize in 512 bytes
-	}
-	*(u_int16_t *)&partitionInfo[0x000C] = 0x0001; //Number of active FATs (always 1) (?)
-	*(u_int32_t *)&partitionInfo[0x000E] = 0x00000000; //Unknown (always set to 0)
-	memset(&partitionInfo[0x0012],0xff,0xfee); //Unknown (usually set to 0xff, or 0). Probably padding.
-
 	memset(partition,0,sizeof(FATXPartition));
 
 	if(!nCreate) {
@@ -727,80 +740,31 @@ FATXPartition* createPartition(char *szFileName, u_int64_t partitionOffset,
 	}
 
 	partition->partitionStart = partitionOffset;
-	if (!nCreate){
-	if ((partition->partitionSize >= (512000000000ULL))){ //more than 512GB
-                *(u_int64_t *)&partitionInfo[0x0008] = 0x00000080; // Clustersize in 512 bytes
-                    partition->clusterSize = 0x10000; // 64k clustersize
-        }
-        else if ((partition->partitionSize >= (256000000000ULL))){
-                    // between 256GB and 512GB
-                *(u_int64_t *)&partitionInfo[0x0008] = 0x00000040; // Clustersize in 512 bytes
-                    partition->clusterSize = 0x8000; // 32k clustersize
-        }
-        else
-              partition->clusterSize = 0x4000; // 16k clustersize
+	if (!nCreate) {
+		partition->clusterSize = formatClusterSize(partition->partitionSize);
+	} else {
+		partition->clusterSize = 0x800; // 2k clusters for scratch images
 	}
-	partition->clusterCount = partition->partitionSize / partition->clusterSize;
-	partition->chainMapEntrySize = (partition->clusterCount >= 0xfff4) ? 4 : 2;
 	
 	if(nCreate) {
-		memset(szBuffer,0x00,1024);
-		for(i = 0; i < (partitionSize * 1024);i++) {
-			lRet = fwrite(szBuffer, 1024, 1, partition->sourceFd);
+		// size the new image; unwritten ranges stay holes and read back as zero
+		if (ftruncate(fileno(partition->sourceFd), partition->partitionStart + partition->partitionSize) == -1) {
+			printf("createPartition -> Error sizing File %s: %s\n",szFileName,strerror(errno));
+			return NULL;
+		}
+		if ((nCreate == FATX_CREATE_FILL) && 
+				(fillImage(partition->sourceFd, partition->partitionStart, partition->partitionSize) == -1)) {
+			printf("createPartition -> Error filling File %s: %s\n",szFileName,strerror(errno));
+			return NULL;
 		}
 	}
 	
-	fseeko(partition->sourceFd,partition->partitionStart,SEEK_SET);
-	
-	*(u_int16_t *)&partitionInfo[0x000C] = 0x0001; //Number of active FATs (always 1) (?)
-
-	// fwrite the header
-	fwrite(partitionInfo, FATX_PARTITION_HEADERSIZE, 1, partition->sourceFd);
-	
-	partition->chainTableSize = partition->clusterCount * partition->chainMapEntrySize;
-	if (partition->chainTableSize % FATX_CHAINTABLE_BLOCKSIZE) {
-	// round up to nearest FATX_CHAINTABLE_BLOCKSIZE bytes
-		partition->chainTableSize = ((partition->chainTableSize / FATX_CHAINTABLE_BLOCKSIZE) + 1) 
-						* FATX_CHAINTABLE_BLOCKSIZE;
-		
-	}
-	// Create empty chain map table
-	partition->clusterChainMap.words = (u_int16_t*) malloc(2*sizeof(u_int64_t)); // (u_int16_t*) malloc(partition->chainTableSize);
-	if (partition->clusterChainMap.words == NULL) {
-		error("Out of memory here");
-	}
-	
-	
-	memset(partition->clusterChainMap.words,0x0000,2*sizeof(u_int64_t));
-	//memset(partition->clusterChainMap.words,0x00,partition->chainTableSize);
-		
-	if (partition->chainMapEntrySize == 2) {
-		rootFatMarker = 0xfff8;
-		eocMarker = 0xffff;
-		partition->clusterChainMap.words[0] = rootFatMarker;
-		partition->clusterChainMap.words[1] = eocMarker;
-	} else {
-		rootFatMarker = 0xfffffff8;
-		eocMarker = 0xffffffff;
-		partition->clusterChainMap.dwords[0] = rootFatMarker;
-		partition->clusterChainMap.dwords[1] = eocMarker;
+	if (writeFormat(fileno(partition->sourceFd), partition, (u_int32_t) time(NULL),
+			nCreate == FATX_CREATE_FILL) == -1) {
+		printf("createPartition -> Error writing File %s: %s\n",szFileName,strerror(errno));
+		return NULL;
 	}
 	
-	// writing the new chaintable
-	fwriteChainMap(partition);
-	
-	// Address of the first cluster
-	partition->cluster1Address = partitionOffset + FATX_PARTITION_HEADERSIZE + partition->chainTableSize;
-	fseeko(partition->sourceFd, partition->cluster1Address, SEEK_SET);
-	
-	// clearing the first cluster
-	clusterData = (unsigned char *)malloc(partition->clusterSize);
-	
-	memset(clusterData,0xFF,partition->clusterSize);
-	
-	fwriteCluster(partition, 1, clusterData);
-	// first direcory or file
-	
 	printf("createPartition : Filename : %s\n",szFileName);
 	printf("createPartition : clusters       %ld\n",(unsigned long)partition->clusterCount);
 	printf("createPartition : start          %llu\n",partition->partitionStart);
@@ -812,34 +776,84 @@ FATXPartition* createPartition(char *szFileName, u_int64_t partitionOffset,
 }
 
 /**
- * Open a FATX partition
+ * Format a FATX partition through an already open descriptor
  *
- * @param sourceFd Source file
+ * @param fd Descriptor of the file or drive holding the partition
  * @param partitionOffset Offset into above file that partition starts at
  * @param partitionSize Size of partition in bytes
+ * @return 0 on success, -1 on failure (errno set)
  */
-FATXPartition* openPartition(FILE *sourceFd, 
+int formatPartition(int fd, u_int64_t partitionOffset, u_int64_t partitionSize) {
+	return formatPartitionGeometry(fd, partitionOffset, partitionSize,
+			formatClusterSize(partitionSize), (u_int32_t) time(NULL));
+}
+
+/**
+ * Format a FATX partition with a given cluster size and volume id
+ *
+ * @param fd Descriptor of the file or drive holding the partition
+ * @param partitionOffset Offset into above file that partition starts at
+ * @param partitionSize Size of partition in bytes
+ * @param clusterSize Cluster size in bytes (a power of two, 512 to 64k)
+ * @param volumeId Volume id to give the partition
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int formatPartitionGeometry(int fd, u_int64_t partitionOffset, u_int64_t partitionSize,
+		u_int32_t clusterSize, u_int32_t volumeId) {
+	FATXPartition partition;
+	int result;
+
+	memset(&partition,0,sizeof(FATXPartition));
+	partition.partitionStart = partitionOffset;
+	partition.partitionSize = partitionSize;
+	partition.clusterSize = clusterSize;
+
+	result = writeFormat(fd, &partition, volumeId, 0);
+	free(partition.clusterChainMap.words);
+	return result;
+}
+
+/**
+ * Open a FATX partition
+ *
+ * @param backend Source image
+ * @param partitionOffset Offset into above image that partition starts at
+ * @param partitionSize Size of partition in bytes
+ */
+FATXPartition* openPartition(FATXBackend *backend, 
                              u_int64_t partitionOffset,
                              u_int64_t partitionSize) {
-  unsigned char partitionInfo[FATX_PARTITION_HEADERSIZE];
-  size_t freadSize;
-  FATXPartition* partition;
-  u_int32_t chainTableSize = 0;
-
-  // load the partition header
-  fseeko(sourceFd, partitionOffset, SEEK_SET);
-  freadSize = fread(partitionInfo, 1, FATX_PARTITION_HEADERSIZE, sourceFd);
-#ifdef DEBUG
-  printf("openPartition : %c%c%c%c FATX_PARTITION_HEADERSIZE %d freadSize %d \n",partitionInfo[0],partitionInfo[1],partitionInfo[2],partitionInfo[3],FATX_PARTITION_HEADERSIZE,freadSize);
-#endif
-  if (freadSize != FATX_PARTITION_HEADERSIZE) {
-    error("Out of data while freading partition header");
-  }
+  u_int32_t clusterSize;
+  int status;
 
-  // check the magic
-  if (*((u_int32_t*) &partitionInfo) != FATX_PARTITION_MAGIC) {
+  // load and check the partition header
+  status = fatxReadHeader(backend, partitionOffset, &clusterSize);
+  if (status == FATX_ERR_FORMAT) {
     error("No FATX partition found at requested offset");
   }
+  if (status != FATX_OK) {
+    error("Out of data while freading partition header");
+  }
+  printf("openPartition : FATX FATX_PARTITION_HEADERSIZE %d\n",FATX_PARTITION_HEADERSIZE);
+
+  return loadPartition(backend, partitionOffset, partitionSize, clusterSize);
+}
+
+
+/**
+ * Open a FATX partition whose header has already been read
+ *
+ * @param backend Source image
+ * @param partitionOffset Offset into above image that partition starts at
+ * @param partitionSize Size of partition in bytes
+ * @param clusterSize Cluster size from the partition header
+ */
+FATXPartition* loadPartition(FATXBackend *backend,
+                             u_int64_t partitionOffset,
+                             u_int64_t partitionSize,
+                             u_int32_t clusterSize) {
+  FATXPartition* partition;
+  void *chainMap;
 
   // make up new structure
   partition = (FATXPartition*) malloc(sizeof(FATXPartition));
@@ -847,40 +861,22 @@ FATXPartition* openPartition(FILE *sourceFd,
     error("Out of memory");
   }
 
-  // setup the easy bits
-  partition->sourceFd = sourceFd;
-  partition->partitionStart = partitionOffset;
-  partition->partitionSize = partitionSize;
-  partition->clusterSize = 0x4000;
-  partition->clusterCount = partition->partitionSize / partition->clusterSize;
-  partition->chainMapEntrySize = (partition->clusterCount >= 0xfff4) ? 4 : 2;
-  
-  // Now, work out the size of the cluster chain map table
-  chainTableSize = partition->clusterCount * partition->chainMapEntrySize;
-  if (chainTableSize % (unsigned long long)FATX_CHAINTABLE_BLOCKSIZE) {
-    // round up to nearest FATX_CHAINTABLE_BLOCKSIZE bytes
-    chainTableSize = ((chainTableSize / FATX_CHAINTABLE_BLOCKSIZE) + 1) * FATX_CHAINTABLE_BLOCKSIZE;
+  // work out the layout, then load the cluster chain map table
+  if (fatxSetGeometry(partition, backend, partitionOffset, partitionSize, clusterSize) != FATX_OK) {
+    error("Invalid partition: %llu bytes with a cluster size of %u", (unsigned long long) partitionSize, clusterSize);
   }
-
-  // Load the cluster chain map table
-  partition->clusterChainMap.words = (u_int16_t*) malloc(chainTableSize);
-  if (partition->clusterChainMap.words == NULL) {
+  chainMap = malloc(partition->chainTableSize);
+  if (chainMap == NULL) {
     error("Out of memory");
   }
-  fseeko(sourceFd, partitionOffset + FATX_PARTITION_HEADERSIZE, SEEK_SET);
-  freadSize = fread(partition->clusterChainMap.words, 1, chainTableSize, sourceFd);
-  if (freadSize != chainTableSize) {
+  if (fatxLoadChainMap(partition, chainMap) != FATX_OK) {
     error("Out of data while freading cluster chain map table");
   }
-  
-  // Work out the address of cluster 1
-  partition->cluster1Address = 
-    partitionOffset + FATX_PARTITION_HEADERSIZE + chainTableSize;
 
   printf("openPartition : clusters	%d\n",partition->clusterCount);
   printf("openPartition : size		%lld\n",partition->partitionSize);
   printf("openPartition : chainMapSize	%d\n",partition->chainMapEntrySize);
-  printf("openPartition : chainTableSize %d\n",chainTableSize);
+  printf("openPartition : chainTableSize %lld\n",partition->chainTableSize);
 		  
   // All done
   return partition;
@@ -891,6 +887,13 @@ FATXPartition* openPartition(FILE *sourceFd,
  * Close a FATX partition
  */
 void closePartition(FATXPartition* partition) {
+  u_int32_t i;
+
+  for(i = 0; i < partition->chainDirtyCount; i++) {
+    free(partition->chainDiskBlocks[partition->chainDirtyBlocks[i]]);
+  }
+  free(partition->chainDirtyBlocks);
+  free(partition->chainDiskBlocks);
   free(partition->clusterChainMap.words);
   free(partition);
   partition = NULL;
@@ -904,26 +907,24 @@ void closePartition(FATXPartition* partition) {
  * @param partition The FATX partition
  * @param outputStream Stream to output data to
  * @param filename Filename of file to dump
+ * @param hash If not NULL, hash to update with the data written
  */
-void dumpFile(FATXPartition* partition, char* filename, FILE *outputStream) {
-  int i = 0;
-  
-  // convert any '\' to '/' characters
-  while(filename[i] != 0) {
-    if (filename[i] == '\\') {
-      filename[i] = '/';
-    }
-    i++;
+void dumpFile(FATXPartition* partition, char* filename, FILE *outputStream, HashState *hash) {
+  unsigned char clusterData[partition->clusterSize];
+  FATXDirEntry entry;
+  int status;
+
+  // find it from the root; / and \ both separate names
+  status = fatxFindPath(partition, filename, &entry, clusterData);
+  if ((status == FATX_ERR_NOTFOUND) || (status == FATX_ERR_NOTDIR) ||
+      ((status == FATX_OK) && (entry.attributes & FATX_FILEATTR_DIRECTORY))) {
+    error("File not found");
   }
-
-  // skip over any leading / characters
-  i=0;
-  while((filename[i] != 0) && (filename[i] == '/')) {
-    i++;
+  if (status != FATX_OK) {
+    error("Unable to find %s: %s", filename, fatxStatusString(status));
   }
-  
-  // OK, start off the recursion at the root FAT
-  _recurseToFile(partition, filename + i, outputStream, FATX_ROOT_FAT_CLUSTER);
+
+  _dumpFile(partition, outputStream, entry.firstCluster, entry.fileSize, hash);
 }
 
 /**
@@ -939,222 +940,79 @@ void dumpTree(FATXPartition* partition, int outputStream) {
 
 
 /**
- * Recursively dump the directory tree
- *
- * @param partition FATX Partition
- * @param outputStream Stream to output to
- * @param clusterId ID of cluster to start at
- * @param nesting Nesting level of directory tree
+ * Print one entry of a directory tree, and what is under it
  */
-void _dumpTree(FATXPartition* partition, 
-              int outputStream,
-              int clusterId, int nesting) {
-  unsigned char clusterData[0x4000];
-  int i;
-  int j;
-  int endOfDirectory;
-  FATXDirEntry *dirEntry;
+static int dumpTreeEntry(void* context, FATXDirEntry* dirEntry) {
+  DumpTreeContext *ctx = (DumpTreeContext*) context;
   char fwriteBuf[512];
   char flagsStr[5];
+  char foundFilename[FATX_FILENAME_MAX + 1];
+  u_int32_t fileSize;
+  int j;
 
-  
-  // OK, output all the directory entries
-  endOfDirectory = 0;
-  while(clusterId != -1) {
-    // load cluster data
-    loadCluster(partition, clusterId, clusterData);
-
-    // loop through it, outputing entries
-    for(i=0; i< partition->clusterSize / sizeof(FATXDirEntry); i++) {
-      // work out the currentEntry
-      dirEntry = (FATXDirEntry *)&clusterData[i * sizeof(FATXDirEntry)];
-      
-      // first of all, check that it isn't an end of directory marker
-      if(dirEntry->filenameSize == 0xFF) {
-        endOfDirectory = 1;
-        break;
-      }
-
-      // check if file is deleted
-      if (dirEntry->filenameSize == 0xE5) {
-        continue;
-      }
-
-      // extract the filename
-      dirEntry->filename[dirEntry->filenameSize] = 0;
+  // extract the filename (a full length name has no room for a
+  // terminator, so it is copied out)
+  memcpy(foundFilename, dirEntry->filename, FATX_FILENAME_MAX);
+  foundFilename[(dirEntry->filenameSize < FATX_FILENAME_MAX) ? dirEntry->filenameSize : FATX_FILENAME_MAX] = 0;
 
-      // wipe fileSize
-      if (dirEntry->attributes & FATX_FILEATTR_DIRECTORY) {
-        dirEntry->fileSize = 0;
-      }
-      
-      // zap flagsStr
-      strcpy(flagsStr, "    ");
+  // directories have no size
+  fileSize = (dirEntry->attributes & FATX_FILEATTR_DIRECTORY) ? 0 : dirEntry->fileSize;
 
-      // work out other flags
-      if (dirEntry->attributes & FATX_FILEATTR_READONLY) {
-        flagsStr[0] = 'R';
-      }
-      if (dirEntry->attributes & FATX_FILEATTR_HIDDEN) {
-        flagsStr[1] = 'H';
-      }
-      if (dirEntry->attributes & FATX_FILEATTR_SYSTEM) {
-        flagsStr[2] = 'S';
-      }
-      if (dirEntry->attributes & FATX_FILEATTR_ARCHIVE) {
-        flagsStr[3] = 'A';
-      }
+  // zap flagsStr
+  strcpy(flagsStr, "    ");
 
-      // Output it
-      for(j=0; j< nesting; j++) {
-        fwriteBuf[j] = ' ';
-      }
-      sprintf(fwriteBuf+nesting, "/%s  [%s] (SZ:%ld CL:%x)\n", 
-              dirEntry->filename, flagsStr, (unsigned long)dirEntry->fileSize, dirEntry->firstCluster);
-      write(outputStream, fwriteBuf, strlen(fwriteBuf));
+  // work out other flags
+  if (dirEntry->attributes & FATX_FILEATTR_READONLY) {
+    flagsStr[0] = 'R';
+  }
+  if (dirEntry->attributes & FATX_FILEATTR_HIDDEN) {
+    flagsStr[1] = 'H';
+  }
+  if (dirEntry->attributes & FATX_FILEATTR_SYSTEM) {
+    flagsStr[2] = 'S';
+  }
+  if (dirEntry->attributes & FATX_FILEATTR_ARCHIVE) {
+    flagsStr[3] = 'A';
+  }
 
-      // If it is a sub-directory, recurse
-      if (dirEntry->attributes & FATX_FILEATTR_DIRECTORY) {
-        _dumpTree(partition, outputStream, dirEntry->firstCluster, nesting+1);
-      }
-    }
+  // Output it
+  for(j=0; j< ctx->nesting; j++) {
+    fwriteBuf[j] = ' ';
+  }
+  sprintf(fwriteBuf+ctx->nesting, "/%s  [%s] (SZ:%ld CL:%x)\n", 
+          foundFilename, flagsStr, (unsigned long)fileSize, dirEntry->firstCluster);
+  write(ctx->outputStream, fwriteBuf, strlen(fwriteBuf));
 
-    // have we hit the end of the directory yet?
-    if (endOfDirectory) {
-      break;
-    }
-    
-    // Find next cluster
-    clusterId = getNextClusterInChain(partition, clusterId);
+  // If it is a sub-directory, recurse
+  if (dirEntry->attributes & FATX_FILEATTR_DIRECTORY) {
+    _dumpTree(ctx->partition, ctx->outputStream, dirEntry->firstCluster, ctx->nesting+1);
   }
+  return 0;
 }
 
 
 /**
- * Recursively down a directory tree to find and extract a specific file
+ * Recursively dump the directory tree
  *
  * @param partition FATX Partition
- * @param filename Filename to extract
  * @param outputStream Stream to output to
  * @param clusterId ID of cluster to start at
+ * @param nesting Nesting level of directory tree
  */
-void _recurseToFile(FATXPartition* partition, 
-                    char* filename,
-                    FILE *outputStream,
-                    int clusterId) {
-  unsigned char clusterData[0x4000];
-  int i;
-  int j;
-  int endOfDirectory;
-  char seekFilename[50];
-  char* slashPos;
-  int lookForDirectory = 0;
-  int lookForFile = 0;
-  FATXDirEntry *dirEntry;
-
-
-  // work out the filename we're looking for
-  slashPos = strchr(filename, '/');
-  if (slashPos == NULL) {
-    // looking for file
-    lookForFile = 1;
-
-    // check seek filename size
-    if (strlen(filename) > FATX_FILENAME_MAX) {
-      error("Bad filename supplied (one leafname is too big)");
-    }
-    
-    // copy the filename to look for
-    strcpy(seekFilename, filename);
-  } else {
-    // looking for directory
-    lookForDirectory = 1;
-    
-    // check seek filename size
-    if ((slashPos - filename) > FATX_FILENAME_MAX) {
-      error("Bad filename supplied (one leafname is too big)");
-    }
-
-    // copy the filename to look for
-    strncpy(seekFilename, filename, slashPos - filename);
-    seekFilename[slashPos - filename] = 0;
-  }
-
-#ifdef DEBUG
-  printf("_recurseToFile : Filename : %s\n",filename);
-#endif
-
-  // lowercase it
-  for(i=0; i< strlen(seekFilename); i++) {
-    seekFilename[i] = tolower(seekFilename[i]);
-  }
-
-  // OK, search through directory entries
-  endOfDirectory = 0;
-  while(clusterId != -1) {
-    // load cluster data
-    loadCluster(partition, clusterId, clusterData);
-
-    // loop through it, outputing entries
-    for(i=0; i< partition->clusterSize / FATX_DIRECTORYENTRY_SIZE; i++) {
-      // work out the currentEntry
-      dirEntry = (FATXDirEntry *)&clusterData[i * sizeof(FATXDirEntry)];
-
-      // first of all, check that it isn't an end of directory marker
-      if(dirEntry->filenameSize == 0xFF) {
-        endOfDirectory = 1;
-        break;
-      }
-
-      // check if file is deleted
-      if (dirEntry->filenameSize == 0xE5) {
-        continue;
-      }
-
-      dirEntry->filename[dirEntry->filenameSize] = 0;
-      // lowercase foundfilename
-      for(j=0; j< strlen(dirEntry->filename); j++) {
-        dirEntry->filename[j] = tolower(dirEntry->filename[j]);
-      }
-
-      // is it what we're looking for...
-      if (!strcmp(dirEntry->filename, seekFilename)) {
-        // if we're looking for a directory and found a directory
-        if (lookForDirectory) {
-          if (dirEntry->attributes & FATX_FILEATTR_DIRECTORY) {
-            _recurseToFile(partition, slashPos+1, outputStream, dirEntry->firstCluster);
-            return;
-          } else {
-            error("File not found");
-          }
-        }
-
-        // if we're looking for a file and found a file
-        if (lookForFile) {
-          if (!(dirEntry->attributes & FATX_FILEATTR_DIRECTORY)) {
-#ifdef DEBUG
-            printf("_recurseToFile : Cluster : %ld\n",(unsigned long)dirEntry->firstCluster);
-#endif
-            _dumpFile(partition, outputStream, dirEntry->firstCluster, dirEntry->fileSize);
-            return;
-          } else {
-            error("File not found");
-          }
-        }
-      }
-    }
-
-    // have we hit the end of the directory yet?
-    if (endOfDirectory) {
-      break;
-    }
-    
-    // Find next cluster
-    clusterId = getNextClusterInChain(partition, clusterId);
+void _dumpTree(FATXPartition* partition, 
+              int outputStream,
+              int clusterId, int nesting) {
+  unsigned char clusterData[partition->clusterSize];
+  DumpTreeContext ctx;
+  int status;
+
+  ctx.partition = partition;
+  ctx.outputStream = outputStream;
+  ctx.nesting = nesting;
+  status = fatxWalkDirectory(partition, clusterId, clusterData, dumpTreeEntry, &ctx);
+  if (status != FATX_OK) {
+    error("Unable to list the directory at cluster %x: %s", clusterId, fatxStatusString(status));
   }
-
-  // not found it!
-  error("File not found");
 }
 
 
@@ -1166,20 +1024,24 @@ void _recurseToFile(FATXPartition* partition,
  * @param outputStream Stream to output to
  * @param clusterId Starting cluster ID of file
  * @param fileSize Size of file
+ * @param hash If not NULL, hash to update with the data written
  */
 void _dumpFile(FATXPartition* partition, FILE *outputStream, 
-               int clusterId, u_int32_t fileSize) {
+               int clusterId, u_int32_t fileSize, HashState *hash) {
   unsigned char clusterData[partition->clusterSize];
   int writtenSize;
 
-  // loop, outputting clusters
-  while(clusterId != -1) {
+  // loop, outputting clusters (empty files have none)
+  while((clusterId != -1) && (fileSize != 0)) {
     // Load the cluster data
     loadCluster(partition, clusterId, clusterData);
     
-    // Now, output it
+    // Now, output it, hashing exactly what was written
     writtenSize = 
       fwrite(clusterData, 1, (fileSize <= partition->clusterSize) ? fileSize : partition->clusterSize, outputStream);
+    if (hash != NULL) {
+      hashUpdate(hash, clusterData, writtenSize);
+    }
     fileSize -=writtenSize;
 
     // Find next cluster
@@ -1220,46 +1082,14 @@ int checkForLastDirectoryEntry(unsigned char* entry) {
  * @return ID of the next cluster in the chain, or -1 if there is no next cluster
  */
 u_int32_t getNextClusterInChain(FATXPartition* partition, int clusterId) {
-  int nextClusterId = 0;
-  u_int32_t eocMarker = 0;
-  u_int32_t rootFatMarker = 0;
-  u_int32_t maxCluster = 0;
-
-  // check
-  if (clusterId < 1) {
-    error("Attempt to access invalid cluster: %i", clusterId);
-  }
+  u_int32_t nextClusterId;
 
-  // get the next ID
-  if (partition->chainMapEntrySize == 2) {
-    nextClusterId = partition->clusterChainMap.words[clusterId];
-    eocMarker = 0xffff;
-    rootFatMarker = 0xfff8;
-    maxCluster = 0xfff4;
-  } else if (partition->chainMapEntrySize == 4) {
-    nextClusterId = partition->clusterChainMap.dwords[clusterId];
-    eocMarker = 0xffffffff;
-    rootFatMarker = 0xfffffff8;
-    maxCluster = 0xfffffff4;
-  } else {
-    error("Unknown cluster chain map entry size: %i", partition->chainMapEntrySize);
-  }
-  
-  // is it the end of chain?
-  if ((nextClusterId == eocMarker) || (nextClusterId == rootFatMarker)) {
-    return -1;
-  }
-
-  // is it something else unknown?
-  if (nextClusterId == 0) {
-    error("Cluster chain problem: Next cluster after %i is unallocated!", clusterId);
-  }
-  if (nextClusterId > maxCluster) {
-    error("Cluster chain problem: Next cluster after %i has invalid value: %i", clusterId, nextClusterId);
+  if (fatxNextCluster(partition, clusterId, &nextClusterId) != FATX_OK) {
+    error("Cluster chain problem: Next cluster after %i has invalid value", clusterId);
   }
   
-  // OK!
-  return nextClusterId;
+  // zero marks the end of the chain
+  return (nextClusterId == 0) ? -1 : nextClusterId;
 }
 
 
@@ -1271,26 +1101,11 @@ u_int32_t getNextClusterInChain(FATXPartition* partition, int clusterId) {
  * @param clusterData Where to store the data (must be at least the cluster size)
  */
 void loadCluster(FATXPartition* partition, unsigned long clusterId, unsigned char* clusterData) {
-  u_int64_t clusterAddress;
-  u_int64_t freadSize;
-  int err;
-  
-  // work out the address of the cluster
-  clusterAddress = partition->cluster1Address + ((unsigned long long)(clusterId - 1) * partition->clusterSize);
-  
-  printf("loadCluster : cluster1Address %lld clusterAddress %lld cluster %ld\n",
-		  partition->cluster1Address, clusterAddress, clusterId);
-  
-  // Now, load it
-  err = fseeko(partition->sourceFd, clusterAddress, SEEK_SET);
-  
-  if(err == -1) {
-	  printf("loadCluster : Error in seeking to position %lld\n", clusterAddress);
-  }
-  
-  freadSize = fread(clusterData, 1, partition->clusterSize, partition->sourceFd);
-  if (freadSize != partition->clusterSize) {
-    error("Out of data while freading cluster %i", clusterId);
+  int status;
+
+  status = fatxReadCluster(partition, clusterId, clusterData);
+  if (status != FATX_OK) {
+    error("Unable to read cluster %lu: %s", clusterId, fatxStatusString(status));
   }
 }
 
@@ -1318,3 +1133,245 @@ void fwriteCluster(FATXPartition* partition, int clusterId, unsigned char* clust
   }
 }
 
+
+/**
+ * Read data from consecutive clusters
+ *
+ * @param partition FATX partition
+ * @param clusterId First cluster to read
+ * @param data Where to store the data
+ * @param length Number of bytes
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int readClusters(FATXPartition* partition, u_int32_t clusterId, 
+                 unsigned char* data, u_int64_t length) {
+  u_int64_t clusterAddress;
+
+  clusterAddress = partition->cluster1Address + ((u_int64_t)(clusterId - 1) * partition->clusterSize);
+  return backendRead(partition->backend, data, length, clusterAddress);
+}
+
+
+/**
+ * Write data to consecutive clusters
+ *
+ * @param partition FATX partition
+ * @param clusterId First cluster to write
+ * @param data Data to write
+ * @param length Number of bytes (a multiple of the cluster size)
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int writeClusters(FATXPartition* partition, u_int32_t clusterId, 
+                  unsigned char* data, u_int64_t length) {
+  u_int64_t clusterAddress;
+  u_int64_t done;
+  ssize_t n;
+
+  clusterAddress = partition->cluster1Address + ((u_int64_t)(clusterId - 1) * partition->clusterSize);
+  for(done = 0; done < length; done += n) {
+    n = pwrite(fileno(partition->sourceFd), data + done, length - done, clusterAddress + done);
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Read a raw cluster chain map entry
+ *
+ * @param partition FATX partition
+ * @param clusterId Cluster whose entry to read
+ * @return The entry (0 = free)
+ */
+u_int32_t getChainEntry(FATXPartition* partition, u_int32_t clusterId) {
+  if (partition->chainMapEntrySize == 2) {
+    return partition->clusterChainMap.words[clusterId];
+  }
+  return partition->clusterChainMap.dwords[clusterId];
+}
+
+
+/**
+ * Change a cluster chain map entry in memory; flushChainMap() writes it out.
+ * The first change to a chain table block keeps a copy of the block as it
+ * is on disk.
+ *
+ * @param partition FATX partition
+ * @param clusterId Cluster whose entry to change
+ * @param value New entry
+ */
+void setChainEntry(FATXPartition* partition, u_int32_t clusterId, u_int32_t value) {
+  u_int32_t block = ((u_int64_t) clusterId * partition->chainMapEntrySize) / FATX_CHAINTABLE_BLOCKSIZE;
+  u_int32_t blockCount = partition->chainTableSize / FATX_CHAINTABLE_BLOCKSIZE;
+  unsigned char *copy;
+
+  if (partition->chainDiskBlocks == NULL) {
+    partition->chainDiskBlocks = (unsigned char**) calloc(blockCount, sizeof(unsigned char*));
+    partition->chainDirtyBlocks = (u_int32_t*) malloc(blockCount * sizeof(u_int32_t));
+    if ((partition->chainDiskBlocks == NULL) || (partition->chainDirtyBlocks == NULL)) {
+      error("Out of memory");
+    }
+  }
+  if (partition->chainDiskBlocks[block] == NULL) {
+    copy = (unsigned char*) malloc(FATX_CHAINTABLE_BLOCKSIZE);
+    if (copy == NULL) {
+      error("Out of memory");
+    }
+    memcpy(copy, ((unsigned char*) partition->clusterChainMap.words) + 
+           (u_int64_t) block * FATX_CHAINTABLE_BLOCKSIZE, FATX_CHAINTABLE_BLOCKSIZE);
+    partition->chainDiskBlocks[block] = copy;
+    partition->chainDirtyBlocks[partition->chainDirtyCount++] = block;
+  }
+
+  if (partition->chainMapEntrySize == 2) {
+    partition->clusterChainMap.words[clusterId] = value;
+  } else {
+    partition->clusterChainMap.dwords[clusterId] = value;
+  }
+}
+
+
+/**
+ * The end of chain marker for a partition's chain map entry size
+ */
+u_int32_t chainEndMarker(FATXPartition* partition) {
+  return (partition->chainMapEntrySize == 2) ? 0xffff : 0xffffffff;
+}
+
+
+/**
+ * Copy the entries of a chain table block which are in use in memory into
+ * the on-disk copy of the block, leaving entries freed in memory alone
+ *
+ * @return 1 if the on-disk copy changed, 0 if not
+ */
+static int mergeAllocations(FATXPartition* partition, unsigned char* memory, unsigned char* disk) {
+  int changed = 0;
+  int i;
+
+  if (partition->chainMapEntrySize == 2) {
+    u_int16_t *from = (u_int16_t*) memory;
+    u_int16_t *to = (u_int16_t*) disk;
+    for(i = 0; i < FATX_CHAINTABLE_BLOCKSIZE / 2; i++) {
+      if ((from[i] != 0) && (from[i] != to[i])) {
+        to[i] = from[i];
+        changed = 1;
+      }
+    }
+  } else {
+    u_int32_t *from = (u_int32_t*) memory;
+    u_int32_t *to = (u_int32_t*) disk;
+    for(i = 0; i < FATX_CHAINTABLE_BLOCKSIZE / 4; i++) {
+      if ((from[i] != 0) && (from[i] != to[i])) {
+        to[i] = from[i];
+        changed = 1;
+      }
+    }
+  }
+  return changed;
+}
+
+
+/**
+ * Write consecutive chain table blocks with one system call
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int writeChainBlocks(FATXPartition* partition, u_int32_t firstBlock, 
+                            struct iovec* iov, int iovCount) {
+  u_int64_t offset = partition->partitionStart + FATX_PARTITION_HEADERSIZE + 
+    (u_int64_t) firstBlock * FATX_CHAINTABLE_BLOCKSIZE;
+  ssize_t n;
+
+  while(iovCount > 0) {
+    n = pwritev(fileno(partition->sourceFd), iov, iovCount, offset);
+    if (n <= 0) {
+      return -1;
+    }
+    offset += n;
+    // step past whatever was written, in case the write was short
+    while((iovCount > 0) && (n >= (ssize_t) iov->iov_len)) {
+      n -= iov->iov_len;
+      iov++;
+      iovCount--;
+    }
+    if (iovCount > 0) {
+      iov->iov_base = ((unsigned char*) iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+
+static int compareBlocks(const void* a, const void* b) {
+  u_int32_t x = *(const u_int32_t*) a;
+  u_int32_t y = *(const u_int32_t*) b;
+  return (x > y) - (x < y);
+}
+
+
+/**
+ * Write the changed blocks of the in-memory chain map back to disk, in
+ * block order, with neighbouring blocks coalesced into single writes.
+ * FATX_FLUSH_ALLOCATIONS writes only entries which became non-zero, leaving
+ * freed entries in use on disk until a later FATX_FLUSH_ALL.
+ *
+ * @param partition FATX partition
+ * @param what FATX_FLUSH_ALLOCATIONS or FATX_FLUSH_ALL
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int flushChainMap(FATXPartition* partition, int what) {
+  struct iovec iov[FATX_FLUSH_MAXBLOCKS];
+  unsigned char *memory;
+  unsigned char *disk;
+  u_int32_t firstBlock = 0;
+  u_int32_t block;
+  u_int32_t i;
+  int iovCount = 0;
+
+  qsort(partition->chainDirtyBlocks, partition->chainDirtyCount, sizeof(u_int32_t), compareBlocks);
+  for(i = 0; i < partition->chainDirtyCount; i++) {
+    block = partition->chainDirtyBlocks[i];
+    memory = ((unsigned char*) partition->clusterChainMap.words) + (u_int64_t) block * FATX_CHAINTABLE_BLOCKSIZE;
+    disk = partition->chainDiskBlocks[block];
+
+    if (what == FATX_FLUSH_ALLOCATIONS) {
+      if (!mergeAllocations(partition, memory, disk)) {
+        continue;
+      }
+    } else if (memcmp(memory, disk, FATX_CHAINTABLE_BLOCKSIZE) == 0) {
+      continue;
+    } else {
+      memcpy(disk, memory, FATX_CHAINTABLE_BLOCKSIZE);
+    }
+
+    if ((iovCount > 0) && ((block != firstBlock + iovCount) || (iovCount == FATX_FLUSH_MAXBLOCKS))) {
+      if (writeChainBlocks(partition, firstBlock, iov, iovCount) == -1) {
+        return -1;
+      }
+      iovCount = 0;
+    }
+    if (iovCount == 0) {
+      firstBlock = block;
+    }
+    iov[iovCount].iov_base = disk;
+    iov[iovCount].iov_len = FATX_CHAINTABLE_BLOCKSIZE;
+    iovCount++;
+  }
+  if ((iovCount > 0) && (writeChainBlocks(partition, firstBlock, iov, iovCount) == -1)) {
+    return -1;
+  }
+
+  // everything is on disk now, so forget the blocks
+  if (what == FATX_FLUSH_ALL) {
+    for(i = 0; i < partition->chainDirtyCount; i++) {
+      free(partition->chainDiskBlocks[partition->chainDirtyBlocks[i]]);
+      partition->chainDiskBlocks[partition->chainDirtyBlocks[i]] = NULL;
+    }
+    partition->chainDirtyCount = 0;
+  }
+  return 0;
+}
@@ -21,6 +21,8 @@
 // Definitions for FATX on-disk structures
 
 #include <stdio.h>
+#include "hash.h"
+#include "backend.h"
 
 #ifndef FATX_H
 #define FATX_H
@@ -50,6 +52,15 @@
 // FATX chain table block size
 #define FATX_CHAINTABLE_BLOCKSIZE 4096
 
+// Chunk size used when physically filling a new image
+#define FATX_FILL_CHUNKSIZE (1024 * 1024)
+
+// createPartition modes: format an existing file or device in place,
+// create a new sparse image, or create a new image and zero every byte
+#define FATX_CREATE_FORMAT 0
+#define FATX_CREATE_SPARSE 1
+#define FATX_CREATE_FILL 2
+
 // ID of the root FAT cluster
 #define FATX_ROOT_FAT_CLUSTER 1
 
@@ -71,14 +82,24 @@
 // Directory entry flag indicating entry is a sub-directory
 #define FATX_FILEATTR_DIRECTORY 0x10
 
+// What flushChainMap() writes
+#define FATX_FLUSH_ALLOCATIONS 0
+#define FATX_FLUSH_ALL 1
+
+// Most chain table blocks written by one system call in flushChainMap()
+#define FATX_FLUSH_MAXBLOCKS 64
+
 // max filename size
 #define FATX_FILENAME_MAX 42
 
 // This structure describes a FATX partition
 typedef struct {
-  // The source file
+  // The source file, for writing
   FILE *sourceFd;
 
+  // Where the image is read from (NULL for partitions being created)
+  FATXBackend *backend;
+
   // The starting byte of the partition
   u_int64_t partitionStart;
 
@@ -105,6 +126,12 @@ typedef struct {
   
   // Address of cluster 1
   u_int64_t cluster1Address;
+
+  // Chain table blocks changed since they were last written: their block
+  // numbers, and for each block a copy of what is on disk (NULL if clean)
+  u_int32_t *chainDirtyBlocks;
+  u_int32_t chainDirtyCount;
+  unsigned char **chainDiskBlocks;
   
 } FATXPartition;
 
@@ -138,20 +165,109 @@ typedef struct {
 /**
  * Open a FATX partition
  *
- * @param sourceFd File to read from
- * @param partitionOffset Offset into above file that partition starts at
+ * @param backend Image to read from
+ * @param partitionOffset Offset into above image that partition starts at
  * @param partitionSize Size of partition in bytes
  */
-FATXPartition* openPartition(FILE *sourceFd,
+FATXPartition* openPartition(FATXBackend *backend,
                              u_int64_t partitionOffset,
                              u_int64_t partitionSize);
 
+/**
+ * Open a FATX partition whose header has already been read
+ *
+ * @param backend Image to read from
+ * @param partitionOffset Offset into above image that partition starts at
+ * @param partitionSize Size of partition in bytes
+ * @param clusterSize Cluster size from the partition header
+ */
+FATXPartition* loadPartition(FATXBackend *backend,
+                             u_int64_t partitionOffset,
+                             u_int64_t partitionSize,
+                             u_int32_t clusterSize);
+
 
 /**
  * Close a FATX partition
  */
 void closePartition(FATXPartition* partition);
 
+/**
+ * Gets the next cluster in the cluster chain
+ *
+ * @param partition FATX partition
+ * @param clusterId Cluster to find the next cluster for
+ * @return ID of the next cluster in the chain, or -1 if there is no next cluster
+ */
+u_int32_t getNextClusterInChain(FATXPartition* partition, int clusterId);
+
+/**
+ * Read a raw cluster chain map entry
+ *
+ * @param partition FATX partition
+ * @param clusterId Cluster whose entry to read
+ * @return The entry (0 = free)
+ */
+u_int32_t getChainEntry(FATXPartition* partition, u_int32_t clusterId);
+
+/**
+ * Change a cluster chain map entry in memory; flushChainMap() writes it out
+ *
+ * @param partition FATX partition
+ * @param clusterId Cluster whose entry to change
+ * @param value New entry
+ */
+void setChainEntry(FATXPartition* partition, u_int32_t clusterId, u_int32_t value);
+
+/**
+ * The end of chain marker for a partition's chain map entry size
+ */
+u_int32_t chainEndMarker(FATXPartition* partition);
+
+/**
+ * Write the changed blocks of the in-memory chain map back to disk.
+ * FATX_FLUSH_ALLOCATIONS writes only entries which became non-zero, leaving
+ * freed entries in use on disk until a later FATX_FLUSH_ALL.
+ *
+ * @param partition FATX partition
+ * @param what FATX_FLUSH_ALLOCATIONS or FATX_FLUSH_ALL
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int flushChainMap(FATXPartition* partition, int what);
+
+/**
+ * Load data for a cluster
+ *
+ * @param partition FATX partition
+ * @param clusterId ID of the cluster to load
+ * @param clusterData Where to store the data (must be at least the cluster size)
+ */
+void loadCluster(FATXPartition* partition, unsigned long clusterId, unsigned char* clusterData);
+
+/**
+ * Read data from consecutive clusters
+ *
+ * @param partition FATX partition
+ * @param clusterId First cluster to read
+ * @param data Where to store the data
+ * @param length Number of bytes
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int readClusters(FATXPartition* partition, u_int32_t clusterId, 
+                 unsigned char* data, u_int64_t length);
+
+/**
+ * Write data to consecutive clusters
+ *
+ * @param partition FATX partition
+ * @param clusterId First cluster to write
+ * @param data Data to write
+ * @param length Number of bytes (a multiple of the cluster size)
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int writeClusters(FATXPartition* partition, u_int32_t clusterId, 
+                  unsigned char* data, u_int64_t length);
+
 /**
  * Dump entire directory tree to supplied stream
  *
@@ -160,15 +276,59 @@ void closePartition(FATXPartition* partition);
  */
 void dumpTree(FATXPartition* partition, int outputStream);
 
-void dumpFile(FATXPartition* partition, char* filename, FILE *outputStream);
+/**
+ * Dump a file to the supplied stream
+ *
+ * @param partition The FATX partition
+ * @param filename Filename of file to dump
+ * @param outputStream Stream to output data to
+ * @param hash If not NULL, hash to update with the data written
+ */
+void dumpFile(FATXPartition* partition, char* filename, FILE *outputStream, HashState *hash);
 
+/**
+ * Format a FATX partition
+ *
+ * @param szFileName File or device to format
+ * @param partitionOffset Offset into above file that partition starts at
+ * @param partitionSize Size of partition in bytes (0 = whole file), or in MB
+ *                      when creating a new image
+ * @param nCreate One of the FATX_CREATE_* modes
+ */
 FATXPartition* createPartition(char *szFileName, u_int64_t partitionOffset, 
 		u_int64_t partitionSize,int nCreate);
 
+/**
+ * Format a FATX partition through an already open descriptor. Only
+ * positional writes are used, so disjoint partitions on the same
+ * descriptor may be formatted concurrently.
+ *
+ * @param fd Descriptor of the file or drive holding the partition
+ * @param partitionOffset Offset into above file that partition starts at
+ * @param partitionSize Size of partition in bytes
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int formatPartition(int fd, u_int64_t partitionOffset, u_int64_t partitionSize);
+
+/**
+ * Format a FATX partition with a given cluster size and volume id, so
+ * the same arguments always write the same bytes
+ *
+ * @param fd Descriptor of the file or drive holding the partition
+ * @param partitionOffset Offset into above file that partition starts at
+ * @param partitionSize Size of partition in bytes
+ * @param clusterSize Cluster size in bytes (a power of two, 512 to 64k)
+ * @param volumeId Volume id to give the partition
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int formatPartitionGeometry(int fd, u_int64_t partitionOffset, u_int64_t partitionSize,
+                            u_int32_t clusterSize, u_int32_t volumeId);
+
+int fwriteChainMap(FATXPartition *partition, int fd, int keepAllocated);
+
 void DumpSector(char *szFileName, long lSector);
 unsigned long getDiskSize(char *szDrive);
 
 int writeBRFR(char *szDrive,int p_mode);
-int listPartitions(char *szDrive);
 int prepareFG(char *szDrive,int p_mode);
 #endif
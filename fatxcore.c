@@ -0,0 +1,406 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Status-returning core of FATX read access, shared by the utilities and
+// libfatx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "fatxcore.h"
+
+// Looking for a name in a directory
+typedef struct {
+  const char *name;
+  size_t length;
+  FATXDirEntry *found;
+} FindContext;
+
+
+/**
+ * Address in the image of a cluster
+ */
+static u_int64_t clusterAddress(FATXPartition* partition, u_int32_t clusterId) {
+  return partition->cluster1Address + (u_int64_t) (clusterId - 1) * partition->clusterSize;
+}
+
+/**
+ * Check a cluster ID is one the partition has
+ */
+static int isValidCluster(FATXPartition* partition, u_int32_t clusterId) {
+  return (clusterId >= 1) && (clusterId < partition->clusterCount);
+}
+
+
+/**
+ * Check a partition header
+ *
+ * @param backend Image
+ * @param offset Where the partition starts
+ * @param clusterSize Set to the cluster size in bytes
+ * @return Status
+ */
+int fatxReadHeader(FATXBackend* backend, u_int64_t offset, u_int32_t* clusterSize) {
+  unsigned char header[FATX_PARTITION_HEADERSIZE];
+
+  if (backendRead(backend, header, FATX_PARTITION_HEADERSIZE, offset) == -1) {
+    return FATX_ERR_IO;
+  }
+  if (*(u_int32_t*) header != FATX_PARTITION_MAGIC) {
+    return FATX_ERR_FORMAT;
+  }
+  *clusterSize = *(u_int32_t*) &header[0x0008] * 512;
+  return FATX_OK;
+}
+
+
+/**
+ * Work out the layout of a partition. The chain map is not loaded; see
+ * fatxLoadChainMap().
+ *
+ * @param partition Partition to fill in
+ * @param backend Image
+ * @param offset Where the partition starts
+ * @param size Size of the partition in bytes
+ * @param clusterSize Cluster size from the header
+ * @return Status
+ */
+int fatxSetGeometry(FATXPartition* partition, FATXBackend* backend, u_int64_t offset,
+                    u_int64_t size, u_int32_t clusterSize) {
+  u_int64_t chainTableSize;
+
+  memset(partition, 0, sizeof(FATXPartition));
+  if ((clusterSize == 0) || (clusterSize > 0x10000) || (clusterSize & (clusterSize - 1)) ||
+      (size / clusterSize < 1) || (size / clusterSize > 0xffffffffULL)) {
+    return FATX_ERR_FORMAT;
+  }
+  partition->backend = backend;
+  partition->sourceFd = backend->file;
+  partition->partitionStart = offset;
+  partition->partitionSize = size;
+  partition->clusterSize = clusterSize;
+  partition->clusterCount = size / clusterSize;
+  partition->chainMapEntrySize = (partition->clusterCount >= 0xfff4) ? 4 : 2;
+
+  // the chain map is rounded up to whole blocks
+  chainTableSize = (u_int64_t) partition->clusterCount * partition->chainMapEntrySize;
+  chainTableSize = (chainTableSize + FATX_CHAINTABLE_BLOCKSIZE - 1) / FATX_CHAINTABLE_BLOCKSIZE *
+                   FATX_CHAINTABLE_BLOCKSIZE;
+  if (FATX_PARTITION_HEADERSIZE + chainTableSize > size) {
+    return FATX_ERR_FORMAT;
+  }
+  partition->chainTableSize = chainTableSize;
+  partition->cluster1Address = offset + FATX_PARTITION_HEADERSIZE + chainTableSize;
+  return FATX_OK;
+}
+
+
+/**
+ * Read the chain map of a partition into memory
+ *
+ * @param partition Partition, with its layout set
+ * @param chainMap Where to put it (chainTableSize bytes); the partition
+ *                 keeps pointing at it
+ * @return Status
+ */
+int fatxLoadChainMap(FATXPartition* partition, void* chainMap) {
+  if (backendRead(partition->backend, chainMap, partition->chainTableSize,
+                  partition->partitionStart + FATX_PARTITION_HEADERSIZE) == -1) {
+    return FATX_ERR_IO;
+  }
+  partition->clusterChainMap.words = (u_int16_t*) chainMap;
+  return FATX_OK;
+}
+
+
+/**
+ * Follow the chain map from a cluster
+ *
+ * @param partition Partition
+ * @param clusterId Cluster to follow on from
+ * @param next Set to the next cluster, or 0 at the end of the chain
+ * @return Status
+ */
+int fatxNextCluster(FATXPartition* partition, u_int32_t clusterId, u_int32_t* next) {
+  u_int32_t entry;
+
+  if (!isValidCluster(partition, clusterId)) {
+    return FATX_ERR_CORRUPT;
+  }
+  if (partition->chainMapEntrySize == 2) {
+    entry = partition->clusterChainMap.words[clusterId];
+    if (entry >= 0xfff8) {
+      *next = 0;
+      return FATX_OK;
+    }
+  } else {
+    entry = partition->clusterChainMap.dwords[clusterId];
+    if (entry >= 0xfffffff8) {
+      *next = 0;
+      return FATX_OK;
+    }
+  }
+  if (!isValidCluster(partition, entry)) {
+    return FATX_ERR_CORRUPT;
+  }
+  *next = entry;
+  return FATX_OK;
+}
+
+
+/**
+ * Read one cluster
+ *
+ * @param partition Partition
+ * @param clusterId Cluster to read
+ * @param data Where to put it (at least the cluster size)
+ * @return Status
+ */
+int fatxReadCluster(FATXPartition* partition, u_int32_t clusterId, unsigned char* data) {
+  if (!isValidCluster(partition, clusterId)) {
+    return FATX_ERR_CORRUPT;
+  }
+  if (backendRead(partition->backend, data, partition->clusterSize,
+                  clusterAddress(partition, clusterId)) == -1) {
+    return FATX_ERR_IO;
+  }
+  return FATX_OK;
+}
+
+
+/**
+ * Visit the entries of a directory, skipping deleted ones
+ *
+ * @param partition Partition
+ * @param firstCluster First cluster of the directory
+ * @param buffer A cluster sized buffer to work in
+ * @param visitor Called for each entry
+ * @param context Passed to the visitor
+ * @return Status, or what the visitor stopped the walk with
+ */
+int fatxWalkDirectory(FATXPartition* partition, u_int32_t firstCluster, unsigned char* buffer,
+                      FATXEntryVisitor visitor, void* context) {
+  u_int32_t entriesPerCluster = partition->clusterSize / FATX_DIRECTORYENTRY_SIZE;
+  u_int32_t clusterId = firstCluster;
+  u_int32_t followed;
+  FATXDirEntry *entry;
+  u_int32_t i;
+  int status;
+
+  // a chain longer than the partition has a loop in it
+  for(followed = 0; clusterId != 0; followed++) {
+    if (followed > partition->clusterCount) {
+      return FATX_ERR_CORRUPT;
+    }
+    status = fatxReadCluster(partition, clusterId, buffer);
+    if (status != FATX_OK) {
+      return status;
+    }
+    for(i = 0; i < entriesPerCluster; i++) {
+      entry = (FATXDirEntry*) &buffer[i * FATX_DIRECTORYENTRY_SIZE];
+      if ((entry->filenameSize == 0xff) || (entry->filenameSize == 0)) {
+        return FATX_OK;
+      }
+      if (entry->filenameSize != 0xe5) {
+        status = visitor(context, entry);
+        if (status != 0) {
+          return status;
+        }
+      }
+    }
+    status = fatxNextCluster(partition, clusterId, &clusterId);
+    if (status != FATX_OK) {
+      return status;
+    }
+  }
+  return FATX_OK;
+}
+
+static int findVisitor(void* context, FATXDirEntry* entry) {
+  FindContext *find = (FindContext*) context;
+
+  if ((entry->filenameSize == find->length) &&
+      !strncasecmp(entry->filename, find->name, find->length)) {
+    *find->found = *entry;
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Find the entry for a path, matching names ignoring case
+ *
+ * @param partition Partition
+ * @param path Path from the root, with / or \ separators
+ * @param entry Set to the entry (made up for the root)
+ * @param buffer A cluster sized buffer to work in
+ * @return Status
+ */
+int fatxFindPath(FATXPartition* partition, const char* path, FATXDirEntry* entry,
+                 unsigned char* buffer) {
+  FindContext find;
+  int status;
+
+  memset(entry, 0, sizeof(FATXDirEntry));
+  entry->attributes = FATX_FILEATTR_DIRECTORY;
+  entry->firstCluster = FATX_ROOT_FAT_CLUSTER;
+
+  while(*path != 0) {
+    if ((*path == '/') || (*path == '\\')) {
+      path++;
+      continue;
+    }
+    if (!(entry->attributes & FATX_FILEATTR_DIRECTORY)) {
+      return FATX_ERR_NOTDIR;
+    }
+
+    find.name = path;
+    find.length = strcspn(path, "/\\");
+    find.found = entry;
+    if (find.length > FATX_FILENAME_MAX) {
+      return FATX_ERR_NOTFOUND;
+    }
+    status = fatxWalkDirectory(partition, entry->firstCluster, buffer, findVisitor, &find);
+    if (status == FATX_OK) {
+      return FATX_ERR_NOTFOUND;
+    }
+    if (status != 1) {
+      return status;
+    }
+    path += find.length;
+  }
+  return FATX_OK;
+}
+
+
+/**
+ * Read part of a cluster chain holding a file, a run of consecutive
+ * clusters at a time
+ *
+ * @param partition Partition
+ * @param firstCluster First cluster of the file
+ * @param fileSize Size of the file
+ * @param offset Where to start in the file
+ * @param buffer Where to put the data
+ * @param length Most bytes to read
+ * @param done Set to the bytes read (less than length at the end of the
+ *             file)
+ * @return Status
+ */
+int fatxReadChain(FATXPartition* partition, u_int32_t firstCluster, u_int64_t fileSize,
+                  u_int64_t offset, unsigned char* buffer, size_t length, size_t* done) {
+  u_int32_t clusterSize = partition->clusterSize;
+  u_int32_t clusterId;
+  u_int32_t runStart;
+  u_int32_t runLength;
+  u_int32_t next;
+  u_int64_t skip;
+  u_int64_t within;
+  u_int64_t piece;
+  int status;
+
+  *done = 0;
+  if (offset >= fileSize) {
+    return FATX_OK;
+  }
+  if (length > fileSize - offset) {
+    length = fileSize - offset;
+  }
+
+  // follow the chain to the cluster holding the offset
+  clusterId = firstCluster;
+  for(skip = offset / clusterSize; skip > 0; skip--) {
+    status = fatxNextCluster(partition, clusterId, &clusterId);
+    if (status != FATX_OK) {
+      return status;
+    }
+    if (clusterId == 0) {
+      return FATX_ERR_CORRUPT;
+    }
+  }
+  within = offset % clusterSize;
+
+  // read runs of consecutive clusters at once
+  while(*done < length) {
+    if (!isValidCluster(partition, clusterId)) {
+      return FATX_ERR_CORRUPT;
+    }
+    runStart = clusterId;
+    runLength = 1;
+    while((u_int64_t) runLength * clusterSize - within < length - *done) {
+      status = fatxNextCluster(partition, clusterId, &next);
+      if (status != FATX_OK) {
+        return status;
+      }
+      if (next == 0) {
+        return FATX_ERR_CORRUPT;
+      }
+      clusterId = next;
+      if (next != runStart + runLength) {
+        break;
+      }
+      runLength++;
+    }
+
+    piece = (u_int64_t) runLength * clusterSize - within;
+    if (piece > length - *done) {
+      piece = length - *done;
+    }
+    if (backendRead(partition->backend, buffer + *done, piece,
+                    clusterAddress(partition, runStart) + within) == -1) {
+      return FATX_ERR_IO;
+    }
+    *done += piece;
+    within = 0;
+  }
+  return FATX_OK;
+}
+
+
+/**
+ * Describe a status code
+ *
+ * @return Constant string
+ */
+const char* fatxStatusString(int status) {
+  switch(status) {
+  case FATX_OK:
+    return "success";
+  case FATX_ERR_INVALID:
+    return "invalid argument";
+  case FATX_ERR_NOMEM:
+    return "out of memory";
+  case FATX_ERR_IO:
+    return "unable to read the image";
+  case FATX_ERR_FORMAT:
+    return "not a FATX partition";
+  case FATX_ERR_NOTFOUND:
+    return "no such file or directory";
+  case FATX_ERR_NOTDIR:
+    return "not a directory";
+  case FATX_ERR_ISDIR:
+    return "is a directory";
+  case FATX_ERR_CORRUPT:
+    return "broken cluster chain";
+  }
+  return "unknown status";
+}
@@ -0,0 +1,140 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Status-returning core of FATX read access, shared by the utilities and
+// libfatx. Nothing here prints or exits, and nothing changes the
+// partition, so several threads may read one partition at once.
+
+#ifndef FATXCORE_H
+#define FATXCORE_H 1
+
+#include <sys/types.h>
+#include "fatx.h"
+
+// The status codes are the ones libfatx exports
+#include "libfatx.h"
+
+/**
+ * Called for each live entry of a directory
+ *
+ * @param context Context passed to fatxWalkDirectory()
+ * @param entry The entry, valid until the visitor returns
+ * @return 0 to carry on, anything else to stop the walk with that status
+ *         (use 1 for "found, stop" so it is not taken as an error)
+ */
+typedef int (*FATXEntryVisitor)(void* context, FATXDirEntry* entry);
+
+/**
+ * Check a partition header
+ *
+ * @param backend Image
+ * @param offset Where the partition starts
+ * @param clusterSize Set to the cluster size in bytes
+ * @return Status
+ */
+int fatxReadHeader(FATXBackend* backend, u_int64_t offset, u_int32_t* clusterSize);
+
+/**
+ * Work out the layout of a partition. The chain map is not loaded; see
+ * fatxLoadChainMap().
+ *
+ * @param partition Partition to fill in
+ * @param backend Image
+ * @param offset Where the partition starts
+ * @param size Size of the partition in bytes
+ * @param clusterSize Cluster size from the header
+ * @return Status
+ */
+int fatxSetGeometry(FATXPartition* partition, FATXBackend* backend, u_int64_t offset,
+                    u_int64_t size, u_int32_t clusterSize);
+
+/**
+ * Read the chain map of a partition into memory
+ *
+ * @param partition Partition, with its layout set
+ * @param chainMap Where to put it (chainTableSize bytes); the partition
+ *                 keeps pointing at it
+ * @return Status
+ */
+int fatxLoadChainMap(FATXPartition* partition, void* chainMap);
+
+/**
+ * Follow the chain map from a cluster
+ *
+ * @param partition Partition
+ * @param clusterId Cluster to follow on from
+ * @param next Set to the next cluster, or 0 at the end of the chain
+ * @return Status
+ */
+int fatxNextCluster(FATXPartition* partition, u_int32_t clusterId, u_int32_t* next);
+
+/**
+ * Read one cluster
+ *
+ * @param partition Partition
+ * @param clusterId Cluster to read
+ * @param data Where to put it (at least the cluster size)
+ * @return Status
+ */
+int fatxReadCluster(FATXPartition* partition, u_int32_t clusterId, unsigned char* data);
+
+/**
+ * Visit the entries of a directory, skipping deleted ones
+ *
+ * @param partition Partition
+ * @param firstCluster First cluster of the directory
+ * @param buffer A cluster sized buffer to work in
+ * @param visitor Called for each entry
+ * @param context Passed to the visitor
+ * @return Status, or what the visitor stopped the walk with
+ */
+int fatxWalkDirectory(FATXPartition* partition, u_int32_t firstCluster, unsigned char* buffer,
+                      FATXEntryVisitor visitor, void* context);
+
+/**
+ * Find the entry for a path, matching names ignoring case
+ *
+ * @param partition Partition
+ * @param path Path from the root, with / or \ separators
+ * @param entry Set to the entry (made up for the root)
+ * @param buffer A cluster sized buffer to work in
+ * @return Status
+ */
+int fatxFindPath(FATXPartition* partition, const char* path, FATXDirEntry* entry,
+                 unsigned char* buffer);
+
+/**
+ * Read part of a cluster chain holding a file, a run of consecutive
+ * clusters at a time
+ *
+ * @param partition Partition
+ * @param firstCluster First cluster of the file
+ * @param fileSize Size of the file
+ * @param offset Where to start in the file
+ * @param buffer Where to put the data
+ * @param length Most bytes to read
+ * @param done Set to the bytes read (less than length at the end of the
+ *             file)
+ * @return Status
+ */
+int fatxReadChain(FATXPartition* partition, u_int32_t firstCluster, u_int64_t fileSize,
+                  u_int64_t offset, unsigned char* buffer, size_t length, size_t* done);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Directory entry lookup and update for FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "fatxdir.h"
+#include "fatxcore.h"
+#include "util.h"
+
+/**
+ * Find the hash slot for a cluster (either holding it or empty)
+ */
+static FATXDirCluster* dirCacheSlot(FATXDirCache* cache, u_int32_t clusterId) {
+  int i = (clusterId * 2654435761U) % cache->slotCount;
+
+  while((cache->slots[i].clusterId != 0) && (cache->slots[i].clusterId != clusterId)) {
+    i = (i + 1) % cache->slotCount;
+  }
+  return &cache->slots[i];
+}
+
+
+/**
+ * Double the size of the hash table
+ */
+static void growDirCache(FATXDirCache* cache) {
+  FATXDirCluster *old = cache->slots;
+  int oldCount = cache->slotCount;
+  int i;
+
+  cache->slotCount *= 2;
+  cache->slots = (FATXDirCluster*) calloc(cache->slotCount, sizeof(FATXDirCluster));
+  if (cache->slots == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < oldCount; i++) {
+    if (old[i].clusterId != 0) {
+      *dirCacheSlot(cache, old[i].clusterId) = old[i];
+    }
+  }
+  free(old);
+}
+
+
+/**
+ * Add a cluster to the cache, without loading it
+ */
+static FATXDirCluster* insertDirCluster(FATXDirCache* cache, u_int32_t clusterId) {
+  FATXDirCluster *slot;
+
+  if ((cache->used + 1) * 2 > cache->slotCount) {
+    growDirCache(cache);
+  }
+  slot = dirCacheSlot(cache, clusterId);
+  slot->clusterId = clusterId;
+  slot->dirty = 0;
+  slot->data = (unsigned char*) malloc(cache->partition->clusterSize);
+  if (slot->data == NULL) {
+    error("Out of memory");
+  }
+  cache->used++;
+  return slot;
+}
+
+
+/**
+ * Create an empty directory cluster cache
+ *
+ * @param partition FATX partition
+ * @return New cache, or NULL if out of memory
+ */
+FATXDirCache* createDirCache(FATXPartition* partition) {
+  FATXDirCache* cache;
+
+  cache = (FATXDirCache*) calloc(1, sizeof(FATXDirCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->partition = partition;
+  cache->slotCount = 64;
+  cache->slots = (FATXDirCluster*) calloc(cache->slotCount, sizeof(FATXDirCluster));
+  if (cache->slots == NULL) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+
+/**
+ * Free a directory cluster cache, discarding unflushed changes
+ */
+void freeDirCache(FATXDirCache* cache) {
+  int i;
+
+  for(i = 0; i < cache->slotCount; i++) {
+    free(cache->slots[i].data);
+  }
+  free(cache->slots);
+  free(cache);
+}
+
+
+/**
+ * Get a directory cluster, loading it if not cached
+ *
+ * @param data Set to the cluster data, valid until the cache is freed
+ * @return Status
+ */
+static int loadDirCluster(FATXDirCache* cache, u_int32_t clusterId, unsigned char** data) {
+  FATXDirCluster *slot = dirCacheSlot(cache, clusterId);
+  int status;
+
+  if (slot->clusterId == 0) {
+    slot = insertDirCluster(cache, clusterId);
+    status = fatxReadCluster(cache->partition, clusterId, slot->data);
+    if (status != FATX_OK) {
+      // it was the last in, so nothing probes past its slot yet
+      free(slot->data);
+      slot->data = NULL;
+      slot->clusterId = 0;
+      cache->used--;
+      return status;
+    }
+  }
+  *data = slot->data;
+  return FATX_OK;
+}
+
+
+/**
+ * Get a directory cluster, loading it if not cached
+ *
+ * @param cache Directory cache
+ * @param clusterId Cluster to get
+ * @return Cluster data, valid until the cache is freed
+ */
+unsigned char* getDirCluster(FATXDirCache* cache, u_int32_t clusterId) {
+  unsigned char *data;
+  int status;
+
+  status = loadDirCluster(cache, clusterId, &data);
+  if (status != FATX_OK) {
+    error("Unable to read directory cluster %u: %s", clusterId, fatxStatusString(status));
+  }
+  return data;
+}
+
+
+/**
+ * Start a new, empty directory cluster
+ *
+ * @param cache Directory cache
+ * @param clusterId Newly allocated cluster
+ * @return Cluster data
+ */
+unsigned char* newDirCluster(FATXDirCache* cache, u_int32_t clusterId) {
+  FATXDirCluster *slot = dirCacheSlot(cache, clusterId);
+
+  if (slot->clusterId == 0) {
+    slot = insertDirCluster(cache, clusterId);
+  }
+  memset(slot->data, FATX_DIRENTRY_END, cache->partition->clusterSize);
+  slot->dirty = 1;
+  return slot->data;
+}
+
+
+/**
+ * Get a directory entry for modification; the cluster holding it will be
+ * written by the next flushDirCache()
+ *
+ * @param cache Directory cache
+ * @param slot Location of the entry
+ * @return The entry
+ */
+FATXDirEntry* modifyDirEntry(FATXDirCache* cache, FATXDirSlot* slot) {
+  unsigned char *data = getDirCluster(cache, slot->clusterId);
+
+  dirCacheSlot(cache, slot->clusterId)->dirty = 1;
+  return (FATXDirEntry*) &data[slot->index * FATX_DIRECTORYENTRY_SIZE];
+}
+
+
+/**
+ * Order directory clusters by cluster ID
+ */
+static int compareDirClusters(const void *a, const void *b) {
+  u_int32_t x = (*(FATXDirCluster**) a)->clusterId;
+  u_int32_t y = (*(FATXDirCluster**) b)->clusterId;
+
+  return (x > y) - (x < y);
+}
+
+
+/**
+ * Write all changed directory clusters, in cluster order
+ *
+ * @param cache Directory cache
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int flushDirCache(FATXDirCache* cache) {
+  FATXDirCluster **dirty;
+  int count = 0;
+  int result = 0;
+  int i;
+
+  dirty = (FATXDirCluster**) malloc((cache->used + 1) * sizeof(FATXDirCluster*));
+  if (dirty == NULL) {
+    return -1;
+  }
+  for(i = 0; i < cache->slotCount; i++) {
+    if (cache->slots[i].dirty) {
+      dirty[count++] = &cache->slots[i];
+    }
+  }
+  qsort(dirty, count, sizeof(FATXDirCluster*), compareDirClusters);
+
+  for(i = 0; (i < count) && (result == 0); i++) {
+    result = writeClusters(cache->partition, dirty[i]->clusterId, dirty[i]->data, 
+                           cache->partition->clusterSize);
+    dirty[i]->dirty = 0;
+  }
+  free(dirty);
+  return result;
+}
+
+
+/**
+ * Commit a batch of changes to a partition. File data (already written)
+ * goes first, then chain entries claiming new clusters, then the directory
+ * clusters which reach them, then chain entries freeing clusters the
+ * directories no longer reach. Each step is synced before the next, so a
+ * crash at any point leaves at worst lost clusters, never cross-linked ones.
+ *
+ * @param cache Directory cache holding the changed directories
+ * @param bitmap Cluster bitmap, whose released clusters become reusable
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int commitPartition(FATXDirCache* cache, ClusterBitmap* bitmap) {
+  FATXPartition *partition = cache->partition;
+  int fd = fileno(partition->sourceFd);
+
+  if ((fdatasync(fd) == -1) ||
+      (flushChainMap(partition, FATX_FLUSH_ALLOCATIONS) == -1) || (fdatasync(fd) == -1) ||
+      (flushDirCache(cache) == -1) || (fdatasync(fd) == -1) ||
+      (flushChainMap(partition, FATX_FLUSH_ALL) == -1) || (fdatasync(fd) == -1)) {
+    return -1;
+  }
+  return reuseReleasedClusters(bitmap);
+}
+
+
+/**
+ * Check if an entry ends its directory
+ */
+static int isEndOfDirectory(FATXDirEntry* entry) {
+  return (entry->filenameSize == FATX_DIRENTRY_END) || (entry->filenameSize == 0);
+}
+
+
+/**
+ * Look up a name in a directory (case insensitively)
+ *
+ * @param cache Directory cache
+ * @param dirCluster First cluster of the directory
+ * @param name Name to look for
+ * @param entry If not NULL, set to a copy of the entry found
+ * @param slot If not NULL, set to the location of the entry found
+ * @return 1 if found, 0 if not, or a FATX_ERR_ status if the directory
+ *         cannot be read
+ */
+int findDirEntry(FATXDirCache* cache, u_int32_t dirCluster, char* name,
+                 FATXDirEntry* entry, FATXDirSlot* slot) {
+  int entriesPerCluster = cache->partition->clusterSize / FATX_DIRECTORYENTRY_SIZE;
+  size_t nameLength = strlen(name);
+  u_int32_t clusterId = dirCluster;
+  FATXDirEntry *dirEntry;
+  unsigned char *data;
+  int status;
+  int i;
+
+  while(clusterId != 0) {
+    status = loadDirCluster(cache, clusterId, &data);
+    if (status != FATX_OK) {
+      return status;
+    }
+    for(i = 0; i < entriesPerCluster; i++) {
+      dirEntry = (FATXDirEntry*) &data[i * FATX_DIRECTORYENTRY_SIZE];
+      if (isEndOfDirectory(dirEntry)) {
+        return 0;
+      }
+      if ((dirEntry->filenameSize == nameLength) && 
+          !strncasecmp(dirEntry->filename, name, nameLength)) {
+        if (entry != NULL) {
+          *entry = *dirEntry;
+        }
+        if (slot != NULL) {
+          slot->clusterId = clusterId;
+          slot->index = i;
+        }
+        return 1;
+      }
+    }
+    status = fatxNextCluster(cache->partition, clusterId, &clusterId);
+    if (status != FATX_OK) {
+      return status;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Look up a path from the root (case insensitively)
+ *
+ * @param cache Directory cache
+ * @param path Path, with / or \ separators
+ * @param entry Set to a copy of the entry found (made up for the root)
+ * @return 1 if found, 0 if not, or a FATX_ERR_ status if a directory on
+ *         the way cannot be read
+ */
+int findPathEntry(FATXDirCache* cache, char* path, FATXDirEntry* entry) {
+  char name[FATX_FILENAME_MAX + 1];
+  size_t length;
+  int found;
+
+  memset(entry, 0, sizeof(FATXDirEntry));
+  entry->attributes = FATX_FILEATTR_DIRECTORY;
+  entry->firstCluster = FATX_ROOT_FAT_CLUSTER;
+
+  while(*path != 0) {
+    if ((*path == '/') || (*path == '\\')) {
+      path++;
+      continue;
+    }
+    length = strcspn(path, "/\\");
+    if (!(entry->attributes & FATX_FILEATTR_DIRECTORY) || (length > FATX_FILENAME_MAX)) {
+      return 0;
+    }
+    memcpy(name, path, length);
+    name[length] = 0;
+    found = findDirEntry(cache, entry->firstCluster, name, entry, NULL);
+    if (found != 1) {
+      return found;
+    }
+    path += length;
+  }
+  return 1;
+}
+
+
+/**
+ * Step to the next entry of a directory, skipping deleted entries
+ *
+ * @param cache Directory cache
+ * @param slot Current position; set clusterId to the first cluster of the
+ *        directory and index to -1 to start
+ * @param entry If not NULL, set to a copy of the entry
+ * @return 1 if there is another entry, 0 at the end of the directory, or a
+ *         FATX_ERR_ status if the directory cannot be read
+ */
+int nextDirEntry(FATXDirCache* cache, FATXDirSlot* slot, FATXDirEntry* entry) {
+  int entriesPerCluster = cache->partition->clusterSize / FATX_DIRECTORYENTRY_SIZE;
+  FATXDirEntry *dirEntry;
+  unsigned char *data;
+  u_int32_t next;
+  int status;
+
+  while(slot->clusterId != -1) {
+    status = loadDirCluster(cache, slot->clusterId, &data);
+    if (status != FATX_OK) {
+      slot->clusterId = -1;
+      return status;
+    }
+    while(++slot->index < entriesPerCluster) {
+      dirEntry = (FATXDirEntry*) &data[slot->index * FATX_DIRECTORYENTRY_SIZE];
+      if (isEndOfDirectory(dirEntry)) {
+        slot->clusterId = -1;
+        return 0;
+      }
+      if (dirEntry->filenameSize != FATX_DIRENTRY_DELETED) {
+        if (entry != NULL) {
+          *entry = *dirEntry;
+        }
+        return 1;
+      }
+    }
+    status = fatxNextCluster(cache->partition, slot->clusterId, &next);
+    if (status != FATX_OK) {
+      slot->clusterId = -1;
+      return status;
+    }
+    slot->clusterId = (next == 0) ? -1 : next;
+    slot->index = -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Add an entry to a directory, reusing deleted entries and extending the
+ * directory with a new cluster if it is full
+ *
+ * @param cache Directory cache
+ * @param bitmap Cluster bitmap to allocate from
+ * @param dirCluster First cluster of the directory
+ * @param entry Entry to add
+ * @param slot If not NULL, set to the location of the new entry
+ * @return 0 on success, -1 if the partition is full
+ */
+int addDirEntry(FATXDirCache* cache, ClusterBitmap* bitmap, u_int32_t dirCluster,
+                FATXDirEntry* entry, FATXDirSlot* slot) {
+  int entriesPerCluster = cache->partition->clusterSize / FATX_DIRECTORYENTRY_SIZE;
+  u_int32_t clusterId = dirCluster;
+  u_int32_t lastCluster = dirCluster;
+  FATXDirSlot found;
+  FATXDirEntry *dirEntry;
+  ClusterRun *run;
+  unsigned char *data;
+  int runCount;
+  int i;
+
+  while(clusterId != -1) {
+    data = getDirCluster(cache, clusterId);
+    for(i = 0; i < entriesPerCluster; i++) {
+      dirEntry = (FATXDirEntry*) &data[i * FATX_DIRECTORYENTRY_SIZE];
+      if (dirEntry->filenameSize == FATX_DIRENTRY_DELETED) {
+        found.clusterId = clusterId;
+        found.index = i;
+        goto store;
+      }
+      if (isEndOfDirectory(dirEntry)) {
+        // move the end marker along
+        if (i + 1 < entriesPerCluster) {
+          memset(dirEntry + 1, FATX_DIRENTRY_END, FATX_DIRECTORYENTRY_SIZE);
+        }
+        found.clusterId = clusterId;
+        found.index = i;
+        goto store;
+      }
+    }
+    lastCluster = clusterId;
+    clusterId = getNextClusterInChain(cache->partition, clusterId);
+  }
+
+  // directory is full: chain on another cluster
+  run = allocateClusters(bitmap, 1, &runCount);
+  if (run == NULL) {
+    return -1;
+  }
+  newDirCluster(cache, run->start);
+  setChainEntry(cache->partition, lastCluster, run->start);
+  setChainEntry(cache->partition, run->start, chainEndMarker(cache->partition));
+  found.clusterId = run->start;
+  found.index = 0;
+  free(run);
+
+ store:
+  *modifyDirEntry(cache, &found) = *entry;
+  if (slot != NULL) {
+    *slot = found;
+  }
+  return 0;
+}
+
+
+/**
+ * Fill in a directory entry
+ *
+ * @param entry Entry to fill in
+ * @param name Filename
+ * @param attributes FATX_FILEATTR_* flags
+ * @param firstCluster First cluster of the file data
+ * @param fileSize Size of file in bytes
+ * @param when Modification time
+ * @return 0 on success, -1 if the name cannot be stored in FATX
+ */
+int makeDirEntry(FATXDirEntry* entry, char* name, u_int8_t attributes,
+                 u_int32_t firstCluster, u_int32_t fileSize, time_t when) {
+  size_t nameLength = strlen(name);
+
+  if ((nameLength == 0) || (nameLength > FATX_FILENAME_MAX)) {
+    return -1;
+  }
+
+  memset(entry, 0, sizeof(FATXDirEntry));
+  entry->filenameSize = nameLength;
+  entry->attributes = attributes;
+  memset(entry->filename, 0xff, FATX_FILENAME_MAX);
+  memcpy(entry->filename, name, nameLength);
+  entry->firstCluster = firstCluster;
+  entry->fileSize = fileSize;
+  storeDosDateTime(when, &entry->modDate, &entry->modTime);
+  entry->createDate = entry->laccessDate = entry->modDate;
+  entry->createTime = entry->laccessTime = entry->modTime;
+  return 0;
+}
@@ -0,0 +1,190 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Directory entry lookup and update for FATX partitions
+
+#ifndef FATXDIR_H
+#define FATXDIR_H 1
+
+#include <sys/types.h>
+#include <time.h>
+#include "fatx.h"
+#include "alloc.h"
+
+// Filename size values with special meanings
+#define FATX_DIRENTRY_DELETED 0xE5
+#define FATX_DIRENTRY_END 0xFF
+
+/**
+ * A directory cluster held in a FATXDirCache
+ */
+typedef struct {
+  u_int32_t clusterId;
+  int dirty;
+  unsigned char *data;
+} FATXDirCluster;
+
+/**
+ * Write-back cache of directory clusters, so a batch of directory
+ * updates costs one write per changed cluster
+ */
+typedef struct {
+  FATXPartition *partition;
+
+  // Open addressing hash table keyed on cluster ID (0 = empty slot)
+  FATXDirCluster *slots;
+  int slotCount;
+  int used;
+} FATXDirCache;
+
+/**
+ * Where a directory entry lives
+ */
+typedef struct {
+  u_int32_t clusterId;
+  int index;
+} FATXDirSlot;
+
+/**
+ * Create an empty directory cluster cache
+ *
+ * @param partition FATX partition
+ * @return New cache, or NULL if out of memory
+ */
+FATXDirCache* createDirCache(FATXPartition* partition);
+
+/**
+ * Free a directory cluster cache, discarding unflushed changes
+ */
+void freeDirCache(FATXDirCache* cache);
+
+/**
+ * Get a directory cluster, loading it if not cached
+ *
+ * @param cache Directory cache
+ * @param clusterId Cluster to get
+ * @return Cluster data, valid until the cache is freed
+ */
+unsigned char* getDirCluster(FATXDirCache* cache, u_int32_t clusterId);
+
+/**
+ * Start a new, empty directory cluster
+ *
+ * @param cache Directory cache
+ * @param clusterId Newly allocated cluster
+ * @return Cluster data
+ */
+unsigned char* newDirCluster(FATXDirCache* cache, u_int32_t clusterId);
+
+/**
+ * Get a directory entry for modification; the cluster holding it will be
+ * written by the next flushDirCache()
+ *
+ * @param cache Directory cache
+ * @param slot Location of the entry
+ * @return The entry
+ */
+FATXDirEntry* modifyDirEntry(FATXDirCache* cache, FATXDirSlot* slot);
+
+/**
+ * Write all changed directory clusters, in cluster order
+ *
+ * @param cache Directory cache
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int flushDirCache(FATXDirCache* cache);
+
+/**
+ * Commit a batch of changes to a partition: synced file data, then chain
+ * entries claiming clusters, then directories, then chain entries freeing
+ * clusters
+ *
+ * @param cache Directory cache holding the changed directories
+ * @param bitmap Cluster bitmap, whose released clusters become reusable
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int commitPartition(FATXDirCache* cache, ClusterBitmap* bitmap);
+
+/**
+ * Look up a name in a directory (case insensitively)
+ *
+ * @param cache Directory cache
+ * @param dirCluster First cluster of the directory
+ * @param name Name to look for
+ * @param entry If not NULL, set to a copy of the entry found
+ * @param slot If not NULL, set to the location of the entry found
+ * @return 1 if found, 0 if not, or a FATX_ERR_ status if the directory
+ *         cannot be read
+ */
+int findDirEntry(FATXDirCache* cache, u_int32_t dirCluster, char* name,
+                 FATXDirEntry* entry, FATXDirSlot* slot);
+
+/**
+ * Look up a path from the root (case insensitively)
+ *
+ * @param cache Directory cache
+ * @param path Path, with / or \ separators
+ * @param entry Set to a copy of the entry found (made up for the root)
+ * @return 1 if found, 0 if not, or a FATX_ERR_ status if a directory on
+ *         the way cannot be read
+ */
+int findPathEntry(FATXDirCache* cache, char* path, FATXDirEntry* entry);
+
+/**
+ * Step to the next entry of a directory, skipping deleted entries
+ *
+ * @param cache Directory cache
+ * @param slot Current position; set clusterId to the first cluster of the
+ *        directory and index to -1 to start
+ * @param entry If not NULL, set to a copy of the entry
+ * @return 1 if there is another entry, 0 at the end of the directory, or a
+ *         FATX_ERR_ status if the directory cannot be read
+ */
+int nextDirEntry(FATXDirCache* cache, FATXDirSlot* slot, FATXDirEntry* entry);
+
+/**
+ * Add an entry to a directory, reusing deleted entries and extending the
+ * directory with a new cluster if it is full
+ *
+ * @param cache Directory cache
+ * @param bitmap Cluster bitmap to allocate from
+ * @param dirCluster First cluster of the directory
+ * @param entry Entry to add
+ * @param slot If not NULL, set to the location of the new entry
+ * @return 0 on success, -1 if the partition is full
+ */
+int addDirEntry(FATXDirCache* cache, ClusterBitmap* bitmap, u_int32_t dirCluster,
+                FATXDirEntry* entry, FATXDirSlot* slot);
+
+/**
+ * Fill in a directory entry
+ *
+ * @param entry Entry to fill in
+ * @param name Filename
+ * @param attributes FATX_FILEATTR_* flags
+ * @param firstCluster First cluster of the file data
+ * @param fileSize Size of file in bytes
+ * @param when Modification time
+ * @return 0 on success, -1 if the name cannot be stored in FATX
+ */
+int makeDirEntry(FATXDirEntry* entry, char* name, u_int8_t attributes,
+                 u_int32_t firstCluster, u_int32_t fileSize, time_t when);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// In-memory index of a FATX partition for serving many lookups and reads
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "fsindex.h"
+
+
+/**
+ * Order two names, ignoring case as FATX does
+ */
+static int compareNames(const char* a, int aLength, const char* b, int bLength) {
+  int cmp;
+
+  cmp = strncasecmp(a, b, (aLength < bLength) ? aLength : bLength);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return aLength - bLength;
+}
+
+/**
+ * Length of a node's name
+ */
+int indexNameLength(FATXIndex* index, int node) {
+  FATXDirEntry *entry = &index->tree->nodes[node].entry;
+
+  return (entry->filenameSize <= FATX_FILENAME_MAX) ? entry->filenameSize : FATX_FILENAME_MAX;
+}
+
+/**
+ * qsort_r() comparison of two children by name
+ */
+static int compareChildren(const void* a, const void* b, void* context) {
+  FATXIndex *index = (FATXIndex*) context;
+  int nodeA = *(const int*) a;
+  int nodeB = *(const int*) b;
+
+  return compareNames(index->tree->nodes[nodeA].entry.filename, indexNameLength(index, nodeA),
+                      index->tree->nodes[nodeB].entry.filename, indexNameLength(index, nodeB));
+}
+
+/**
+ * Index the children of every directory
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int indexChildren(FATXIndex* index) {
+  FATXTree *tree = index->tree;
+  int *next;
+  int i;
+
+  index->childStart = (int*) calloc(tree->count + 1, sizeof(int));
+  index->children = (int*) malloc((tree->count + 1) * sizeof(int));
+  next = (int*) malloc((tree->count + 1) * sizeof(int));
+  if ((index->childStart == NULL) || (index->children == NULL) || (next == NULL)) {
+    free(next);
+    return -1;
+  }
+
+  // count the children of each node, then give each node its range
+  for(i = 1; i < tree->count; i++) {
+    index->childStart[tree->nodes[i].parent + 1]++;
+  }
+  for(i = 0; i < tree->count; i++) {
+    index->childStart[i + 1] += index->childStart[i];
+    next[i] = index->childStart[i];
+  }
+  for(i = 1; i < tree->count; i++) {
+    index->children[next[tree->nodes[i].parent]++] = i;
+  }
+  free(next);
+
+  for(i = 0; i < tree->count; i++) {
+    qsort_r(index->children + index->childStart[i], index->childStart[i + 1] - index->childStart[i],
+            sizeof(int), compareChildren, index);
+  }
+  return 0;
+}
+
+
+FATXIndex* createIndex(FATXPartition* partition) {
+  FATXIndex *index;
+  int i;
+
+  index = (FATXIndex*) calloc(1, sizeof(FATXIndex));
+  if (index == NULL) {
+    return NULL;
+  }
+  index->partition = partition;
+  pthread_mutex_init(&index->extentLock, NULL);
+  for(i = 0; i < INDEX_CACHE_LOCKS; i++) {
+    pthread_mutex_init(&index->cacheLocks[i], NULL);
+  }
+
+  index->tree = loadTree(partition);
+  if ((index->tree == NULL) || (indexChildren(index) == -1)) {
+    freeIndex(index);
+    return NULL;
+  }
+  index->extents = (FATXExtent**) calloc(index->tree->count, sizeof(FATXExtent*));
+  index->extentCounts = (int*) malloc(index->tree->count * sizeof(int));
+  index->cacheSlots = INDEX_CACHE_BYTES / partition->clusterSize;
+  index->cacheData = (unsigned char*) malloc((size_t) index->cacheSlots * partition->clusterSize);
+  index->cacheIds = (u_int32_t*) calloc(index->cacheSlots, sizeof(u_int32_t));
+  if ((index->extents == NULL) || (index->extentCounts == NULL) ||
+      (index->cacheData == NULL) || (index->cacheIds == NULL)) {
+    freeIndex(index);
+    return NULL;
+  }
+  for(i = 0; i < index->tree->count; i++) {
+    index->extentCounts[i] = -1;
+  }
+  return index;
+}
+
+
+void freeIndex(FATXIndex* index) {
+  int i;
+
+  if (index->extents != NULL) {
+    for(i = 0; i < index->tree->count; i++) {
+      free(index->extents[i]);
+    }
+  }
+  free(index->extents);
+  free(index->extentCounts);
+  free(index->childStart);
+  free(index->children);
+  free(index->cacheData);
+  free(index->cacheIds);
+  if (index->tree != NULL) {
+    freeTree(index->tree);
+  }
+  pthread_mutex_destroy(&index->extentLock);
+  for(i = 0; i < INDEX_CACHE_LOCKS; i++) {
+    pthread_mutex_destroy(&index->cacheLocks[i]);
+  }
+  free(index);
+}
+
+
+int findIndexChild(FATXIndex* index, int parent, const char* name) {
+  int nameSize = strlen(name);
+  int low = index->childStart[parent];
+  int high = index->childStart[parent + 1] - 1;
+  int middle;
+  int node;
+  int cmp;
+
+  while(low <= high) {
+    middle = low + (high - low) / 2;
+    node = index->children[middle];
+    cmp = compareNames(name, nameSize, index->tree->nodes[node].entry.filename, indexNameLength(index, node));
+    if (cmp == 0) {
+      return node;
+    }
+    if (cmp < 0) {
+      high = middle - 1;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return -1;
+}
+
+
+int findIndexPath(FATXIndex* index, const char* path) {
+  char name[FATX_FILENAME_MAX + 1];
+  const char *end;
+  int node = 0;
+
+  while(*path != 0) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    for(end = path; (*end != 0) && (*end != '/'); end++);
+    if (!isTreeDirectory(&index->tree->nodes[node]) || (end - path > FATX_FILENAME_MAX)) {
+      return -1;
+    }
+    memcpy(name, path, end - path);
+    name[end - path] = 0;
+    node = findIndexChild(index, node, name);
+    if (node == -1) {
+      return -1;
+    }
+    path = end;
+  }
+  return node;
+}
+
+
+/**
+ * Get the extents of a file, building them on first use
+ *
+ * @param count Set to the number of extents
+ * @return Extents, or NULL if the file has none
+ */
+static FATXExtent* fileExtents(FATXIndex* index, int node, int* count) {
+  FATXDirEntry *entry = &index->tree->nodes[node].entry;
+  u_int32_t clusters;
+
+  pthread_mutex_lock(&index->extentLock);
+  if (index->extentCounts[node] == -1) {
+    clusters = ((u_int64_t) entry->fileSize + index->partition->clusterSize - 1) / index->partition->clusterSize;
+    index->extents[node] = NULL;
+    index->extentCounts[node] = 0;
+    if (clusters > 0) {
+      index->extents[node] = buildExtents(index->partition, entry->firstCluster, clusters,
+                                          &index->extentCounts[node], NULL);
+      if (index->extents[node] == NULL) {
+        index->extentCounts[node] = 0;
+      }
+    }
+  }
+  *count = index->extentCounts[node];
+  pthread_mutex_unlock(&index->extentLock);
+  return index->extents[node];
+}
+
+/**
+ * Copy part of a cluster through the cache
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int cachedRead(FATXIndex* index, u_int32_t clusterId, unsigned char* data,
+                      u_int32_t offset, u_int32_t length, unsigned char* cluster) {
+  u_int32_t clusterSize = index->partition->clusterSize;
+  u_int32_t slot = clusterId % index->cacheSlots;
+  pthread_mutex_t *lock = &index->cacheLocks[slot % INDEX_CACHE_LOCKS];
+
+  pthread_mutex_lock(lock);
+  if (index->cacheIds[slot] == clusterId) {
+    memcpy(data, index->cacheData + (u_int64_t) slot * clusterSize + offset, length);
+    pthread_mutex_unlock(lock);
+    return 0;
+  }
+  pthread_mutex_unlock(lock);
+
+  // read without holding the lock, then keep the cluster
+  if (readClusters(index->partition, clusterId, cluster, clusterSize) == -1) {
+    return -1;
+  }
+  memcpy(data, cluster + offset, length);
+  pthread_mutex_lock(lock);
+  memcpy(index->cacheData + (u_int64_t) slot * clusterSize, cluster, clusterSize);
+  index->cacheIds[slot] = clusterId;
+  pthread_mutex_unlock(lock);
+  return 0;
+}
+
+
+int64_t readIndexedFile(FATXIndex* index, int node, unsigned char* data,
+                        u_int64_t offset, u_int64_t length, unsigned char* cluster) {
+  u_int32_t clusterSize = index->partition->clusterSize;
+  u_int64_t fileSize = index->tree->nodes[node].entry.fileSize;
+  FATXExtent *extents;
+  u_int64_t extentEnd;
+  u_int64_t within;
+  u_int64_t run;
+  u_int64_t piece;
+  u_int64_t done = 0;
+  u_int32_t clusterId;
+  u_int32_t clusterOffset;
+  int count;
+  int i;
+
+  if (offset >= fileSize) {
+    return 0;
+  }
+  if (length > fileSize - offset) {
+    length = fileSize - offset;
+  }
+  extents = fileExtents(index, node, &count);
+  i = findExtent(index->partition, extents, count, offset);
+  if (i == -1) {
+    i = count;
+  }
+
+  for(; (done < length) && (i < count); i++) {
+    extentEnd = extents[i].offset + (u_int64_t) extents[i].length * clusterSize;
+    while((done < length) && (offset + done < extentEnd)) {
+      within = offset + done - extents[i].offset;
+      clusterId = extents[i].start + within / clusterSize;
+      clusterOffset = within % clusterSize;
+
+      // whole clusters go straight into the buffer when there are enough
+      // of them; the rest go through the cache
+      run = (extentEnd - (offset + done)) / clusterSize;
+      if ((clusterOffset == 0) && ((length - done) / clusterSize < run)) {
+        run = (length - done) / clusterSize;
+      }
+      if ((clusterOffset == 0) && (run >= INDEX_DIRECT_CLUSTERS)) {
+        piece = run * clusterSize;
+        if (readClusters(index->partition, clusterId, data + done, piece) == -1) {
+          return -1;
+        }
+      } else {
+        piece = clusterSize - clusterOffset;
+        if (piece > length - done) {
+          piece = length - done;
+        }
+        if (cachedRead(index, clusterId, data + done, clusterOffset, piece, cluster) == -1) {
+          return -1;
+        }
+      }
+      done += piece;
+    }
+  }
+
+  // the chain ended before the file did
+  if (done < length) {
+    errno = EIO;
+    return -1;
+  }
+  return done;
+}
@@ -0,0 +1,120 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// In-memory index of a FATX partition for serving many lookups and reads
+
+#ifndef FSINDEX_H
+#define FSINDEX_H 1
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "fatx.h"
+#include "extent.h"
+#include "tree.h"
+
+// Memory used to cache clusters
+#define INDEX_CACHE_BYTES (64 * 1024 * 1024)
+
+// Locks shared out between the cache slots
+#define INDEX_CACHE_LOCKS 64
+
+// Runs of at least this many whole clusters are read straight into the
+// caller's buffer instead of through the cache
+#define INDEX_DIRECT_CLUSTERS 16
+
+/**
+ * The directory tree of a partition with its children sorted by name,
+ * each file's extents (built on its first read) and a cluster cache, all
+ * safe to use from many threads at once
+ */
+typedef struct {
+  FATXPartition *partition;
+  FATXTree *tree;
+
+  // Children of each node, sorted by name: those of node i are
+  // children[childStart[i]] to children[childStart[i + 1] - 1]
+  int *childStart;
+  int *children;
+
+  // Extents of each file, built on its first read (count -1 until then)
+  FATXExtent **extents;
+  int *extentCounts;
+  pthread_mutex_t extentLock;
+
+  // Direct-mapped cluster cache; a slot holding cluster 0 is empty
+  unsigned char *cacheData;
+  u_int32_t *cacheIds;
+  u_int32_t cacheSlots;
+  pthread_mutex_t cacheLocks[INDEX_CACHE_LOCKS];
+} FATXIndex;
+
+/**
+ * Index a partition, reading its whole directory tree
+ *
+ * @param partition FATX partition
+ * @return New index, or NULL if out of memory
+ */
+FATXIndex* createIndex(FATXPartition* partition);
+
+/**
+ * Free an index (but not its partition)
+ */
+void freeIndex(FATXIndex* index);
+
+/**
+ * Find a child of a directory by name, ignoring case as FATX does
+ *
+ * @param index Index
+ * @param parent Directory node
+ * @param name Name to look for
+ * @return Child node, or -1 if there is none
+ */
+int findIndexChild(FATXIndex* index, int parent, const char* name);
+
+/**
+ * Find a node by path
+ *
+ * @param index Index
+ * @param path / separated path from the root
+ * @return Node, or -1 if there is none
+ */
+int findIndexPath(FATXIndex* index, const char* path);
+
+/**
+ * Length of a node's name
+ */
+int indexNameLength(FATXIndex* index, int node);
+
+/**
+ * Read part of a file
+ *
+ * @param index Index
+ * @param node File node
+ * @param data Where to put the data
+ * @param offset Where to start in the file
+ * @param length Most bytes to read
+ * @param cluster A cluster sized buffer for the caller's thread
+ * @return Number of bytes read (short at the end of the file), or -1 on
+ *         failure (errno set)
+ */
+int64_t readIndexedFile(FATXIndex* index, int node, unsigned char* data,
+                        u_int64_t offset, u_int64_t length, unsigned char* cluster);
+
+#endif
@@ -0,0 +1,541 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Read-only FUSE mount of a FATX partition, speaking the kernel protocol
+// on /dev/fuse directly
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/fuse.h>
+#include "fusemount.h"
+#include "fsindex.h"
+#include "pool.h"
+#include "util.h"
+
+// State shared by the threads serving a mount
+typedef struct {
+  FATXIndex *index;
+  int fd;
+} MountContext;
+
+// Buffers of one serving thread
+typedef struct {
+  MountContext *ctx;
+  unsigned char *request;
+  unsigned char *reply;
+  unsigned char *cluster;
+} MountWorker;
+
+// Mount point to detach on a signal, and whether fusermount mounted it
+static char *mountedPath = NULL;
+static int mountedByHelper = 0;
+
+
+/**
+ * Turn a FUSE node id into a tree index
+ *
+ * @return Index, or -1 if the id is not one of ours
+ */
+static int nodeIndex(MountContext* ctx, u_int64_t nodeId) {
+  if ((nodeId < FUSE_ROOT_ID) || (nodeId > (u_int64_t) ctx->index->tree->count)) {
+    return -1;
+  }
+  return nodeId - FUSE_ROOT_ID;
+}
+
+/**
+ * Fill in the attributes of a node
+ */
+static void fillAttr(MountContext* ctx, int index, struct fuse_attr* attr) {
+  FATXDirEntry *entry = &ctx->index->tree->nodes[index].entry;
+
+  memset(attr, 0, sizeof(struct fuse_attr));
+  attr->ino = index + FUSE_ROOT_ID;
+  attr->mtime = loadDosTime(entry->modDate, entry->modTime);
+  attr->ctime = loadDosTime(entry->createDate, entry->createTime);
+  attr->atime = loadDosTime(entry->laccessDate, entry->laccessTime);
+  attr->blksize = ctx->index->partition->clusterSize;
+  if (isTreeDirectory(&ctx->index->tree->nodes[index])) {
+    attr->mode = S_IFDIR | 0555;
+    attr->nlink = 2;
+  } else {
+    attr->mode = S_IFREG | 0444;
+    attr->nlink = 1;
+    attr->size = entry->fileSize;
+    attr->blocks = ((u_int64_t) (entry->fileSize + ctx->index->partition->clusterSize - 1) /
+                    ctx->index->partition->clusterSize) * (ctx->index->partition->clusterSize / 512);
+  }
+}
+
+/**
+ * Send a reply
+ *
+ * @param unique Request being answered
+ * @param error Negative errno, or 0
+ * @param data Reply data (NULL if none)
+ * @param length Length of the reply data
+ */
+static void reply(MountContext* ctx, u_int64_t unique, int error, void* data, size_t length) {
+  struct fuse_out_header header;
+  struct iovec iov[2];
+
+  header.unique = unique;
+  header.error = error;
+  header.len = sizeof(header) + length;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = data;
+  iov[1].iov_len = length;
+
+  // ENOENT means the request was interrupted, which needs nothing more
+  writev(ctx->fd, iov, (length > 0) ? 2 : 1);
+}
+
+/**
+ * Answer INIT
+ */
+static void doInit(MountContext* ctx, struct fuse_in_header* in, struct fuse_init_in* init) {
+  struct fuse_init_out out;
+
+  memset(&out, 0, sizeof(out));
+  out.major = FUSE_KERNEL_VERSION;
+  out.minor = FUSE_KERNEL_MINOR_VERSION;
+  if (init->major != FUSE_KERNEL_VERSION) {
+    // the kernel will retry with our major version, or give up
+    reply(ctx, in->unique, 0, &out, sizeof(out));
+    return;
+  }
+  out.max_readahead = init->max_readahead;
+  out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES | FUSE_PARALLEL_DIROPS);
+  out.max_background = 64;
+  out.congestion_threshold = 48;
+  out.max_write = MOUNT_REQUEST_BUFFER - sizeof(struct fuse_in_header) - sizeof(struct fuse_write_in);
+  out.time_gran = 1000000000;
+  out.max_pages = MOUNT_MAX_READ / 4096;
+  reply(ctx, in->unique, 0, &out, (init->minor < 23) ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+}
+
+/**
+ * Answer READDIR
+ */
+static void doReaddir(MountWorker* worker, struct fuse_in_header* in, struct fuse_read_in* read, int index) {
+  MountContext *ctx = worker->ctx;
+  struct fuse_dirent *dirent;
+  FATXTreeNode *node;
+  u_int32_t size = (read->size < MOUNT_MAX_READ) ? read->size : MOUNT_MAX_READ;
+  u_int32_t used = 0;
+  u_int32_t entrySize;
+  u_int64_t position;
+  int children = ctx->index->childStart[index + 1] - ctx->index->childStart[index];
+  int child;
+  int length;
+
+  // positions 0 and 1 are . and .., the children follow
+  for(position = read->offset; position < (u_int64_t) children + 2; position++) {
+    if (position < 2) {
+      child = (position == 0) ? index : ((index == 0) ? 0 : ctx->index->tree->nodes[index].parent);
+      length = position + 1;
+    } else {
+      child = ctx->index->children[ctx->index->childStart[index] + position - 2];
+      length = indexNameLength(ctx->index, child);
+    }
+    entrySize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + length);
+    if (used + entrySize > size) {
+      break;
+    }
+
+    node = &ctx->index->tree->nodes[child];
+    dirent = (struct fuse_dirent*) (worker->reply + used);
+    memset(dirent, 0, entrySize);
+    dirent->ino = child + FUSE_ROOT_ID;
+    dirent->off = position + 1;
+    dirent->namelen = length;
+    dirent->type = isTreeDirectory(node) ? (S_IFDIR >> 12) : (S_IFREG >> 12);
+    if (position < 2) {
+      memcpy(dirent->name, "..", length);
+    } else {
+      memcpy(dirent->name, node->entry.filename, length);
+    }
+    used += entrySize;
+  }
+  reply(ctx, in->unique, 0, worker->reply, used);
+}
+
+/**
+ * Handle one request
+ */
+static void handleRequest(MountWorker* worker, struct fuse_in_header* in) {
+  MountContext *ctx = worker->ctx;
+  void *arg = in + 1;
+  struct fuse_entry_out entry;
+  struct fuse_attr_out attr;
+  struct fuse_open_out open;
+  struct fuse_statfs_out statfs;
+  struct fuse_read_in *read;
+  int64_t done;
+  int index;
+  int child;
+
+  switch(in->opcode) {
+  case FUSE_INIT:
+    doInit(ctx, in, (struct fuse_init_in*) arg);
+    return;
+  case FUSE_FORGET:
+  case FUSE_BATCH_FORGET:
+  case FUSE_INTERRUPT:
+    // nodes live as long as the mount, and requests are not cancelled
+    return;
+  case FUSE_DESTROY:
+  case FUSE_RELEASE:
+  case FUSE_RELEASEDIR:
+  case FUSE_FLUSH:
+    reply(ctx, in->unique, 0, NULL, 0);
+    return;
+  case FUSE_STATFS:
+    memset(&statfs, 0, sizeof(statfs));
+    statfs.st.blocks = ctx->index->partition->clusterCount;
+    statfs.st.files = ctx->index->tree->count;
+    statfs.st.bsize = ctx->index->partition->clusterSize;
+    statfs.st.frsize = ctx->index->partition->clusterSize;
+    statfs.st.namelen = FATX_FILENAME_MAX;
+    reply(ctx, in->unique, 0, &statfs, sizeof(statfs));
+    return;
+  }
+
+  index = nodeIndex(ctx, in->nodeid);
+  if (index == -1) {
+    reply(ctx, in->unique, -ENOENT, NULL, 0);
+    return;
+  }
+
+  switch(in->opcode) {
+  case FUSE_LOOKUP:
+    child = isTreeDirectory(&ctx->index->tree->nodes[index]) ? findIndexChild(ctx->index, index, (char*) arg) : -1;
+    if (child == -1) {
+      reply(ctx, in->unique, -ENOENT, NULL, 0);
+      return;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.nodeid = child + FUSE_ROOT_ID;
+    entry.entry_valid = MOUNT_ATTR_TIMEOUT;
+    entry.attr_valid = MOUNT_ATTR_TIMEOUT;
+    fillAttr(ctx, child, &entry.attr);
+    reply(ctx, in->unique, 0, &entry, sizeof(entry));
+    return;
+
+  case FUSE_GETATTR:
+    memset(&attr, 0, sizeof(attr));
+    attr.attr_valid = MOUNT_ATTR_TIMEOUT;
+    fillAttr(ctx, index, &attr.attr);
+    reply(ctx, in->unique, 0, &attr, sizeof(attr));
+    return;
+
+  case FUSE_OPEN:
+  case FUSE_OPENDIR:
+    if (isTreeDirectory(&ctx->index->tree->nodes[index]) != (in->opcode == FUSE_OPENDIR)) {
+      reply(ctx, in->unique, (in->opcode == FUSE_OPENDIR) ? -ENOTDIR : -EISDIR, NULL, 0);
+      return;
+    }
+    if ((in->opcode == FUSE_OPEN) && ((((struct fuse_open_in*) arg)->flags & O_ACCMODE) != O_RDONLY)) {
+      reply(ctx, in->unique, -EROFS, NULL, 0);
+      return;
+    }
+    memset(&open, 0, sizeof(open));
+    open.open_flags = (in->opcode == FUSE_OPEN) ? FOPEN_KEEP_CACHE : FOPEN_CACHE_DIR;
+    reply(ctx, in->unique, 0, &open, sizeof(open));
+    return;
+
+  case FUSE_READ:
+    read = (struct fuse_read_in*) arg;
+    done = readIndexedFile(ctx->index, index, worker->reply, read->offset,
+                           (read->size < MOUNT_MAX_READ) ? read->size : MOUNT_MAX_READ, worker->cluster);
+    if (done == -1) {
+      reply(ctx, in->unique, -EIO, NULL, 0);
+      return;
+    }
+    reply(ctx, in->unique, 0, worker->reply, done);
+    return;
+
+  case FUSE_READDIR:
+    if (!isTreeDirectory(&ctx->index->tree->nodes[index])) {
+      reply(ctx, in->unique, -ENOTDIR, NULL, 0);
+      return;
+    }
+    doReaddir(worker, in, (struct fuse_read_in*) arg, index);
+    return;
+
+  case FUSE_ACCESS:
+    reply(ctx, in->unique, 0, NULL, 0);
+    return;
+  }
+
+  reply(ctx, in->unique, -ENOSYS, NULL, 0);
+}
+
+/**
+ * Serve requests until the partition is unmounted
+ */
+static void* serveRequests(void* context) {
+  MountWorker *worker = (MountWorker*) context;
+  ssize_t n;
+
+  while(1) {
+    n = read(worker->ctx->fd, worker->request, MOUNT_REQUEST_BUFFER);
+    if (n == -1) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == ENOENT)) {
+        continue;
+      }
+      // ENODEV once unmounted
+      break;
+    }
+    if ((size_t) n < sizeof(struct fuse_in_header)) {
+      continue;
+    }
+    handleRequest(worker, (struct fuse_in_header*) worker->request);
+  }
+  return NULL;
+}
+
+/**
+ * Run fusermount3, or the older fusermount if that is missing, and wait
+ * for it
+ *
+ * @param args Arguments after the program name, NULL terminated
+ * @param keepFd Descriptor the helper must inherit, or -1
+ * @return Child pid, or -1 if it could not be started
+ */
+static pid_t runFusermount(char** args, int keepFd) {
+  char *argv[8];
+  char fdString[16];
+  pid_t pid;
+  int i;
+
+  pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  if (keepFd != -1) {
+    snprintf(fdString, sizeof(fdString), "%i", keepFd);
+    setenv("_FUSE_COMMFD", fdString, 1);
+  }
+  for(i = 0; (i < 6) && (args[i] != NULL); i++) {
+    argv[i + 1] = args[i];
+  }
+  argv[i + 1] = NULL;
+  argv[0] = "fusermount3";
+  execvp(argv[0], argv);
+  argv[0] = "fusermount";
+  execvp(argv[0], argv);
+  _exit(127);
+}
+
+/**
+ * Detach a mount, through fusermount if that is what mounted it
+ */
+static void unmountPath(char* mountPoint, int byHelper) {
+  char *args[] = { "-u", "-z", "--", mountPoint, NULL };
+  pid_t pid;
+
+  if (!byHelper) {
+    umount2(mountPoint, MNT_DETACH);
+    return;
+  }
+  pid = runFusermount(args, -1);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/**
+ * Mount through the setuid fusermount helper, which is how users other
+ * than root may mount. It opens /dev/fuse, mounts and passes the
+ * descriptor back over the socket named by _FUSE_COMMFD.
+ *
+ * @param mountPoint Directory to mount on
+ * @param options Mount options for the helper
+ * @return The /dev/fuse descriptor, or -1 on failure
+ */
+static int mountByHelper(char* mountPoint, char* options) {
+  char *args[] = { "-o", options, "--", mountPoint, NULL };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  char byte;
+  int sockets[2];
+  int status;
+  int fd = -1;
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+    return -1;
+  }
+  pid = runFusermount(args, sockets[1]);
+  close(sockets[1]);
+  if (pid == -1) {
+    close(sockets[0]);
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while((recvmsg(sockets[0], &msg, 0) == -1) && (errno == EINTR));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  close(sockets[0]);
+
+  waitpid(pid, &status, 0);
+  if ((fd != -1) && (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd != -1) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+/**
+ * Detach the mount on a signal; the threads then see the device go
+ */
+static void unmountOnSignal(int sig) {
+  if (mountedPath != NULL) {
+    unmountPath(mountedPath, mountedByHelper);
+  }
+}
+
+int mountPartition(FATXPartition* partition, char* mountPoint, int flags) {
+  MountContext ctx;
+  MountWorker *workers;
+  pthread_t *tids;
+  char options[128 + PATH_MAX];
+  int byHelper = 0;
+  int threads;
+  int started;
+  int i;
+
+  // index the tree and set up the caches before the kernel can ask
+  ctx.index = createIndex(partition);
+  if (ctx.index == NULL) {
+    fprintf(stderr, "mount : out of memory\n");
+    return -1;
+  }
+
+  // mount directly if we may, otherwise have the setuid helper do it
+  ctx.fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+  if (ctx.fd == -1) {
+    fprintf(stderr, "mount : unable to open /dev/fuse: %s\n", strerror(errno));
+    freeIndex(ctx.index);
+    return -1;
+  }
+  snprintf(options, sizeof(options), "fd=%i,rootmode=40000,user_id=%u,group_id=%u,default_permissions%s",
+           ctx.fd, getuid(), getgid(), (flags & MOUNT_ALLOW_OTHER) ? ",allow_other" : "");
+  if (mount("xboxdumper", mountPoint, "fuse.xboxdumper", MS_RDONLY | MS_NOSUID | MS_NODEV, options) == -1) {
+    if (errno != EPERM) {
+      fprintf(stderr, "mount : unable to mount on %s: %s\n", mountPoint, strerror(errno));
+      close(ctx.fd);
+      freeIndex(ctx.index);
+      return -1;
+    }
+    close(ctx.fd);
+    snprintf(options, sizeof(options), "ro,nosuid,nodev,fsname=xboxdumper,subtype=xboxdumper,default_permissions%s",
+             (flags & MOUNT_ALLOW_OTHER) ? ",allow_other" : "");
+    ctx.fd = mountByHelper(mountPoint, options);
+    if (ctx.fd == -1) {
+      fprintf(stderr, "mount : unable to mount on %s, as fusermount3 failed\n", mountPoint);
+      freeIndex(ctx.index);
+      return -1;
+    }
+    byHelper = 1;
+  }
+  mountedPath = mountPoint;
+  mountedByHelper = byHelper;
+  signal(SIGINT, unmountOnSignal);
+  signal(SIGTERM, unmountOnSignal);
+  printf("mount : %i entries mounted on %s, unmount with %s %s\n", ctx.index->tree->count, mountPoint,
+         byHelper ? "fusermount3 -u" : "umount", mountPoint);
+  fflush(stdout);
+
+  // serve from several threads, since reads block on the disk
+  threads = defaultThreads();
+  if (threads < MOUNT_MIN_THREADS) {
+    threads = MOUNT_MIN_THREADS;
+  }
+  workers = (MountWorker*) calloc(threads, sizeof(MountWorker));
+  tids = (pthread_t*) malloc(threads * sizeof(pthread_t));
+  started = 0;
+  if ((workers != NULL) && (tids != NULL)) {
+    for(; started < threads; started++) {
+      workers[started].ctx = &ctx;
+      workers[started].request = (unsigned char*) malloc(MOUNT_REQUEST_BUFFER);
+      workers[started].reply = (unsigned char*) malloc(MOUNT_MAX_READ);
+      workers[started].cluster = (unsigned char*) malloc(partition->clusterSize);
+      if ((workers[started].request == NULL) || (workers[started].reply == NULL) ||
+          (workers[started].cluster == NULL) ||
+          (pthread_create(&tids[started], NULL, serveRequests, &workers[started]) != 0)) {
+        break;
+      }
+    }
+  }
+  if (started == 0) {
+    fprintf(stderr, "mount : unable to start serving\n");
+    unmountPath(mountPoint, byHelper);
+  }
+  for(i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  mountedPath = NULL;
+  if (workers != NULL) {
+    for(i = 0; i < threads; i++) {
+      free(workers[i].request);
+      free(workers[i].reply);
+      free(workers[i].cluster);
+    }
+  }
+  free(workers);
+  free(tids);
+  close(ctx.fd);
+  freeIndex(ctx.index);
+  return (started == 0) ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Read-only FUSE mount of a FATX partition
+
+#ifndef FUSEMOUNT_H
+#define FUSEMOUNT_H 1
+
+#include "fatx.h"
+
+// Fewest threads serving requests; reads block on the disk, so there are
+// at least this many even on a single CPU
+#define MOUNT_MIN_THREADS 4
+
+// Largest read answered at once
+#define MOUNT_MAX_READ (1024 * 1024)
+
+// Size of the buffer each thread reads requests into
+#define MOUNT_REQUEST_BUFFER (128 * 1024)
+
+// Seconds the kernel may keep names and attributes
+#define MOUNT_ATTR_TIMEOUT 3600
+
+// Let users other than the one mounting see the files
+#define MOUNT_ALLOW_OTHER 1
+
+/**
+ * Mount a partition read-only on a directory through /dev/fuse, and serve
+ * it until it is unmounted, through an index of the partition (see
+ * createIndex()). Users other than root are mounted through the
+ * fusermount3 helper. Interrupt or terminate to unmount.
+ *
+ * @param partition FATX partition
+ * @param mountPoint Directory to mount on
+ * @param flags MOUNT_ALLOW_OTHER, or 0
+ * @return 0 on success, -1 on failure
+ */
+int mountPartition(FATXPartition* partition, char* mountPoint, int flags);
+
+#endif
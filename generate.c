@@ -0,0 +1,655 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Generating synthetic FATX images for benchmarks and testing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "generate.h"
+#include "fatx.h"
+#include "fatxdir.h"
+#include "alloc.h"
+#include "backend.h"
+#include "util.h"
+
+// Characters generated names are made of
+static const char nameChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+
+// Extensions given to generated files
+static const char* nameExtensions[] = { "", ".xbe", ".xpr", ".xtf", ".wav", ".dat", ".bin", ".sav" };
+
+// State of one generator run
+typedef struct {
+  GenerateOptions *options;
+  FATXPartition *partition;
+  ClusterBitmap *bitmap;
+  FATXDirCache *dirCache;
+
+  // Random state for the layout; file data has a state per file
+  u_int64_t random;
+
+  // First cluster and depth of each directory (the root is directory 0)
+  u_int32_t *dirClusters;
+  int *dirDepths;
+  u_int32_t dirCount;
+
+  // Directories which may still be given sub-directories
+  u_int32_t *parents;
+  u_int32_t parentCount;
+
+  // Entries to mark deleted once every entry has been added
+  FATXDirSlot *deleted;
+  u_int32_t deletedCount;
+
+  // Data staging buffer (a multiple of the cluster size)
+  unsigned char *buffer;
+  u_int64_t bufferSize;
+
+  u_int32_t files;
+  u_int32_t fragmented;
+  u_int64_t bytes;
+} GenerateContext;
+
+
+/**
+ * Step a splitmix64 generator
+ *
+ * @param state Generator state
+ * @return Next random value
+ */
+static u_int64_t nextRandom(u_int64_t* state) {
+  u_int64_t z;
+
+  *state += 0x9e3779b97f4a7c15ULL;
+  z = *state;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+/**
+ * Get a random number below a limit
+ *
+ * @param state Generator state
+ * @param limit Limit (must not be 0)
+ * @return Random number from 0 to limit - 1
+ */
+static u_int64_t randomBelow(u_int64_t* state, u_int64_t limit) {
+  return nextRandom(state) % limit;
+}
+
+
+/**
+ * Get the number of bits needed to hold a value
+ */
+static int bitLength(u_int64_t value) {
+  int bits = 0;
+
+  while(value != 0) {
+    bits++;
+    value >>= 1;
+  }
+  return bits;
+}
+
+
+/**
+ * Parse a size in bytes, with an optional K, M or G suffix
+ *
+ * @param text Text to parse
+ * @param end Set to the first character after the size
+ * @param size Set to the size
+ * @return 0 on success, -1 if there is no number
+ */
+static int parseSize(char* text, char** end, u_int64_t* size) {
+  *size = strtoull(text, end, 0);
+  if (*end == text) {
+    return -1;
+  }
+  switch(**end) {
+  case 'G': case 'g':
+    *size <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    *size <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    *size <<= 10;
+    (*end)++;
+  }
+  return 0;
+}
+
+
+void defaultGenerateOptions(GenerateOptions* options) {
+  memset(options, 0, sizeof(GenerateOptions));
+  options->seed = 1;
+  options->files = 1000;
+  options->dirs = 50;
+  options->depth = 4;
+  options->minSize = 512;
+  options->maxSize = 1024 * 1024;
+  options->distribution = GENERATE_DIST_LOG;
+}
+
+
+int parseGenerateOption(GenerateOptions* options, char* arg) {
+  char *value = strchr(arg, '=');
+  char *end;
+  u_int64_t number;
+
+  if (value == NULL) {
+    return -1;
+  }
+  value++;
+
+  if (!strncmp(arg, "sizes=", 6)) {
+    if (parseSize(value, &end, &options->minSize) == -1) {
+      return -1;
+    }
+    options->maxSize = options->minSize;
+    if ((*end == ':') && (parseSize(end + 1, &end, &options->maxSize) == -1)) {
+      return -1;
+    }
+    return ((*end == 0) && (options->minSize <= options->maxSize) && (options->maxSize <= 0xffffffffULL)) ? 0 : -1;
+  }
+  if (!strncmp(arg, "dist=", 5)) {
+    if (!strcmp(value, "log")) {
+      options->distribution = GENERATE_DIST_LOG;
+    } else if (!strcmp(value, "uniform")) {
+      options->distribution = GENERATE_DIST_UNIFORM;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  // everything else is a plain number
+  if (parseSize(value, &end, &number) == -1 || (*end != 0)) {
+    return -1;
+  }
+  if (!strncmp(arg, "seed=", 5)) {
+    options->seed = number;
+  } else if (!strncmp(arg, "files=", 6) && (number <= 0xffffffffULL)) {
+    options->files = number;
+  } else if (!strncmp(arg, "dirs=", 5) && (number <= 0xffffffffULL)) {
+    options->dirs = number;
+  } else if (!strncmp(arg, "depth=", 6) && (number <= 1000)) {
+    options->depth = number;
+  } else if (!strncmp(arg, "fragment=", 9) && (number <= 100)) {
+    options->fragmentPercent = number;
+  } else if (!strncmp(arg, "deleted=", 8) && (number <= 100)) {
+    options->deletedPercent = number;
+  } else if (!strncmp(arg, "chain=", 6) && ((number == 16) || (number == 32))) {
+    options->chainBits = number;
+  } else if (!strncmp(arg, "cluster=", 8) && (number >= 512) && (number <= 0x10000) &&
+             !(number & (number - 1))) {
+    options->clusterSize = number;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Pick the cluster size for an image. Chain map entries are 32 bits wide
+ * once a partition has 0xfff4 clusters, so a chain map width is had by
+ * moving the cluster size away from the console's 16k.
+ *
+ * @param options Generator options
+ * @return Cluster size in bytes, or 0 if the options cannot be met
+ */
+static u_int32_t pickClusterSize(GenerateOptions* options) {
+  u_int32_t clusterSize = options->clusterSize ? options->clusterSize : GENERATE_CLUSTERSIZE;
+
+  if (!options->clusterSize && (options->chainBits == 16)) {
+    while((options->size / clusterSize >= 0xfff4) && (clusterSize < 0x10000)) {
+      clusterSize <<= 1;
+    }
+  } else if (!options->clusterSize && (options->chainBits == 32)) {
+    while((options->size / clusterSize < 0xfff4) && (clusterSize > 512)) {
+      clusterSize >>= 1;
+    }
+  }
+
+  if (options->size / clusterSize < 16) {
+    fprintf(stderr, "generate: image too small for %u byte clusters\n", clusterSize);
+    return 0;
+  }
+  if (options->chainBits && (((options->size / clusterSize >= 0xfff4) ? 32 : 16) != options->chainBits)) {
+    fprintf(stderr, "generate: a %lluMB image cannot have a %d bit chain map with %u byte clusters\n",
+            (unsigned long long) options->size / (1024 * 1024), options->chainBits, clusterSize);
+    return 0;
+  }
+  return clusterSize;
+}
+
+
+/**
+ * Make up a name. The suffix keeps names unique within the image; the
+ * rest is mostly short, with the odd name using all of the 42 characters.
+ *
+ * @param ctx Generator context
+ * @param name Where to store the name (FATX_FILENAME_MAX + 1 bytes)
+ * @param index Unique number for the name
+ * @param isFile Whether to add a file extension
+ */
+static void makeName(GenerateContext* ctx, char* name, u_int32_t index, int isFile) {
+  char suffix[FATX_FILENAME_MAX + 1];
+  const char *extension = "";
+  size_t suffixLength;
+  size_t length;
+  size_t i;
+
+  if (isFile) {
+    extension = nameExtensions[randomBelow(&ctx->random, sizeof(nameExtensions) / sizeof(nameExtensions[0]))];
+  }
+  suffixLength = snprintf(suffix, sizeof(suffix), "_%x%s", index, extension);
+
+  if (randomBelow(&ctx->random, 8) == 0) {
+    length = FATX_FILENAME_MAX - suffixLength;
+  } else {
+    length = 1 + randomBelow(&ctx->random, 12);
+  }
+  for(i = 0; i < length; i++) {
+    name[i] = nameChars[randomBelow(&ctx->random, sizeof(nameChars) - 1)];
+  }
+  memcpy(name + length, suffix, suffixLength + 1);
+}
+
+
+/**
+ * Give a directory entry random timestamps, worked out directly as DOS
+ * values so the image does not depend on the local time zone
+ *
+ * @param ctx Generator context
+ * @param entry Entry to update
+ */
+static void setRandomTimes(GenerateContext* ctx, FATXDirEntry* entry) {
+  u_int64_t r = nextRandom(&ctx->random);
+
+  entry->modDate = ((21 + r % 12) << 9) | ((1 + (r >> 8) % 12) << 5) | (1 + (r >> 16) % 28);
+  entry->modTime = (((r >> 24) % 24) << 11) | (((r >> 32) % 60) << 5) | ((r >> 40) % 30);
+  entry->createDate = entry->laccessDate = entry->modDate;
+  entry->createTime = entry->laccessTime = entry->modTime;
+}
+
+
+/**
+ * Pick the size of a file
+ *
+ * @param ctx Generator context
+ * @return Size in bytes
+ */
+static u_int64_t pickFileSize(GenerateContext* ctx) {
+  GenerateOptions *options = ctx->options;
+  u_int64_t low = options->minSize;
+  u_int64_t high = options->maxSize;
+  int bits;
+
+  if (options->distribution == GENERATE_DIST_LOG) {
+    // every power of two in the range is equally likely, then the size is
+    // spread evenly within it
+    bits = bitLength(low) + randomBelow(&ctx->random, bitLength(high) - bitLength(low) + 1);
+    if (bits == 0) {
+      return 0;
+    }
+    if (low < (1ULL << (bits - 1))) {
+      low = 1ULL << (bits - 1);
+    }
+    if (high > (1ULL << bits) - 1) {
+      high = (1ULL << bits) - 1;
+    }
+  }
+  return low + randomBelow(&ctx->random, high - low + 1);
+}
+
+
+/**
+ * Add the directory tree. Each directory goes under a random directory
+ * which is not yet at the deepest level allowed.
+ *
+ * @param ctx Generator context
+ * @return 0 on success, -1 if the partition is full
+ */
+static int makeDirectories(GenerateContext* ctx) {
+  char name[FATX_FILENAME_MAX + 1];
+  FATXDirEntry entry;
+  ClusterRun *run;
+  u_int32_t parent;
+  int runCount;
+
+  ctx->dirClusters[0] = FATX_ROOT_FAT_CLUSTER;
+  ctx->dirDepths[0] = 0;
+  ctx->dirCount = 1;
+  if (ctx->options->depth > 0) {
+    ctx->parents[ctx->parentCount++] = 0;
+  }
+
+  while((ctx->dirCount <= ctx->options->dirs) && (ctx->parentCount > 0)) {
+    parent = ctx->parents[randomBelow(&ctx->random, ctx->parentCount)];
+    makeName(ctx, name, ctx->dirCount, 0);
+    makeDirEntry(&entry, name, FATX_FILEATTR_DIRECTORY, 0, 0, 0);
+    setRandomTimes(ctx, &entry);
+
+    run = allocateClusters(ctx->bitmap, 1, &runCount);
+    if (run == NULL) {
+      return -1;
+    }
+    entry.firstCluster = run->start;
+    free(run);
+    newDirCluster(ctx->dirCache, entry.firstCluster);
+    setChainEntry(ctx->partition, entry.firstCluster, chainEndMarker(ctx->partition));
+    if (addDirEntry(ctx->dirCache, ctx->bitmap, ctx->dirClusters[parent], &entry, NULL) == -1) {
+      return -1;
+    }
+
+    ctx->dirClusters[ctx->dirCount] = entry.firstCluster;
+    ctx->dirDepths[ctx->dirCount] = ctx->dirDepths[parent] + 1;
+    if (ctx->dirDepths[ctx->dirCount] < ctx->options->depth) {
+      ctx->parents[ctx->parentCount++] = ctx->dirCount;
+    }
+    ctx->dirCount++;
+  }
+  return 0;
+}
+
+
+/**
+ * Allocate the clusters of a file. A fragmented file is allocated as
+ * several pieces with a few free clusters left between them, and the
+ * pieces are chained in a random order.
+ *
+ * @param ctx Generator context
+ * @param clusters Number of clusters wanted
+ * @param fragment Whether to fragment the file
+ * @param runCount Set to the number of runs returned
+ * @return malloc()ed array of runs in chain order, or NULL if the
+ *         partition is full
+ */
+static ClusterRun* allocateFile(GenerateContext* ctx, u_int32_t clusters, int fragment, int* runCount) {
+  ClusterRun *runs = NULL;
+  ClusterRun *pieceRuns;
+  ClusterRun gap;
+  ClusterRun swap;
+  u_int32_t pieces;
+  u_int32_t length;
+  u_int32_t p;
+  int pieceCount;
+  int i;
+
+  if (!fragment) {
+    return allocateClusters(ctx->bitmap, clusters, runCount);
+  }
+
+  pieces = 2 + randomBelow(&ctx->random, ((clusters < GENERATE_MAX_FRAGMENTS) ? clusters : GENERATE_MAX_FRAGMENTS) - 1);
+  *runCount = 0;
+  for(p = 0; p < pieces; p++) {
+    length = clusters / pieces + ((p < clusters % pieces) ? 1 : 0);
+    pieceRuns = allocateClusters(ctx->bitmap, length, &pieceCount);
+    if (pieceRuns == NULL) {
+      free(runs);
+      return NULL;
+    }
+    runs = (ClusterRun*) realloc(runs, (*runCount + pieceCount) * sizeof(ClusterRun));
+    if (runs == NULL) {
+      error("Out of memory");
+    }
+    memcpy(runs + *runCount, pieceRuns, pieceCount * sizeof(ClusterRun));
+    *runCount += pieceCount;
+    free(pieceRuns);
+
+    // the gap is never chained, so it is free space in the finished image
+    if (p + 1 < pieces) {
+      allocateRun(ctx->bitmap, 1 + randomBelow(&ctx->random, GENERATE_MAX_GAP), &gap);
+    }
+  }
+
+  for(i = *runCount - 1; i > 0; i--) {
+    p = randomBelow(&ctx->random, i + 1);
+    swap = runs[i];
+    runs[i] = runs[p];
+    runs[p] = swap;
+  }
+  return runs;
+}
+
+
+/**
+ * Add one file, with random contents
+ *
+ * @param ctx Generator context
+ * @param index Number of the file
+ * @return 0 on success, -1 on failure
+ */
+static int makeFile(GenerateContext* ctx, u_int32_t index) {
+  u_int32_t clusterSize = ctx->partition->clusterSize;
+  char name[FATX_FILENAME_MAX + 1];
+  FATXDirEntry entry;
+  FATXDirSlot slot;
+  ClusterRun *runs = NULL;
+  u_int64_t dataRandom;
+  u_int64_t remaining;
+  u_int64_t runBytes;
+  u_int64_t chunk;
+  u_int64_t done;
+  u_int64_t fill;
+  u_int64_t size;
+  u_int64_t word;
+  u_int32_t clusters;
+  u_int32_t dir;
+  u_int32_t next;
+  u_int32_t i;
+  int runCount = 0;
+  int fragment;
+  int deleted;
+  int r;
+
+  dir = randomBelow(&ctx->random, ctx->dirCount);
+  size = pickFileSize(ctx);
+  clusters = (size + clusterSize - 1) / clusterSize;
+  fragment = (clusters > 1) && (randomBelow(&ctx->random, 100) < ctx->options->fragmentPercent);
+  deleted = randomBelow(&ctx->random, 100) < ctx->options->deletedPercent;
+  makeName(ctx, name, index, 1);
+  makeDirEntry(&entry, name, FATX_FILEATTR_ARCHIVE, 0, size, 0);
+  setRandomTimes(ctx, &entry);
+
+  if (clusters > 0) {
+    runs = allocateFile(ctx, clusters, fragment, &runCount);
+    if (runs == NULL) {
+      fprintf(stderr, "generate: partition full after %u files\n", index);
+      return -1;
+    }
+    entry.firstCluster = runs[0].start;
+  }
+
+  // each file's data has its own generator, so it does not depend on the
+  // layout of the rest of the image
+  dataRandom = ctx->options->seed ^ ((u_int64_t) (index + 1) << 32);
+  remaining = size;
+  for(r = 0; r < runCount; r++) {
+    runBytes = (u_int64_t) runs[r].length * clusterSize;
+    for(done = 0; done < runBytes; done += chunk) {
+      chunk = (runBytes - done < ctx->bufferSize) ? runBytes - done : ctx->bufferSize;
+      fill = (remaining < chunk) ? remaining : chunk;
+      for(i = 0; i < fill; i += sizeof(word)) {
+        word = nextRandom(&dataRandom);
+        memcpy(ctx->buffer + i, &word, sizeof(word));
+      }
+
+      // zero the slack of the last cluster
+      memset(ctx->buffer + fill, 0, chunk - fill);
+      remaining -= fill;
+      if (writeClusters(ctx->partition, runs[r].start + done / clusterSize, ctx->buffer, chunk) == -1) {
+        fprintf(stderr, "generate: writing data: %s\n", strerror(errno));
+        free(runs);
+        return -1;
+      }
+    }
+
+    // a deleted file's data stays behind, but its clusters are free
+    for(i = 0; !deleted && (i < runs[r].length); i++) {
+      if (i + 1 < runs[r].length) {
+        next = runs[r].start + i + 1;
+      } else if (r + 1 < runCount) {
+        next = runs[r + 1].start;
+      } else {
+        next = chainEndMarker(ctx->partition);
+      }
+      setChainEntry(ctx->partition, runs[r].start + i, next);
+    }
+  }
+  free(runs);
+
+  if (addDirEntry(ctx->dirCache, ctx->bitmap, ctx->dirClusters[dir], &entry, &slot) == -1) {
+    fprintf(stderr, "generate: partition full after %u files\n", index);
+    return -1;
+  }
+  if (deleted) {
+    ctx->deleted[ctx->deletedCount++] = slot;
+  } else {
+    ctx->files++;
+    ctx->bytes += size;
+    ctx->fragmented += (runCount > 1);
+  }
+  return 0;
+}
+
+
+/**
+ * Create an image file and format it
+ *
+ * @param filename Image to create
+ * @param size Size of the image in bytes
+ * @param clusterSize Cluster size in bytes
+ * @param volumeId Volume id to give the partition
+ * @return Open image file, or NULL on failure
+ */
+static FILE* createImage(char* filename, u_int64_t size, u_int32_t clusterSize, u_int32_t volumeId) {
+  FILE *file;
+  int fd;
+
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "generate: %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  // unwritten ranges stay holes and read back as zero
+  if ((ftruncate(fd, size) == -1) || (formatPartitionGeometry(fd, 0, size, clusterSize, volumeId) == -1)) {
+    fprintf(stderr, "generate: formatting %s: %s\n", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  file = fdopen(fd, "r+");
+  if (file == NULL) {
+    error("Out of memory");
+  }
+  return file;
+}
+
+
+int generateImage(char* filename, GenerateOptions* options) {
+  GenerateContext ctx;
+  FATXBackend *backend;
+  FILE *file;
+  u_int32_t clusterSize;
+  u_int32_t i;
+  int failed = 0;
+
+  memset(&ctx, 0, sizeof(GenerateContext));
+  ctx.options = options;
+  ctx.random = options->seed;
+
+  clusterSize = pickClusterSize(options);
+  if (clusterSize == 0) {
+    return -1;
+  }
+  file = createImage(filename, options->size, clusterSize, (u_int32_t) nextRandom(&ctx.random));
+  if (file == NULL) {
+    return -1;
+  }
+  backend = openBackend(file, filename);
+  if (backend == NULL) {
+    error("Unable to read %s: %s", filename, strerror(errno));
+  }
+  ctx.partition = openPartition(backend, 0, options->size);
+
+  ctx.bufferSize = GENERATE_CHUNKSIZE - (GENERATE_CHUNKSIZE % clusterSize);
+  ctx.buffer = (unsigned char*) malloc(ctx.bufferSize);
+  ctx.bitmap = loadClusterBitmap(ctx.partition);
+  ctx.dirCache = createDirCache(ctx.partition);
+  ctx.dirClusters = (u_int32_t*) malloc(((u_int64_t) options->dirs + 1) * sizeof(u_int32_t));
+  ctx.dirDepths = (int*) malloc(((u_int64_t) options->dirs + 1) * sizeof(int));
+  ctx.parents = (u_int32_t*) malloc(((u_int64_t) options->dirs + 1) * sizeof(u_int32_t));
+  ctx.deleted = (FATXDirSlot*) malloc(((u_int64_t) options->files + 1) * sizeof(FATXDirSlot));
+  if ((ctx.buffer == NULL) || (ctx.bitmap == NULL) || (ctx.dirCache == NULL) || (ctx.dirClusters == NULL) ||
+      (ctx.dirDepths == NULL) || (ctx.parents == NULL) || (ctx.deleted == NULL)) {
+    error("Out of memory");
+  }
+
+  printf("generate : %lluMB image, %u byte clusters, %d bit chain map, seed %llu\n",
+         (unsigned long long) options->size / (1024 * 1024), clusterSize,
+         ctx.partition->chainMapEntrySize * 8, (unsigned long long) options->seed);
+
+  if (makeDirectories(&ctx) == -1) {
+    fprintf(stderr, "generate: partition full after %u directories\n", ctx.dirCount - 1);
+    failed = 1;
+  }
+  for(i = 0; !failed && (i < options->files); i++) {
+    if (makeFile(&ctx, i) == -1) {
+      failed = 1;
+    }
+  }
+
+  // only now can entries be deleted, or later files would have reused them
+  for(i = 0; i < ctx.deletedCount; i++) {
+    modifyDirEntry(ctx.dirCache, &ctx.deleted[i])->filenameSize = FATX_DIRENTRY_DELETED;
+  }
+
+  if (commitPartition(ctx.dirCache, ctx.bitmap) == -1) {
+    fprintf(stderr, "generate: error updating %s: %s\n", filename, strerror(errno));
+    failed = 1;
+  }
+
+  printf("generate : %u directories, %u files (%u fragmented), %u deleted, %llu bytes\n",
+         ctx.dirCount - 1, ctx.files, ctx.fragmented, ctx.deletedCount, (unsigned long long) ctx.bytes);
+
+  free(ctx.buffer);
+  free(ctx.dirClusters);
+  free(ctx.dirDepths);
+  free(ctx.parents);
+  free(ctx.deleted);
+  freeClusterBitmap(ctx.bitmap);
+  freeDirCache(ctx.dirCache);
+  closePartition(ctx.partition);
+  closeBackend(backend);
+  if (fclose(file) != 0) {
+    failed = 1;
+  }
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,109 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Generating synthetic FATX images for benchmarks and testing
+
+#ifndef GENERATE_H
+#define GENERATE_H 1
+
+#include <sys/types.h>
+
+// Largest single data write made while generating
+#define GENERATE_CHUNKSIZE (4 * 1024 * 1024)
+
+// Most pieces a fragmented file is split into
+#define GENERATE_MAX_FRAGMENTS 8
+
+// Most clusters left free between the pieces of a fragmented file
+#define GENERATE_MAX_GAP 4
+
+// Cluster size used unless a chain map width asks for another
+#define GENERATE_CLUSTERSIZE 0x4000
+
+// File size distributions
+#define GENERATE_DIST_LOG 0
+#define GENERATE_DIST_UNIFORM 1
+
+/**
+ * What to put in a generated image
+ */
+typedef struct {
+  // Image size in bytes
+  u_int64_t size;
+
+  // Everything generated follows from the seed
+  u_int64_t seed;
+
+  // Number of files, and of directories to spread them over
+  u_int32_t files;
+  u_int32_t dirs;
+
+  // Deepest directory nesting (0 = everything in the root)
+  int depth;
+
+  // File size range in bytes, and how sizes are spread over it
+  u_int64_t minSize;
+  u_int64_t maxSize;
+  int distribution;
+
+  // Percentage of files split into several pieces
+  int fragmentPercent;
+
+  // Percentage of files left as deleted directory entries
+  int deletedPercent;
+
+  // Chain map entry width wanted (0 = whatever the cluster size gives)
+  int chainBits;
+
+  // Cluster size in bytes (0 = pick one)
+  u_int32_t clusterSize;
+} GenerateOptions;
+
+/**
+ * Set the default generator options
+ *
+ * @param options Options to fill in
+ */
+void defaultGenerateOptions(GenerateOptions* options);
+
+/**
+ * Parse a generator option of the form name=value: seed, files, dirs,
+ * depth, sizes=<min>[:<max>] (K, M and G suffixes allowed), dist=log or
+ * uniform, fragment=<percent>, deleted=<percent>, chain=16 or 32 and
+ * cluster=<bytes>
+ *
+ * @param options Options to update
+ * @param arg Option to parse
+ * @return 0 on success, -1 if the option is not understood
+ */
+int parseGenerateOption(GenerateOptions* options, char* arg);
+
+/**
+ * Create a FATX image filled with generated directories and files. The
+ * image is built with the normal allocator and directory code, and the
+ * same options (seed included) always give a byte-identical image.
+ *
+ * @param filename Image to create (overwritten if it exists)
+ * @param options What to put in the image
+ * @return 0 on success, -1 on failure
+ */
+int generateImage(char* filename, GenerateOptions* options);
+
+#endif
@@ -0,0 +1,519 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Streaming content hashes for extracted data. CRC32C and SHA-1 use the
+// SSE4.2 and SHA extensions when the CPU has them.
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// CPU features, worked out on first use
+static pthread_once_t cpuChecked = PTHREAD_ONCE_INIT;
+static int haveCrc32Instruction;
+static int haveShaInstructions;
+
+// CRC32C (Castagnoli) lookup table for CPUs without the instruction
+static u_int32_t crcTable[256];
+
+// xxHash64 primes
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+
+/**
+ * Work out which instructions the CPU has, and build the CRC table
+ */
+static void checkCpu(void) {
+#ifdef HASH_X86
+  unsigned int eax, ebx, ecx, edx;
+#endif
+  u_int32_t crc;
+  int i;
+  int j;
+
+  for(i = 0; i < 256; i++) {
+    crc = i;
+    for(j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crcTable[i] = crc;
+  }
+
+#ifdef HASH_X86
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    haveCrc32Instruction = (ecx >> 20) & 1;
+    if (((ecx >> 9) & 1) && ((ecx >> 19) & 1) && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      // SHA extensions, plus the SSSE3 and SSE4.1 the code needs
+      haveShaInstructions = (ebx >> 29) & 1;
+    }
+  }
+#endif
+}
+
+
+/**
+ * Look up a hash algorithm by name (crc32c, xxh64 or sha1)
+ *
+ * @param name Algorithm name
+ * @return HASH_* value, or -1 if unknown
+ */
+int hashAlgorithm(char* name) {
+  if (!strcasecmp(name, "crc32c")) {
+    return HASH_CRC32C;
+  }
+  if (!strcasecmp(name, "xxh64")) {
+    return HASH_XXH64;
+  }
+  if (!strcasecmp(name, "sha1")) {
+    return HASH_SHA1;
+  }
+  return -1;
+}
+
+
+/**
+ * Name of a hash algorithm
+ */
+char* hashName(int algorithm) {
+  switch(algorithm) {
+  case HASH_CRC32C:
+    return "crc32c";
+  case HASH_XXH64:
+    return "xxh64";
+  default:
+    return "sha1";
+  }
+}
+
+
+/**
+ * CRC32C a buffer a byte at a time
+ */
+static u_int32_t crc32cTable(u_int32_t crc, const unsigned char* data, size_t length) {
+  while(length--) {
+    crc = crcTable[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+
+#ifdef HASH_X86
+/**
+ * CRC32C a buffer eight bytes at a time with the SSE4.2 instruction
+ */
+__attribute__((target("sse4.2")))
+static u_int32_t crc32cHardware(u_int32_t crc, const unsigned char* data, size_t length) {
+  u_int64_t crc64;
+  u_int64_t word;
+
+  while((length > 0) && ((unsigned long) data & 7)) {
+    crc = _mm_crc32_u8(crc, *data++);
+    length--;
+  }
+#ifdef __x86_64__
+  crc64 = crc;
+  while(length >= 8) {
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  crc = crc64;
+#endif
+  while(length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+
+static u_int64_t rotl64(u_int64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+
+static u_int32_t rotl32(u_int32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+
+static u_int64_t read64(const unsigned char* p) {
+  u_int64_t v;
+
+  memcpy(&v, p, 8);
+  return v;
+}
+
+
+static u_int32_t read32(const unsigned char* p) {
+  u_int32_t v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+
+static u_int64_t xxhRound(u_int64_t acc, u_int64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+
+static u_int64_t xxhMerge(u_int64_t acc, u_int64_t lane) {
+  acc ^= xxhRound(0, lane);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+/**
+ * Run whole 32 byte stripes through the four xxHash64 lanes
+ *
+ * @return Number of bytes used
+ */
+static size_t xxhStripes(u_int64_t* lanes, const unsigned char* data, size_t length) {
+  u_int64_t v1 = lanes[0];
+  u_int64_t v2 = lanes[1];
+  u_int64_t v3 = lanes[2];
+  u_int64_t v4 = lanes[3];
+  size_t done;
+
+  for(done = 0; done + 32 <= length; done += 32) {
+    v1 = xxhRound(v1, read64(data + done));
+    v2 = xxhRound(v2, read64(data + done + 8));
+    v3 = xxhRound(v3, read64(data + done + 16));
+    v4 = xxhRound(v4, read64(data + done + 24));
+  }
+  lanes[0] = v1;
+  lanes[1] = v2;
+  lanes[2] = v3;
+  lanes[3] = v4;
+  return done;
+}
+
+
+/**
+ * Run whole 64 byte blocks through SHA-1
+ */
+static void sha1Blocks(u_int32_t* h, const unsigned char* data, size_t blocks) {
+  u_int32_t w[80];
+  u_int32_t a, b, c, d, e, f, k, t;
+  int i;
+
+  while(blocks--) {
+    for(i = 0; i < 16; i++) {
+      w[i] = ((u_int32_t) data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+    }
+    for(; i < 80; i++) {
+      w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+    for(i = 0; i < 80; i++) {
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      t = rotl32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl32(b, 30);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    data += 64;
+  }
+}
+
+
+#ifdef HASH_X86
+/**
+ * Four SHA-1 rounds with the SHA extensions. Group g uses message words
+ * 4g to 4g+3, computing them from earlier words from group 4 on.
+ */
+#define SHA1_ROUNDS(g)                                                          \
+  if ((g) >= 4) {                                                               \
+    msg[(g) % 4] = _mm_sha1msg2_epu32(                                          \
+      _mm_xor_si128(_mm_sha1msg1_epu32(msg[(g) % 4], msg[((g) + 1) % 4]),       \
+                    msg[((g) + 2) % 4]),                                        \
+      msg[((g) + 3) % 4]);                                                      \
+  }                                                                             \
+  e = ((g) == 0) ? _mm_add_epi32(e, msg[0]) : _mm_sha1nexte_epu32(previous, msg[(g) % 4]); \
+  previous = abcd;                                                              \
+  abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5);
+
+/**
+ * Run whole 64 byte blocks through SHA-1 with the SHA extensions
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha1BlocksHardware(u_int32_t* h, const unsigned char* data, size_t blocks) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcdSaved, e, eSaved, previous;
+  __m128i msg[4];
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) h), 0x1b);
+  e = _mm_set_epi32(h[4], 0, 0, 0);
+
+  while(blocks--) {
+    abcdSaved = abcd;
+    eSaved = e;
+    msg[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) data), byteSwap);
+    msg[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), byteSwap);
+    msg[2] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), byteSwap);
+    msg[3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), byteSwap);
+
+    SHA1_ROUNDS(0)  SHA1_ROUNDS(1)  SHA1_ROUNDS(2)  SHA1_ROUNDS(3)
+    SHA1_ROUNDS(4)  SHA1_ROUNDS(5)  SHA1_ROUNDS(6)  SHA1_ROUNDS(7)
+    SHA1_ROUNDS(8)  SHA1_ROUNDS(9)  SHA1_ROUNDS(10) SHA1_ROUNDS(11)
+    SHA1_ROUNDS(12) SHA1_ROUNDS(13) SHA1_ROUNDS(14) SHA1_ROUNDS(15)
+    SHA1_ROUNDS(16) SHA1_ROUNDS(17) SHA1_ROUNDS(18) SHA1_ROUNDS(19)
+
+    e = _mm_sha1nexte_epu32(previous, eSaved);
+    abcd = _mm_add_epi32(abcd, abcdSaved);
+    data += 64;
+  }
+
+  _mm_storeu_si128((__m128i*) h, _mm_shuffle_epi32(abcd, 0x1b));
+  h[4] = _mm_extract_epi32(e, 3);
+}
+#endif
+
+
+/**
+ * Run whole 64 byte blocks through SHA-1 the fastest way available
+ */
+static void sha1Compress(u_int32_t* h, const unsigned char* data, size_t blocks) {
+#ifdef HASH_X86
+  if (haveShaInstructions) {
+    sha1BlocksHardware(h, data, blocks);
+    return;
+  }
+#endif
+  sha1Blocks(h, data, blocks);
+}
+
+
+/**
+ * Start a hash
+ *
+ * @param state Hash state
+ * @param algorithm HASH_* value
+ */
+void hashInit(HashState* state, int algorithm) {
+  pthread_once(&cpuChecked, checkCpu);
+  memset(state, 0, sizeof(HashState));
+  state->algorithm = algorithm;
+  switch(algorithm) {
+  case HASH_CRC32C:
+    state->u.crc = 0xffffffff;
+    break;
+  case HASH_XXH64:
+    state->u.xxh.lanes[0] = PRIME64_1 + PRIME64_2;
+    state->u.xxh.lanes[1] = PRIME64_2;
+    state->u.xxh.lanes[2] = 0;
+    state->u.xxh.lanes[3] = -PRIME64_1;
+    break;
+  default:
+    state->u.sha1.h[0] = 0x67452301;
+    state->u.sha1.h[1] = 0xefcdab89;
+    state->u.sha1.h[2] = 0x98badcfe;
+    state->u.sha1.h[3] = 0x10325476;
+    state->u.sha1.h[4] = 0xc3d2e1f0;
+    break;
+  }
+}
+
+
+/**
+ * Add data to a hash
+ *
+ * @param state Hash state
+ * @param data Data to add
+ * @param length Number of bytes
+ */
+void hashUpdate(HashState* state, const void* data, size_t length) {
+  const unsigned char *bytes = (const unsigned char*) data;
+  size_t n;
+
+  switch(state->algorithm) {
+  case HASH_CRC32C:
+#ifdef HASH_X86
+    if (haveCrc32Instruction) {
+      state->u.crc = crc32cHardware(state->u.crc, bytes, length);
+      break;
+    }
+#endif
+    state->u.crc = crc32cTable(state->u.crc, bytes, length);
+    break;
+
+  case HASH_XXH64:
+    state->u.xxh.total += length;
+    // top up a part filled stripe first
+    if (state->u.xxh.used > 0) {
+      n = 32 - state->u.xxh.used;
+      if (n > length) {
+        n = length;
+      }
+      memcpy(state->u.xxh.buffer + state->u.xxh.used, bytes, n);
+      state->u.xxh.used += n;
+      bytes += n;
+      length -= n;
+      if (state->u.xxh.used < 32) {
+        break;
+      }
+      xxhStripes(state->u.xxh.lanes, state->u.xxh.buffer, 32);
+      state->u.xxh.used = 0;
+    }
+    n = xxhStripes(state->u.xxh.lanes, bytes, length);
+    memcpy(state->u.xxh.buffer, bytes + n, length - n);
+    state->u.xxh.used = length - n;
+    break;
+
+  default:
+    state->u.sha1.total += length;
+    if (state->u.sha1.used > 0) {
+      n = 64 - state->u.sha1.used;
+      if (n > length) {
+        n = length;
+      }
+      memcpy(state->u.sha1.buffer + state->u.sha1.used, bytes, n);
+      state->u.sha1.used += n;
+      bytes += n;
+      length -= n;
+      if (state->u.sha1.used < 64) {
+        break;
+      }
+      sha1Compress(state->u.sha1.h, state->u.sha1.buffer, 1);
+      state->u.sha1.used = 0;
+    }
+    sha1Compress(state->u.sha1.h, bytes, length / 64);
+    n = length - (length % 64);
+    memcpy(state->u.sha1.buffer, bytes + n, length - n);
+    state->u.sha1.used = length - n;
+    break;
+  }
+}
+
+
+/**
+ * Finish a hash
+ *
+ * @param state Hash state
+ * @param hex Where to put the hash as a hex string (HASH_HEXSIZE bytes)
+ */
+void hashFinal(HashState* state, char* hex) {
+  unsigned char *p;
+  u_int64_t h;
+  u_int64_t bits;
+  int remaining;
+  int i;
+
+  switch(state->algorithm) {
+  case HASH_CRC32C:
+    sprintf(hex, "%08x", ~state->u.crc);
+    break;
+
+  case HASH_XXH64:
+    if (state->u.xxh.total >= 32) {
+      h = rotl64(state->u.xxh.lanes[0], 1) + rotl64(state->u.xxh.lanes[1], 7) +
+        rotl64(state->u.xxh.lanes[2], 12) + rotl64(state->u.xxh.lanes[3], 18);
+      for(i = 0; i < 4; i++) {
+        h = xxhMerge(h, state->u.xxh.lanes[i]);
+      }
+    } else {
+      h = PRIME64_5;
+    }
+    h += state->u.xxh.total;
+
+    p = state->u.xxh.buffer;
+    remaining = state->u.xxh.used;
+    for(; remaining >= 8; remaining -= 8, p += 8) {
+      h ^= xxhRound(0, read64(p));
+      h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (remaining >= 4) {
+      h ^= (u_int64_t) read32(p) * PRIME64_1;
+      h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+      remaining -= 4;
+      p += 4;
+    }
+    for(; remaining > 0; remaining--, p++) {
+      h ^= *p * PRIME64_5;
+      h = rotl64(h, 11) * PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    sprintf(hex, "%016llx", (unsigned long long) h);
+    break;
+
+  default:
+    bits = state->u.sha1.total * 8;
+    p = state->u.sha1.buffer;
+    p[state->u.sha1.used++] = 0x80;
+    if (state->u.sha1.used > 56) {
+      memset(p + state->u.sha1.used, 0, 64 - state->u.sha1.used);
+      sha1Compress(state->u.sha1.h, p, 1);
+      state->u.sha1.used = 0;
+    }
+    memset(p + state->u.sha1.used, 0, 56 - state->u.sha1.used);
+    for(i = 0; i < 8; i++) {
+      p[56 + i] = bits >> (56 - i * 8);
+    }
+    sha1Compress(state->u.sha1.h, p, 1);
+    for(i = 0; i < 5; i++) {
+      sprintf(hex + i * 8, "%08x", state->u.sha1.h[i]);
+    }
+    break;
+  }
+}
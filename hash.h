@@ -0,0 +1,97 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Streaming content hashes for extracted data
+
+#ifndef HASH_H
+#define HASH_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Hash algorithms
+#define HASH_CRC32C 0
+#define HASH_XXH64 1
+#define HASH_SHA1 2
+
+// Room needed for a hash as a hex string (the longest is SHA-1)
+#define HASH_HEXSIZE 41
+
+/**
+ * State of a hash being computed
+ */
+typedef struct {
+  int algorithm;
+  union {
+    u_int32_t crc;
+    struct {
+      u_int64_t lanes[4];
+      u_int64_t total;
+      unsigned char buffer[32];
+      int used;
+    } xxh;
+    struct {
+      u_int32_t h[5];
+      u_int64_t total;
+      unsigned char buffer[64];
+      int used;
+    } sha1;
+  } u;
+} HashState;
+
+/**
+ * Look up a hash algorithm by name (crc32c, xxh64 or sha1)
+ *
+ * @param name Algorithm name
+ * @return HASH_* value, or -1 if unknown
+ */
+int hashAlgorithm(char* name);
+
+/**
+ * Name of a hash algorithm
+ */
+char* hashName(int algorithm);
+
+/**
+ * Start a hash
+ *
+ * @param state Hash state
+ * @param algorithm HASH_* value
+ */
+void hashInit(HashState* state, int algorithm);
+
+/**
+ * Add data to a hash
+ *
+ * @param state Hash state
+ * @param data Data to add
+ * @param length Number of bytes
+ */
+void hashUpdate(HashState* state, const void* data, size_t length);
+
+/**
+ * Finish a hash
+ *
+ * @param state Hash state
+ * @param hex Where to put the hash as a hex string (HASH_HEXSIZE bytes)
+ */
+void hashFinal(HashState* state, char* hex);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Copying host files into FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "import.h"
+#include "fatxdir.h"
+#include "fatxcore.h"
+#include "alloc.h"
+#include "dir.h"
+#include "util.h"
+
+// State shared by everything imported in one go
+typedef struct {
+  FATXPartition *partition;
+  ClusterBitmap *bitmap;
+  FATXDirCache *dirCache;
+
+  // Data staging buffer (a multiple of the cluster size)
+  unsigned char *buffer;
+  u_int64_t bufferSize;
+
+  int failures;
+  u_int32_t files;
+  u_int64_t bytes;
+} ImportContext;
+
+
+/**
+ * Read until a buffer is full or the end of the file. Network and FUSE
+ * filesystems may return less than asked for well before the end.
+ *
+ * @param fd File to read
+ * @param buffer Where to store the data
+ * @param length Number of bytes wanted
+ * @return Number of bytes read (less than length only at the end of the
+ *         file), or -1 on failure
+ */
+static ssize_t readFull(int fd, unsigned char* buffer, size_t length) {
+  size_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = read(fd, buffer + done, length - done);
+    if ((n == -1) && (errno == EINTR)) {
+      n = 0;
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+  return done;
+}
+
+
+/**
+ * Chain runs of clusters together, in order
+ *
+ * @param partition FATX partition
+ * @param runs Runs making up the chain
+ * @param runCount Number of runs
+ */
+static void linkRuns(FATXPartition* partition, ClusterRun* runs, int runCount) {
+  u_int32_t next;
+  u_int32_t i;
+  int r;
+
+  for(r = 0; r < runCount; r++) {
+    for(i = 0; i < runs[r].length; i++) {
+      if (i + 1 < runs[r].length) {
+        next = runs[r].start + i + 1;
+      } else if (r + 1 < runCount) {
+        next = runs[r + 1].start;
+      } else {
+        next = chainEndMarker(partition);
+      }
+      setChainEntry(partition, runs[r].start + i, next);
+    }
+  }
+}
+
+
+/**
+ * Give back clusters allocated for something which could not be added,
+ * so the next commit does not write a chain nothing refers to
+ *
+ * @param ctx Import context
+ * @param firstCluster First cluster of the chain to release
+ */
+static void releaseClusters(ImportContext* ctx, u_int32_t firstCluster) {
+  if (releaseChain(ctx->bitmap, ctx->partition, firstCluster) == -1) {
+    error("Out of memory");
+  }
+}
+
+
+/**
+ * Find or create a sub-directory
+ *
+ * @param ctx Import context
+ * @param dirCluster Parent directory
+ * @param name Name of the sub-directory
+ * @param when Modification time to give a new directory
+ * @return First cluster of the sub-directory, or 0 on failure
+ */
+static u_int32_t makeDirectory(ImportContext* ctx, u_int32_t dirCluster, char* name, time_t when) {
+  FATXDirEntry entry;
+  ClusterRun *run;
+  int runCount;
+  int found;
+
+  found = findDirEntry(ctx->dirCache, dirCluster, name, &entry, NULL);
+  if (found < 0) {
+    fprintf(stderr, "import: looking for %s: %s\n", name, fatxStatusString(found));
+    return 0;
+  }
+  if (found) {
+    if (!(entry.attributes & FATX_FILEATTR_DIRECTORY)) {
+      fprintf(stderr, "import: %s exists and is not a directory\n", name);
+      return 0;
+    }
+    return entry.firstCluster;
+  }
+
+  if (makeDirEntry(&entry, name, FATX_FILEATTR_DIRECTORY, 0, 0, when) == -1) {
+    fprintf(stderr, "import: %s: name not valid in FATX\n", name);
+    return 0;
+  }
+  run = allocateClusters(ctx->bitmap, 1, &runCount);
+  if (run == NULL) {
+    fprintf(stderr, "import: partition full\n");
+    return 0;
+  }
+  entry.firstCluster = run->start;
+  free(run);
+
+  newDirCluster(ctx->dirCache, entry.firstCluster);
+  setChainEntry(ctx->partition, entry.firstCluster, chainEndMarker(ctx->partition));
+  if (addDirEntry(ctx->dirCache, ctx->bitmap, dirCluster, &entry, NULL) == -1) {
+    fprintf(stderr, "import: partition full\n");
+    releaseClusters(ctx, entry.firstCluster);
+    return 0;
+  }
+  return entry.firstCluster;
+}
+
+
+/**
+ * Find a FATX directory by path, creating any missing components
+ *
+ * @param ctx Import context
+ * @param path Path from the root, using / or \ separators
+ * @return First cluster of the directory, or 0 on failure
+ */
+static u_int32_t resolveDirectory(ImportContext* ctx, char* path) {
+  u_int32_t dirCluster = FATX_ROOT_FAT_CLUSTER;
+  char component[FATX_FILENAME_MAX + 1];
+  char *end;
+  size_t length;
+
+  while(*path != 0) {
+    while((*path == '/') || (*path == '\\')) {
+      path++;
+    }
+    if (*path == 0) {
+      break;
+    }
+    end = strpbrk(path, "/\\");
+    length = (end == NULL) ? strlen(path) : end - path;
+    if (length > FATX_FILENAME_MAX) {
+      fprintf(stderr, "import: path component too long in %s\n", path);
+      return 0;
+    }
+    memcpy(component, path, length);
+    component[length] = 0;
+
+    dirCluster = makeDirectory(ctx, dirCluster, component, time(NULL));
+    if (dirCluster == 0) {
+      return 0;
+    }
+    path += length;
+  }
+  return dirCluster;
+}
+
+
+/**
+ * Copy one host file into a directory. The file's clusters are allocated
+ * up front, then its data is streamed into each run with large writes.
+ *
+ * @param ctx Import context
+ * @param dirCluster Directory to add the file to
+ * @param hostDir Descriptor host paths are relative to (or AT_FDCWD)
+ * @param file Host file details
+ * @return 0 on success, -1 on failure
+ */
+static int importFile(ImportContext* ctx, u_int32_t dirCluster, int hostDir, HostEntry* file) {
+  u_int32_t clusterSize = ctx->partition->clusterSize;
+  u_int64_t runBytes;
+  u_int64_t chunk;
+  u_int64_t done;
+  u_int64_t remaining;
+  u_int32_t clusters;
+  FATXDirEntry entry;
+  ClusterRun *runs = NULL;
+  int runCount = 0;
+  ssize_t n;
+  int fd;
+  int r;
+
+  r = findDirEntry(ctx->dirCache, dirCluster, file->name, NULL, NULL);
+  if (r < 0) {
+    fprintf(stderr, "import: looking for %s: %s\n", file->path, fatxStatusString(r));
+    return -1;
+  }
+  if (r) {
+    fprintf(stderr, "import: %s already exists, skipped\n", file->path);
+    return -1;
+  }
+  if (file->size > 0xffffffffLL) {
+    fprintf(stderr, "import: %s is too big for FATX\n", file->path);
+    return -1;
+  }
+  if (makeDirEntry(&entry, file->name, FATX_FILEATTR_ARCHIVE | ((file->mode & S_IWUSR) ? 0 : FATX_FILEATTR_READONLY),
+                   0, file->size, file->mtime) == -1) {
+    fprintf(stderr, "import: %s: name not valid in FATX\n", file->path);
+    return -1;
+  }
+
+  fd = openat(hostDir, file->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "import: %s: %s\n", file->path, strerror(errno));
+    return -1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  clusters = (file->size + clusterSize - 1) / clusterSize;
+  if (clusters > 0) {
+    runs = allocateClusters(ctx->bitmap, clusters, &runCount);
+    if (runs == NULL) {
+      fprintf(stderr, "import: partition full, cannot import %s\n", file->path);
+      close(fd);
+      return -1;
+    }
+    entry.firstCluster = runs[0].start;
+  }
+
+  // stream the data into each run
+  remaining = file->size;
+  for(r = 0; r < runCount; r++) {
+    runBytes = (u_int64_t) runs[r].length * clusterSize;
+    for(done = 0; done < runBytes; done += chunk) {
+      chunk = (runBytes - done < ctx->bufferSize) ? runBytes - done : ctx->bufferSize;
+      n = readFull(fd, ctx->buffer, (remaining < chunk) ? remaining : chunk);
+      if (n < 0) {
+        fprintf(stderr, "import: %s: %s\n", file->path, strerror(errno));
+        goto fail;
+      }
+      remaining -= n;
+
+      // zero the slack of the last cluster (or the clusters of a file
+      // which shrank while we were reading it)
+      memset(ctx->buffer + n, 0, chunk - n);
+      if (writeClusters(ctx->partition, runs[r].start + done / clusterSize, ctx->buffer, chunk) == -1) {
+        fprintf(stderr, "import: writing %s: %s\n", file->path, strerror(errno));
+        goto fail;
+      }
+    }
+  }
+  linkRuns(ctx->partition, runs, runCount);
+  close(fd);
+  free(runs);
+
+  if (addDirEntry(ctx->dirCache, ctx->bitmap, dirCluster, &entry, NULL) == -1) {
+    fprintf(stderr, "import: partition full, cannot import %s\n", file->path);
+    if (runCount > 0) {
+      releaseClusters(ctx, entry.firstCluster);
+    }
+    return -1;
+  }
+  ctx->files++;
+  ctx->bytes += file->size;
+
+  // commit in batches, so a long import is not lost to a crash near the end
+  if (((ctx->files % IMPORT_COMMIT_FILES) == 0) && (commitPartition(ctx->dirCache, ctx->bitmap) == -1)) {
+    fprintf(stderr, "import: error updating partition: %s\n", strerror(errno));
+    ctx->failures++;
+  }
+  return 0;
+
+ fail:
+  // chain the runs so they can be released as one
+  linkRuns(ctx->partition, runs, runCount);
+  releaseClusters(ctx, runs[0].start);
+  close(fd);
+  free(runs);
+  return -1;
+}
+
+
+/**
+ * Get the last component of a host path
+ */
+static char* baseName(char* path) {
+  char *slash;
+
+  while(((slash = strrchr(path, '/')) != NULL) && (slash[1] == 0) && (slash != path)) {
+    *slash = 0;
+  }
+  return (slash == NULL) ? path : slash + 1;
+}
+
+
+/**
+ * Import the contents of a host directory
+ *
+ * @param ctx Import context
+ * @param dirCluster FATX directory matching hostDir
+ * @param hostDir Host directory
+ */
+static void importTree(ImportContext* ctx, u_int32_t dirCluster, char* hostDir) {
+  HostTree *tree;
+  HostEntry *item;
+  u_int32_t *clusters;
+  u_int32_t parentCluster;
+  int i;
+
+  tree = scanHostTree(hostDir, 0);
+  if (tree == NULL) {
+    ctx->failures++;
+    return;
+  }
+  ctx->failures += tree->errors;
+
+  // FATX directory made for each host directory entry
+  clusters = (u_int32_t*) calloc(tree->count + 1, sizeof(u_int32_t));
+  if (clusters == NULL) {
+    error("Out of memory");
+  }
+
+  // directories always come before their contents
+  for(i = 0; i < tree->count; i++) {
+    item = &tree->entries[i];
+    parentCluster = (item->parent == -1) ? dirCluster : clusters[item->parent];
+    if (parentCluster == 0) {
+      // parent could not be created
+      ctx->failures++;
+      continue;
+    }
+
+    if (S_ISDIR(item->mode)) {
+      clusters[i] = makeDirectory(ctx, parentCluster, item->name, item->mtime);
+      if (clusters[i] == 0) {
+        ctx->failures++;
+      }
+    } else if (S_ISREG(item->mode)) {
+      if (importFile(ctx, parentCluster, tree->rootFd, item) == -1) {
+        ctx->failures++;
+      }
+    }
+  }
+
+  free(clusters);
+  freeHostTree(tree);
+}
+
+
+/**
+ * Copy a host file or directory tree into a FATX partition. Each file is
+ * given a single run of clusters whenever the free space allows.
+ *
+ * @param partition FATX partition (source file opened for writing)
+ * @param hostPath Host file or directory to import
+ * @param fatxDir FATX directory to import into (created if missing)
+ * @return 0 on success, -1 if anything could not be imported
+ */
+int importPath(FATXPartition* partition, char* hostPath, char* fatxDir) {
+  ImportContext ctx;
+  u_int32_t dirCluster;
+  HostEntry file;
+  struct stat st;
+
+  memset(&ctx, 0, sizeof(ImportContext));
+  ctx.partition = partition;
+  ctx.bufferSize = IMPORT_CHUNKSIZE - (IMPORT_CHUNKSIZE % partition->clusterSize);
+  ctx.buffer = (unsigned char*) malloc(ctx.bufferSize);
+  ctx.bitmap = loadClusterBitmap(partition);
+  ctx.dirCache = createDirCache(partition);
+  if ((ctx.buffer == NULL) || (ctx.bitmap == NULL) || (ctx.dirCache == NULL)) {
+    error("Out of memory");
+  }
+
+  if (stat(hostPath, &st) == -1) {
+    fprintf(stderr, "import: %s: %s\n", hostPath, strerror(errno));
+    ctx.failures++;
+  } else if ((dirCluster = resolveDirectory(&ctx, fatxDir)) == 0) {
+    ctx.failures++;
+  } else if (S_ISDIR(st.st_mode)) {
+    dirCluster = makeDirectory(&ctx, dirCluster, baseName(hostPath), st.st_mtime);
+    if (dirCluster == 0) {
+      ctx.failures++;
+    } else {
+      importTree(&ctx, dirCluster, hostPath);
+    }
+  } else {
+    file.path = hostPath;
+    file.mode = st.st_mode;
+    file.size = st.st_size;
+    file.mtime = st.st_mtime;
+    file.name = baseName(hostPath);
+    if (importFile(&ctx, dirCluster, AT_FDCWD, &file) == -1) {
+      ctx.failures++;
+    }
+  }
+
+  if (commitPartition(ctx.dirCache, ctx.bitmap) == -1) {
+    fprintf(stderr, "import: error updating partition: %s\n", strerror(errno));
+    ctx.failures++;
+  }
+
+  printf("import : %u files, %llu bytes, %d failed\n", ctx.files, (unsigned long long) ctx.bytes, ctx.failures);
+
+  free(ctx.buffer);
+  freeClusterBitmap(ctx.bitmap);
+  freeDirCache(ctx.dirCache);
+  return ctx.failures ? -1 : 0;
+}
@@ -0,0 +1,45 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Copying host files into FATX partitions
+
+#ifndef IMPORT_H
+#define IMPORT_H 1
+
+#include "fatx.h"
+
+// Largest single data write made while importing
+#define IMPORT_CHUNKSIZE (8 * 1024 * 1024)
+
+// Files imported between commits of the chain map and directories
+#define IMPORT_COMMIT_FILES 4096
+
+/**
+ * Copy a host file or directory tree into a FATX partition. Each file is
+ * given a single run of clusters whenever the free space allows.
+ *
+ * @param partition FATX partition (source file opened for writing)
+ * @param hostPath Host file or directory to import
+ * @param fatxDir FATX directory to import into (created if missing)
+ * @return 0 on success, -1 if anything could not be imported
+ */
+int importPath(FATXPartition* partition, char* hostPath, char* fatxDir);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// libfatx: read access to FATX partitions for embedding in other programs,
+// built on the same core as the utilities (see fatxcore.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "libfatx.h"
+#include "backend.h"
+#include "fatxcore.h"
+#include "util.h"
+
+// An open partition; nothing in it changes until it is closed
+struct FATXHandle {
+  FATXAllocator allocator;
+  FILE *file;
+  FATXBackend *backend;
+  FATXPartitionInfo info;
+  FATXPartition partition;
+};
+
+// Listing part of a directory
+typedef struct {
+  u_int32_t skip;
+  FATXFileInfo *entries;
+  u_int32_t capacity;
+  u_int32_t count;
+} ListContext;
+
+
+static void* defaultAllocate(void* context, size_t size) {
+  return malloc(size);
+}
+
+static void defaultRelease(void* context, void* memory) {
+  free(memory);
+}
+
+static void* allocate(FATXHandle* handle, size_t size) {
+  return handle->allocator.allocate(handle->allocator.context, size);
+}
+
+static void release(FATXHandle* handle, void* memory) {
+  if (memory != NULL) {
+    handle->allocator.release(handle->allocator.context, memory);
+  }
+}
+
+/**
+ * Copy a directory entry out
+ */
+static void fillFileInfo(FATXDirEntry* entry, FATXFileInfo* info) {
+  size_t length = (entry->filenameSize <= FATX_NAME_MAX) ? entry->filenameSize : FATX_NAME_MAX;
+
+  memset(info, 0, sizeof(FATXFileInfo));
+  memcpy(info->name, entry->filename, length);
+  info->attributes = entry->attributes;
+  info->firstCluster = entry->firstCluster;
+  info->size = (entry->attributes & FATX_FILEATTR_DIRECTORY) ? 0 : entry->fileSize;
+  info->modified = loadDosTime(entry->modDate, entry->modTime);
+  info->created = loadDosTime(entry->createDate, entry->createTime);
+  info->accessed = loadDosTime(entry->laccessDate, entry->laccessTime);
+}
+
+static int listVisitor(void* context, FATXDirEntry* entry) {
+  ListContext *list = (ListContext*) context;
+
+  if (list->skip > 0) {
+    list->skip--;
+    return 0;
+  }
+  fillFileInfo(entry, &list->entries[list->count++]);
+  return list->count == list->capacity;
+}
+
+/**
+ * Find the entry for a path, with a buffer from the allocator
+ *
+ * @return Status
+ */
+static int lookup(FATXHandle* handle, const char* path, FATXDirEntry* entry) {
+  unsigned char *buffer;
+  int status;
+
+  buffer = (unsigned char*) allocate(handle, handle->info.clusterSize);
+  if (buffer == NULL) {
+    return FATX_ERR_NOMEM;
+  }
+  status = fatxFindPath(&handle->partition, path, entry, buffer);
+  release(handle, buffer);
+  return status;
+}
+
+
+int fatxOpen(const char* filename, u_int64_t offset, u_int64_t size,
+             const FATXAllocator* allocator, FATXHandle** handle) {
+  FATXAllocator defaults = { defaultAllocate, defaultRelease, NULL };
+  u_int32_t clusterSize;
+  void *chainMap;
+  FATXHandle *h;
+  int status;
+
+  if ((filename == NULL) || (handle == NULL) ||
+      ((allocator != NULL) && ((allocator->allocate == NULL) || (allocator->release == NULL)))) {
+    return FATX_ERR_INVALID;
+  }
+  if (allocator == NULL) {
+    allocator = &defaults;
+  }
+  *handle = NULL;
+
+  h = (FATXHandle*) allocator->allocate(allocator->context, sizeof(FATXHandle));
+  if (h == NULL) {
+    return FATX_ERR_NOMEM;
+  }
+  memset(h, 0, sizeof(FATXHandle));
+  h->allocator = *allocator;
+
+  // open the image
+  h->file = fopen(filename, "r");
+  if (h->file == NULL) {
+    status = (errno == ENOENT) ? FATX_ERR_NOTFOUND : FATX_ERR_IO;
+    goto fail;
+  }
+  h->backend = openBackend(h->file, (char*) filename);
+  if (h->backend == NULL) {
+    status = (errno == ENOMEM) ? FATX_ERR_NOMEM : FATX_ERR_FORMAT;
+    goto fail;
+  }
+  if ((offset >= h->backend->size) || (size > h->backend->size - offset)) {
+    status = FATX_ERR_INVALID;
+    goto fail;
+  }
+  if (size == 0) {
+    size = h->backend->size - offset;
+  }
+
+  // check the header and load the chain map
+  status = fatxReadHeader(h->backend, offset, &clusterSize);
+  if (status == FATX_OK) {
+    status = fatxSetGeometry(&h->partition, h->backend, offset, size, clusterSize);
+  }
+  if (status != FATX_OK) {
+    goto fail;
+  }
+  chainMap = allocate(h, h->partition.chainTableSize);
+  if (chainMap == NULL) {
+    status = FATX_ERR_NOMEM;
+    goto fail;
+  }
+  status = fatxLoadChainMap(&h->partition, chainMap);
+  if (status != FATX_OK) {
+    release(h, chainMap);
+    goto fail;
+  }
+
+  h->info.offset = offset;
+  h->info.size = size;
+  h->info.clusterSize = h->partition.clusterSize;
+  h->info.clusterCount = h->partition.clusterCount;
+  h->info.chainMapEntrySize = h->partition.chainMapEntrySize;
+  *handle = h;
+  return FATX_OK;
+
+ fail:
+  fatxClose(h);
+  return status;
+}
+
+
+int fatxClose(FATXHandle* handle) {
+  if (handle == NULL) {
+    return FATX_OK;
+  }
+  release(handle, handle->partition.clusterChainMap.words);
+  if (handle->backend != NULL) {
+    closeBackend(handle->backend);
+  }
+  if (handle->file != NULL) {
+    fclose(handle->file);
+  }
+  handle->allocator.release(handle->allocator.context, handle);
+  return FATX_OK;
+}
+
+
+int fatxGetInfo(FATXHandle* handle, FATXPartitionInfo* info) {
+  if ((handle == NULL) || (info == NULL)) {
+    return FATX_ERR_INVALID;
+  }
+  *info = handle->info;
+  return FATX_OK;
+}
+
+
+int fatxStat(FATXHandle* handle, const char* path, FATXFileInfo* info) {
+  FATXDirEntry entry;
+  int status;
+
+  if ((handle == NULL) || (path == NULL) || (info == NULL)) {
+    return FATX_ERR_INVALID;
+  }
+  status = lookup(handle, path, &entry);
+  if (status == FATX_OK) {
+    fillFileInfo(&entry, info);
+  }
+  return status;
+}
+
+
+int fatxReadDir(FATXHandle* handle, const char* path, u_int32_t start,
+                FATXFileInfo* entries, u_int32_t capacity, u_int32_t* count) {
+  FATXDirEntry entry;
+  ListContext list;
+  unsigned char *buffer;
+  int status;
+
+  if ((handle == NULL) || (path == NULL) || (count == NULL) || ((entries == NULL) && (capacity > 0))) {
+    return FATX_ERR_INVALID;
+  }
+  *count = 0;
+  if (capacity == 0) {
+    return FATX_OK;
+  }
+
+  buffer = (unsigned char*) allocate(handle, handle->info.clusterSize);
+  if (buffer == NULL) {
+    return FATX_ERR_NOMEM;
+  }
+  status = fatxFindPath(&handle->partition, path, &entry, buffer);
+  if ((status == FATX_OK) && !(entry.attributes & FATX_FILEATTR_DIRECTORY)) {
+    status = FATX_ERR_NOTDIR;
+  }
+  if (status == FATX_OK) {
+    list.skip = start;
+    list.entries = entries;
+    list.capacity = capacity;
+    list.count = 0;
+    status = fatxWalkDirectory(&handle->partition, entry.firstCluster, buffer, listVisitor, &list);
+    if (status == 1) {
+      status = FATX_OK;
+    }
+    *count = list.count;
+  }
+  release(handle, buffer);
+  return status;
+}
+
+
+int fatxReadFile(FATXHandle* handle, const char* path, u_int64_t offset,
+                 void* buffer, size_t length, size_t* done) {
+  FATXDirEntry entry;
+  int status;
+
+  if ((handle == NULL) || (path == NULL) || (done == NULL) || ((buffer == NULL) && (length > 0))) {
+    return FATX_ERR_INVALID;
+  }
+  *done = 0;
+
+  status = lookup(handle, path, &entry);
+  if (status != FATX_OK) {
+    return status;
+  }
+  if (entry.attributes & FATX_FILEATTR_DIRECTORY) {
+    return FATX_ERR_ISDIR;
+  }
+  return fatxReadChain(&handle->partition, entry.firstCluster, entry.fileSize, offset,
+                       (unsigned char*) buffer, length, done);
+}
@@ -0,0 +1,202 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// libfatx: read access to FATX partitions for embedding in other programs
+//
+// Every function returns a status code (FATX_OK or a negative FATX_ERR_
+// value) and never prints or exits. A handle does not change once
+// opened, so any number of threads may use one at the same time; only
+// fatxClose() must not race with other calls on the handle. Memory for
+// the handle, its chain map and the working buffers of each call comes
+// from the caller's allocator when one is given.
+
+#ifndef LIBFATX_H
+#define LIBFATX_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Functions exported from the shared library
+#define LIBFATX_API __attribute__((visibility("default")))
+
+// Status codes
+#define FATX_OK 0
+#define FATX_ERR_INVALID -1
+#define FATX_ERR_NOMEM -2
+#define FATX_ERR_IO -3
+#define FATX_ERR_FORMAT -4
+#define FATX_ERR_NOTFOUND -5
+#define FATX_ERR_NOTDIR -6
+#define FATX_ERR_ISDIR -7
+#define FATX_ERR_CORRUPT -8
+
+// Longest name of a file, not counting the terminating zero
+#define FATX_NAME_MAX 42
+
+// Attribute bits of FATXFileInfo
+#define FATX_ATTR_READONLY 0x01
+#define FATX_ATTR_HIDDEN 0x02
+#define FATX_ATTR_SYSTEM 0x04
+#define FATX_ATTR_DIRECTORY 0x10
+#define FATX_ATTR_ARCHIVE 0x20
+
+/**
+ * An open partition (opaque)
+ */
+typedef struct FATXHandle FATXHandle;
+
+/**
+ * Caller supplied memory allocator
+ */
+typedef struct {
+  /**
+   * Allocate memory
+   *
+   * @param context The allocator's context
+   * @param size Bytes wanted
+   * @return The memory, or NULL on failure
+   */
+  void* (*allocate)(void* context, size_t size);
+
+  /**
+   * Free memory from allocate
+   *
+   * @param context The allocator's context
+   * @param memory Memory to free
+   */
+  void (*release)(void* context, void* memory);
+
+  void *context;
+} FATXAllocator;
+
+/**
+ * Layout of an open partition
+ */
+typedef struct {
+  u_int64_t offset;
+  u_int64_t size;
+  u_int32_t clusterSize;
+  u_int32_t clusterCount;
+
+  // 2 or 4 byte chain map entries
+  u_int32_t chainMapEntrySize;
+} FATXPartitionInfo;
+
+/**
+ * A file or directory
+ */
+typedef struct {
+  char name[FATX_NAME_MAX + 1];
+  u_int32_t attributes;
+  u_int32_t firstCluster;
+  u_int64_t size;
+  time_t modified;
+  time_t created;
+  time_t accessed;
+} FATXFileInfo;
+
+/**
+ * Open a FATX partition in an image or device. Compressed and split
+ * images are read as the disk they hold.
+ *
+ * @param filename Image or device
+ * @param offset Where the partition starts in the image
+ * @param size Size of the partition (0 = to the end of the image)
+ * @param allocator Allocator to use (NULL = malloc)
+ * @param handle Set to the new handle
+ * @return Status
+ */
+LIBFATX_API int fatxOpen(const char* filename, u_int64_t offset, u_int64_t size,
+                         const FATXAllocator* allocator, FATXHandle** handle);
+
+/**
+ * Close a partition and free everything it holds
+ *
+ * @param handle Handle to close (NULL is ignored)
+ * @return Status
+ */
+LIBFATX_API int fatxClose(FATXHandle* handle);
+
+/**
+ * Get the layout of a partition
+ *
+ * @param handle Partition
+ * @param info Where to put the layout
+ * @return Status
+ */
+LIBFATX_API int fatxGetInfo(FATXHandle* handle, FATXPartitionInfo* info);
+
+/**
+ * Look up a file or directory
+ *
+ * @param handle Partition
+ * @param path Path from the root, / separated, matched ignoring case
+ * @param info Where to put the file's details
+ * @return Status
+ */
+LIBFATX_API int fatxStat(FATXHandle* handle, const char* path, FATXFileInfo* info);
+
+/**
+ * List part of a directory. Call again with start advanced by count until
+ * count comes back less than capacity.
+ *
+ * @param handle Partition
+ * @param path Directory
+ * @param start Number of entries to skip
+ * @param entries Where to put the entries
+ * @param capacity Size of entries
+ * @param count Set to the number of entries stored
+ * @return Status
+ */
+LIBFATX_API int fatxReadDir(FATXHandle* handle, const char* path, u_int32_t start,
+                            FATXFileInfo* entries, u_int32_t capacity, u_int32_t* count);
+
+/**
+ * Read part of a file
+ *
+ * @param handle Partition
+ * @param path File
+ * @param offset Where to start in the file
+ * @param buffer Where to put the data
+ * @param length Most bytes to read
+ * @param done Set to the bytes read (less than length at the end of the
+ *             file)
+ * @return Status
+ */
+LIBFATX_API int fatxReadFile(FATXHandle* handle, const char* path, u_int64_t offset,
+                             void* buffer, size_t length, size_t* done);
+
+/**
+ * Describe a status code
+ *
+ * @return Constant string
+ */
+LIBFATX_API const char* fatxStatusString(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
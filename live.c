@@ -0,0 +1,156 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Finding the parts of a disk that hold data
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "live.h"
+#include "alloc.h"
+#include "util.h"
+
+
+/**
+ * Add a range
+ */
+static void addRange(FATXRangeList* list, u_int64_t offset, u_int64_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (list->count == list->allocated) {
+    list->allocated = list->allocated ? list->allocated * 2 : 256;
+    list->ranges = (FATXRange*) realloc(list->ranges, list->allocated * sizeof(FATXRange));
+    if (list->ranges == NULL) {
+      error("Out of memory");
+    }
+  }
+  list->ranges[list->count].offset = offset;
+  list->ranges[list->count].length = length;
+  list->count++;
+}
+
+
+/**
+ * Add the ranges of a FATX partition holding data
+ */
+static void addPartition(FATXRangeList* list, FATXPartition* partition) {
+  u_int32_t lastCluster = lastDataCluster(partition);
+  u_int32_t runStart = 0;
+  u_int32_t i;
+
+  // header and chain table
+  addRange(list, partition->partitionStart, partition->cluster1Address - partition->partitionStart);
+
+  // runs of allocated clusters
+  for(i = FATX_ROOT_FAT_CLUSTER; i <= lastCluster + 1; i++) {
+    if ((i <= lastCluster) && (getChainEntry(partition, i) != 0)) {
+      if (runStart == 0) {
+        runStart = i;
+      }
+      continue;
+    }
+    if (runStart != 0) {
+      addRange(list, partition->cluster1Address + (u_int64_t) (runStart - 1) * partition->clusterSize,
+               (u_int64_t) (i - runStart) * partition->clusterSize);
+      runStart = 0;
+    }
+  }
+}
+
+
+/**
+ * Order ranges by offset
+ */
+static int compareRanges(const void* a, const void* b) {
+  const FATXRange *x = (const FATXRange*) a;
+  const FATXRange *y = (const FATXRange*) b;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+
+/**
+ * Sort ranges into disk order, joining those that overlap or are close
+ * together
+ */
+static void mergeRanges(FATXRangeList* list, u_int64_t mergeGap) {
+  FATXRange *last;
+  int kept = 0;
+  int i;
+
+  qsort(list->ranges, list->count, sizeof(FATXRange), compareRanges);
+  for(i = 0; i < list->count; i++) {
+    last = kept ? &list->ranges[kept - 1] : NULL;
+    if ((last != NULL) && (list->ranges[i].offset <= last->offset + last->length + mergeGap)) {
+      if (list->ranges[i].offset + list->ranges[i].length > last->offset + last->length) {
+        last->length = list->ranges[i].offset + list->ranges[i].length - last->offset;
+      }
+    } else {
+      list->ranges[kept++] = list->ranges[i];
+    }
+  }
+  list->count = kept;
+}
+
+
+/**
+ * Work out which parts of a disk hold data: everything before the first
+ * partition, and for each FATX partition its header, chain table and
+ * allocated clusters. Partitions that are not FATX are left out.
+ *
+ * @param disk Disk
+ * @param mergeGap Ranges closer together than this are joined, the gap
+ *        included
+ * @return The ranges, sorted and with no overlaps
+ */
+FATXRangeList* liveRanges(FATXDisk* disk, u_int64_t mergeGap) {
+  FATXRangeList *list;
+  FATXPartition *partition;
+  u_int64_t firstPartition = disk->diskSize;
+  int i;
+
+  list = (FATXRangeList*) calloc(1, sizeof(FATXRangeList));
+  if (list == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0; i < disk->count; i++) {
+    if (disk->entries[i].size == 0) {
+      continue;
+    }
+    if (disk->entries[i].offset < firstPartition) {
+      firstPartition = disk->entries[i].offset;
+    }
+    partition = getDiskPartition(disk, i);
+    if (partition != NULL) {
+      addPartition(list, partition);
+    }
+  }
+  addRange(list, 0, firstPartition);
+  mergeRanges(list, mergeGap);
+  return list;
+}
+
+
+/**
+ * Free a range list
+ */
+void freeRangeList(FATXRangeList* list) {
+  free(list->ranges);
+  free(list);
+}
@@ -0,0 +1,63 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Finding the parts of a disk that hold data
+
+#ifndef LIVE_H
+#define LIVE_H 1
+
+#include <sys/types.h>
+#include "disk.h"
+
+/**
+ * A byte range of a disk
+ */
+typedef struct {
+  u_int64_t offset;
+  u_int64_t length;
+} FATXRange;
+
+/**
+ * Byte ranges of a disk, in disk order
+ */
+typedef struct {
+  FATXRange *ranges;
+  int count;
+  int allocated;
+} FATXRangeList;
+
+/**
+ * Work out which parts of a disk hold data: everything before the first
+ * partition, and for each FATX partition its header, chain table and
+ * allocated clusters. Partitions that are not FATX are left out.
+ *
+ * @param disk Disk
+ * @param mergeGap Ranges closer together than this are joined, the gap
+ *        included
+ * @return The ranges, sorted and with no overlaps
+ */
+FATXRangeList* liveRanges(FATXDisk* disk, u_int64_t mergeGap);
+
+/**
+ * Free a range list
+ */
+void freeRangeList(FATXRangeList* list);
+
+#endif
@@ -25,19 +25,55 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include "util.h"
 #include "fatx.h"
 #include "dir.h"
+#include "import.h"
+#include "defrag.h"
+#include "analyze.h"
+#include "scan.h"
+#include "disk.h"
+#include "hash.h"
+#include "manifest.h"
+#include "dedupe.h"
+#include "verify.h"
+#include "clone.h"
+#include "export.h"
+#include "fusemount.h"
+#include "serve.h"
+#include "tar.h"
+#include "range.h"
+#include "generate.h"
 
 /**
  * Output syntax
  */
 void syntax() {
+  printf("Syntax: xboxdumper [-p <partition>] [-H <hash>] <command> ...\n");
+  printf("Syntax: where partition is an index 0-13, a drive letter (E, C, X, Y, Z, F, G), auto or @<byte offset>\n");
+  printf("Syntax: where hash is crc32c, xxh64 or sha1; dump also writes a manifest <output filename>.<hash>\n");
   printf("Syntax: xboxdumper <list|dump <FATX filename> <output filename>> <XBOX image file>\n");
-  printf("Syntax: xboxdumper <create <XBOX image file> <partitionsize in MB>\n");
+  printf("Syntax: xboxdumper <import <host file or directory> <FATX directory> <XBOX image file>\n");
+  printf("Syntax: xboxdumper <defrag <XBOX image file> [dryrun] [dirs]\n");
+  printf("Syntax: xboxdumper <read <XBOX image file> <FATX filename> <offset> <length>  (data written to stdout)\n");
+  printf("Syntax: xboxdumper <tar <XBOX image file> <FATX file or directory>  (archive written to stdout)\n");
+  printf("Syntax: xboxdumper <analyze <XBOX image file> [files]\n");
+  printf("Syntax: xboxdumper <hash <XBOX image file> <manifest file>\n");
+  printf("Syntax: xboxdumper <create <XBOX image file> <partitionsize in MB> [fill]\n");
   printf("Syntax: xboxdumper <mkfs   <XBOX image file>\n");
+  printf("Syntax: xboxdumper <generate <XBOX image file> <size in MB> [<option>=<value> ...]\n");
+  printf("Syntax: where options are seed, files, dirs, depth, sizes=<min>[:<max>], dist=log|uniform,\n");
+  printf("Syntax:   fragment=<percent>, deleted=<percent>, chain=16|32 and cluster=<bytes>\n");
   printf("Syntax: xboxdumper <cluster <XBOX image file> <sector number>\n");
   printf("Syntax: xboxdumper <listpartitions <XBOX image file>\n");
+  printf("Syntax: xboxdumper <scan <XBOX image file>\n");
+  printf("Syntax: xboxdumper <verify <XBOX image file> <copy image file or device> [free]\n");
+  printf("Syntax: xboxdumper <mount <XBOX image file> <mount point> [allow_other]\n");
+  printf("Syntax: xboxdumper <serve <socket path> <XBOX image file> [<XBOX image file> ...]\n");
+  printf("Syntax: xboxdumper <clone <XBOX hdd dev or image file> <output image file>\n");
+  printf("Syntax: xboxdumper <export <XBOX hdd dev or image file> <output compressed image file>\n");
+  printf("Syntax: xboxdumper <dedupe-report <XBOX image file> [<XBOX image file> ...]\n");
   printf("Syntax: xboxdumper <prepare <XBOX hdd dev> <partition type>\n");
   printf("Syntax: xboxdumper <preparefg <XBOX hdd dev> <partition type>\n");
   printf("Syntax: where partition type is value of 0, 1, 2 or 3\n");
@@ -50,11 +86,36 @@ void syntax() {
 }
 
 
+/**
+ * Print the partitions found by scanning an image
+ *
+ * @param backend Image
+ * @param imageSize Size of the image
+ */
+static void printPartitionMap(FATXBackend* backend, u_int64_t imageSize) {
+  FATXPartitionMap *map;
+  int i;
+
+  map = scanPartitions(backend, imageSize);
+  if (map == NULL) {
+    error("Out of memory");
+  }
+  printf("Partitions found: %d\n", map->count);
+  for(i = 0; i < map->count; i++) {
+    printf("partition @%llu\tsize %lluMB\tcluster size %uK\tchain entries %u bytes\n",
+           (unsigned long long) map->partitions[i].offset, (unsigned long long) map->partitions[i].size / 1048576,
+           map->partitions[i].clusterSize / 1024, map->partitions[i].chainMapEntrySize);
+  }
+  freePartitionMap(map);
+}
+
+
 /**
  * Main entry point
  */
 int main(int argc, char* argv[]) {
   FILE *sourceFd;
+  FATXBackend *backend;
   FATXPartition* partition;
   char* sourceFilename = NULL;
   char* extractFilename = NULL;
@@ -62,9 +123,51 @@ int main(int argc, char* argv[]) {
   FILE *outputFd = NULL;
   int listFiles = 0;
   int extractFile = 0;
+  int importFiles = 0;
+  char* importSource = NULL;
+  int defragFiles = 0;
+  int defragFlags = 0;
+  int analyzeFiles = 0;
+  int analyzeFlags = 0;
+  int scanImage = 0;
+  int hashFiles = 0;
+  int hashType = -1;
+  HashState hash;
+  char hashHex[HASH_HEXSIZE];
+  char* manifestFilename = NULL;
+  FILE *manifestFd = NULL;
+  int verifyFiles = 0;
+  int verifyFlags = 0;
+  char* verifyFilename = NULL;
+  char* mountPoint = NULL;
+  int mountFlags = 0;
+  char* tarPath = NULL;
+  int dataFd = -1;
+  char* rangePath = NULL;
+  u_int64_t rangeOffset = 0;
+  u_int64_t rangeLength = 0;
+  int verifyFd = -1;
+  char* partitionSpec = NULL;
+  int i;
   u_int64_t lFileSize;
+  FATXDisk *disk = NULL;
+  int failed = 0;
   u_int64_t lNewPartSize = 0;
+  GenerateOptions generateOptions;
   
+  // parse the options, then shift them out of the way of the command
+  while((i = getopt(argc, argv, "+p:H:")) != -1) {
+    if (i == 'p') {
+      partitionSpec = optarg;
+    } else if ((i == 'H') && ((hashType = hashAlgorithm(optarg)) != -1)) {
+      continue;
+    } else {
+      syntax();
+    }
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
   // parse the arguments
   if (argc < 3) {
     syntax();
@@ -84,18 +187,135 @@ int main(int argc, char* argv[]) {
     extractFilename = argv[2];
     outputFilename = argv[3];
     sourceFilename = argv[4];
+  } else if (!strcmp(argv[1], "import")) {
+    // ensure we still have enough args
+    if (argc < 5) {
+      syntax();
+    }
+
+    // import config
+    importFiles = 1;
+    importSource = argv[2];
+    extractFilename = argv[3];
+    sourceFilename = argv[4];
+  } else if (!strcmp(argv[1], "defrag")) {
+    // defrag config
+    defragFiles = 1;
+    sourceFilename = argv[2];
+    for(i = 3; i < argc; i++) {
+      if (!strcmp(argv[i], "dryrun")) {
+        defragFlags |= DEFRAG_DRYRUN;
+      } else if (!strcmp(argv[i], "dirs")) {
+        defragFlags |= DEFRAG_DIRECTORIES;
+      } else {
+        syntax();
+      }
+    }
+  } else if (!strcmp(argv[1], "analyze")) {
+    // analyze config
+    analyzeFiles = 1;
+    sourceFilename = argv[2];
+    if ((argc > 3) && !strcmp(argv[3], "files")) {
+      analyzeFlags |= ANALYZE_FILES;
+    }
+  } else if (!strcmp(argv[1], "hash")) {
+    // ensure we still have enough args
+    if (argc < 4) {
+      syntax();
+    }
+
+    // hash config
+    hashFiles = 1;
+    sourceFilename = argv[2];
+    manifestFilename = argv[3];
+    if (hashType == -1) {
+      hashType = HASH_SHA1;
+    }
+  } else if (!strcmp(argv[1], "verify")) {
+    // ensure we still have enough args
+    if (argc < 4) {
+      syntax();
+    }
+
+    // verify config
+    verifyFiles = 1;
+    sourceFilename = argv[2];
+    verifyFilename = argv[3];
+    if ((argc > 4) && !strcmp(argv[4], "free")) {
+      verifyFlags |= VERIFY_FREE;
+    }
+  } else if (!strcmp(argv[1], "tar") || !strcmp(argv[1], "read")) {
+    if ((argc < 4) || (!strcmp(argv[1], "read") && (argc < 6))) {
+      syntax();
+    }
+    sourceFilename = argv[2];
+    if (!strcmp(argv[1], "tar")) {
+      tarPath = argv[3];
+    } else {
+      rangePath = argv[3];
+      rangeOffset = strtoull(argv[4], NULL, 0);
+      rangeLength = strtoull(argv[5], NULL, 0);
+    }
+
+    // the data goes to stdout, so everything else printed goes to stderr
+    dataFd = dup(STDOUT_FILENO);
+    if ((dataFd == -1) || (dup2(STDERR_FILENO, STDOUT_FILENO) == -1)) {
+      error("Unable to redirect output");
+    }
+  } else if (!strcmp(argv[1], "mount")) {
+    if (argc < 4) {
+      syntax();
+    }
+    sourceFilename = argv[2];
+    mountPoint = argv[3];
+    if ((argc > 4) && !strcmp(argv[4], "allow_other")) {
+      mountFlags |= MOUNT_ALLOW_OTHER;
+    }
+  } else if (!strcmp(argv[1], "scan")) {
+    scanImage = 1;
+    sourceFilename = argv[2];
+  } else if (!strcmp(argv[1], "dedupe-report")) {
+    exit((dedupeReport(argv + 2, argc - 2, partitionSpec) == -1) ? 1 : 0);
+  } else if (!strcmp(argv[1], "serve")) {
+    if (argc < 4) {
+      syntax();
+    }
+    exit((serveImages(argv[2], argv + 3, argc - 3, partitionSpec) == -1) ? 1 : 0);
+  } else if (!strcmp(argv[1], "clone")) {
+    if (argc < 4) {
+      syntax();
+    }
+    exit((cloneDisk(argv[2], argv[3]) == -1) ? 1 : 0);
+  } else if (!strcmp(argv[1], "export")) {
+    if (argc < 4) {
+      syntax();
+    }
+    exit((exportDisk(argv[2], argv[3]) == -1) ? 1 : 0);
   } else if (!strcmp(argv[1], "create")) {
   	if(argc < 4) {
 		syntax();
 	}
 	outputFilename = argv[2];
 	lNewPartSize = atol(argv[3]);
-	partition = createPartition(outputFilename, 0, lNewPartSize, 1);
+	partition = createPartition(outputFilename, 0, lNewPartSize,
+			((argc > 4) && !strcmp(argv[4], "fill")) ? FATX_CREATE_FILL : FATX_CREATE_SPARSE);
 	if(partition == 0) {
 		printf("Error in creating FATX partition\n");
 		exit(1);
 	}
 	exit(0);
+  } else if (!strcmp(argv[1], "generate")) {
+    if (argc < 4) {
+      syntax();
+    }
+    defaultGenerateOptions(&generateOptions);
+    generateOptions.size = strtoull(argv[3], NULL, 0) * 1024 * 1024;
+    for(i = 4; i < argc; i++) {
+      if (parseGenerateOption(&generateOptions, argv[i]) == -1) {
+        syntax();
+      }
+    }
+    exit((generateImage(argv[2], &generateOptions) == -1) ? 1 : 0);
   } else if (!strcmp(argv[1], "mkfs")) {
   	if(argc < 3) {
 		syntax();
@@ -156,38 +376,130 @@ int main(int argc, char* argv[]) {
       error("Unable to open output file %s", outputFilename);
     }
   }
+
+  // open the copy to verify against
+  if (verifyFiles) {
+    verifyFd = open(verifyFilename, O_RDONLY);
+    if (verifyFd == -1) {
+      error("Unable to open %s", verifyFilename);
+    }
+  }
+
+  // open the manifest: named after the output file when dumping
+  if (extractFile && (hashType != -1)) {
+    manifestFilename = (char*) malloc(strlen(outputFilename) + 16);
+    if (manifestFilename == NULL) {
+      error("Out of memory");
+    }
+    sprintf(manifestFilename, "%s.%s", outputFilename, hashName(hashType));
+  }
+  if (manifestFilename != NULL) {
+    manifestFd = fopen(manifestFilename, "w");
+    if (manifestFd == 0) {
+      error("Unable to open manifest file %s", manifestFilename);
+    }
+  }
   
   // open the file
-  if ((sourceFd = fopen(sourceFilename, "r")) == 0) {
+  if ((sourceFd = fopen(sourceFilename, 
+                        (importFiles || (defragFiles && !(defragFlags & DEFRAG_DRYRUN))) ? "r+" : "r")) == 0) {
     error("Unable to open source file %s", sourceFilename);
   }
 
-  fseeko(sourceFd, 0L, SEEK_END);
-  lFileSize = ftello(sourceFd);
-  fseeko(sourceFd, 0L, SEEK_SET);
+  // images are read through a backend; compressed and split ones can't
+  // be changed
+  backend = openBackend(sourceFd, sourceFilename);
+  if (backend == NULL) {
+    error("Unable to read source file %s: %s", sourceFilename, strerror(errno));
+  }
+  if (!backend->writable && (importFiles || (defragFiles && !(defragFlags & DEFRAG_DRYRUN)))) {
+    error("Source file %s is compressed or split, and can only be read", sourceFilename);
+  }
+  lFileSize = backend->size;
   printf("Filename : %s , Filesize %lld\n",sourceFilename,(unsigned long long)lFileSize);
 		  
-  // open the partition
-  partition = openPartition(sourceFd,0,lFileSize);
+  if (scanImage) {
+    printPartitionMap(backend, lFileSize);
+    closeBackend(backend);
+    fclose(sourceFd);
+    exit(0);
+  }
+
+  // open the partition: the one asked for on the disk, or else a
+  // partition filling the whole image
+  if (partitionSpec != NULL) {
+    disk = openDisk(backend, lFileSize);
+    if (disk == NULL) {
+      error("Out of memory");
+    }
+    i = findDiskEntry(disk, partitionSpec);
+    if (i == -1) {
+      error("No FATX partition %s found", partitionSpec);
+    }
+    partition = getDiskPartition(disk, i);
+  } else {
+    partition = openPartition(backend,0,lFileSize);
+  }
   
   // dump the directory tree
   if (listFiles) {
     dumpTree(partition, fileno(stdout));
   }
   if (extractFile) {
-    dumpFile(partition, extractFilename, outputFd);
+    if (manifestFd != NULL) {
+      hashInit(&hash, hashType);
+      dumpFile(partition, extractFilename, outputFd, &hash);
+      hashFinal(&hash, hashHex);
+      fprintf(manifestFd, "%s  %s\n", hashHex, outputFilename);
+    } else {
+      dumpFile(partition, extractFilename, outputFd, NULL);
+    }
+  }
+  if (hashFiles && (hashPartition(partition, hashType, manifestFd) == -1)) {
+    failed = 1;
+  }
+  if (importFiles && (importPath(partition, importSource, extractFilename) == -1)) {
+    failed = 1;
+  }
+  if (analyzeFiles) {
+    analyzePartition(partition, analyzeFlags);
+  }
+  if (defragFiles && (defragPartition(partition, defragFlags) == -1)) {
+    failed = 1;
+  }
+  if (verifyFiles && (verifyPartition(partition, verifyFd, verifyFlags) == -1)) {
+    failed = 1;
+  }
+  if ((mountPoint != NULL) && (mountPartition(partition, mountPoint, mountFlags) == -1)) {
+    failed = 1;
+  }
+  if ((tarPath != NULL) && (tarTree(partition, tarPath, dataFd) == -1)) {
+    failed = 1;
+  }
+  if ((rangePath != NULL) && (dumpRange(partition, rangePath, rangeOffset, rangeLength, dataFd) == -1)) {
+    failed = 1;
   }
   
   // close output file
   if (extractFile) {
     fclose(outputFd);
   }
+  if (manifestFd != NULL) {
+    fclose(manifestFd);
+  }
+  if (verifyFd != -1) {
+    close(verifyFd);
+  }
   
   // close the partition
-  closePartition(partition);
+  if (disk != NULL) {
+    closeDisk(disk);
+  } else {
+    closePartition(partition);
+  }
   
   // close the file
+  closeBackend(backend);
   fclose(sourceFd);
-  return 1;
+  return failed ? 1 : 0;
 }
-  
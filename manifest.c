@@ -0,0 +1,148 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Hash manifests of the files in FATX partitions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "manifest.h"
+#include "hash.h"
+#include "extent.h"
+#include "tree.h"
+#include "pool.h"
+#include "util.h"
+
+// Hash of one file
+typedef struct {
+  char hex[HASH_HEXSIZE];
+  int broken;
+} ManifestEntry;
+
+// State for hashing a partition
+typedef struct {
+  FATXPartition *partition;
+  FATXTree *tree;
+  ManifestEntry *entries;
+  int algorithm;
+} ManifestContext;
+
+
+/**
+ * Add a piece of a file to its hash
+ */
+static int hashPiece(void* context, unsigned char* data, u_int64_t length) {
+  hashUpdate((HashState*) context, data, length);
+  return 0;
+}
+
+
+/**
+ * Hash one file
+ */
+static void hashJob(void* context, int index) {
+  ManifestContext *ctx = (ManifestContext*) context;
+  FATXPartition *partition = ctx->partition;
+  FATXTreeNode *node = &ctx->tree->nodes[index];
+  ManifestEntry *entry = &ctx->entries[index];
+  FATXExtent *extents = NULL;
+  unsigned char *buffer = NULL;
+  u_int64_t bufferSize;
+  u_int32_t clusters;
+  HashState hash;
+  int count = 0;
+
+  if (isTreeDirectory(node)) {
+    return;
+  }
+
+  hashInit(&hash, ctx->algorithm);
+  clusters = ((u_int64_t) node->entry.fileSize + partition->clusterSize - 1) / partition->clusterSize;
+  if (clusters > 0) {
+    // no bigger a buffer than the file needs, so small files stay cheap
+    bufferSize = (u_int64_t) clusters * partition->clusterSize;
+    if (bufferSize > MANIFEST_CHUNKSIZE) {
+      bufferSize = MANIFEST_CHUNKSIZE - (MANIFEST_CHUNKSIZE % partition->clusterSize);
+    }
+    extents = buildExtents(partition, node->entry.firstCluster, clusters, &count, NULL);
+    buffer = (unsigned char*) malloc(bufferSize);
+    if ((extents == NULL) || (buffer == NULL) ||
+        (readExtents(partition, extents, count, node->entry.fileSize, buffer, bufferSize,
+                     hashPiece, &hash) == -1)) {
+      entry->broken = 1;
+    }
+    free(buffer);
+    free(extents);
+  }
+  hashFinal(&hash, entry->hex);
+}
+
+
+/**
+ * Hash every file in a partition, in parallel, and write a manifest with
+ * one "<hash>  <path>" line per file in directory tree order
+ *
+ * @param partition FATX partition
+ * @param algorithm HASH_* value
+ * @param manifest Stream to write the manifest to
+ * @return 0 on success, -1 if any file could not be read
+ */
+int hashPartition(FATXPartition* partition, int algorithm, FILE* manifest) {
+  ManifestContext ctx;
+  u_int64_t bytes = 0;
+  char path[4096];
+  int files = 0;
+  int broken = 0;
+  int i;
+
+  ctx.partition = partition;
+  ctx.algorithm = algorithm;
+  ctx.tree = loadTree(partition);
+  if (ctx.tree == NULL) {
+    error("Out of memory");
+  }
+  ctx.entries = (ManifestEntry*) calloc(ctx.tree->count, sizeof(ManifestEntry));
+  if (ctx.entries == NULL) {
+    error("Out of memory");
+  }
+
+  runParallel(hashJob, &ctx, ctx.tree->count, 0);
+
+  for(i = 0; i < ctx.tree->count; i++) {
+    if (isTreeDirectory(&ctx.tree->nodes[i])) {
+      continue;
+    }
+    treePath(ctx.tree, i, path, sizeof(path));
+    if (ctx.entries[i].broken) {
+      fprintf(stderr, "hash : %s: cluster chain is broken or unreadable\n", path);
+      broken++;
+      continue;
+    }
+    fprintf(manifest, "%s  %s\n", ctx.entries[i].hex, path);
+    files++;
+    bytes += ctx.tree->nodes[i].entry.fileSize;
+  }
+  printf("hash : %d files, %llu bytes hashed with %s, %d unreadable\n", files,
+         (unsigned long long) bytes, hashName(algorithm), broken);
+
+  free(ctx.entries);
+  freeTree(ctx.tree);
+  return broken ? -1 : 0;
+}
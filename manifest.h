@@ -0,0 +1,43 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Hash manifests of the files in FATX partitions
+
+#ifndef MANIFEST_H
+#define MANIFEST_H 1
+
+#include <stdio.h>
+#include "fatx.h"
+
+// Most data read at once when hashing one file
+#define MANIFEST_CHUNKSIZE (8 * 1024 * 1024)
+
+/**
+ * Hash every file in a partition, in parallel, and write a manifest with
+ * one "<hash>  <path>" line per file in directory tree order
+ *
+ * @param partition FATX partition
+ * @param algorithm HASH_* value
+ * @param manifest Stream to write the manifest to
+ * @return 0 on success, -1 if any file could not be read
+ */
+int hashPartition(FATXPartition* partition, int algorithm, FILE* manifest);
+
+#endif
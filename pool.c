@@ -0,0 +1,104 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Minimal worker pool for running independent jobs in parallel
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "pool.h"
+
+typedef struct {
+  PoolJob job;
+  void *context;
+  int count;
+  int next;
+} PoolState;
+
+
+/**
+ * Worker thread: keep claiming the next unstarted job until none are left
+ */
+static void *poolWorker(void *arg) {
+  PoolState *state = (PoolState*) arg;
+  int index;
+
+  while((index = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->count) {
+    state->job(state->context, index);
+  }
+  return NULL;
+}
+
+
+/**
+ * Number of threads runParallel uses by default
+ */
+int defaultThreads(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return (cpus > 0) ? (int) cpus : 1;
+}
+
+
+/**
+ * Run count jobs across a number of threads and wait for all of them
+ *
+ * @param job Function to run for each job
+ * @param context Context passed to every job
+ * @param count Number of jobs
+ * @param threads Number of threads to use (0 = one per online CPU). If
+ *                threads cannot be started the jobs still all run.
+ */
+void runParallel(PoolJob job, void *context, int count, int threads) {
+  PoolState state;
+  pthread_t *tids;
+  int started;
+  int i;
+
+  state.job = job;
+  state.context = context;
+  state.count = count;
+  state.next = 0;
+
+  if (threads <= 0) {
+    threads = defaultThreads();
+  }
+  if (threads > count) {
+    threads = count;
+  }
+
+  // the calling thread is one of the workers
+  tids = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+  started = 0;
+  if (tids != NULL) {
+    for(i=1; i < threads; i++) {
+      if (pthread_create(&tids[started], NULL, poolWorker, &state) != 0) {
+        break;
+      }
+      started++;
+    }
+  }
+  poolWorker(&state);
+
+  for(i=0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+}
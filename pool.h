@@ -0,0 +1,50 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Minimal worker pool for running independent jobs in parallel
+
+#ifndef POOL_H
+#define POOL_H 1
+
+/**
+ * A job run by the pool
+ *
+ * @param context Context passed to runParallel
+ * @param index Index of the job, 0 to count-1
+ */
+typedef void (*PoolJob)(void *context, int index);
+
+/**
+ * Run count jobs across a number of threads and wait for all of them
+ *
+ * @param job Function to run for each job
+ * @param context Context passed to every job
+ * @param count Number of jobs
+ * @param threads Number of threads to use (0 = one per online CPU). If
+ *                threads cannot be started the jobs still all run.
+ */
+void runParallel(PoolJob job, void *context, int count, int threads);
+
+/**
+ * Number of threads runParallel uses by default
+ */
+int defaultThreads(void);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Reading byte ranges of files without reading the rest of them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "range.h"
+#include "extent.h"
+#include "fatxdir.h"
+#include "fatxcore.h"
+#include "util.h"
+
+/**
+ * Write all of a buffer
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeAll(int fd, unsigned char* data, u_int64_t length) {
+  u_int64_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = write(fd, data + done, length - done);
+    if ((n == -1) && (errno == EINTR)) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int64_t dumpRange(FATXPartition* partition, char* filename, u_int64_t offset, u_int64_t length,
+                  int outputFd) {
+  FATXDirCache *cache;
+  FATXDirEntry entry;
+  FATXExtent *extents;
+  unsigned char *buffer;
+  u_int64_t done;
+  u_int64_t piece;
+  int64_t n = 0;
+  int count = 0;
+  int found;
+
+  cache = createDirCache(partition);
+  if (cache == NULL) {
+    error("Out of memory");
+  }
+  found = findPathEntry(cache, filename, &entry);
+  freeDirCache(cache);
+  if (found < 0) {
+    fprintf(stderr, "read : %s: %s\n", filename, fatxStatusString(found));
+    return -1;
+  }
+  if (!found) {
+    fprintf(stderr, "read : %s not found\n", filename);
+    return -1;
+  }
+  if (entry.attributes & FATX_FILEATTR_DIRECTORY) {
+    fprintf(stderr, "read : %s is a directory\n", filename);
+    return -1;
+  }
+  if (offset >= entry.fileSize) {
+    return 0;
+  }
+  if (length > entry.fileSize - offset) {
+    length = entry.fileSize - offset;
+  }
+
+  // the chain is only followed as far as the end of the range
+  extents = buildExtents(partition, entry.firstCluster,
+                         (offset + length + partition->clusterSize - 1) / partition->clusterSize, &count, NULL);
+  buffer = (unsigned char*) malloc((length < RANGE_CHUNKSIZE) ? length : RANGE_CHUNKSIZE);
+  if (buffer == NULL) {
+    error("Out of memory");
+  }
+
+  for(done = 0; done < length; done += n) {
+    piece = (length - done < RANGE_CHUNKSIZE) ? length - done : RANGE_CHUNKSIZE;
+    n = readExtentRange(partition, extents, count, offset + done, piece, buffer);
+    if (n == -1) {
+      fprintf(stderr, "read : unable to read %s: %s\n", filename, strerror(errno));
+      break;
+    }
+    if (n < piece) {
+      fprintf(stderr, "read : the cluster chain of %s ends after %llu bytes\n", filename,
+              (unsigned long long) (offset + done + n));
+    }
+    if (writeAll(outputFd, buffer, n) == -1) {
+      fprintf(stderr, "read : unable to write: %s\n", strerror(errno));
+      n = -1;
+      break;
+    }
+    if (n < piece) {
+      n = -1;
+      break;
+    }
+  }
+
+  free(buffer);
+  free(extents);
+  return (n == -1) ? -1 : (int64_t) done;
+}
@@ -0,0 +1,48 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Reading byte ranges of files without reading the rest of them
+
+#ifndef RANGE_H
+#define RANGE_H 1
+
+#include <sys/types.h>
+#include "fatx.h"
+
+// Most data read at once
+#define RANGE_CHUNKSIZE (4 * 1024 * 1024)
+
+/**
+ * Write a byte range of a file. The file's extents are built only as far
+ * as the end of the range, the extent holding the start is found by
+ * binary search, and only the clusters holding the range are read.
+ *
+ * @param partition FATX partition
+ * @param filename File to read
+ * @param offset Where to start in the file
+ * @param length Number of bytes (the range is cut short at the end of the
+ *               file)
+ * @param outputFd Where to write the data
+ * @return Number of bytes written, or -1 on failure
+ */
+int64_t dumpRange(FATXPartition* partition, char* filename, u_int64_t offset, u_int64_t length,
+                  int outputFd);
+
+#endif
@@ -0,0 +1,449 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Finding FATX partitions anywhere in a disk image
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+#include "fatx.h"
+#include "fatxdir.h"
+#include "pool.h"
+#include "util.h"
+
+// Hits found in one chunk of the image
+typedef struct {
+  u_int64_t *offsets;
+  int count;
+} ScanHits;
+
+// State shared by the scan jobs
+typedef struct {
+  FATXBackend *backend;
+  u_int64_t imageSize;
+  ScanHits *chunks;
+} ScanContext;
+
+
+/**
+ * Record a hit
+ */
+static void addHit(ScanHits* hits, u_int64_t offset) {
+  // grow in powers of two
+  if ((hits->count & (hits->count - 1)) == 0) {
+    hits->offsets = (u_int64_t*) realloc(hits->offsets, (hits->count ? hits->count * 2 : 1) * sizeof(u_int64_t));
+    if (hits->offsets == NULL) {
+      error("Out of memory");
+    }
+  }
+  hits->offsets[hits->count++] = offset;
+}
+
+
+/**
+ * Search one chunk of the image for the magic. Only the first word of each
+ * 4 KiB block can hold it, so a strided compare replaces a byte search, and
+ * holes in sparse images are skipped without being read.
+ */
+static void scanJob(void* context, int index) {
+  ScanContext *ctx = (ScanContext*) context;
+  ScanHits *hits = &ctx->chunks[index];
+  u_int64_t position = (u_int64_t) index * SCAN_CHUNKSIZE;
+  u_int64_t end = position + SCAN_CHUNKSIZE;
+  unsigned char *buffer;
+  u_int64_t data;
+  u_int64_t n;
+  u_int64_t i;
+
+  if (end > ctx->imageSize) {
+    end = ctx->imageSize;
+  }
+  buffer = (unsigned char*) malloc(SCAN_READSIZE);
+  if (buffer == NULL) {
+    error("Out of memory");
+  }
+
+  while(position < end) {
+    // jump over holes
+    data = backendNextData(ctx->backend, position);
+    if (data > position) {
+      position = (data + SCAN_ALIGNMENT - 1) & ~((u_int64_t) SCAN_ALIGNMENT - 1);
+      continue;
+    }
+
+    n = (end - position < SCAN_READSIZE) ? end - position : SCAN_READSIZE;
+    if (backendRead(ctx->backend, buffer, n, position) == -1) {
+      break;
+    }
+    for(i = 0; i + 4 <= n; i += SCAN_ALIGNMENT) {
+      if (*(u_int32_t*) &buffer[i] == FATX_PARTITION_MAGIC) {
+        addHit(hits, position + i);
+      }
+    }
+    position += (n + SCAN_ALIGNMENT - 1) & ~((u_int64_t) SCAN_ALIGNMENT - 1);
+  }
+  free(buffer);
+}
+
+
+/**
+ * Check a hit's header and the start of its chain map. The first words
+ * cannot tell the entry size on their own: a 16 bit map whose root is one
+ * cluster starts f8ff ffff, which also reads as a 32 bit media marker.
+ *
+ * @param backend Image
+ * @param offset Offset of the hit
+ * @param info Filled in with the cluster size
+ * @return The chain map entry sizes (2 and/or 4, or'ed together) whose
+ *         media marker and root entry match, or 0 if it does not look like
+ *         a FATX partition
+ */
+static int checkHeader(FATXBackend* backend, u_int64_t offset, FATXPartitionInfo* info) {
+  unsigned char header[FATX_PARTITION_HEADERSIZE + 8];
+  u_int32_t sectorsPerCluster;
+  int entrySizes = 0;
+
+  if (backendRead(backend, header, sizeof(header), offset) == -1) {
+    return 0;
+  }
+  sectorsPerCluster = *(u_int32_t*) &header[0x0008];
+  if ((sectorsPerCluster == 0) || (sectorsPerCluster > 128) || 
+      (sectorsPerCluster & (sectorsPerCluster - 1))) {
+    return 0;
+  }
+  if (*(u_int16_t*) &header[0x000C] != 1) {
+    return 0;
+  }
+
+  // the first chain map entry is the media marker, the root's is in use
+  info->clusterSize = sectorsPerCluster * 512;
+  if ((*(u_int32_t*) &header[FATX_PARTITION_HEADERSIZE] == 0xfffffff8) &&
+      (*(u_int32_t*) &header[FATX_PARTITION_HEADERSIZE + 4] != 0)) {
+    entrySizes |= 4;
+  }
+  if ((*(u_int16_t*) &header[FATX_PARTITION_HEADERSIZE] == 0xfff8) &&
+      (*(u_int16_t*) &header[FATX_PARTITION_HEADERSIZE + 2] != 0)) {
+    entrySizes |= 2;
+  }
+  return entrySizes;
+}
+
+
+/**
+ * Check a partition size fits a header: the entry size its cluster count
+ * implies must be one the chain map allows, and the chain map must leave
+ * room for data
+ *
+ * @param info Cluster size of the partition; the chain map entry size is
+ *             filled in
+ * @param entrySizes Entry sizes allowed, from checkHeader()
+ * @param size Partition size to check
+ * @return 1 if the size fits, 0 if not
+ */
+static int checkSize(FATXPartitionInfo* info, int entrySizes, u_int64_t size) {
+  u_int64_t clusterCount = size / info->clusterSize;
+  u_int64_t chainTableSize;
+
+  if ((clusterCount < 2) || (clusterCount > 0xfffffff0ULL)) {
+    return 0;
+  }
+  info->chainMapEntrySize = (clusterCount >= 0xfff4) ? 4 : 2;
+  if (!(entrySizes & info->chainMapEntrySize)) {
+    return 0;
+  }
+  chainTableSize = clusterCount * info->chainMapEntrySize;
+  chainTableSize = (chainTableSize + FATX_CHAINTABLE_BLOCKSIZE - 1) & ~((u_int64_t) FATX_CHAINTABLE_BLOCKSIZE - 1);
+  return FATX_PARTITION_HEADERSIZE + chainTableSize + info->clusterSize <= size;
+}
+
+
+/**
+ * Read a chain map entry
+ *
+ * @return The entry, with end markers widened to 32 bits, or 0 if it
+ *         cannot be read
+ */
+static u_int32_t readChainEntry(FATXBackend* backend, u_int64_t offset, u_int32_t entrySize,
+                                u_int64_t clusterId) {
+  u_int32_t entry = 0;
+
+  if (backendRead(backend, &entry, entrySize, offset + FATX_PARTITION_HEADERSIZE + clusterId * entrySize) == -1) {
+    return 0;
+  }
+  if ((entrySize == 2) && (entry >= 0xfff8)) {
+    entry |= 0xffff0000;
+  }
+  return entry;
+}
+
+
+/**
+ * Check the root directory of a candidate geometry. An empty root is a
+ * wholly cleared cluster, since a few end marker bytes could as well be
+ * chain map entries; otherwise the first entry must be deleted, or a
+ * plausible name whose first cluster is inside the partition and in use.
+ * Free chain map entries read as a zero name size, so that is never taken
+ * as an empty directory.
+ *
+ * @param backend Image
+ * @param offset Offset of the partition
+ * @param info Cluster size and chain map entry size of the partition
+ * @param tableSize Chain table size of the candidate
+ * @param clusterCount Cluster count of the candidate
+ * @return 1 if it looks like a directory, 0 if not
+ */
+static int checkRootDirectory(FATXBackend* backend, u_int64_t offset, FATXPartitionInfo* info,
+                              u_int64_t tableSize, u_int64_t clusterCount) {
+  unsigned char *cluster;
+  FATXDirEntry *entry;
+  u_int32_t next;
+  u_int32_t i;
+  int length;
+  int result = 0;
+
+  cluster = (unsigned char*) malloc(info->clusterSize);
+  if (cluster == NULL) {
+    error("Out of memory");
+  }
+  if (backendRead(backend, cluster, info->clusterSize,
+                  offset + FATX_PARTITION_HEADERSIZE + tableSize) == -1) {
+    goto out;
+  }
+  entry = (FATXDirEntry*) cluster;
+
+  if (entry->filenameSize == FATX_DIRENTRY_END) {
+    for(i = 0; (i < info->clusterSize) && (cluster[i] == 0xff); i++);
+    result = (i == info->clusterSize);
+    goto out;
+  }
+
+  // deleted entries lose their name size, but keep the name
+  length = entry->filenameSize;
+  if (length == FATX_DIRENTRY_DELETED) {
+    length = 1;
+  }
+  if ((length == 0) || (length > FATX_FILENAME_MAX)) {
+    goto out;
+  }
+  if (entry->attributes & ~(FATX_FILEATTR_READONLY | FATX_FILEATTR_HIDDEN | FATX_FILEATTR_SYSTEM |
+                            FATX_FILEATTR_DIRECTORY | FATX_FILEATTR_ARCHIVE)) {
+    goto out;
+  }
+  for(i = 0; i < length; i++) {
+    if (((unsigned char) entry->filename[i] < 0x20) || ((unsigned char) entry->filename[i] >= 0x7f) ||
+        (entry->filename[i] == '/') || (entry->filename[i] == '\\')) {
+      goto out;
+    }
+  }
+  if ((entry->filenameSize == FATX_DIRENTRY_DELETED) || (entry->firstCluster == 0)) {
+    result = 1;
+    goto out;
+  }
+  if ((entry->firstCluster < 2) || (entry->firstCluster >= clusterCount)) {
+    goto out;
+  }
+  next = readChainEntry(backend, offset, info->chainMapEntrySize, entry->firstCluster);
+  result = (next != 0) && ((next < clusterCount) || (next >= 0xfffffff8));
+
+ out:
+  free(cluster);
+  return result;
+}
+
+
+/**
+ * Check the last block of a chain map fits a cluster count: entries for
+ * clusters the partition has must be free, end markers or links inside
+ * it, and the padding past the last cluster must be zero
+ *
+ * @param backend Image
+ * @param address Address of the last chain table block
+ * @param first Index of the first entry in that block
+ * @param clusterCount Cluster count the partition would have
+ * @param entrySize Chain map entry size
+ * @return 1 if the block fits, 0 if not
+ */
+static int checkChainBlock(FATXBackend* backend, u_int64_t address, u_int64_t first,
+                           u_int64_t clusterCount, u_int32_t entrySize) {
+  unsigned char block[FATX_CHAINTABLE_BLOCKSIZE];
+  u_int64_t entry;
+  u_int32_t i;
+
+  if (backendRead(backend, block, sizeof(block), address) == -1) {
+    return 0;
+  }
+  for(i = 0; i < FATX_CHAINTABLE_BLOCKSIZE / entrySize; i++) {
+    entry = (entrySize == 2) ? ((u_int16_t*) block)[i] : ((u_int32_t*) block)[i];
+    if (first + i >= clusterCount) {
+      if (entry != 0) {
+        return 0;
+      }
+    } else if ((entry >= clusterCount) &&
+               (entry < ((entrySize == 2) ? 0xfff8ULL : 0xfffffff8ULL))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/**
+ * Size a partition found in front of a gap. The gap is only an upper
+ * bound, as the space between two partitions need not belong to either;
+ * each chain table size that fits is tried from the smallest up, taking
+ * the largest cluster count giving that table, and the first whose chain
+ * map ends cleanly and whose root directory parses wins.
+ *
+ * @param backend Image
+ * @param offset Offset of the partition
+ * @param info Cluster size of the partition; the chain map entry size is
+ *             filled in
+ * @param entrySizes Entry sizes allowed, from checkHeader()
+ * @param gap Bytes to the next partition or the end of the image
+ * @return Size of the partition; the gap if no smaller size validates, or
+ *         0 if the gap does not fit the header either
+ */
+static u_int64_t fitSize(FATXBackend* backend, u_int64_t offset, FATXPartitionInfo* info,
+                         int entrySizes, u_int64_t gap) {
+  u_int64_t clusterCount;
+  u_int64_t tableSize;
+  u_int32_t entrySize;
+
+  for(tableSize = FATX_CHAINTABLE_BLOCKSIZE;
+      FATX_PARTITION_HEADERSIZE + tableSize + info->clusterSize <= gap;
+      tableSize += FATX_CHAINTABLE_BLOCKSIZE) {
+    for(entrySize = 2; entrySize <= 4; entrySize += 2) {
+      if (!(entrySizes & entrySize)) {
+        continue;
+      }
+      clusterCount = tableSize / entrySize;
+      if (clusterCount > gap / info->clusterSize) {
+        clusterCount = gap / info->clusterSize;
+      }
+      // the count must give back this table size and entry size
+      if ((clusterCount * entrySize <= tableSize - FATX_CHAINTABLE_BLOCKSIZE) ||
+          !checkSize(info, entrySizes, clusterCount * info->clusterSize) ||
+          (info->chainMapEntrySize != entrySize)) {
+        continue;
+      }
+      if (checkChainBlock(backend, offset + FATX_PARTITION_HEADERSIZE + tableSize - FATX_CHAINTABLE_BLOCKSIZE,
+                          (tableSize - FATX_CHAINTABLE_BLOCKSIZE) / entrySize, clusterCount, entrySize) &&
+          checkRootDirectory(backend, offset, info, tableSize, clusterCount)) {
+        return (clusterCount == gap / info->clusterSize) ? gap : clusterCount * info->clusterSize;
+      }
+    }
+  }
+  return checkSize(info, entrySizes, gap) ? gap : 0;
+}
+
+
+/**
+ * Search an image for FATX partitions. Every 4 KiB boundary is checked for
+ * the FATX magic, in parallel chunks; each hit must have a sane cluster
+ * size and a chain map starting with the media marker, and is bounded by
+ * the next hit with a valid header (or the end of the image) whose
+ * cluster count gives a chain map entry size the media marker allows.
+ * Within that bound the size is the smallest whose chain map and root
+ * directory check out.
+ *
+ * @param backend Image to search
+ * @param imageSize Size of the image in bytes
+ * @return Partition map (possibly empty), or NULL if out of memory
+ */
+FATXPartitionMap* scanPartitions(FATXBackend* backend, u_int64_t imageSize) {
+  ScanContext ctx;
+  FATXPartitionMap *map;
+  FATXPartitionInfo info;
+  FATXPartitionInfo next;
+  u_int64_t *hits;
+  u_int64_t end;
+  int chunkCount;
+  int hitCount = 0;
+  int entrySizes;
+  int i;
+  int j;
+
+  ctx.backend = backend;
+  ctx.imageSize = imageSize;
+  chunkCount = (imageSize + SCAN_CHUNKSIZE - 1) / SCAN_CHUNKSIZE;
+  ctx.chunks = (ScanHits*) calloc(chunkCount + 1, sizeof(ScanHits));
+  map = (FATXPartitionMap*) calloc(1, sizeof(FATXPartitionMap));
+  if ((ctx.chunks == NULL) || (map == NULL)) {
+    free(ctx.chunks);
+    free(map);
+    return NULL;
+  }
+  runParallel(scanJob, &ctx, chunkCount, 0);
+
+  // chunks are in disk order, so the hits come out sorted
+  for(i = 0; i < chunkCount; i++) {
+    hitCount += ctx.chunks[i].count;
+  }
+  hits = (u_int64_t*) malloc((hitCount + 1) * sizeof(u_int64_t));
+  map->partitions = (FATXPartitionInfo*) malloc((hitCount + 1) * sizeof(FATXPartitionInfo));
+  if ((hits == NULL) || (map->partitions == NULL)) {
+    error("Out of memory");
+  }
+  for(i = 0, hitCount = 0; i < chunkCount; i++) {
+    memcpy(&hits[hitCount], ctx.chunks[i].offsets, ctx.chunks[i].count * sizeof(u_int64_t));
+    hitCount += ctx.chunks[i].count;
+    free(ctx.chunks[i].offsets);
+  }
+  free(ctx.chunks);
+
+  // a partition is bounded by the first later valid header it fits in
+  // front of; any hits before that are files inside it which happen to
+  // look like partitions
+  for(i = 0; i < hitCount; i = j) {
+    j = i + 1;
+    entrySizes = checkHeader(backend, hits[i], &info);
+    if (entrySizes == 0) {
+      continue;
+    }
+    for(; j <= hitCount; j++) {
+      end = (j < hitCount) ? hits[j] : imageSize;
+      if (((j == hitCount) || checkHeader(backend, hits[j], &next)) &&
+          ((info.size = fitSize(backend, hits[i], &info, entrySizes, end - hits[i])) != 0)) {
+        break;
+      }
+    }
+    if (j > hitCount) {
+      j = i + 1;
+      continue;
+    }
+    info.offset = hits[i];
+    map->partitions[map->count++] = info;
+
+    // hits in the space after a partition smaller than its gap get a look
+    for(j = i + 1; (j < hitCount) && (hits[j] < info.offset + info.size); j++);
+  }
+  free(hits);
+  return map;
+}
+
+
+/**
+ * Free a partition map
+ */
+void freePartitionMap(FATXPartitionMap* map) {
+  free(map->partitions);
+  free(map);
+}
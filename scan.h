@@ -0,0 +1,79 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Finding FATX partitions anywhere in a disk image
+
+#ifndef SCAN_H
+#define SCAN_H 1
+
+#include <sys/types.h>
+#include "backend.h"
+
+// Bytes of the image searched by one job
+#define SCAN_CHUNKSIZE (64 * 1024 * 1024)
+
+// Bytes read at a time within a job
+#define SCAN_READSIZE (1024 * 1024)
+
+// Partition headers are only looked for on this alignment
+#define SCAN_ALIGNMENT 4096
+
+/**
+ * A partition found by the scanner
+ */
+typedef struct {
+  // Byte offset and size of the partition
+  u_int64_t offset;
+  u_int64_t size;
+
+  // Cluster size from the header, and chain map entry size (2 or 4)
+  u_int32_t clusterSize;
+  u_int32_t chainMapEntrySize;
+} FATXPartitionInfo;
+
+/**
+ * Partitions found in an image, in disk order
+ */
+typedef struct {
+  FATXPartitionInfo *partitions;
+  int count;
+} FATXPartitionMap;
+
+/**
+ * Search an image for FATX partitions. Every 4 KiB boundary is checked for
+ * the FATX magic, in parallel chunks; each hit must have a sane cluster
+ * size and a chain map starting with the media marker, and is bounded by
+ * the next hit with a valid header (or the end of the image) whose
+ * cluster count gives a chain map entry size the media marker allows.
+ * Within that bound the size is the smallest whose chain map and root
+ * directory check out.
+ *
+ * @param backend Image to search
+ * @param imageSize Size of the image in bytes
+ * @return Partition map (possibly empty), or NULL if out of memory
+ */
+FATXPartitionMap* scanPartitions(FATXBackend* backend, u_int64_t imageSize);
+
+/**
+ * Free a partition map
+ */
+void freePartitionMap(FATXPartitionMap* map);
+
+#endif
@@ -0,0 +1,516 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Serving FATX partitions to other programs over a Unix domain socket
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "backend.h"
+#include "disk.h"
+#include "fsindex.h"
+#include "util.h"
+
+// Size of an entry record, before the name
+#define SERVE_ENTRY_SIZE 24
+
+// Size of a volume record, before the image name
+#define SERVE_VOLUME_SIZE 16
+
+// A partition being served
+typedef struct {
+  char *image;
+  int entry;
+  char letter;
+  FATXIndex *index;
+} ServeVolume;
+
+// Everything being served
+typedef struct {
+  ServeVolume *volumes;
+  int count;
+} ServeContext;
+
+// One client connection
+typedef struct {
+  ServeContext *ctx;
+  int fd;
+
+  // The reply being built, headers included
+  unsigned char *reply;
+  size_t allocated;
+  size_t used;
+
+  unsigned char *cluster;
+} ServeConnection;
+
+
+/**
+ * Read exactly length bytes
+ *
+ * @return 0 on success, -1 on failure or at the end of the stream
+ */
+static int readExact(int fd, void* data, size_t length) {
+  size_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = recv(fd, (unsigned char*) data + done, length - done, 0);
+    if ((n == -1) && (errno == EINTR)) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Write exactly length bytes
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeExact(int fd, void* data, size_t length) {
+  size_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = send(fd, (unsigned char*) data + done, length - done, MSG_NOSIGNAL);
+    if ((n == -1) && (errno == EINTR)) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Make room for more reply data
+ *
+ * @return Where to put length more bytes, or NULL if out of memory
+ */
+static unsigned char* growReply(ServeConnection* conn, size_t length) {
+  unsigned char *reply;
+  size_t allocated;
+
+  if (conn->used + length > conn->allocated) {
+    allocated = conn->allocated * 2;
+    while(allocated < conn->used + length) {
+      allocated *= 2;
+    }
+    reply = (unsigned char*) realloc(conn->reply, allocated);
+    if (reply == NULL) {
+      return NULL;
+    }
+    conn->reply = reply;
+    conn->allocated = allocated;
+  }
+  conn->used += length;
+  return conn->reply + conn->used - length;
+}
+
+/**
+ * Start a reply, dropping any data added so far
+ */
+static void startReply(ServeConnection* conn) {
+  conn->used = 4 + SERVE_REPLY_HEADERSIZE;
+}
+
+/**
+ * Send the reply built so far
+ *
+ * @param id Request being answered
+ * @param status 0, or a negative errno (the data is dropped)
+ * @return 0 on success, -1 if the connection failed
+ */
+static int sendReply(ServeConnection* conn, u_int32_t id, int32_t status) {
+  u_int32_t length;
+
+  if (status != 0) {
+    startReply(conn);
+  }
+  length = conn->used - 4;
+  memcpy(conn->reply, &length, 4);
+  memcpy(conn->reply + 4, &id, 4);
+  memcpy(conn->reply + 8, &status, 4);
+  return writeExact(conn->fd, conn->reply, conn->used);
+}
+
+/**
+ * Add an entry record to the reply
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int addEntry(ServeConnection* conn, FATXIndex* index, int node) {
+  FATXDirEntry *entry = &index->tree->nodes[node].entry;
+  int nameLength = indexNameLength(index, node);
+  u_int64_t size = isTreeDirectory(&index->tree->nodes[node]) ? 0 : entry->fileSize;
+  int64_t modified = loadDosTime(entry->modDate, entry->modTime);
+  unsigned char *record;
+
+  record = growReply(conn, SERVE_ENTRY_SIZE + nameLength);
+  if (record == NULL) {
+    return -1;
+  }
+  record[0] = entry->attributes;
+  record[1] = nameLength;
+  record[2] = record[3] = 0;
+  memcpy(record + 4, &entry->firstCluster, 4);
+  memcpy(record + 8, &size, 8);
+  memcpy(record + 16, &modified, 8);
+  memcpy(record + SERVE_ENTRY_SIZE, entry->filename, nameLength);
+  return 0;
+}
+
+/**
+ * Add the volume records to the reply
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int addVolumes(ServeConnection* conn) {
+  ServeVolume *volume;
+  unsigned char *record;
+  u_int16_t nameLength;
+  int i;
+
+  for(i = 0; i < conn->ctx->count; i++) {
+    volume = &conn->ctx->volumes[i];
+    nameLength = strlen(volume->image);
+    record = growReply(conn, SERVE_VOLUME_SIZE + nameLength);
+    if (record == NULL) {
+      return -1;
+    }
+    record[0] = volume->entry;
+    record[1] = volume->letter;
+    memcpy(record + 2, &nameLength, 2);
+    memcpy(record + 4, &volume->index->partition->clusterSize, 4);
+    memcpy(record + 8, &volume->index->partition->partitionSize, 8);
+    memcpy(record + SERVE_VOLUME_SIZE, volume->image, nameLength);
+  }
+  return 0;
+}
+
+/**
+ * Send a file in pieces
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+static int sendFile(ServeConnection* conn, u_int32_t id, FATXIndex* index, int node) {
+  u_int64_t offset = 0;
+  unsigned char *data;
+  int64_t done;
+
+  do {
+    startReply(conn);
+    data = growReply(conn, SERVE_CHUNKSIZE);
+    if (data == NULL) {
+      return sendReply(conn, id, -ENOMEM);
+    }
+    done = readIndexedFile(index, node, data, offset, SERVE_CHUNKSIZE, conn->cluster);
+    if (done == -1) {
+      return sendReply(conn, id, -EIO);
+    }
+    conn->used -= SERVE_CHUNKSIZE - done;
+    offset += done;
+    if (sendReply(conn, id, 0) == -1) {
+      return -1;
+    }
+  } while(done > 0);
+  return 0;
+}
+
+/**
+ * Answer one request
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+static int handleRequest(ServeConnection* conn, unsigned char* request, u_int32_t length) {
+  char path[SERVE_MAX_REQUEST];
+  FATXIndex *index;
+  unsigned char *data;
+  u_int32_t id;
+  u_int16_t volume;
+  u_int64_t offset;
+  u_int64_t size;
+  int64_t done;
+  int node;
+  int i;
+
+  memcpy(&id, request, 4);
+  memcpy(&volume, request + 6, 2);
+  memcpy(&offset, request + 8, 8);
+  memcpy(&size, request + 16, 8);
+  memcpy(path, request + SERVE_REQUEST_HEADERSIZE, length - SERVE_REQUEST_HEADERSIZE);
+  path[length - SERVE_REQUEST_HEADERSIZE] = 0;
+  startReply(conn);
+
+  if (request[4] == SERVE_OP_VOLUMES) {
+    return sendReply(conn, id, (addVolumes(conn) == -1) ? -ENOMEM : 0);
+  }
+  if (volume >= conn->ctx->count) {
+    return sendReply(conn, id, -ENODEV);
+  }
+  index = conn->ctx->volumes[volume].index;
+  node = findIndexPath(index, path);
+  if (node == -1) {
+    return sendReply(conn, id, -ENOENT);
+  }
+
+  switch(request[4]) {
+  case SERVE_OP_LIST:
+    if (!isTreeDirectory(&index->tree->nodes[node])) {
+      return sendReply(conn, id, -ENOTDIR);
+    }
+    for(i = index->childStart[node]; i < index->childStart[node + 1]; i++) {
+      if (addEntry(conn, index, index->children[i]) == -1) {
+        return sendReply(conn, id, -ENOMEM);
+      }
+    }
+    return sendReply(conn, id, 0);
+
+  case SERVE_OP_STAT:
+    return sendReply(conn, id, (addEntry(conn, index, node) == -1) ? -ENOMEM : 0);
+
+  case SERVE_OP_READ:
+  case SERVE_OP_DUMP:
+    if (isTreeDirectory(&index->tree->nodes[node])) {
+      return sendReply(conn, id, -EISDIR);
+    }
+    if (request[4] == SERVE_OP_DUMP) {
+      return sendFile(conn, id, index, node);
+    }
+    if (size > SERVE_MAX_READ) {
+      size = SERVE_MAX_READ;
+    }
+    data = growReply(conn, size);
+    if (data == NULL) {
+      return sendReply(conn, id, -ENOMEM);
+    }
+    done = readIndexedFile(index, node, data, offset, size, conn->cluster);
+    if (done == -1) {
+      return sendReply(conn, id, -EIO);
+    }
+    conn->used -= size - done;
+    return sendReply(conn, id, 0);
+  }
+  return sendReply(conn, id, -ENOSYS);
+}
+
+/**
+ * Serve one connection until it closes
+ */
+static void* serveConnection(void* context) {
+  ServeConnection *conn = (ServeConnection*) context;
+  unsigned char request[SERVE_MAX_REQUEST];
+  u_int32_t length;
+
+  while(readExact(conn->fd, &length, 4) == 0) {
+    // a bad frame leaves no way to find the next one
+    if ((length < SERVE_REQUEST_HEADERSIZE) || (length > SERVE_MAX_REQUEST) ||
+        (readExact(conn->fd, request, length) == -1) ||
+        (handleRequest(conn, request, length) == -1)) {
+      break;
+    }
+  }
+
+  close(conn->fd);
+  free(conn->reply);
+  free(conn->cluster);
+  free(conn);
+  return NULL;
+}
+
+/**
+ * Open an image and index the partitions to serve
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int addImage(ServeContext* ctx, char* image, char* partitionSpec) {
+  ServeVolume *volume;
+  FATXBackend *backend;
+  FATXDisk *disk;
+  FILE *sourceFd;
+  int first = 0;
+  int last;
+  int i;
+
+  if ((sourceFd = fopen(image, "r")) == NULL) {
+    fprintf(stderr, "serve : unable to open %s: %s\n", image, strerror(errno));
+    return -1;
+  }
+  backend = openBackend(sourceFd, image);
+  if (backend == NULL) {
+    fprintf(stderr, "serve : unable to read %s: %s\n", image, strerror(errno));
+    fclose(sourceFd);
+    return -1;
+  }
+  disk = openDisk(backend, backend->size);
+  if (disk == NULL) {
+    error("Out of memory");
+  }
+  last = disk->count - 1;
+  if (partitionSpec != NULL) {
+    first = last = findDiskEntry(disk, partitionSpec);
+    if (first == -1) {
+      fprintf(stderr, "serve : no FATX partition %s found in %s\n", partitionSpec, image);
+      return -1;
+    }
+  }
+
+  for(i = first; i <= last; i++) {
+    if (getDiskPartition(disk, i) == NULL) {
+      continue;
+    }
+    ctx->volumes = (ServeVolume*) realloc(ctx->volumes, (ctx->count + 1) * sizeof(ServeVolume));
+    if (ctx->volumes == NULL) {
+      error("Out of memory");
+    }
+    volume = &ctx->volumes[ctx->count];
+    volume->image = image;
+    volume->entry = i;
+    volume->letter = disk->entries[i].letter;
+    volume->index = createIndex(disk->entries[i].partition);
+    if (volume->index == NULL) {
+      error("Out of memory");
+    }
+    printf("serve : volume %d is %s:%c (partition %d), %d entries\n", ctx->count, image,
+           volume->letter ? volume->letter : '-', i, volume->index->tree->count);
+    ctx->count++;
+  }
+  return 0;
+}
+
+/**
+ * Create the listening socket
+ *
+ * @return The socket, or -1 on failure
+ */
+static int openSocket(char* socketPath) {
+  struct sockaddr_un address;
+  struct stat st;
+  int fd;
+
+  if (strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "serve : socket path %s is too long\n", socketPath);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath);
+
+  // a socket left by an earlier server is replaced; anything else is not
+  if ((lstat(socketPath, &st) == 0) && S_ISSOCK(st.st_mode)) {
+    unlink(socketPath);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ((fd == -1) || (bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1) ||
+      (listen(fd, SOMAXCONN) == -1)) {
+    fprintf(stderr, "serve : unable to listen on %s: %s\n", socketPath, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+int serveImages(char* socketPath, char** images, int count, char* partitionSpec) {
+  ServeContext ctx;
+  ServeConnection *conn;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int listenFd;
+  int fd;
+  int i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  for(i = 0; i < count; i++) {
+    if (addImage(&ctx, images[i], partitionSpec) == -1) {
+      return -1;
+    }
+  }
+  if (ctx.count == 0) {
+    fprintf(stderr, "serve : no FATX partitions found\n");
+    return -1;
+  }
+
+  listenFd = openSocket(socketPath);
+  if (listenFd == -1) {
+    return -1;
+  }
+  printf("serve : serving %d volumes on %s\n", ctx.count, socketPath);
+  fflush(stdout);
+
+  signal(SIGPIPE, SIG_IGN);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while(1) {
+    fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      if ((errno == EMFILE) || (errno == ENFILE)) {
+        // out of descriptors: wait for connections to close
+        usleep(10000);
+        continue;
+      }
+      fprintf(stderr, "serve : unable to accept connections: %s\n", strerror(errno));
+      break;
+    }
+
+    conn = (ServeConnection*) calloc(1, sizeof(ServeConnection));
+    if (conn != NULL) {
+      conn->ctx = &ctx;
+      conn->fd = fd;
+      conn->allocated = 64 * 1024;
+      conn->reply = (unsigned char*) malloc(conn->allocated);
+      // big enough for the largest cluster size loadPartition() accepts
+      conn->cluster = (unsigned char*) malloc(0x10000);
+    }
+    if ((conn == NULL) || (conn->reply == NULL) || (conn->cluster == NULL) ||
+        (pthread_create(&tid, &attr, serveConnection, conn) != 0)) {
+      // too busy: drop the connection
+      if (conn != NULL) {
+        free(conn->reply);
+        free(conn->cluster);
+        free(conn);
+      }
+      close(fd);
+    }
+  }
+
+  close(listenFd);
+  return -1;
+}
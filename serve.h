@@ -0,0 +1,83 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Serving FATX partitions to other programs over a Unix domain socket
+
+#ifndef SERVE_H
+#define SERVE_H 1
+
+// Requests and replies are frames: a 4 byte length of the rest of the
+// frame, then the rest. All values are little endian.
+//
+// Request: id (4), operation (1), reserved (1), volume (2), offset (8),
+// length (8), then the path, not zero terminated
+#define SERVE_REQUEST_HEADERSIZE 24
+
+// Reply: id of the request (4), status (4, 0 or a negative errno), then
+// the data
+#define SERVE_REPLY_HEADERSIZE 8
+
+// List the volumes being served. Each is described by a partition index
+// (1), drive letter (1, 0 if none), image name length (2), cluster size
+// (4), partition size (8), then the image name.
+#define SERVE_OP_VOLUMES 0
+
+// List a directory, as one entry record per child. An entry record is
+// attributes (1), name length (1), reserved (2), first cluster (4), size
+// (8), modification time (8, seconds since 1970), then the name.
+#define SERVE_OP_LIST 1
+
+// Describe a file or directory with one entry record
+#define SERVE_OP_STAT 2
+
+// Read up to length bytes of a file from offset (less at the end of the
+// file, and at most SERVE_MAX_READ)
+#define SERVE_OP_READ 3
+
+// Read a whole file: the replies each hold the next piece of it, and the
+// last one holds nothing
+#define SERVE_OP_DUMP 4
+
+// Largest request frame accepted
+#define SERVE_MAX_REQUEST 4096
+
+// Most data in one reply to a read
+#define SERVE_MAX_READ (16 * 1024 * 1024)
+
+// Size of each piece of a dumped file
+#define SERVE_CHUNKSIZE (1024 * 1024)
+
+/**
+ * Serve the FATX partitions of some images until killed. Each partition
+ * is opened and indexed once (see createIndex()), and volumes are
+ * numbered from 0 in the order they are found. Every connection is
+ * handled by a thread of its own.
+ *
+ * @param socketPath Where to create the socket; a stale socket there is
+ *                   replaced
+ * @param images Image files
+ * @param count Number of images
+ * @param partitionSpec Partition to serve from each image (see
+ *        findDiskEntry()), or NULL for all of them
+ * @return -1 on failure to start
+ */
+int serveImages(char* socketPath, char** images, int count, char* partitionSpec);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Streaming a FATX directory tree out as a tar archive
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tar.h"
+#include "extent.h"
+#include "tree.h"
+#include "util.h"
+
+// Longest path written
+#define TAR_PATH_MAX 4096
+
+// A chunk of file data read by the reading thread, waiting to be written
+typedef struct {
+  unsigned char *data;
+  u_int64_t length;
+
+  // Set if the rest of the file could not be read
+  int broken;
+  int full;
+} TarBuffer;
+
+// State for one archive
+typedef struct {
+  FATXPartition *partition;
+  FATXTree *tree;
+  int outputFd;
+
+  // Nodes to archive, in order
+  int *nodes;
+  int count;
+
+  // Ring of buffers from the reading thread to the writing one
+  TarBuffer buffers[TAR_BUFFERS];
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int failed;
+} TarContext;
+
+// A ustar header block
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TarHeader;
+
+
+/**
+ * Wait for a buffer to be full or empty
+ *
+ * @return 0 once it is, -1 if the archive has failed
+ */
+static int waitForBuffer(TarContext* ctx, TarBuffer* buffer, int full) {
+  pthread_mutex_lock(&ctx->lock);
+  while((buffer->full != full) && !ctx->failed) {
+    pthread_cond_wait(&ctx->changed, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return ctx->failed ? -1 : 0;
+}
+
+
+/**
+ * Mark a buffer full or empty, or the archive failed
+ */
+static void setBuffer(TarContext* ctx, TarBuffer* buffer, int full, int failed) {
+  pthread_mutex_lock(&ctx->lock);
+  if (buffer != NULL) {
+    buffer->full = full;
+  }
+  if (failed) {
+    ctx->failed = 1;
+  }
+  pthread_cond_broadcast(&ctx->changed);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+
+/**
+ * Size of the data of a node in the archive
+ */
+static u_int64_t nodeSize(TarContext* ctx, int node) {
+  return isTreeDirectory(&ctx->tree->nodes[node]) ? 0 : ctx->tree->nodes[node].entry.fileSize;
+}
+
+
+/**
+ * Reading thread: read the data of every file in order, an extent (or a
+ * chunk of one) at a time
+ */
+static void* readFiles(void* context) {
+  TarContext *ctx = (TarContext*) context;
+  u_int32_t clusterSize = ctx->partition->clusterSize;
+  FATXExtent *extents;
+  TarBuffer *buffer;
+  u_int64_t size;
+  u_int64_t done;
+  u_int64_t within;
+  int extentCount;
+  int broken;
+  int slot = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < ctx->count; i++) {
+    size = nodeSize(ctx, ctx->nodes[i]);
+    if (size == 0) {
+      continue;
+    }
+    extentCount = 0;
+    extents = buildExtents(ctx->partition, ctx->tree->nodes[ctx->nodes[i]].entry.firstCluster,
+                           (size + clusterSize - 1) / clusterSize, &extentCount, NULL);
+
+    done = 0;
+    broken = 0;
+    for(j = 0; (j < extentCount) && (done < size) && !broken; ) {
+      buffer = &ctx->buffers[slot];
+      slot = (slot + 1) % TAR_BUFFERS;
+      if (waitForBuffer(ctx, buffer, 0) == -1) {
+        free(extents);
+        return NULL;
+      }
+      within = done - extents[j].offset;
+      buffer->length = (u_int64_t) extents[j].length * clusterSize - within;
+      if (buffer->length > TAR_CHUNKSIZE) {
+        buffer->length = TAR_CHUNKSIZE;
+      }
+      if (buffer->length > size - done) {
+        buffer->length = size - done;
+      }
+      broken = buffer->broken = readClusters(ctx->partition, extents[j].start + within / clusterSize,
+                                             buffer->data, buffer->length) == -1;
+      if (broken) {
+        buffer->length = 0;
+      }
+      done += buffer->length;
+      if (done == extents[j].offset + (u_int64_t) extents[j].length * clusterSize) {
+        j++;
+      }
+      setBuffer(ctx, buffer, 1, 0);
+    }
+    free(extents);
+
+    // a chain that ends early leaves the rest of the file unreadable
+    if ((done < size) && !broken) {
+      buffer = &ctx->buffers[slot];
+      slot = (slot + 1) % TAR_BUFFERS;
+      if (waitForBuffer(ctx, buffer, 0) == -1) {
+        return NULL;
+      }
+      buffer->length = 0;
+      buffer->broken = 1;
+      setBuffer(ctx, buffer, 1, 0);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Write to the archive
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeArchive(TarContext* ctx, void* data, u_int64_t length) {
+  u_int64_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = write(ctx->outputFd, (unsigned char*) data + done, length - done);
+    if ((n == -1) && (errno == EINTR)) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "tar : unable to write the archive: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Write zeros to the archive
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeZeros(TarContext* ctx, u_int64_t length) {
+  static const unsigned char zeros[TAR_BLOCKSIZE];
+  u_int64_t piece;
+
+  for(; length > 0; length -= piece) {
+    piece = (length < TAR_BLOCKSIZE) ? length : TAR_BLOCKSIZE;
+    if (writeArchive(ctx, (void*) zeros, piece) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Fill a header field with an octal number, zero padded and terminated
+ */
+static void storeOctal(char* field, size_t size, u_int64_t value) {
+  size_t i;
+
+  field[size - 1] = 0;
+  for(i = size - 1; i > 0; i--) {
+    field[i - 1] = '0' + (value & 7);
+    value >>= 3;
+  }
+}
+
+
+/**
+ * Write a header block
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeHeader(TarContext* ctx, const char* name, const char* prefix, char type,
+                       unsigned int mode, u_int64_t size, time_t mtime) {
+  TarHeader header;
+  unsigned int checksum = 0;
+  unsigned int i;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.name, name, strnlen(name, sizeof(header.name)));
+  memcpy(header.prefix, prefix, strnlen(prefix, sizeof(header.prefix)));
+  storeOctal(header.mode, sizeof(header.mode), mode);
+  storeOctal(header.uid, sizeof(header.uid), 0);
+  storeOctal(header.gid, sizeof(header.gid), 0);
+  storeOctal(header.size, sizeof(header.size), size);
+  storeOctal(header.mtime, sizeof(header.mtime), (mtime > 0) ? mtime : 0);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+
+  // the checksum is worked out with its own field as spaces
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  for(i = 0; i < sizeof(header); i++) {
+    checksum += ((unsigned char*) &header)[i];
+  }
+  storeOctal(header.checksum, sizeof(header.checksum) - 1, checksum);
+  return writeArchive(ctx, &header, sizeof(header));
+}
+
+
+/**
+ * Write the header of an entry, with a pax extended header first if its
+ * path does not fit a ustar header
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int writeEntry(TarContext* ctx, int node, char* path) {
+  FATXDirEntry *entry = &ctx->tree->nodes[node].entry;
+  int directory = isTreeDirectory(&ctx->tree->nodes[node]);
+  unsigned int mode = directory ? 0755 : 0644;
+  time_t mtime = loadDosTime(entry->modDate, entry->modTime);
+  char record[TAR_PATH_MAX + 32];
+  char prefix[156];
+  size_t length = strlen(path);
+  size_t recordLength;
+  size_t digits;
+  char *split;
+
+  if (entry->attributes & FATX_FILEATTR_READONLY) {
+    mode &= ~0222;
+  }
+
+  // ustar fits names of up to 100 characters, plus a prefix of up to 155
+  // split off at a /
+  prefix[0] = 0;
+  split = path;
+  if (length > 100) {
+    for(split = path + length - 100; (*split != 0) && (*split != '/'); split++);
+    if ((*split == '/') && (split - path <= 155)) {
+      memcpy(prefix, path, split - path);
+      prefix[split - path] = 0;
+      split++;
+    } else {
+      // "<length> path=<path>\n", where the length counts its own digits
+      recordLength = length + 7;
+      for(digits = 1; snprintf(NULL, 0, "%zu", recordLength + digits) != (int) digits; digits++);
+      recordLength += digits;
+      snprintf(record, sizeof(record), "%zu path=%s\n", recordLength, path);
+      if ((writeHeader(ctx, "././@PaxHeader", "", 'x', 0644, recordLength, mtime) == -1) ||
+          (writeArchive(ctx, record, recordLength) == -1) ||
+          (writeZeros(ctx, (TAR_BLOCKSIZE - recordLength % TAR_BLOCKSIZE) % TAR_BLOCKSIZE) == -1)) {
+        return -1;
+      }
+      split = path + length - ((length < 100) ? length : 100);
+    }
+  }
+  return writeHeader(ctx, split, prefix, directory ? '5' : '0', mode, nodeSize(ctx, node), mtime);
+}
+
+
+/**
+ * Write the archive: each entry's header, then its data from the reading
+ * thread
+ *
+ * @param strip Characters to take off the front of each node's path
+ * @return 0 on success, 1 if some files could not be read, -1 on failure
+ */
+static int writeEntries(TarContext* ctx, size_t strip) {
+  char path[TAR_PATH_MAX];
+  TarBuffer *buffer;
+  u_int64_t size;
+  u_int64_t done;
+  int broken = 0;
+  int slot = 0;
+  int i;
+
+  for(i = 0; i < ctx->count; i++) {
+    treePath(ctx->tree, ctx->nodes[i], path, sizeof(path) - 1);
+    if (isTreeDirectory(&ctx->tree->nodes[ctx->nodes[i]])) {
+      strcat(path, "/");
+    }
+    if (writeEntry(ctx, ctx->nodes[i], path + strip) == -1) {
+      return -1;
+    }
+
+    size = nodeSize(ctx, ctx->nodes[i]);
+    for(done = 0; done < size; ) {
+      buffer = &ctx->buffers[slot];
+      slot = (slot + 1) % TAR_BUFFERS;
+      if (waitForBuffer(ctx, buffer, 1) == -1) {
+        return -1;
+      }
+      if (buffer->broken) {
+        fprintf(stderr, "tar : %s: only %llu of %llu bytes could be read\n", path,
+                (unsigned long long) done, (unsigned long long) size);
+        broken = 1;
+        setBuffer(ctx, buffer, 0, 0);
+        if (writeZeros(ctx, size - done) == -1) {
+          return -1;
+        }
+        break;
+      }
+      if (writeArchive(ctx, buffer->data, buffer->length) == -1) {
+        return -1;
+      }
+      // the reading thread refills the buffer once it is marked empty
+      done += buffer->length;
+      setBuffer(ctx, buffer, 0, 0);
+    }
+    if (writeZeros(ctx, (TAR_BLOCKSIZE - size % TAR_BLOCKSIZE) % TAR_BLOCKSIZE) == -1) {
+      return -1;
+    }
+  }
+
+  // the end of an archive is two empty blocks
+  if (writeZeros(ctx, 2 * TAR_BLOCKSIZE) == -1) {
+    return -1;
+  }
+  return broken;
+}
+
+
+/**
+ * Check if a node is below another
+ */
+static int isBelow(FATXTree* tree, int node, int top) {
+  while(node > top) {
+    node = tree->nodes[node].parent;
+  }
+  return node == top;
+}
+
+
+int tarTree(FATXPartition* partition, char* path, int outputFd) {
+  char parentPath[TAR_PATH_MAX];
+  TarContext ctx;
+  pthread_t reader;
+  size_t strip;
+  int result;
+  int top;
+  int i;
+
+  memset(&ctx, 0, sizeof(TarContext));
+  ctx.partition = partition;
+  ctx.outputFd = outputFd;
+  ctx.tree = loadTree(partition);
+  if (ctx.tree == NULL) {
+    error("Out of memory");
+  }
+  top = findTreeNode(ctx.tree, path);
+  if (top == -1) {
+    fprintf(stderr, "tar : %s not found\n", path);
+    freeTree(ctx.tree);
+    return -1;
+  }
+
+  // the entry asked for and everything under it, parents first; names
+  // are relative to the directory holding it
+  ctx.nodes = (int*) malloc(ctx.tree->count * sizeof(int));
+  if (ctx.nodes == NULL) {
+    error("Out of memory");
+  }
+  for(i = (top == 0) ? 1 : top; i < ctx.tree->count; i++) {
+    if (isBelow(ctx.tree, i, top)) {
+      ctx.nodes[ctx.count++] = i;
+    }
+  }
+  strip = 1;
+  if ((top != 0) && (ctx.tree->nodes[top].parent != 0)) {
+    treePath(ctx.tree, ctx.tree->nodes[top].parent, parentPath, sizeof(parentPath));
+    strip = strlen(parentPath) + 1;
+  }
+
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.changed, NULL);
+  for(i = 0; i < TAR_BUFFERS; i++) {
+    ctx.buffers[i].data = (unsigned char*) malloc(TAR_CHUNKSIZE);
+    if (ctx.buffers[i].data == NULL) {
+      error("Out of memory");
+    }
+  }
+
+  if (pthread_create(&reader, NULL, readFiles, &ctx) != 0) {
+    error("Unable to start reading thread");
+  }
+  result = writeEntries(&ctx, strip);
+  if (result == -1) {
+    setBuffer(&ctx, NULL, 0, 1);
+  }
+  pthread_join(reader, NULL);
+
+  for(i = 0; i < TAR_BUFFERS; i++) {
+    free(ctx.buffers[i].data);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+  pthread_cond_destroy(&ctx.changed);
+  free(ctx.nodes);
+  freeTree(ctx.tree);
+  return (result == 0) ? 0 : -1;
+}
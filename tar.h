@@ -0,0 +1,52 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Streaming a FATX directory tree out as a tar archive
+
+#ifndef TAR_H
+#define TAR_H 1
+
+#include "fatx.h"
+
+// Size of a tar block
+#define TAR_BLOCKSIZE 512
+
+// Most file data read at once
+#define TAR_CHUNKSIZE (4 * 1024 * 1024)
+
+// Buffers in flight between the reading and writing threads
+#define TAR_BUFFERS 4
+
+/**
+ * Write a file or directory and everything under it as a POSIX pax
+ * archive. Names are relative to the directory holding the path (to the
+ * root for /), with pax extended headers for those too long for ustar.
+ * Modification times come from the DOS dates. A thread reads file data an
+ * extent at a time ahead of the writing. A file whose data cannot be read
+ * is padded with zeros, so the archive stays readable.
+ *
+ * @param partition FATX partition
+ * @param path File or directory to archive
+ * @param outputFd Where to write the archive
+ * @return 0 on success, -1 on failure
+ */
+int tarTree(FATXPartition* partition, char* path, int outputFd);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// In-memory copy of a FATX directory tree
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "tree.h"
+#include "fatxcore.h"
+
+// Building a tree
+typedef struct {
+  FATXTree *tree;
+  FATXPartition *partition;
+
+  // Bitmap of directory clusters already walked
+  u_int64_t *visited;
+
+  // Node of the directory being walked
+  int dirIndex;
+} TreeContext;
+
+static int addDirectory(TreeContext* ctx, int dirIndex);
+
+
+/**
+ * Add a node to a tree
+ *
+ * @return Index of the node, or -1 if out of memory
+ */
+static int addNode(FATXTree* tree, int parent, FATXDirEntry* entry) {
+  FATXTreeNode *nodes;
+
+  if (tree->count == tree->allocated) {
+    nodes = (FATXTreeNode*) realloc(tree->nodes, (tree->allocated ? tree->allocated * 2 : 1024) * sizeof(FATXTreeNode));
+    if (nodes == NULL) {
+      return -1;
+    }
+    tree->nodes = nodes;
+    tree->allocated = tree->allocated ? tree->allocated * 2 : 1024;
+  }
+  tree->nodes[tree->count].entry = *entry;
+  tree->nodes[tree->count].parent = parent;
+  return tree->count++;
+}
+
+
+/**
+ * Check and set a directory's first cluster in the visited bitmap
+ *
+ * @return 1 if it was already visited, 0 if not
+ */
+static int visitCluster(u_int64_t* visited, u_int32_t clusterId) {
+  u_int64_t bit = 1ULL << (clusterId % 64);
+
+  if (visited[clusterId / 64] & bit) {
+    return 1;
+  }
+  visited[clusterId / 64] |= bit;
+  return 0;
+}
+
+
+/**
+ * Add one entry of a directory to the tree, and what is under it
+ */
+static int addEntry(void* context, FATXDirEntry* entry) {
+  TreeContext *ctx = (TreeContext*) context;
+  FATXTree *tree = ctx->tree;
+  u_int32_t clusterCount = ctx->partition->clusterCount;
+  char path[4096];
+  int index;
+
+  if ((entry->attributes & FATX_FILEATTR_DIRECTORY) &&
+      ((entry->firstCluster >= clusterCount) || visitCluster(ctx->visited, entry->firstCluster))) {
+    treePath(tree, ctx->dirIndex, path, sizeof(path));
+    fprintf(stderr, "loadTree : %s%s%.*s starts at cluster %u, which is %s; skipped\n", path,
+            (ctx->dirIndex > 0) ? "/" : "", (entry->filenameSize <= FATX_FILENAME_MAX) ? entry->filenameSize : FATX_FILENAME_MAX,
+            entry->filename, entry->firstCluster,
+            (entry->firstCluster >= clusterCount) ? "outside the partition" : "already in the tree");
+    tree->corrupt++;
+    return 0;
+  }
+  index = addNode(tree, ctx->dirIndex, entry);
+  if (index == -1) {
+    return FATX_ERR_NOMEM;
+  }
+  if (isTreeDirectory(&tree->nodes[index])) {
+    return addDirectory(ctx, index);
+  }
+  return 0;
+}
+
+
+/**
+ * Add the contents of a directory to a tree, recursively. A directory
+ * whose first cluster has been seen before (or is outside the partition)
+ * would make the walk loop forever, so it is reported and left out, as is
+ * the rest of a directory which cannot be read.
+ *
+ * @param ctx Tree being built
+ * @param dirIndex Node of the directory
+ * @return 0 on success, FATX_ERR_NOMEM if out of memory
+ */
+static int addDirectory(TreeContext* ctx, int dirIndex) {
+  TreeContext inner = *ctx;
+  unsigned char *buffer;
+  char path[4096];
+  int status;
+
+  buffer = (unsigned char*) malloc(ctx->partition->clusterSize);
+  if (buffer == NULL) {
+    return FATX_ERR_NOMEM;
+  }
+  inner.dirIndex = dirIndex;
+  status = fatxWalkDirectory(ctx->partition, ctx->tree->nodes[dirIndex].entry.firstCluster, buffer,
+                             addEntry, &inner);
+  free(buffer);
+
+  if ((status != FATX_OK) && (status != FATX_ERR_NOMEM)) {
+    treePath(ctx->tree, dirIndex, path, sizeof(path));
+    fprintf(stderr, "loadTree : %s: %s; the rest of it skipped\n", path, fatxStatusString(status));
+    ctx->tree->corrupt++;
+    status = FATX_OK;
+  }
+  return status;
+}
+
+
+/**
+ * Read the whole directory tree of a partition
+ *
+ * @param partition FATX partition
+ * @return New tree, or NULL if out of memory
+ */
+FATXTree* loadTree(FATXPartition* partition) {
+  FATXDirEntry root;
+  TreeContext ctx;
+  FATXTree *tree;
+  u_int64_t *visited;
+  int result;
+
+  tree = (FATXTree*) calloc(1, sizeof(FATXTree));
+  visited = (u_int64_t*) calloc(partition->clusterCount / 64 + 1, sizeof(u_int64_t));
+  if ((tree == NULL) || (visited == NULL)) {
+    free(tree);
+    free(visited);
+    return NULL;
+  }
+
+  memset(&root, 0, sizeof(FATXDirEntry));
+  root.attributes = FATX_FILEATTR_DIRECTORY;
+  root.firstCluster = FATX_ROOT_FAT_CLUSTER;
+  visitCluster(visited, FATX_ROOT_FAT_CLUSTER);
+  result = addNode(tree, -1, &root);
+  if (result != -1) {
+    ctx.tree = tree;
+    ctx.partition = partition;
+    ctx.visited = visited;
+    result = addDirectory(&ctx, 0);
+  }
+  free(visited);
+
+  if (result != FATX_OK) {
+    freeTree(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+
+/**
+ * Free a tree
+ */
+void freeTree(FATXTree* tree) {
+  free(tree->nodes);
+  free(tree);
+}
+
+
+/**
+ * Build the full path of a node, using / separators
+ *
+ * @param tree Tree
+ * @param index Node
+ * @param path Where to put the path
+ * @param size Size of path
+ */
+void treePath(FATXTree* tree, int index, char* path, size_t size) {
+  FATXDirEntry *entry;
+  size_t used = 0;
+  size_t length;
+
+  path[0] = 0;
+  // build the path backwards from the end of the buffer, then move it down
+  while((index > 0) && (size > 1)) {
+    entry = &tree->nodes[index].entry;
+    length = (entry->filenameSize <= FATX_FILENAME_MAX) ? entry->filenameSize : FATX_FILENAME_MAX;
+    if (used + length + 1 >= size) {
+      break;
+    }
+    used += length + 1;
+    memcpy(path + size - 1 - used + 1, entry->filename, length);
+    path[size - 1 - used] = '/';
+    index = tree->nodes[index].parent;
+  }
+  if (used == 0) {
+    snprintf(path, size, "/");
+    return;
+  }
+  memmove(path, path + size - 1 - used, used);
+  path[used] = 0;
+}
+
+
+/**
+ * Find a node by path, ignoring case as FATX does
+ *
+ * @param tree Tree
+ * @param path / separated path from the root
+ * @return Index of the node, or -1 if there is none
+ */
+int findTreeNode(FATXTree* tree, const char* path) {
+  const char *end;
+  int node = 0;
+  int i;
+
+  while(*path != 0) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    for(end = path; (*end != 0) && (*end != '/'); end++);
+
+    // children come after their parent
+    for(i = node + 1; i < tree->count; i++) {
+      if ((tree->nodes[i].parent == node) && (tree->nodes[i].entry.filenameSize == end - path) &&
+          !strncasecmp(tree->nodes[i].entry.filename, path, end - path)) {
+        break;
+      }
+    }
+    if (i == tree->count) {
+      return -1;
+    }
+    node = i;
+    path = end;
+  }
+  return node;
+}
+
+
+/**
+ * Check if a node is a directory
+ */
+int isTreeDirectory(FATXTreeNode* node) {
+  return (node->entry.attributes & FATX_FILEATTR_DIRECTORY) != 0;
+}
@@ -0,0 +1,91 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// In-memory copy of a FATX directory tree
+
+#ifndef TREE_H
+#define TREE_H 1
+
+#include <sys/types.h>
+#include "fatx.h"
+
+/**
+ * A file or directory in a tree
+ */
+typedef struct {
+  // Copy of the directory entry (zeroed for the root, apart from its
+  // attributes and first cluster)
+  FATXDirEntry entry;
+
+  // Index of the parent directory (-1 for the root)
+  int parent;
+} FATXTreeNode;
+
+/**
+ * Every entry of a partition, parents before children; node 0 is the root
+ */
+typedef struct {
+  FATXTreeNode *nodes;
+  int count;
+  int allocated;
+
+  // Directories left out because their first cluster was already in the
+  // tree or outside the partition
+  int corrupt;
+} FATXTree;
+
+/**
+ * Read the whole directory tree of a partition
+ *
+ * @param partition FATX partition
+ * @return New tree, or NULL if out of memory
+ */
+FATXTree* loadTree(FATXPartition* partition);
+
+/**
+ * Free a tree
+ */
+void freeTree(FATXTree* tree);
+
+/**
+ * Build the full path of a node, using / separators
+ *
+ * @param tree Tree
+ * @param index Node
+ * @param path Where to put the path
+ * @param size Size of path
+ */
+void treePath(FATXTree* tree, int index, char* path, size_t size);
+
+/**
+ * Find a node by path, ignoring case as FATX does
+ *
+ * @param tree Tree
+ * @param path / separated path from the root
+ * @return Index of the node, or -1 if there is none
+ */
+int findTreeNode(FATXTree* tree, const char* path);
+
+/**
+ * Check if a node is a directory
+ */
+int isTreeDirectory(FATXTreeNode* node);
+
+#endif
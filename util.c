@@ -23,6 +23,14 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 #include "util.h"
 
 /**
@@ -58,6 +66,58 @@ void loadDosDateTime(DosDateTime* dateTime,
 
 
 
+/**
+ * Make a DOS date and time stamp from a host time
+ *
+ * @param when Host time
+ * @param date Where to put the raw DOS date value
+ * @param time Where to put the raw DOS time value
+ */
+void storeDosDateTime(time_t when, u_int16_t* date, u_int16_t* time) {
+  struct tm tm;
+
+  localtime_r(&when, &tm);
+  if (tm.tm_year < 80) {
+    // DOS dates start at 1980
+    *date = (1 << 5) | 1;
+    *time = 0;
+    return;
+  }
+  *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+
+
+/**
+ * Convert a DOS date and time stamp to a host time
+ *
+ * @param date Raw DOS date value
+ * @param time Raw DOS time value
+ *
+ * @return Host time, or 0 if the date is not set
+ */
+time_t loadDosTime(u_int16_t date, u_int16_t time) {
+  DosDateTime dateTime;
+  struct tm tm;
+
+  if (date == 0) {
+    return 0;
+  }
+  loadDosDateTime(&dateTime, date, time);
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = dateTime.year - 1900;
+  tm.tm_mon = dateTime.month - 1;
+  tm.tm_mday = dateTime.day;
+  tm.tm_hour = dateTime.hours;
+  tm.tm_min = dateTime.mins;
+  tm.tm_sec = dateTime.secs;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+
+
 /**
  * Format a DOSDateTime for printing
  *
@@ -66,10 +126,146 @@ void loadDosDateTime(DosDateTime* dateTime,
  * @return Formatted string
  */
 char* formatDosDate(DosDateTime* dateTime) {
-  static char formatDosDateSTORE[256];
+  static __thread char formatDosDateSTORE[256];
   
   sprintf(formatDosDateSTORE, "%02i:%02i:%02i-%i/%i/%i",
           dateTime->hours, dateTime->mins, dateTime->secs, 
           dateTime->day, dateTime->month, dateTime->year);
   return formatDosDateSTORE;
 }
+
+
+/**
+ * Check whether a descriptor refers to a block device
+ */
+static int isBlockDevice(int fd) {
+  struct stat st;
+
+  return (fstat(fd, &st) == 0) && S_ISBLK(st.st_mode);
+}
+
+
+/**
+ * Apply a BLKZEROOUT/BLKDISCARD style ioctl to the whole logical blocks
+ * inside a byte range
+ *
+ * @param fd Block device
+ * @param request BLKZEROOUT or BLKDISCARD
+ * @param offset Start of the range
+ * @param length Length of the range in bytes
+ * @param first Set to the first byte covered by the ioctl
+ * @param last Set to the byte after the last one covered by the ioctl
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+static int blockRangeIoctl(int fd, unsigned long request,
+                           u_int64_t offset, u_int64_t length,
+                           u_int64_t *first, u_int64_t *last) {
+  int sectorSize = 512;
+  u_int64_t range[2];
+
+  ioctl(fd, BLKSSZGET, &sectorSize);
+  *first = ((offset + sectorSize - 1) / sectorSize) * sectorSize;
+  *last = ((offset + length) / sectorSize) * sectorSize;
+  if (*first >= *last) {
+    *first = *last = offset;
+    return 0;
+  }
+
+  range[0] = *first;
+  range[1] = *last - *first;
+  return ioctl(fd, request, range);
+}
+
+
+/**
+ * Zero a byte range with large pwrite()s, aligned to ZERO_CHUNKSIZE after
+ * the first
+ */
+static int writeZeroes(int fd, u_int64_t offset, u_int64_t length) {
+  static unsigned char zeroes[ZERO_CHUNKSIZE];
+  u_int64_t done;
+  u_int64_t chunk;
+  ssize_t n;
+
+  for (done = 0; done < length; done += n) {
+    chunk = ZERO_CHUNKSIZE - ((offset + done) % ZERO_CHUNKSIZE);
+    if (chunk > length - done) {
+      chunk = length - done;
+    }
+    n = pwrite(fd, zeroes, chunk, offset + done);
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Zero a byte range of a file or device
+ *
+ * @param fd File descriptor to zero
+ * @param offset Start of the range
+ * @param length Length of the range in bytes
+ * @param keepAllocated Nonzero to keep the range backed by storage
+ *                      rather than punching a hole in a regular file
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int zeroRegion(int fd, u_int64_t offset, u_int64_t length, int keepAllocated) {
+  u_int64_t first;
+  u_int64_t last;
+
+  if (length == 0) {
+    return 0;
+  }
+
+  if (isBlockDevice(fd)) {
+    // have the drive zero the whole sectors, we only write the ragged ends
+    if (blockRangeIoctl(fd, BLKZEROOUT, offset, length, &first, &last) == 0) {
+      if (writeZeroes(fd, offset, first - offset) == -1) {
+        return -1;
+      }
+      return writeZeroes(fd, last, offset + length - last);
+    }
+  } else {
+    // deallocate the range, leaving a hole which reads back as zero
+    if (!keepAllocated &&
+        (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)) {
+      return 0;
+    }
+
+    // let the filesystem zero it without us transferring data
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+      return 0;
+    }
+  }
+
+  return writeZeroes(fd, offset, length);
+}
+
+
+/**
+ * Tell the storage a byte range no longer holds data. Whether the range
+ * reads back as zero afterwards depends on the device.
+ *
+ * @param fd File descriptor
+ * @param offset Start of the range
+ * @param length Length of the range in bytes
+ *
+ * @return 0 on success, -1 if the target cannot discard (errno set)
+ */
+int discardRegion(int fd, u_int64_t offset, u_int64_t length) {
+  u_int64_t first;
+  u_int64_t last;
+
+  if (length == 0) {
+    return 0;
+  }
+
+  if (isBlockDevice(fd)) {
+    return blockRangeIoctl(fd, BLKDISCARD, offset, length, &first, &last);
+  }
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
@@ -24,6 +24,7 @@
 #define UTIL_H 1
 
 #include <sys/types.h>
+#include <time.h>
 
 /**
  * Structure to contain a DOS date and timestamp
@@ -37,6 +38,9 @@ typedef struct {
   int secs;
 } DosDateTime;
 
+// Largest single write used when zeroing a region by hand
+#define ZERO_CHUNKSIZE (1024 * 1024)
+
 /**
  * Report an error
  */
@@ -54,6 +58,29 @@ void loadDosDateTime(DosDateTime* dateTime,
 
 
 
+/**
+ * Make a DOS date and time stamp from a host time
+ *
+ * @param when Host time
+ * @param date Where to put the raw DOS date value
+ * @param time Where to put the raw DOS time value
+ */
+void storeDosDateTime(time_t when, u_int16_t* date, u_int16_t* time);
+
+
+
+/**
+ * Convert a DOS date and time stamp to a host time
+ *
+ * @param date Raw DOS date value
+ * @param time Raw DOS time value
+ *
+ * @return Host time, or 0 if the date is not set
+ */
+time_t loadDosTime(u_int16_t date, u_int16_t time);
+
+
+
 /**
  * Format a DOSDateTime for printing
  *
@@ -63,5 +90,32 @@ void loadDosDateTime(DosDateTime* dateTime,
  */
 char* formatDosDate(DosDateTime* dateTime);
 
+
+/**
+ * Zero a byte range of a file or device
+ *
+ * @param fd File descriptor to zero
+ * @param offset Start of the range
+ * @param length Length of the range in bytes
+ * @param keepAllocated Nonzero to keep the range backed by storage
+ *                      rather than punching a hole in a regular file
+ *
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int zeroRegion(int fd, u_int64_t offset, u_int64_t length, int keepAllocated);
+
+
+/**
+ * Tell the storage a byte range no longer holds data. Whether the range
+ * reads back as zero afterwards depends on the device.
+ *
+ * @param fd File descriptor
+ * @param offset Start of the range
+ * @param length Length of the range in bytes
+ *
+ * @return 0 on success, -1 if the target cannot discard (errno set)
+ */
+int discardRegion(int fd, u_int64_t offset, u_int64_t length);
+
 #endif
 
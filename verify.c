@@ -0,0 +1,393 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Verification of a FATX partition against a copy of it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "verify.h"
+#include "alloc.h"
+#include "extent.h"
+#include "tree.h"
+#include "pool.h"
+#include "util.h"
+
+// Results of one job
+typedef struct {
+  // Clusters that differ, in order
+  u_int32_t *mismatches;
+  u_int32_t count;
+  u_int32_t allocated;
+
+  u_int64_t bytes;
+  int failed;
+} VerifySlice;
+
+// State for one verification
+typedef struct {
+  FATXPartition *partition;
+  int targetFd;
+  int flags;
+  u_int32_t lastCluster;
+
+  // Job 0 compares the header and chain table; the rest compare clusters
+  VerifySlice *slices;
+  int sliceCount;
+  int headerDiffers;
+  u_int32_t chainBlocksDiffer;
+} VerifyContext;
+
+
+/**
+ * Read from the copy
+ *
+ * @return Number of bytes read (less than length at the end of the
+ *         copy), or -1 on failure
+ */
+static int64_t readTarget(VerifyContext* ctx, unsigned char* data, u_int64_t length, u_int64_t offset) {
+  u_int64_t done;
+  ssize_t n;
+
+  for(done = 0; done < length; done += n) {
+    n = pread(ctx->targetFd, data + done, length - done, offset + done);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+  return done;
+}
+
+
+/**
+ * Record a cluster that differs
+ */
+static void addMismatch(VerifySlice* slice, u_int32_t clusterId) {
+  if (slice->count == slice->allocated) {
+    slice->allocated = slice->allocated ? slice->allocated * 2 : 64;
+    slice->mismatches = (u_int32_t*) realloc(slice->mismatches, slice->allocated * sizeof(u_int32_t));
+    if (slice->mismatches == NULL) {
+      error("Out of memory");
+    }
+  }
+  slice->mismatches[slice->count++] = clusterId;
+}
+
+
+/**
+ * Compare a run of consecutive clusters
+ */
+static void compareRun(VerifyContext* ctx, VerifySlice* slice, u_int32_t first, u_int32_t count,
+                       unsigned char* source, unsigned char* target) {
+  FATXPartition *partition = ctx->partition;
+  u_int64_t length = (u_int64_t) count * partition->clusterSize;
+  int64_t got;
+  u_int32_t i;
+
+  if (readClusters(partition, first, source, length) == -1) {
+    slice->failed = 1;
+    return;
+  }
+  got = readTarget(ctx, target, length, partition->cluster1Address + (u_int64_t) (first - 1) * partition->clusterSize);
+  if (got == -1) {
+    slice->failed = 1;
+    return;
+  }
+  slice->bytes += length;
+
+  // anything past the end of the copy differs
+  for(i = 0; i < count; i++) {
+    if (((u_int64_t) (i + 1) * partition->clusterSize > got) ||
+        memcmp(source + (u_int64_t) i * partition->clusterSize, target + (u_int64_t) i * partition->clusterSize,
+               partition->clusterSize)) {
+      addMismatch(slice, first + i);
+    }
+  }
+}
+
+
+/**
+ * Compare the partition header and chain table
+ */
+static void compareMetadata(VerifyContext* ctx, VerifySlice* slice, unsigned char* source, unsigned char* target) {
+  FATXPartition *partition = ctx->partition;
+  u_int64_t start = partition->partitionStart;
+  u_int64_t end = partition->cluster1Address;
+  u_int64_t offset;
+  u_int64_t length;
+  u_int64_t block;
+  u_int64_t size;
+  int64_t got;
+
+  for(offset = start; offset < end; offset += length) {
+    length = end - offset;
+    if (length > VERIFY_CHUNKSIZE) {
+      length = VERIFY_CHUNKSIZE;
+    }
+    if (backendRead(partition->backend, source, length, offset) == -1) {
+      slice->failed = 1;
+      return;
+    }
+    got = readTarget(ctx, target, length, offset);
+    if (got == -1) {
+      slice->failed = 1;
+      return;
+    }
+    slice->bytes += length;
+
+    // chunks are whole chain table blocks, the first being the header
+    for(block = 0; block < length; block += FATX_CHAINTABLE_BLOCKSIZE) {
+      size = (length - block < FATX_CHAINTABLE_BLOCKSIZE) ? length - block : FATX_CHAINTABLE_BLOCKSIZE;
+      if ((block + size > got) || memcmp(source + block, target + block, size)) {
+        if (offset + block == start) {
+          ctx->headerDiffers = 1;
+        } else {
+          ctx->chainBlocksDiffer++;
+        }
+      }
+    }
+  }
+}
+
+
+/**
+ * Compare one slice of the partition
+ */
+static void verifyJob(void* context, int index) {
+  VerifyContext *ctx = (VerifyContext*) context;
+  FATXPartition *partition = ctx->partition;
+  VerifySlice *slice = &ctx->slices[index];
+  u_int32_t chunkClusters = VERIFY_CHUNKSIZE / partition->clusterSize;
+  u_int32_t first;
+  u_int32_t last;
+  u_int32_t runStart = 0;
+  u_int32_t runLength = 0;
+  unsigned char *source;
+  unsigned char *target;
+  u_int32_t i;
+
+  if (chunkClusters == 0) {
+    chunkClusters = 1;
+  }
+  source = (unsigned char*) malloc((u_int64_t) chunkClusters * partition->clusterSize);
+  target = (unsigned char*) malloc((u_int64_t) chunkClusters * partition->clusterSize);
+  if ((source == NULL) || (target == NULL)) {
+    error("Out of memory");
+  }
+
+  if (index == 0) {
+    compareMetadata(ctx, slice, source, target);
+  } else {
+    first = FATX_ROOT_FAT_CLUSTER + (u_int64_t) (index - 1) * VERIFY_CLUSTERS_PER_JOB;
+    last = first + VERIFY_CLUSTERS_PER_JOB - 1;
+    if (last > ctx->lastCluster) {
+      last = ctx->lastCluster;
+    }
+
+    // gather runs of clusters to compare, a chunk at most at a time
+    for(i = first; (i <= last) && !slice->failed; i++) {
+      if (!(ctx->flags & VERIFY_FREE) && (getChainEntry(partition, i) == 0)) {
+        continue;
+      }
+      if ((runLength > 0) && ((runStart + runLength != i) || (runLength == chunkClusters))) {
+        compareRun(ctx, slice, runStart, runLength, source, target);
+        runLength = 0;
+      }
+      if (runLength == 0) {
+        runStart = i;
+      }
+      runLength++;
+    }
+    if ((runLength > 0) && !slice->failed) {
+      compareRun(ctx, slice, runStart, runLength, source, target);
+    }
+  }
+
+  free(source);
+  free(target);
+}
+
+
+/**
+ * Report which files and directories own the clusters that differ
+ *
+ * @param mismatches Clusters that differ, in order
+ * @param count Number of them
+ */
+static void reportOwners(VerifyContext* ctx, u_int32_t* mismatches, u_int32_t count) {
+  FATXPartition *partition = ctx->partition;
+  FATXExtent *extents;
+  FATXTree *tree;
+  u_int32_t *owned;
+  u_int32_t *firstOwned;
+  u_int32_t expected;
+  u_int32_t freeCount = 0;
+  u_int32_t orphans = 0;
+  char *isOwned;
+  char path[4096];
+  int extentCount;
+  int low;
+  int high;
+  int mid;
+  int e;
+  int i;
+
+  tree = loadTree(partition);
+  owned = (u_int32_t*) calloc(tree ? tree->count : 1, sizeof(u_int32_t));
+  firstOwned = (u_int32_t*) calloc(tree ? tree->count : 1, sizeof(u_int32_t));
+  isOwned = (char*) calloc(count, 1);
+  if ((tree == NULL) || (owned == NULL) || (firstOwned == NULL) || (isOwned == NULL)) {
+    error("Out of memory");
+  }
+
+  for(i = 0; i < tree->count; i++) {
+    expected = 0;
+    if (!isTreeDirectory(&tree->nodes[i])) {
+      expected = ((u_int64_t) tree->nodes[i].entry.fileSize + partition->clusterSize - 1) / partition->clusterSize;
+      if (expected == 0) {
+        continue;
+      }
+    }
+    extents = buildExtents(partition, tree->nodes[i].entry.firstCluster, expected, &extentCount, NULL);
+    for(e = 0; e < extentCount; e++) {
+      // first mismatch at or after the start of the extent
+      low = 0;
+      high = count;
+      while(low < high) {
+        mid = (low + high) / 2;
+        if (mismatches[mid] < extents[e].start) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      for(; (low < count) && (mismatches[low] < extents[e].start + extents[e].length); low++) {
+        if ((owned[i] == 0) || (mismatches[low] < firstOwned[i])) {
+          firstOwned[i] = mismatches[low];
+        }
+        owned[i]++;
+        isOwned[low] = 1;
+      }
+    }
+    free(extents);
+  }
+
+  for(i = 0; i < tree->count; i++) {
+    if (owned[i] > 0) {
+      treePath(tree, i, path, sizeof(path));
+      printf("verify : %s%s: %u clusters differ, the first being cluster %u\n", path,
+             ((i > 0) && isTreeDirectory(&tree->nodes[i])) ? "/" : "", owned[i], firstOwned[i]);
+    }
+  }
+  for(i = 0; i < count; i++) {
+    if (isOwned[i]) {
+      continue;
+    }
+    if (getChainEntry(partition, mismatches[i]) == 0) {
+      freeCount++;
+    } else {
+      orphans++;
+    }
+  }
+  if (orphans > 0) {
+    printf("verify : %u allocated clusters not in any file differ\n", orphans);
+  }
+  if (freeCount > 0) {
+    printf("verify : %u free clusters differ\n", freeCount);
+  }
+
+  free(isOwned);
+  free(firstOwned);
+  free(owned);
+  freeTree(tree);
+}
+
+
+/**
+ * Compare a partition with the same byte range of another image or
+ * device: the partition header, the chain table and the allocated
+ * clusters (or all clusters with VERIFY_FREE). Clusters that differ are
+ * reported with the file or directory that owns them.
+ *
+ * @param partition FATX partition
+ * @param targetFd Image or device holding the copy, at the same offset
+ * @param flags VERIFY_* flags
+ * @return 0 if they match, -1 if anything differs or could not be read
+ */
+int verifyPartition(FATXPartition* partition, int targetFd, int flags) {
+  VerifyContext ctx;
+  u_int32_t *mismatches;
+  u_int32_t count = 0;
+  u_int64_t bytes = 0;
+  int failed = 0;
+  int i;
+
+  memset(&ctx, 0, sizeof(VerifyContext));
+  ctx.partition = partition;
+  ctx.targetFd = targetFd;
+  ctx.flags = flags;
+  ctx.lastCluster = lastDataCluster(partition);
+  ctx.sliceCount = 1 + (ctx.lastCluster + VERIFY_CLUSTERS_PER_JOB - 1) / VERIFY_CLUSTERS_PER_JOB;
+  ctx.slices = (VerifySlice*) calloc(ctx.sliceCount, sizeof(VerifySlice));
+  if (ctx.slices == NULL) {
+    error("Out of memory");
+  }
+
+  runParallel(verifyJob, &ctx, ctx.sliceCount, 0);
+
+  // slices are in cluster order, so joining them keeps the list sorted
+  for(i = 0; i < ctx.sliceCount; i++) {
+    count += ctx.slices[i].count;
+  }
+  mismatches = (u_int32_t*) malloc((count + 1) * sizeof(u_int32_t));
+  if (mismatches == NULL) {
+    error("Out of memory");
+  }
+  for(i = 0, count = 0; i < ctx.sliceCount; i++) {
+    memcpy(mismatches + count, ctx.slices[i].mismatches, ctx.slices[i].count * sizeof(u_int32_t));
+    count += ctx.slices[i].count;
+    bytes += ctx.slices[i].bytes;
+    failed |= ctx.slices[i].failed;
+    free(ctx.slices[i].mismatches);
+  }
+
+  if (ctx.headerDiffers) {
+    printf("verify : partition header differs\n");
+  }
+  if (ctx.chainBlocksDiffer > 0) {
+    printf("verify : %u chain table blocks differ\n", ctx.chainBlocksDiffer);
+  }
+  if (count > 0) {
+    reportOwners(&ctx, mismatches, count);
+  }
+  if (failed) {
+    printf("verify : some data could not be read\n");
+  }
+  printf("verify : %llu bytes compared%s, %u clusters differ\n", (unsigned long long) bytes,
+         (flags & VERIFY_FREE) ? " including free space" : "", count);
+
+  free(mismatches);
+  free(ctx.slices);
+  return (failed || ctx.headerDiffers || ctx.chainBlocksDiffer || count) ? -1 : 0;
+}
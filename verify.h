@@ -0,0 +1,50 @@
+/*
+    Xboxdumper - FATX library and utilities.
+
+    Copyright (C) 2005 Andrew de Quincey <adq_dvb@lidskialf.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+// Verification of a FATX partition against a copy of it
+
+#ifndef VERIFY_H
+#define VERIFY_H 1
+
+#include "fatx.h"
+
+// Compare free clusters as well as allocated ones
+#define VERIFY_FREE 1
+
+// Clusters compared by one job
+#define VERIFY_CLUSTERS_PER_JOB 4096
+
+// Most data read from each side at once
+#define VERIFY_CHUNKSIZE (4 * 1024 * 1024)
+
+/**
+ * Compare a partition with the same byte range of another image or
+ * device: the partition header, the chain table and the allocated
+ * clusters (or all clusters with VERIFY_FREE). Clusters that differ are
+ * reported with the file or directory that owns them.
+ *
+ * @param partition FATX partition
+ * @param targetFd Image or device holding the copy, at the same offset
+ * @param flags VERIFY_* flags
+ * @return 0 if they match, -1 if anything differs or could not be read
+ */
+int verifyPartition(FATXPartition* partition, int targetFd, int flags);
+
+#endif